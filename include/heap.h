@@ -24,96 +24,277 @@
  *
  *
  *********************************************************************/
+#ifndef INCLUDE_PICO_HEAP
+#define INCLUDE_PICO_HEAP
+
+/* The first block holds MAX_BLOCK_SIZE bytes worth of elements, each
+ * following block twice as many as the previous one: MAX_BLOCK_COUNT blocks
+ * give room for (MAX_BLOCK_SIZE / sizeof(type)) * (2^MAX_BLOCK_COUNT - 1)
+ * elements. A lower limit can be set at runtime with heap_set_max().
+ */
+#ifndef MAX_BLOCK_SIZE
 #define MAX_BLOCK_SIZE 1600
+#endif
+
+#ifndef MAX_BLOCK_COUNT
 #define MAX_BLOCK_COUNT 16
+#endif
+
+/* Initial number of slots in the id -> heap position index (power of two) */
+#ifndef HEAP_INDEX_INIT
+#define HEAP_INDEX_INIT 64u
+#endif
+
+/* Compact dead entries once they are more than half of the heap */
+#ifndef HEAP_COMPACT_MIN
+#define HEAP_COMPACT_MIN 32u
+#endif
 
-#define DECLARE_HEAP(type, orderby) \
+struct heap_index_entry {
+    uint32_t id;   /* 0: empty slot */
+    uint32_t pos;
+};
+
+/* Binary min-heap of 'type', ordered by the 'orderby' field.
+ * Every element with a non-zero 'idfield' is tracked in an open-addressing
+ * index, updated on each move during sifts, so that an element can be
+ * removed by id in O(log n). Elements whose id is zero are dead: they are
+ * not indexed and are dropped by heap_compact().
+ */
+#define DECLARE_HEAP(type, orderby, idfield) \
     struct heap_ ## type {   \
         uint32_t size;    \
         uint32_t n;       \
+        uint32_t max;     \
+        uint32_t blocks;  \
+        uint32_t dead;    \
+        uint32_t index_size;  \
+        uint32_t index_count; \
+        struct heap_index_entry *index; \
         type *top[MAX_BLOCK_COUNT];        \
     }; \
     typedef struct heap_ ## type heap_ ## type; \
     static inline type* heap_get_element(struct heap_ ## type *heap, uint32_t idx) \
     { \
         uint32_t elements_per_block = MAX_BLOCK_SIZE/sizeof(type); \
-        return &heap->top[idx/elements_per_block][idx%elements_per_block];\
+        uint32_t q = idx / elements_per_block + 1u; \
+        uint32_t b = 0; \
+        /* Block b starts at elements_per_block * (2^b - 1) */ \
+        while (q >>= 1) \
+            b++; \
+        return &heap->top[b][idx - elements_per_block * ((1u << b) - 1u)]; \
+    } \
+    static inline uint32_t heap_index_hash(struct heap_ ## type *heap, uint32_t id) \
+    { \
+        return (id * 0x9E3779B1u) & (heap->index_size - 1u); \
+    } \
+    static inline struct heap_index_entry *heap_index_find(struct heap_ ## type *heap, uint32_t id) \
+    { \
+        uint32_t h; \
+        if (!heap->index || !id) \
+            return NULL; \
+        h = heap_index_hash(heap, id); \
+        while (heap->index[h].id) { \
+            if (heap->index[h].id == id) \
+                return &heap->index[h]; \
+            h = (h + 1u) & (heap->index_size - 1u); \
+        } \
+        return NULL; \
+    } \
+    /* Insert or update; capacity must have been reserved */ \
+    static inline void heap_index_put(struct heap_ ## type *heap, uint32_t id, uint32_t pos) \
+    { \
+        uint32_t h = heap_index_hash(heap, id); \
+        while (heap->index[h].id && (heap->index[h].id != id)) \
+            h = (h + 1u) & (heap->index_size - 1u); \
+        if (!heap->index[h].id) \
+            heap->index_count++; \
+        heap->index[h].id = id; \
+        heap->index[h].pos = pos; \
+    } \
+    static inline void heap_index_del(struct heap_ ## type *heap, uint32_t id) \
+    { \
+        struct heap_index_entry *e = heap_index_find(heap, id); \
+        uint32_t mask = heap->index_size - 1u; \
+        uint32_t h, j, home; \
+        if (!e) \
+            return; \
+        h = (uint32_t)(e - heap->index); \
+        heap->index_count--; \
+        /* Backward-shift deletion keeps probe chains intact */ \
+        j = h; \
+        while (1) { \
+            j = (j + 1u) & mask; \
+            if (!heap->index[j].id) \
+                break; \
+            home = heap_index_hash(heap, heap->index[j].id); \
+            if (((j - home) & mask) >= ((j - h) & mask)) { \
+                heap->index[h] = heap->index[j]; \
+                h = j; \
+            } \
+        } \
+        heap->index[h].id = 0; \
+    } \
+    static inline int heap_index_reserve(struct heap_ ## type *heap) \
+    { \
+        struct heap_index_entry *old = heap->index; \
+        uint32_t old_size = heap->index_size, i; \
+        uint32_t new_size = old_size ? (old_size << 1) : HEAP_INDEX_INIT; \
+        if (old && ((heap->index_count + 1u) * 2u <= old_size)) \
+            return 0; \
+        heap->index = PICO_ZALLOC(new_size * sizeof(struct heap_index_entry)); \
+        if (!heap->index) { \
+            heap->index = old; \
+            return -1; \
+        } \
+        heap->index_size = new_size; \
+        heap->index_count = 0; \
+        for (i = 0; i < old_size; i++) { \
+            if (old[i].id) \
+                heap_index_put(heap, old[i].id, old[i].pos); \
+        } \
+        if (old) \
+            PICO_FREE(old); \
+        return 0; \
+    } \
+    static inline void heap_set(struct heap_ ## type *heap, uint32_t i, type *el) \
+    { \
+        memcpy(heap_get_element(heap, i), el, sizeof(type)); \
+        if (el->idfield) \
+            heap_index_put(heap, el->idfield, i); \
+    } \
+    static inline void heap_sift_up(struct heap_ ## type *heap, uint32_t i, type *el) \
+    { \
+        type *half; \
+        while (i > 1) { \
+            half = heap_get_element(heap, i / 2); \
+            if (!(half->orderby > el->orderby)) \
+                break; \
+            heap_set(heap, i, half); \
+            i /= 2; \
+        } \
+        heap_set(heap, i, el); \
+    } \
+    static inline void heap_sift_down(struct heap_ ## type *heap, uint32_t i, type *el) \
+    { \
+        type *left_child; \
+        type *right_child; \
+        uint32_t child; \
+        for(; (i * 2u) <= heap->n; i = child) { \
+            child = 2u * i; \
+            left_child = heap_get_element(heap, child); \
+            if (child != heap->n) { \
+                right_child = heap_get_element(heap, child + 1); \
+                if (right_child->orderby < left_child->orderby) { \
+                    child++; \
+                    left_child = right_child; \
+                } \
+            } \
+            if (el->orderby > left_child->orderby) \
+                heap_set(heap, i, left_child); \
+            else \
+                break; \
+        } \
+        heap_set(heap, i, el); \
     } \
     static inline int8_t heap_increase_size(struct heap_ ## type *heap) \
     {\
         type *newTop; \
-        uint32_t elements_per_block = MAX_BLOCK_SIZE/sizeof(type); \
-        uint32_t elements = (heap->n + 1)%elements_per_block;\
-        elements = elements?elements:elements_per_block;\
-        if (heap->n+1 > elements_per_block * MAX_BLOCK_COUNT){\
-            return -1;\
-        }\
+        uint32_t elements = (uint32_t)(MAX_BLOCK_SIZE/sizeof(type)) << heap->blocks; \
+        if (heap->blocks >= MAX_BLOCK_COUNT) { \
+            return -1; \
+        } \
         newTop = PICO_ZALLOC(elements*sizeof(type)); \
         if(!newTop) { \
             return -1; \
         } \
-        if (heap->top[heap->n/elements_per_block])  { \
-            memcpy(newTop, heap->top[heap->n/elements_per_block], (elements - 1) * sizeof(type)); \
-            PICO_FREE(heap->top[heap->n/elements_per_block]); \
-        } \
-        heap->top[heap->n/elements_per_block] = newTop;             \
-        heap->size++;                                                               \
-        return 0;                                                               \
+        heap->top[heap->blocks++] = newTop; \
+        heap->size += elements; \
+        return 0; \
     }\
     static inline int heap_insert(struct heap_ ## type *heap, type * el) \
     { \
-        type *half;                                                                 \
-        uint32_t i; \
+        if (heap->max && (heap->n >= heap->max)) \
+            return -1; \
+        if (el->idfield && heap_index_reserve(heap)) \
+            return -1; \
         if (++heap->n >= heap->size) {                                                \
             if (heap_increase_size(heap)){                                                    \
                 heap->n--;                                                           \
                 return -1;                                                           \
             }                                                                       \
         }                                                                             \
-        if (heap->n == 1) {                                                       \
-            memcpy(heap_get_element(heap, 1), el, sizeof(type));                                    \
-            return 0;                                                                   \
-        }                                                                             \
-        i = heap->n;                                                                    \
-        half = heap_get_element(heap, i/2);                                                   \
-        while ( (i > 1) && (half->orderby > el->orderby) ) {        \
-            memcpy(heap_get_element(heap, i), heap_get_element(heap, i / 2), sizeof(type));                     \
-            i /= 2;                                                                     \
-            half = heap_get_element(heap, i/2);                                                   \
-        }             \
-        memcpy(heap_get_element(heap, i), el, sizeof(type));                                      \
+        heap_sift_up(heap, heap->n, el); \
         return 0;                                                                     \
     } \
+    /* Remove the element at position i, filling the hole with the last one */ \
+    static inline void heap_remove(struct heap_ ## type *heap, uint32_t i, type *out) \
+    { \
+        type last; \
+        memcpy(out, heap_get_element(heap, i), sizeof(type)); \
+        if (out->idfield) \
+            heap_index_del(heap, out->idfield); \
+        else if (heap->dead) \
+            heap->dead--; \
+        memcpy(&last, heap_get_element(heap, heap->n--), sizeof(type)); \
+        if (i > heap->n) \
+            return; \
+        if ((i > 1) && (heap_get_element(heap, i / 2)->orderby > last.orderby)) \
+            heap_sift_up(heap, i, &last); \
+        else \
+            heap_sift_down(heap, i, &last); \
+    } \
     static inline int heap_peek(struct heap_ ## type *heap, type * first) \
     { \
-        type *last;           \
-        type *left_child;           \
-        type *right_child;           \
-        uint32_t i, child;        \
         if(heap->n == 0) {    \
             return -1;          \
         }                     \
-        memcpy(first, heap_get_element(heap, 1), sizeof(type));   \
-        last = heap_get_element(heap, heap->n--);                 \
-        for(i = 1; (i * 2u) <= heap->n; i = child) {   \
-            child = 2u * i;                              \
-            right_child = heap_get_element(heap, child+1);     \
-            left_child = heap_get_element(heap, child);      \
-            if ((child != heap->n) &&                   \
-                (right_child->orderby          \
-                < left_child->orderby))           \
-                child++;                                \
-            left_child = heap_get_element(heap, child);      \
-            if (last->orderby >                         \
-                left_child->orderby)               \
-                memcpy(heap_get_element(heap,i), heap_get_element(heap,child), \
-                       sizeof(type));                  \
-            else                                        \
-                break;                                  \
-        }                                             \
-        memcpy(heap_get_element(heap, i), last, sizeof(type));    \
+        heap_remove(heap, 1, first); \
         return 0;                                     \
     } \
+    static inline int heap_remove_id(struct heap_ ## type *heap, uint32_t id, type *out) \
+    { \
+        struct heap_index_entry *e = heap_index_find(heap, id); \
+        if (!e) \
+            return -1; \
+        heap_remove(heap, e->pos, out); \
+        return 0; \
+    } \
+    /* Mark the element at position i as dead; it stays in place until compaction */ \
+    static inline void heap_kill(struct heap_ ## type *heap, uint32_t i) \
+    { \
+        type *el = heap_get_element(heap, i); \
+        if (!el->idfield) \
+            return; \
+        heap_index_del(heap, el->idfield); \
+        el->idfield = 0; \
+        heap->dead++; \
+    } \
+    /* Drop dead elements and rebuild the heap in O(n) */ \
+    static inline void heap_compact(struct heap_ ## type *heap) \
+    { \
+        type tmp; \
+        uint32_t i, j = 0; \
+        for (i = 1; i <= heap->n; i++) { \
+            type *el = heap_get_element(heap, i); \
+            if (!el->idfield) \
+                continue; \
+            if (++j != i) \
+                memcpy(heap_get_element(heap, j), el, sizeof(type)); \
+        } \
+        heap->n = j; \
+        heap->dead = 0; \
+        for (i = heap->n / 2; i >= 1; i--) { \
+            memcpy(&tmp, heap_get_element(heap, i), sizeof(type)); \
+            heap_sift_down(heap, i, &tmp); \
+        } \
+        for (i = 1; i <= heap->n; i++) \
+            heap_index_put(heap, heap_get_element(heap, i)->idfield, i); \
+    } \
+    static inline int heap_compact_needed(struct heap_ ## type *heap) \
+    { \
+        return (heap->dead >= HEAP_COMPACT_MIN) && (heap->dead * 2u > heap->n); \
+    } \
     static inline type *heap_first(heap_ ## type * heap)  \
     { \
         if (heap->n == 0)     \
@@ -125,4 +306,19 @@
         heap_ ## type * p = (heap_ ## type *)PICO_ZALLOC(sizeof(heap_ ## type));  \
         return p;     \
     } \
+    /* Limit the number of elements; 0 means bounded only by MAX_BLOCK_COUNT */ \
+    static inline void heap_set_max(heap_ ## type * heap, uint32_t max) \
+    { \
+        heap->max = max; \
+    } \
+    static inline void heap_destroy(heap_ ## type * heap) \
+    { \
+        uint32_t i; \
+        for (i = 0; i < heap->blocks; i++) \
+            PICO_FREE(heap->top[i]); \
+        if (heap->index) \
+            PICO_FREE(heap->index); \
+        PICO_FREE(heap); \
+    } \
 
+#endif
@@ -35,6 +35,10 @@ extern struct pico_tree Device_tree;
 #include "pico_stack.h"
 #define MAX_DEVICE_NAME 16
 
+/* pico_device.offload */
+#define PICO_DEV_OFFLOAD_TSO 0x01 /* send_burst() takes TCP super-frames and segments them itself */
+#define PICO_DEV_OFFLOAD_GRO 0x02 /* coalesce received TCP segments, set by pico_device_init() */
+
 
 struct pico_ethdev {
     struct pico_eth mac;
@@ -51,6 +55,13 @@ struct pico_device {
     struct pico_queue *q_out;
     int (*link_state)(struct pico_device *self);
     int (*send)(struct pico_device *self, void *buf, int len); /* Send function. Return 0 if busy */
+    int (*send_burst)(struct pico_device *self, struct pico_frame **f, int count); /* Optional: send up to count frames, return how many were sent (0 if busy) */
+#ifdef PICO_SUPPORT_GSO
+    uint32_t gso_max_size; /* Largest TCP super-frame accepted. pico_device_init() sets PICO_GSO_MAX_SIZE if 0; clear it afterwards to turn GSO off */
+#endif
+#if defined(PICO_SUPPORT_GSO) || defined(PICO_SUPPORT_GRO)
+    uint8_t offload;       /* PICO_DEV_OFFLOAD_* */
+#endif
     int (*poll)(struct pico_device *self, int loop_score);
     void (*destroy)(struct pico_device *self);
   #ifdef PICO_SUPPORT_TICKLESS
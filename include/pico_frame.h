@@ -32,6 +32,8 @@
 #define PICO_FRAME_FLAG_BCAST               (0x01)
 #define PICO_FRAME_FLAG_EXT_BUFFER          (0x02)
 #define PICO_FRAME_FLAG_EXT_USAGE_COUNTER   (0x04)
+#define PICO_FRAME_FLAG_CSUM_VALID          (0x08) /* transport checksum already verified */
+#define PICO_FRAME_FLAG_L2_RESOLVED         (0x10) /* destination MAC already in the headroom */
 #define PICO_FRAME_FLAG_SACKED              (0x80)
 #define PICO_FRAME_FLAG_LL_SEC              (0x40)
 #define PICO_FRAME_FLAG_SLP_FRAG            (0x20)
@@ -40,6 +42,46 @@
 
 struct pico_socket;
 
+#ifdef PICO_SUPPORT_FRAME_POOL
+/* Per-stack cache of frame headers and buffers.
+ * Buffers are kept in three size classes; larger requests always go to the
+ * heap. Each free list holds at most 'max_cached' objects, extra ones are
+ * returned to the heap on release.
+ */
+#ifndef PICO_FRAME_POOL_SMALL
+#define PICO_FRAME_POOL_SMALL 128u
+#endif
+#ifndef PICO_FRAME_POOL_MTU
+#define PICO_FRAME_POOL_MTU 1514u
+#endif
+#ifndef PICO_FRAME_POOL_JUMBO
+#define PICO_FRAME_POOL_JUMBO 9000u
+#endif
+#ifndef PICO_FRAME_POOL_MAX_CACHED
+#define PICO_FRAME_POOL_MAX_CACHED 64u
+#endif
+#define PICO_FRAME_POOL_CLASSES 3
+
+struct pico_frame_pool_stats {
+    uint32_t hits;      /* allocations served from the free list */
+    uint32_t misses;    /* allocations that went to the heap */
+    uint32_t in_use;    /* objects currently handed out */
+    uint32_t peak;      /* highest in_use seen */
+    uint32_t cached;    /* objects currently on the free list */
+};
+
+struct pico_frame_pool {
+    void *frames;
+    void *buffers[PICO_FRAME_POOL_CLASSES];
+    void *counters;
+    uint32_t max_cached;
+    struct pico_frame_pool_stats frame_stats;
+    struct pico_frame_pool_stats buffer_stats[PICO_FRAME_POOL_CLASSES];
+    struct pico_frame_pool_stats counter_stats;
+};
+#else
+struct pico_frame_pool;
+#endif
 
 struct pico_frame {
 
@@ -92,6 +134,12 @@ struct pico_frame {
     uint16_t frag;
 #endif
 
+#if defined(PICO_SUPPORT_GSO) || defined(PICO_SUPPORT_GRO)
+    /* TCP super-frame, built to be sent or merged on receive: payload
+     * bytes per segment on the wire, 0 for plain frames */
+    uint16_t gso_size;
+#endif
+
 #if defined(PICO_SUPPORT_6LOWPAN)
     uint32_t hash;
     union pico_ll_addr src;
@@ -113,6 +161,12 @@ struct pico_frame {
 
     uint8_t send_ttl; /* Special TTL/HOPS value, 0 = auto assign */
     uint8_t send_tos; /* Type of service */
+
+#ifdef PICO_SUPPORT_FRAME_POOL
+    /* Pool owning this header; buffer size class + 1, 0 if heap-allocated */
+    struct pico_frame_pool *pool;
+    uint8_t pool_class;
+#endif
 };
 
 /** frame alloc/dealloc/copy **/
@@ -123,9 +177,18 @@ struct pico_frame *pico_frame_alloc(uint32_t size);
 int pico_frame_grow(struct pico_frame *f, uint32_t size);
 int pico_frame_grow_head(struct pico_frame *f, uint32_t size);
 struct pico_frame *pico_frame_alloc_skeleton(uint32_t size, int ext_buffer);
+struct pico_frame *pico_frame_alloc_pool(struct pico_frame_pool *pool, uint32_t size);
+struct pico_frame *pico_frame_alloc_skeleton_pool(struct pico_frame_pool *pool, uint32_t size, int ext_buffer);
+#ifdef PICO_SUPPORT_FRAME_POOL
+void pico_frame_pool_init(struct pico_frame_pool *pool, uint32_t max_cached);
+void pico_frame_pool_destroy(struct pico_frame_pool *pool);
+#endif
 int pico_frame_skeleton_set_buffer(struct pico_frame *f, void *buf);
+int pico_frame_set_ext_buffer(struct pico_frame *f, uint8_t *buf, uint32_t len, void (*notify_free)(uint8_t *));
 uint16_t pico_checksum(void *inbuf, uint32_t len);
 uint16_t pico_dualbuffer_checksum(void *b1, uint32_t len1, void *b2, uint32_t len2);
+uint16_t pico_checksum_adjust16(uint16_t crc, uint16_t old_val, uint16_t new_val);
+uint16_t pico_checksum_adjust32(uint16_t crc, uint32_t old_val, uint32_t new_val);
 
 static inline int pico_is_digit(char c)
 {
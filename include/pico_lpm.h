@@ -0,0 +1,61 @@
+/*********************************************************************
+ * PicoTCP-NG 
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#ifndef PICO_LPM_H
+#define PICO_LPM_H
+
+#include "pico_config.h"
+
+/* Path-compressed binary trie for longest-prefix-match lookups.
+ * Keys are addresses in network byte order, up to PICO_LPM_MAX_KEY bytes
+ * (IPv4: 4, IPv6: 16). Each prefix holds one opaque value.
+ */
+#define PICO_LPM_MAX_KEY 16
+
+struct pico_lpm_node
+{
+    struct pico_lpm_node *child[2];
+    void *value;
+    uint8_t key[PICO_LPM_MAX_KEY];
+    uint8_t plen;
+};
+
+struct pico_lpm
+{
+    struct pico_lpm_node *root;
+    uint32_t count;  /* number of prefixes holding a value */
+    uint8_t keylen;  /* key size in bytes */
+};
+
+#define PICO_LPM_INIT(keysize) { NULL, 0, (keysize) }
+
+void pico_lpm_init(struct pico_lpm *t, uint8_t keylen);
+int pico_lpm_insert(struct pico_lpm *t, const uint8_t *key, uint8_t plen, void *value);
+void *pico_lpm_remove(struct pico_lpm *t, const uint8_t *key, uint8_t plen);
+void *pico_lpm_get(struct pico_lpm *t, const uint8_t *key, uint8_t plen);
+void *pico_lpm_lookup(struct pico_lpm *t, const uint8_t *key);
+void pico_lpm_destroy(struct pico_lpm *t);
+
+/* Returns the prefix length of a netmask, or -1 if it is not contiguous */
+int pico_lpm_mask_len(const uint8_t *mask, uint8_t keylen);
+
+#endif
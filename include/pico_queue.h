@@ -184,6 +184,99 @@ static inline struct pico_frame *pico_dequeue(struct pico_queue *q)
     return p;
 }
 
+/* Append a chain of frames (linked through ->next) under a single lock.
+ * Stops at the first frame that does not fit: *list is left pointing to
+ * the frames that were not enqueued. Returns the number of frames added.
+ */
+static inline int pico_enqueue_list(struct pico_queue *q, struct pico_frame **list)
+{
+    struct pico_frame *p = *list;
+    uint32_t was_empty;
+    int n = 0;
+
+    if (!p)
+        return 0;
+
+    if (q->shared)
+        PICOTCP_MUTEX_LOCK(q->mutex);
+
+    if (!q->head) {
+        q->size = 0;
+        q->frames = 0;
+    }
+
+    was_empty = (q->frames == 0);
+    while (p) {
+        if ((q->max_frames) && (q->max_frames <= q->frames))
+            break;
+
+#if (Q_LIMIT != 0)
+        if ((Q_LIMIT < p->buffer_len + q->size))
+            break;
+
+#endif
+        if ((q->max_size) && (q->max_size < (p->buffer_len + q->size)))
+            break;
+
+        *list = p->next;
+        p->next = NULL;
+        if (!q->head)
+            q->head = p;
+        else
+            q->tail->next = p;
+
+        q->tail = p;
+        q->size += p->buffer_len + q->overhead;
+        q->frames++;
+        n++;
+        p = *list;
+    }
+    debug_q(q);
+
+    if (q->shared)
+        PICOTCP_MUTEX_UNLOCK(q->mutex);
+
+    if (was_empty && n)
+        pico_queue_wakeup(q);
+
+    return n;
+}
+
+/* Detach up to 'max' frames from the head of the queue under a single lock.
+ * The frames are returned as a NULL-terminated chain.
+ */
+static inline struct pico_frame *pico_dequeue_list(struct pico_queue *q, int max)
+{
+    struct pico_frame *head = q->head, *p;
+
+    if (!head || (q->frames < 1) || (max < 1))
+        return NULL;
+
+    if (q->shared)
+        PICOTCP_MUTEX_LOCK(q->mutex);
+
+    p = head;
+    while (1) {
+        q->frames--;
+        q->size -= p->buffer_len + q->overhead;
+        if ((--max == 0) || !p->next || (q->frames == 0))
+            break;
+
+        p = p->next;
+    }
+    q->head = p->next;
+    if (q->head == NULL)
+        q->tail = NULL;
+
+    p->next = NULL;
+    debug_q(q);
+
+    if (q->shared)
+        PICOTCP_MUTEX_UNLOCK(q->mutex);
+
+    return head;
+}
+
 static inline struct pico_frame *pico_queue_peek(struct pico_queue *q)
 {
     struct pico_frame *p = q->head;
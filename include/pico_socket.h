@@ -38,6 +38,24 @@
     #define PICO_DEFAULT_SOCKETQ (6 * 1024) /* seems like an acceptable default for small embedded systems */
 #endif
 
+/* TCP receive buffer autotuning: largest buffer a single connection may
+ * grow to, and total growth allowed per stack.
+ */
+#ifndef PICO_TCP_RCVBUF_MAX
+# ifdef __linux__
+    #define PICO_TCP_RCVBUF_MAX (4 * 1024 * 1024)
+# else
+    #define PICO_TCP_RCVBUF_MAX (64 * 1024)
+# endif
+#endif
+#ifndef PICO_TCP_RCVBUF_LIMIT
+# ifdef __linux__
+    #define PICO_TCP_RCVBUF_LIMIT (32 * 1024 * 1024)
+# else
+    #define PICO_TCP_RCVBUF_LIMIT (128 * 1024)
+# endif
+#endif
+
 #define PICO_SHUT_RD   1
 #define PICO_SHUT_WR   2
 #define PICO_SHUT_RDWR 3
@@ -70,6 +88,19 @@ struct pico_sockport
 };
 
 
+/* Where frames to 'dst' went last time: source link, next hop and its
+ * MAC. Valid while 'gen' matches the stack's DstCacheGen.
+ */
+struct pico_ipv4_dst_cache {
+    struct pico_ip4 dst;
+    struct pico_ip4 nexthop;
+    struct pico_ipv4_link *link;
+    uint32_t gen;
+    struct pico_eth mac;
+    uint8_t mac_valid;
+    uint8_t local;      /* dst is one of our addresses */
+};
+
 struct pico_socket {
     struct pico_stack *stack;
     struct pico_protocol *proto;
@@ -88,12 +119,15 @@ struct pico_socket {
 
 
 #ifdef PICO_SUPPORT_TCP
-    /* For the TCP backlog queue */
+    /* For the TCP backlog queue: established children waiting for accept() */
     struct pico_socket *backlog;
+    struct pico_socket *backlog_tail;
     struct pico_socket *next;
     struct pico_socket *parent;
     uint16_t max_backlog;
     uint16_t number_of_pending_conn;
+    /* Chaining in the per-stack connection lookup table */
+    struct pico_socket *hash_next;
 #endif
 #ifdef PICO_SUPPORT_MCAST
     struct pico_tree *MCASTListen;
@@ -102,8 +136,14 @@ struct pico_socket {
 #endif
 #endif
     uint16_t ev_pending;
+    /* Chaining in the per-stack list of sockets with pending work */
+    struct pico_socket *active_prev, *active_next;
+    uint8_t active;
 
     struct pico_device *dev;
+#ifdef PICO_SUPPORT_IPV4
+    struct pico_ipv4_dst_cache dst_cache;
+#endif
 
     /* Private field. */
     int id;
@@ -156,6 +196,15 @@ struct pico_ip_mreq_source {
 /* Socket options */
 # define PICO_TCP_NODELAY                     1
 # define PICO_SOCKET_OPT_TCPNODELAY           0x0000u
+# define PICO_TCP_RX_ZEROCOPY                 2
+# define PICO_SOCKET_OPT_TCPRXZEROCOPY        0x0002u
+# define PICO_TCP_ACK_DELAY                   3
+# define PICO_TCP_CONGESTION                  14
+
+/* Values for PICO_TCP_CONGESTION */
+# define PICO_TCP_CC_RENO                     0
+# define PICO_TCP_CC_CUBIC                    1
+# define PICO_TCP_CC_BBR                      2
 
 # define PICO_IP_MULTICAST_EXCLUDE            0
 # define PICO_IP_MULTICAST_INCLUDE            1
@@ -210,12 +259,22 @@ struct pico_msginfo {
     uint8_t tos;
 };
 
+struct pico_iovec {
+    const void *base;
+    uint32_t len;
+};
+
 int pico_socket_table_compare(void *ka, void *kb);
 
 struct pico_socket *pico_socket_open(struct pico_stack *S, uint16_t net, uint16_t proto, void (*wakeup)(uint16_t ev, struct pico_socket *s));
 
 int pico_socket_read(struct pico_socket *s, void *buf, int len);
+int pico_socket_read_zc(struct pico_socket *s, void **data);
+int pico_socket_read_zc_done(struct pico_socket *s, int len);
 int pico_socket_write(struct pico_socket *s, const void *buf, int len);
+int pico_socket_writev(struct pico_socket *s, const struct pico_iovec *iov, int iovcnt);
+int pico_socket_zc_headroom(struct pico_socket *s);
+int pico_socket_send_zc(struct pico_socket *s, uint8_t *buf, int len, void (*notify_free)(uint8_t *buf));
 
 int pico_socket_sendto(struct pico_socket *s, const void *buf, int len, void *dst, uint16_t remote_port);
 int pico_socket_sendto_extended(struct pico_socket *s, const void *buf, const int len,
@@ -287,6 +346,7 @@ int pico_transport_error(struct pico_stack *S, struct pico_frame *f, uint8_t pro
 
 /* Socket loop */
 int pico_sockets_loop(struct pico_stack *S, int loop_score);
+void pico_socket_schedule(struct pico_socket *s);
 struct pico_socket*pico_sockets_find(struct pico_stack *S, uint16_t local, uint16_t remote);
 /* Port check */
 int pico_is_port_free(struct pico_stack *S, uint16_t proto, uint16_t port, void *addr, void *net);
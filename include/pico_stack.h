@@ -29,6 +29,7 @@
 #include "pico_constants.h"
 #include "pico_queue.h"
 #include "heap.h"
+#include "pico_lpm.h"
 #ifndef INCLUDE_PICO_STACK
 #define INCLUDE_PICO_STACK
 #include "pico_arp.h"
@@ -57,6 +58,22 @@ struct arp_service_ipconflict {
     void (*conflict)(struct pico_stack *, int);
 };
 
+/* Frames waiting for ARP resolution, see pico_arp.c */
+struct pico_arp_stats {
+    uint32_t queued;        /* frames parked for an unresolved neighbour */
+    uint32_t sent;          /* parked frames sent once it resolved */
+    uint32_t overflow;      /* dropped: queue full */
+    uint32_t unresolved;    /* dropped: no reply */
+};
+
+/* Forwarding flow cache, see pico_ipv4.c */
+struct pico_ipv4_flow;
+struct pico_ipfilter_set;
+struct pico_ipv4_flow_stats {
+    uint32_t hits;          /* frames forwarded from a cached flow */
+    uint32_t misses;        /* frames looked up and not found */
+    uint32_t added;         /* flows cached */
+};
 
 
 #define PROTO_DEF_NR      11
@@ -109,10 +126,13 @@ struct pico_timer_ref
 
 typedef struct pico_timer_ref pico_timer_ref;
 
-DECLARE_HEAP(pico_timer_ref, expire);
+DECLARE_HEAP(pico_timer_ref, expire, id);
 
 struct pico_stack {
     struct pico_scheduler *sched;
+#ifdef PICO_SUPPORT_FRAME_POOL
+    struct pico_frame_pool frame_pool;
+#endif
     heap_pico_timer_ref *Timers;
     uint32_t timer_id;
     int score[PROTO_DEF_NR];
@@ -149,6 +169,13 @@ struct pico_stack {
     DECLARE_QUEUES(ipv4);
     struct pico_tree Tree_dev_link; 
     struct pico_tree Routes; 
+    struct pico_lpm RoutesLPM; /* Longest-prefix-match index over Routes */
+    uint32_t RoutesNonContig; /* Routes with non-contiguous netmasks */
+    uint32_t DstCacheGen; /* Bumped on route, link or ARP changes, see pico_ipv4.c */
+    uint32_t FlowCacheGen; /* Bumped with DstCacheGen, and on NAT or filter changes */
+    struct pico_ipv4_flow *ipv4_flows;
+    uint32_t ipv4_flows_size;
+    struct pico_ipv4_flow_stats ipv4_flow_stats;
     uint16_t ipv4_progressive_id;
     struct pico_ipv4_route *default_bcast_route;
 #   ifdef PICO_SUPPORT_RAWSOCKETS
@@ -156,8 +183,7 @@ struct pico_stack {
     struct pico_tree IP4Sockets;
 #   endif
 #   ifdef PICO_SUPPORT_NAT
-    struct pico_tree NATOutbound;
-    struct pico_tree NATInbound;
+    struct pico_nat_table *NAT; /* see pico_nat.c */
 #   endif
 #   ifdef PICO_SUPPORT_IPV4FRAG
     uint32_t ipv4_cur_frag_id;
@@ -173,6 +199,8 @@ struct pico_stack {
 #ifdef PICO_SUPPORT_IPV6
     DECLARE_QUEUES(ipv6);
     struct pico_tree IPV6Routes, IPV6Links, Tree_dev_ip6_link;
+    struct pico_lpm IPV6RoutesLPM; /* Longest-prefix-match index over IPV6Routes */
+    uint32_t IPV6RoutesNonContig;
     struct pico_tree IPV6NQueue;
     struct pico_tree IPV6NCache;
     struct pico_tree IPV6RCache;
@@ -219,11 +247,24 @@ struct pico_stack {
 #ifdef PICO_SUPPORT_TCP
     DECLARE_QUEUES(tcp);
     struct pico_tree TCPTable;
+    /* Connected sockets, hashed by 4-tuple (see pico_socket_tcp.c) */
+    struct pico_socket **TCPConnHash;
+    uint32_t TCPConnHashSize;
+    uint32_t TCPConnHashCount;
+    /* Receive buffer bytes granted by autotuning, see pico_tcp.c */
+    uint32_t TCPRcvBufUsed;
+    uint32_t TCPRcvBufLimit;
+    /* Half-open connections and SYN cookies, see pico_tcp.c */
+    struct pico_tcp_synq *TCPSynq;
+    uint8_t TCPSynCookies;
+    /* Compact TIME_WAIT records, see pico_tcp.c */
+    struct pico_tcp_tw *TCPTimeWait;
 #endif
 
 #if defined(PICO_SUPPORT_TCP) || defined(PICO_SUPPORT_UDP)
-    struct pico_sockport *sp_udp, *sp_tcp;
-    struct pico_tree_node *tcp_loop_index, *udp_loop_index;
+    /* Sockets with output or events pending, see pico_sockets_loop() */
+    struct pico_socket *sock_active, *sock_active_tail;
+    uint32_t sock_active_count;
 #ifdef PICO_SUPPORT_MUTEX
     void *SockMutex;
 #endif
@@ -248,6 +289,10 @@ struct pico_stack {
      *
      */
     struct arp_service_ipconflict conflict_ipv4;
+    /* Pending frames per next hop, see pico_arp.c */
+    struct pico_tree arp_pending;
+    uint32_t arp_pending_max;
+    struct pico_arp_stats arp_stats;
 #endif
 
 #ifdef PICO_SUPPORT_AODV
@@ -287,7 +332,7 @@ struct pico_stack {
 #endif
 
 #ifdef PICO_SUPPORT_IPFILTER
-    struct pico_tree ipfilter_tree;
+    struct pico_ipfilter_set *ipfilter;     /* active rule set */
 #endif
 
 #ifdef PICO_SUPPORT_TICKLESS
@@ -319,6 +364,20 @@ struct pico_stack {
 
 #define PICO_MAX_TIMERS 20
 
+/* Frame pool of a stack, NULL when frames come straight from the heap */
+#ifdef PICO_SUPPORT_FRAME_POOL
+#define PICO_STACK_FRAME_POOL(S) (&(S)->frame_pool)
+#else
+#define PICO_STACK_FRAME_POOL(S) ((struct pico_frame_pool *)NULL)
+#endif
+
+/* Hard limit on pending timers per stack. 0: grow until the heap's block
+ * table is full (see MAX_BLOCK_COUNT in heap.h).
+ */
+#ifndef PICO_TIMERS_LIMIT
+#define PICO_TIMERS_LIMIT 0
+#endif
+
 #define PICO_ETH_MRU (1514u)
 #define PICO_IP_MRU (1500u)
 
@@ -348,6 +407,7 @@ int pico_datalink_send(struct pico_frame *f);
 
 /* From dev up to socket */
 int pico_datalink_receive(struct pico_frame *f);
+int pico_datalink_receive_burst(struct pico_frame *list);
 
 /*******************************************************************************
  *  PHYSICAL LAYER
@@ -367,6 +427,9 @@ int32_t pico_stack_recv_zerocopy(struct pico_device *dev, uint8_t *buffer, uint3
 int32_t pico_stack_recv_zerocopy_ext_buffer(struct pico_device *dev, uint8_t *buffer, uint32_t len);
 int32_t pico_stack_recv_zerocopy_ext_buffer_notify(struct pico_device *dev, uint8_t *buffer, uint32_t len, void (*notify_free)(uint8_t *buffer));
 struct pico_frame *pico_stack_recv_new_frame(struct pico_device *dev, uint8_t *buffer, uint32_t len);
+/* Queue up to 'count' received buffers with one call, see pico_stack.c */
+int32_t pico_stack_recv_burst(struct pico_device *dev, uint8_t **buffers, const uint32_t *len, int count,
+                              void (*notify_free)(uint8_t *buffer));
 
 /* ===== SENDING FUNCTIONS (from socket down to dev) ===== */
 
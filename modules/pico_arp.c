@@ -35,7 +35,7 @@
 extern const uint8_t PICO_ETHADDR_ALL[6];
 #define PICO_ARP_TIMEOUT 600000llu
 #define PICO_ARP_RETRY 300lu
-#define PICO_ARP_MAX_PENDING 5
+#define PICO_ARP_MAX_TRIES 3
 
 #ifdef DEBUG_ARP
     #define arp_dbg dbg
@@ -45,21 +45,51 @@ extern const uint8_t PICO_ETHADDR_ALL[6];
 
 static int max_arp_reqs = PICO_ARP_MAX_RATE;
 static uint32_t arp_rate_timer = 0u;
-static struct pico_frame *frames_queued[PICO_ARP_MAX_PENDING] = {
-    0
+
+/* Frames waiting for one next hop to resolve */
+struct pico_arp_pending {
+    struct pico_ip4 ipv4;
+    struct pico_device *dev;
+    struct pico_frame *head;    /* oldest first, chained on f->next */
+    struct pico_frame *tail;
+    uint32_t len;
+    uint32_t timer;
+    uint8_t tries;              /* requests sent */
 };
 
-static void pico_arp_queued_trigger(void)
+int arp_pending_compare(void *ka, void *kb)
 {
-    int i;
-    struct pico_frame *f;
-    for (i = 0; i < PICO_ARP_MAX_PENDING; i++)
-    {
-        f = frames_queued[i];
-        if (f) {
-            if (pico_datalink_send(f) <= 0)
-                pico_frame_discard(f);
-            frames_queued[i] = NULL;
+    struct pico_arp_pending *a = ka, *b = kb;
+    return pico_ipv4_compare(&a->ipv4, &b->ipv4);
+}
+
+static void pico_arp_pending_del(struct pico_stack *S, struct pico_arp_pending *p)
+{
+    pico_tree_delete(&S->arp_pending, p);
+    pico_timer_cancel(S, p->timer);
+    PICO_FREE(p);
+}
+
+/* Neighbour resolved: hand its frames back to the ethernet layer */
+static void pico_arp_pending_flush(struct pico_stack *S, struct pico_ip4 *ipv4)
+{
+    struct pico_arp_pending search, *p;
+    struct pico_frame *f, *next;
+
+    search.ipv4.addr = ipv4->addr;
+    p = pico_tree_findKey(&S->arp_pending, &search);
+    if (!p)
+        return;
+
+    f = p->head;
+    pico_arp_pending_del(S, p);
+    for (; f; f = next) {
+        next = f->next;
+        if (pico_datalink_send(f) > 0) {
+            S->arp_stats.sent++;
+        } else {
+            S->arp_stats.overflow++;
+            pico_frame_discard(f);
         }
     }
 }
@@ -78,7 +108,7 @@ static void update_max_arp_reqs(pico_time now, void *arg)
 
 void pico_arp_init(struct pico_stack *S)
 {
-    (void)S;
+    S->arp_pending_max = PICO_ARP_MAX_PENDING;
     if (!pico_timer_add(S, PICO_ARP_INTERVAL / PICO_ARP_MAX_RATE, &update_max_arp_reqs, S)) {
         arp_dbg("ARP: Failed to start update_max_arps timer\n");
     }
@@ -154,47 +184,60 @@ struct pico_ip4 *pico_arp_reverse_lookup(struct pico_stack *S, struct pico_eth *
     return NULL;
 }
 
-static void pico_arp_unreachable(struct pico_stack *S, struct pico_ip4 *a)
+/* No reply: the neighbour is unreachable, drop what waited for it */
+static void pico_arp_unreachable(struct pico_stack *S, struct pico_arp_pending *p)
 {
-    int i;
-    struct pico_frame *f;
-    struct pico_ipv4_hdr *hdr;
-    struct pico_ip4 dst;
-    for (i = 0; i < PICO_ARP_MAX_PENDING; i++)
-    {
-        f = frames_queued[i];
-        if (f) {
-            hdr = (struct pico_ipv4_hdr *) f->net_hdr;
-            dst = pico_ipv4_route_get_gateway(S, &hdr->dst);
-            if (!dst.addr)
-                dst.addr = hdr->dst.addr;
-
-            if (dst.addr ==  a->addr) {
-                if (!pico_source_is_local(S, f)) {
-                    pico_notify_dest_unreachable(S, f);
-                }
+    struct pico_frame *f, *next;
 
-            }
+    for (f = p->head; f; f = next) {
+        next = f->next;
+        if (!pico_source_is_local(S, f)) {
+            pico_notify_dest_unreachable(S, f);
         }
+
+        S->arp_stats.unresolved++;
+        pico_frame_discard(f);
     }
+    pico_arp_pending_del(S, p);
 }
 
-static void pico_arp_retry(struct pico_stack *S, struct pico_frame *f, struct pico_ip4 *where)
+static void pico_arp_retry(pico_time now, void *arg)
 {
-    if (++f->failure_count < 4) {
-        arp_dbg ("================= ARP REQUIRED: %d =============\n\n", f->failure_count);
-        /* check if dst is local (gateway = 0), or if to use gateway */
-        pico_arp_request(f->dev, where, PICO_ARP_QUERY);
-    } else {
-        pico_arp_unreachable(S, where);
+    struct pico_arp_pending *p = (struct pico_arp_pending *)arg;
+    struct pico_stack *S = p->dev->stack;
+    IGNORE_PARAMETER(now);
+
+    p->timer = 0u;
+    if (p->tries >= PICO_ARP_MAX_TRIES) {
+        pico_arp_unreachable(S, p);
+        return;
     }
+
+    arp_dbg("================= ARP REQUIRED: %d =============\n\n", p->tries);
+    pico_arp_request(p->dev, &p->ipv4, PICO_ARP_QUERY);
+    p->tries++;
+    p->timer = pico_timer_add(S, PICO_ARP_RETRY, pico_arp_retry, p);
+    if (!p->timer) {
+        arp_dbg("ARP: Failed to start retry timer\n");
+        pico_arp_unreachable(S, p);
+    }
+}
+
+/* check if dst is local (gateway = 0), or if to use gateway */
+static struct pico_ip4 pico_arp_nexthop(struct pico_stack *S, struct pico_frame *f)
+{
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
+    struct pico_ip4 where = pico_ipv4_route_get_gateway(S, &hdr->dst);
+
+    if (!where.addr)
+        where.addr = hdr->dst.addr;
+
+    return where;
 }
 
 struct pico_eth *pico_arp_get(struct pico_stack *S, struct pico_frame *f)
 {
-    struct pico_eth *a4;
-    struct pico_ip4 gateway;
-    struct pico_ip4 *where;
+    struct pico_ip4 where;
     struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
     struct pico_ipv4_link *l;
     if (!hdr)
@@ -206,35 +249,91 @@ struct pico_eth *pico_arp_get(struct pico_stack *S, struct pico_frame *f)
         return &l->dev->eth->mac;
     }
 
-    gateway = pico_ipv4_route_get_gateway(S, &hdr->dst);
-    /* check if dst is local (gateway = 0), or if to use gateway */
-    if (gateway.addr != 0)
-        where = &gateway;
-    else
-        where = &hdr->dst;
+    where = pico_arp_nexthop(S, f);
+    return pico_arp_lookup(S, &where);      /* check if dst ip mac in cache */
+}
 
-    a4 = pico_arp_lookup(S, where);      /* check if dst ip mac in cache */
+/* Park a frame until its next hop resolves. The first frame for a
+ * neighbour sends the request; a full queue drops its oldest frame.
+ * Takes ownership of f.
+ */
+void pico_arp_postpone(struct pico_frame *f)
+{
+    struct pico_stack *S = f->dev->stack;
+    struct pico_arp_pending search, *p;
+    struct pico_frame *old;
+
+    search.ipv4 = pico_arp_nexthop(S, f);
+    p = pico_tree_findKey(&S->arp_pending, &search);
+    if (!p) {
+        p = PICO_ZALLOC(sizeof(struct pico_arp_pending));
+        if (!p) {
+            S->arp_stats.overflow++;
+            pico_frame_discard(f);
+            return;
+        }
 
-    if (!a4)
-        pico_arp_retry(S, f, where);
+        p->ipv4 = search.ipv4;
+        p->dev = f->dev;
+        p->timer = pico_timer_add(S, PICO_ARP_RETRY, pico_arp_retry, p);
+        if (!p->timer || pico_tree_insert(&S->arp_pending, p)) {
+            arp_dbg("ARP: Failed to queue frame for resolution\n");
+            pico_timer_cancel(S, p->timer);
+            PICO_FREE(p);
+            S->arp_stats.overflow++;
+            pico_frame_discard(f);
+            return;
+        }
 
-    return a4;
-}
+        pico_arp_request(p->dev, &p->ipv4, PICO_ARP_QUERY);
+        p->tries = 1;
+    } else if (p->len >= S->arp_pending_max) {
+        old = p->head;
+        p->head = old->next;
+        if (!p->head)
+            p->tail = NULL;
+
+        p->len--;
+        S->arp_stats.overflow++;
+        pico_frame_discard(old);
+    }
 
+    f->next = NULL;
+    if (p->tail)
+        p->tail->next = f;
+    else
+        p->head = f;
 
-void pico_arp_postpone(struct pico_frame *f)
+    p->tail = f;
+    p->len++;
+    S->arp_stats.queued++;
+}
+
+int pico_arp_set_pending_max(struct pico_stack *S, uint32_t max)
 {
-    int i;
-    for (i = 0; i < PICO_ARP_MAX_PENDING; i++)
-    {
-        if (!frames_queued[i]) {
-            if (f->failure_count < 4)
-                frames_queued[i] = f;
+    if (!max) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
 
-            return;
+    S->arp_pending_max = max;
+    return 0;
+}
+
+void pico_arp_destroy(struct pico_stack *S)
+{
+    struct pico_tree_node *index, *_tmp;
+    struct pico_arp_pending *p;
+    struct pico_frame *f, *next;
+
+    pico_tree_foreach_safe(index, &S->arp_pending, _tmp) {
+        p = index->keyValue;
+        for (f = p->head; f; f = next) {
+            next = f->next;
+            pico_frame_discard(f);
         }
+        pico_arp_pending_del(S, p);
     }
-    /* Not possible to enqueue: caller will discard packet */
 }
 
 
@@ -256,6 +355,7 @@ static void arp_expire(pico_time now, void *_stale)
     struct pico_arp *stale = (struct pico_arp *) _stale;
     if (now >= (stale->timestamp + PICO_ARP_TIMEOUT)) {
         stale->arp_status = PICO_ARP_STATUS_STALE;
+        pico_ipv4_dst_cache_invalidate(stale->dev->stack);
         arp_dbg("ARP: Setting arp_status to STALE\n");
         pico_arp_request(stale->dev, &stale->ipv4, PICO_ARP_QUERY);
     } else {
@@ -263,6 +363,7 @@ static void arp_expire(pico_time now, void *_stale)
          * No action required to refresh the entry, will check on the next timeout */
         if (!pico_timer_add(stale->dev->stack, PICO_ARP_TIMEOUT + stale->timestamp - now, arp_expire, stale)) {
             arp_dbg("ARP: Failed to start expiration timer, destroying arp entry\n");
+            pico_ipv4_dst_cache_invalidate(stale->dev->stack);
             pico_tree_delete(&stale->dev->stack->arp_tree, stale);
             PICO_FREE(stale);
         }
@@ -280,7 +381,8 @@ static int pico_arp_add_entry(struct pico_arp *entry)
     }
 
     arp_dbg("ARP ## reachable.\n");
-    pico_arp_queued_trigger();
+    pico_ipv4_dst_cache_invalidate(entry->dev->stack);
+    pico_arp_pending_flush(entry->dev->stack, &entry->ipv4);
     if (!pico_timer_add(entry->dev->stack, PICO_ARP_TIMEOUT, arp_expire, entry)) {
         arp_dbg("ARP: Failed to start expiration timer\n");
         pico_tree_delete(&entry->dev->stack->arp_tree, entry);
@@ -343,6 +445,9 @@ static struct pico_arp *pico_arp_lookup_entry(struct pico_stack *S, struct pico_
             }
         } else {
             /* Update mac address */
+            if (memcmp(found->eth.addr, hdr->s_mac, PICO_SIZE_ETH) != 0)
+                pico_ipv4_dst_cache_invalidate(S);
+
             memcpy(found->eth.addr, hdr->s_mac, PICO_SIZE_ETH);
             arp_dbg("ARP entry updated!\n");
 
@@ -47,11 +47,23 @@ int32_t pico_arp_request(struct pico_device *dev, struct pico_ip4 *dst, uint8_t
 #define PICO_ARP_CONFLICT_REASON_CONFLICT 0
 #define PICO_ARP_CONFLICT_REASON_PROBE 1
 
+/* Frames held per unresolved neighbour, see pico_arp_set_pending_max() */
+#ifndef PICO_ARP_MAX_PENDING
+# ifdef __linux__
+#  define PICO_ARP_MAX_PENDING 16u
+# else
+#  define PICO_ARP_MAX_PENDING 4u
+# endif
+#endif
+
 struct pico_eth *pico_arp_lookup(struct pico_stack *S, struct pico_ip4 *dst);
 struct pico_ip4 *pico_arp_reverse_lookup(struct pico_stack *S, struct pico_eth *dst);
 int pico_arp_create_entry(uint8_t*hwaddr, struct pico_ip4 ipv4, struct pico_device*dev);
 void pico_arp_register_ipconflict(struct pico_stack *S, struct pico_ip4 *ip, struct pico_eth *mac, void (*cb)(struct pico_stack *S, int reason));
 void pico_arp_postpone(struct pico_frame *f);
+int pico_arp_set_pending_max(struct pico_stack *S, uint32_t max);
 void pico_arp_init(struct pico_stack *S);
+void pico_arp_destroy(struct pico_stack *S);
 int arp_compare(void *ka, void *kb);
+int arp_pending_compare(void *ka, void *kb);
 #endif
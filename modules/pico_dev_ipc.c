@@ -25,8 +25,12 @@
  *
  *
  *********************************************************************/
+#ifdef __linux__
+#define _GNU_SOURCE /* sendmmsg */
+#endif
 #include <sys/poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #include "pico_device.h"
@@ -39,6 +43,7 @@ struct pico_device_ipc {
 };
 
 #define IPC_MTU 2048
+#define IPC_BURST 32
 
 static int pico_ipc_send(struct pico_device *dev, void *buf, int len)
 {
@@ -46,6 +51,33 @@ static int pico_ipc_send(struct pico_device *dev, void *buf, int len)
     return (int)write(ipc->fd, buf, (uint32_t)len);
 }
 
+#ifdef __linux__
+/* SOCK_SEQPACKET keeps packet boundaries: push the whole burst with one
+ * sendmmsg() call.
+ */
+static int pico_ipc_send_burst(struct pico_device *dev, struct pico_frame **f, int count)
+{
+    struct pico_device_ipc *ipc = (struct pico_device_ipc *) dev;
+    struct mmsghdr msg[IPC_BURST];
+    struct iovec iov[IPC_BURST];
+    int i;
+
+    if (count > IPC_BURST)
+        count = IPC_BURST;
+
+    memset(msg, 0, sizeof(struct mmsghdr) * (size_t)count);
+    for (i = 0; i < count; i++) {
+        iov[i].iov_base = f[i]->start;
+        iov[i].iov_len = f[i]->len;
+        msg[i].msg_hdr.msg_iov = &iov[i];
+        msg[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    i = sendmmsg(ipc->fd, msg, (unsigned int)count, MSG_DONTWAIT);
+    return (i < 0) ? 0 : i;
+}
+#endif
+
 static int pico_ipc_poll(struct pico_device *dev, int loop_score)
 {
     struct pico_device_ipc *ipc = (struct pico_device_ipc *) dev;
@@ -122,6 +154,9 @@ struct pico_device *pico_ipc_create(struct pico_stack *S, const char *sock_path,
     }
 
     ipc->dev.send = pico_ipc_send;
+#ifdef __linux__
+    ipc->dev.send_burst = pico_ipc_send_burst;
+#endif
     ipc->dev.poll = pico_ipc_poll;
     ipc->dev.destroy = pico_ipc_destroy;
     dbg("Device %s created.\n", ipc->dev.name);
@@ -40,13 +40,15 @@
 
 #include <sys/poll.h>
 
+#define TUN_MTU 2048
+#define TUN_BURST 16 /* Packets read per pico_stack_recv_burst() call */
+
 struct pico_device_tap {
     struct pico_device dev;
     int fd;
+    uint8_t rx_buf[TUN_BURST][TUN_MTU];
 };
 
-#define TUN_MTU 2048
-
 /* We only support one global link state - we only have two USR signals, we */
 /* can't spread these out over an arbitrary amount of devices. When you unplug */
 /* one tap, you unplug all of them. */
@@ -76,24 +78,50 @@ static int pico_tap_send(struct pico_device *dev, void *buf, int len)
     return (int)write(tap->fd, buf, (uint32_t)len);
 }
 
+/* A tun/tap descriptor takes exactly one packet per write(2) (writev would
+ * merge the frames into one), so a burst is a tight write loop that stops
+ * at the first frame the kernel does not accept.
+ */
+static int pico_tap_send_burst(struct pico_device *dev, struct pico_frame **f, int count)
+{
+    struct pico_device_tap *tap = (struct pico_device_tap *) dev;
+    int i;
+    for (i = 0; i < count; i++) {
+        if (write(tap->fd, f[i]->start, f[i]->len) <= 0)
+            break;
+    }
+    return i;
+}
+
 static int pico_tap_poll(struct pico_device *dev, int loop_score)
 {
     struct pico_device_tap *tap = (struct pico_device_tap *) dev;
     struct pollfd pfd;
-    unsigned char buf[TUN_MTU];
-    int len;
+    uint8_t *buf[TUN_BURST];
+    uint32_t len[TUN_BURST];
+    int n, r;
     pfd.fd = tap->fd;
     pfd.events = POLLIN;
     do  {
-        if (poll(&pfd, 1, 0) <= 0) {
-            return loop_score;
-        }
+        /* Drain what is ready, then queue it to the stack in one go */
+        for (n = 0; (n < TUN_BURST) && (n < loop_score); n++) {
+            if (poll(&pfd, 1, 0) <= 0)
+                break;
+
+            r = (int)read(tap->fd, tap->rx_buf[n], TUN_MTU);
+            if (r <= 0)
+                break;
 
-        len = (int)read(tap->fd, buf, TUN_MTU);
-        if (len > 0) {
-            loop_score--;
-            pico_stack_recv(dev, buf, (uint32_t)len);
+            buf[n] = tap->rx_buf[n];
+            len[n] = (uint32_t)r;
         }
+        if (n == 0)
+            return loop_score;
+
+        loop_score -= n;
+        pico_stack_recv_burst(dev, buf, len, n, NULL);
+        if ((n < TUN_BURST) && (loop_score > 0))
+            return loop_score;
     } while(loop_score > 0);
     return 0;
 }
@@ -270,6 +298,7 @@ struct pico_device *pico_tap_create(struct pico_stack *S, char *name)
     }
 
     tap->dev.send = pico_tap_send;
+    tap->dev.send_burst = pico_tap_send_burst;
     tap->dev.poll = pico_tap_poll;
 #ifdef PICO_SUPPORT_TICKLESS
     tap->dev.wfi = pico_tap_WFI;
@@ -35,36 +35,65 @@
 
 #include <sys/poll.h>
 
+#define TUN_MTU 2048
+#define TUN_BURST 16 /* Packets read per pico_stack_recv_burst() call */
+
 struct pico_device_tun {
     struct pico_device dev;
     int fd;
+    uint8_t rx_buf[TUN_BURST][TUN_MTU];
 };
 
-#define TUN_MTU 2048
-
 static int pico_tun_send(struct pico_device *dev, void *buf, int len)
 {
     struct pico_device_tun *tun = (struct pico_device_tun *) dev;
     return (int)write(tun->fd, buf, (uint32_t)len);
 }
 
+/* A tun/tap descriptor takes exactly one packet per write(2) (writev would
+ * merge the frames into one), so a burst is a tight write loop that stops
+ * at the first frame the kernel does not accept.
+ */
+static int pico_tun_send_burst(struct pico_device *dev, struct pico_frame **f, int count)
+{
+    struct pico_device_tun *tun = (struct pico_device_tun *) dev;
+    int i;
+    for (i = 0; i < count; i++) {
+        if (write(tun->fd, f[i]->start, f[i]->len) <= 0)
+            break;
+    }
+    return i;
+}
+
 static int pico_tun_poll(struct pico_device *dev, int loop_score)
 {
     struct pico_device_tun *tun = (struct pico_device_tun *) dev;
     struct pollfd pfd;
-    unsigned char buf[TUN_MTU];
-    int len;
+    uint8_t *buf[TUN_BURST];
+    uint32_t len[TUN_BURST];
+    int n, r;
     pfd.fd = tun->fd;
     pfd.events = POLLIN;
     do  {
-        if (poll(&pfd, 1, 0) <= 0)
-            return loop_score;
+        /* Drain what is ready, then queue it to the stack in one go */
+        for (n = 0; (n < TUN_BURST) && (n < loop_score); n++) {
+            if (poll(&pfd, 1, 0) <= 0)
+                break;
+
+            r = (int)read(tun->fd, tun->rx_buf[n], TUN_MTU);
+            if (r <= 0)
+                break;
 
-        len = (int)read(tun->fd, buf, TUN_MTU);
-        if (len > 0) {
-            loop_score--;
-            pico_stack_recv(dev, buf, (uint32_t)len);
+            buf[n] = tun->rx_buf[n];
+            len[n] = (uint32_t)r;
         }
+        if (n == 0)
+            return loop_score;
+
+        loop_score -= n;
+        pico_stack_recv_burst(dev, buf, len, n, NULL);
+        if ((n < TUN_BURST) && (loop_score > 0))
+            return loop_score;
     } while(loop_score > 0);
     return 0;
 }
@@ -121,6 +150,7 @@ struct pico_device *pico_tun_create(struct pico_stack *S, char *name)
     }
 
     tun->dev.send = pico_tun_send;
+    tun->dev.send_burst = pico_tun_send_burst;
     tun->dev.poll = pico_tun_poll;
     tun->dev.destroy = pico_tun_destroy;
     dbg("Device %s created.\n", tun->dev.name);
@@ -83,13 +83,12 @@ static struct pico_frame *pico_ethernet_alloc(struct pico_stack *S, struct pico_
 {
     struct pico_frame *f = NULL;
     uint32_t overhead = 0;
-    (void)S;
     IGNORE_PARAMETER(self);
 
     if (dev)
         overhead = dev->overhead;
 
-    f = pico_frame_alloc((uint32_t)(overhead + size + PICO_SIZE_ETHHDR));
+    f = pico_frame_alloc_pool(S ? PICO_STACK_FRAME_POOL(S) : NULL, (uint32_t)(overhead + size + PICO_SIZE_ETHHDR));
     if (!f)
         return NULL;
 
@@ -393,6 +392,15 @@ int32_t MOCKABLE pico_ethernet_send(struct pico_stack *S, struct pico_frame *f)
     else
 #endif
 
+#if (defined PICO_SUPPORT_IPV4)
+    /* Unicast to a next hop resolved by the socket's destination cache */
+    if (f->flags & PICO_FRAME_FLAG_L2_RESOLVED) {
+        memcpy(&dstmac, ((struct pico_eth_hdr *)(f->net_hdr - PICO_SIZE_ETHHDR))->daddr, PICO_SIZE_ETH);
+        dstmac_valid = 1;
+    }
+    else
+#endif
+
     /* In case of broadcast (IPV4 only), dst mac is FF:FF:... */
     if (IS_BCAST(f) || destination_is_bcast(S, f))
     {
@@ -418,10 +426,10 @@ int32_t MOCKABLE pico_ethernet_send(struct pico_stack *S, struct pico_frame *f)
             memcpy(&dstmac, arp_get, PICO_SIZE_ETH);
             dstmac_valid = 1;
         } else {
-            /* Enqueue copy of frame in ARP-module to retry later. Discard
-             * frame otherwise we have a duplicate */
+            /* Hand the frame to the ARP module, sent once the next hop
+             * resolves */
             pico_arp_postpone(f);
-            return (int32_t)f->len;
+            return (int32_t)len;
         }
     }
 #endif
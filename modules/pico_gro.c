@@ -0,0 +1,387 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_frame.h"
+#include "pico_device.h"
+#include "pico_protocol.h"
+#include "pico_eth.h"
+#include "pico_ipv4.h"
+#include "pico_ipv6.h"
+#include "pico_nat.h"
+#include "pico_tcp.h"
+#include "pico_gro.h"
+
+/* Segments of one flow held while walking the batch, chained by ->next */
+struct gro_flow {
+    struct pico_frame *head;
+    struct pico_frame *tail;
+    uint32_t next_seq;
+    uint32_t len;   /* payload bytes held */
+};
+
+struct gro_batch {
+    struct gro_flow flow[PICO_GRO_FLOWS];
+    int n;
+    struct pico_frame *out;
+    struct pico_frame **out_tail;
+};
+
+/* gro_classify() */
+#define GRO_OTHER 0 /* not TCP, or unparsed: ends every merge in progress */
+#define GRO_FLUSH 1 /* TCP, but not mergeable: ends its own flow's merge */
+#define GRO_MERGE 2 /* plain data segment */
+
+#define GRO_TCP(f) ((struct pico_tcp_hdr *)(f)->transport_hdr)
+#define GRO_THLEN(f) ((uint16_t)((GRO_TCP(f)->len & 0xf0u) >> 2))
+
+/* Locate the IP and TCP headers. Only plain data segments (no IP
+ * options or extension headers, no fragment, nothing but ACK and PSH
+ * set) with valid checksums can be merged.
+ */
+static int gro_classify(struct pico_frame *f)
+{
+    uint8_t *net = f->start;
+    uint32_t len = f->len;
+    uint16_t nhlen, tlen, thlen;
+    struct pico_tcp_hdr *tcp;
+
+    if (f->dev->eth) {
+        struct pico_eth_hdr *eth = (struct pico_eth_hdr *)f->start;
+        if ((len < PICO_SIZE_ETHHDR) || ((eth->proto != PICO_IDETH_IPV4) && (eth->proto != PICO_IDETH_IPV6)))
+            return GRO_OTHER;
+
+        net += PICO_SIZE_ETHHDR;
+        len -= PICO_SIZE_ETHHDR;
+    }
+
+    f->net_hdr = net;
+    if (0) {}
+#ifdef PICO_SUPPORT_IPV4
+    else if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)net;
+        nhlen = PICO_SIZE_IP4HDR;
+        if ((len < nhlen) || (hdr->vhl != 0x45) || (hdr->proto != PICO_PROTO_TCP) ||
+            (short_be(hdr->frag) & (PICO_IPV4_MOREFRAG | PICO_IPV4_FRAG_MASK)))
+            return GRO_OTHER;
+
+        if ((short_be(hdr->len) > len) || (short_be(hdr->len) < nhlen))
+            return GRO_OTHER;
+
+#ifdef PICO_SUPPORT_CRC
+        if (pico_checksum(hdr, nhlen))
+            return GRO_OTHER;
+#endif
+        tlen = (uint16_t)(short_be(hdr->len) - nhlen);
+    }
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    else if (IS_IPV6(f)) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)net;
+        nhlen = PICO_SIZE_IP6HDR;
+        if ((len < nhlen) || (hdr->nxthdr != PICO_PROTO_TCP))
+            return GRO_OTHER;
+
+        tlen = short_be(hdr->len);
+        if ((uint32_t)(nhlen + tlen) > len)
+            return GRO_OTHER;
+    }
+#endif
+    else {
+        return GRO_OTHER;
+    }
+
+    f->net_len = nhlen;
+    f->transport_hdr = net + nhlen;
+    f->transport_len = tlen;
+    if (tlen < PICO_TCPHDR_SIZE)
+        return GRO_OTHER;
+
+    tcp = GRO_TCP(f);
+    thlen = GRO_THLEN(f);
+    if ((thlen < PICO_TCPHDR_SIZE) || (thlen > tlen))
+        return GRO_OTHER;
+
+#ifdef PICO_SUPPORT_CRC
+    if (short_be(pico_tcp_checksum(f)))
+        return GRO_OTHER;
+#endif
+    if ((thlen == tlen) || ((tcp->flags & (uint8_t)~PICO_TCP_PSH) != PICO_TCP_ACK))
+        return GRO_FLUSH;
+
+    f->payload = f->transport_hdr + thlen;
+    f->payload_len = (uint16_t)(tlen - thlen);
+    return GRO_MERGE;
+}
+
+/* Only traffic for this host: a merged frame must never be forwarded */
+static int gro_dst_is_local(struct pico_frame *f)
+{
+    struct pico_stack *S = f->dev->stack;
+    (void)S;
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        return (pico_ipv4_link_find(S, &hdr->dst) != NULL) && !pico_ipv4_nat_is_enabled(&hdr->dst);
+    }
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f)) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        return (pico_ipv6_link_find(S, &hdr->dst) != NULL);
+    }
+#endif
+    return 0;
+}
+
+static int gro_same_flow(struct pico_frame *a, struct pico_frame *b)
+{
+    uint32_t l2 = (uint32_t)(a->net_hdr - a->start);
+
+    if ((l2 != (uint32_t)(b->net_hdr - b->start)) || (memcmp(a->start, b->start, l2) != 0))
+        return 0;
+
+    if (memcmp(&GRO_TCP(a)->trans, &GRO_TCP(b)->trans, sizeof(struct pico_trans)) != 0)
+        return 0;
+
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(a) && IS_IPV4(b)) {
+        struct pico_ipv4_hdr *ha = (struct pico_ipv4_hdr *)a->net_hdr;
+        struct pico_ipv4_hdr *hb = (struct pico_ipv4_hdr *)b->net_hdr;
+        return (ha->src.addr == hb->src.addr) && (ha->dst.addr == hb->dst.addr);
+    }
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(a) && IS_IPV6(b)) {
+        struct pico_ipv6_hdr *ha = (struct pico_ipv6_hdr *)a->net_hdr;
+        struct pico_ipv6_hdr *hb = (struct pico_ipv6_hdr *)b->net_hdr;
+        return (memcmp(&ha->src, &hb->src, PICO_SIZE_IP6) == 0) && (memcmp(&ha->dst, &hb->dst, PICO_SIZE_IP6) == 0);
+    }
+#endif
+    return 0;
+}
+
+/* f continues the flow: next in sequence, same ACK and options, same
+ * IP header fields, and it still fits.
+ */
+static int gro_can_append(struct gro_flow *fl, struct pico_frame *f)
+{
+    struct pico_frame *h = fl->head;
+    struct pico_tcp_hdr *th = GRO_TCP(h), *tf = GRO_TCP(f);
+    uint16_t thlen = GRO_THLEN(h);
+
+    if ((long_be(tf->seq) != fl->next_seq) || (tf->ack != th->ack) || (GRO_THLEN(f) != thlen))
+        return 0;
+
+    /* A short segment closes the flow. PSH does not: nothing is held
+     * past the batch, so merging never delays delivery.
+     */
+    if (fl->tail->payload_len < h->payload_len)
+        return 0;
+
+    if ((f->payload_len > h->payload_len) || ((fl->len + f->payload_len + thlen) > PICO_GRO_MAX_SIZE))
+        return 0;
+
+    if (memcmp((uint8_t *)th + PICO_TCPHDR_SIZE, (uint8_t *)tf + PICO_TCPHDR_SIZE, (size_t)(thlen - PICO_TCPHDR_SIZE)) != 0)
+        return 0;
+
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(h)) {
+        struct pico_ipv4_hdr *a = (struct pico_ipv4_hdr *)h->net_hdr;
+        struct pico_ipv4_hdr *b = (struct pico_ipv4_hdr *)f->net_hdr;
+        return (a->tos == b->tos) && (a->ttl == b->ttl);
+    }
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(h)) {
+        struct pico_ipv6_hdr *a = (struct pico_ipv6_hdr *)h->net_hdr;
+        struct pico_ipv6_hdr *b = (struct pico_ipv6_hdr *)f->net_hdr;
+        return (a->vtf == b->vtf) && (a->hop == b->hop);
+    }
+#endif
+    return 0;
+}
+
+/* One frame with the headers of the first segment, the window of the
+ * last one, PSH if any had it, and all the payloads. NULL if out of
+ * memory.
+ */
+static struct pico_frame *gro_merge(struct gro_flow *fl)
+{
+    struct pico_frame *h = fl->head, *f, *m;
+    uint32_t hlen = (uint32_t)(h->payload - h->start);
+    uint16_t tlen = (uint16_t)(GRO_THLEN(h) + fl->len);
+    struct pico_tcp_hdr *tcp;
+    uint8_t *p;
+
+    m = pico_frame_alloc(hlen + fl->len);
+    if (!m)
+        return NULL;
+
+    m->dev = h->dev;
+    m->start = m->buffer;
+    m->len = m->buffer_len;
+    /* m owns its buffer: only BCAST may come from the segments */
+    m->flags |= (uint8_t)((h->flags & PICO_FRAME_FLAG_BCAST) | PICO_FRAME_FLAG_CSUM_VALID);
+    m->gso_size = h->payload_len;
+    memcpy(m->buffer, h->start, hlen);
+    p = m->buffer + hlen;
+    for (f = h; f; f = f->next) {
+        memcpy(p, f->payload, f->payload_len);
+        p += f->payload_len;
+    }
+
+    if (h->datalink_hdr)
+        m->datalink_hdr = m->buffer;
+
+    m->net_hdr = m->buffer + (h->net_hdr - h->start);
+    m->transport_hdr = m->buffer + (h->transport_hdr - h->start);
+    tcp = GRO_TCP(m);
+    for (f = h; f; f = f->next)
+        tcp->flags |= GRO_TCP(f)->flags;
+    tcp->rwnd = GRO_TCP(fl->tail)->rwnd;
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(m)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)m->net_hdr;
+        hdr->len = short_be((uint16_t)(PICO_SIZE_IP4HDR + tlen));
+        hdr->crc = 0;
+        hdr->crc = short_be(pico_checksum(hdr, PICO_SIZE_IP4HDR));
+    }
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(m)) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)m->net_hdr;
+        hdr->len = short_be(tlen);
+    }
+#endif
+    return m;
+}
+
+static void gro_emit(struct gro_batch *b, struct pico_frame *f, struct pico_frame *last)
+{
+    *b->out_tail = f;
+    b->out_tail = &last->next;
+    last->next = NULL;
+}
+
+static void gro_flush(struct gro_batch *b, struct gro_flow *fl)
+{
+    struct pico_frame *m = NULL, *f, *next;
+
+    if (fl->head != fl->tail)
+        m = gro_merge(fl);
+
+    if (!m) {
+        gro_emit(b, fl->head, fl->tail);
+        return;
+    }
+
+    for (f = fl->head; f; f = next) {
+        next = f->next;
+        pico_frame_discard(f);
+    }
+    gro_emit(b, m, m);
+}
+
+static void gro_flush_all(struct gro_batch *b)
+{
+    int i;
+    for (i = 0; i < b->n; i++)
+        gro_flush(b, &b->flow[i]);
+    b->n = 0;
+}
+
+static void gro_flush_one(struct gro_batch *b, int i)
+{
+    gro_flush(b, &b->flow[i]);
+    memmove(&b->flow[i], &b->flow[i + 1], sizeof(struct gro_flow) * (size_t)(b->n - i - 1));
+    b->n--;
+}
+
+static void gro_start(struct gro_flow *fl, struct pico_frame *f)
+{
+    fl->head = f;
+    fl->tail = f;
+    fl->len = f->payload_len;
+    fl->next_seq = long_be(GRO_TCP(f)->seq) + f->payload_len;
+    f->next = NULL;
+}
+
+struct pico_frame *pico_gro_receive(struct pico_frame *list)
+{
+    struct gro_batch b;
+    struct gro_flow *fl;
+    struct pico_frame *f, *next;
+    int i, kind;
+
+    b.n = 0;
+    b.out = NULL;
+    b.out_tail = &b.out;
+    for (f = list; f; f = next) {
+        next = f->next;
+        kind = gro_classify(f);
+        if (kind == GRO_OTHER) {
+            /* Keeps its place after whatever arrived before it */
+            gro_flush_all(&b);
+            gro_emit(&b, f, f);
+            continue;
+        }
+
+        for (i = 0; i < b.n; i++) {
+            if (gro_same_flow(b.flow[i].head, f))
+                break;
+        }
+
+        if (kind == GRO_FLUSH) {
+            /* e.g. a FIN, after the data it follows. ACKs flowing the
+             * other way do not disturb a merge.
+             */
+            if (i < b.n)
+                gro_flush_one(&b, i);
+
+            gro_emit(&b, f, f);
+            continue;
+        }
+
+        fl = (i < b.n) ? &b.flow[i] : NULL;
+        if (fl && gro_can_append(fl, f)) {
+            fl->tail->next = f;
+            fl->tail = f;
+            f->next = NULL;
+            fl->len += f->payload_len;
+            fl->next_seq += f->payload_len;
+        } else if (fl) {
+            gro_flush(&b, fl);
+            gro_start(fl, f);
+        } else if (!gro_dst_is_local(f)) {
+            gro_emit(&b, f, f);
+        } else {
+            if (b.n == PICO_GRO_FLOWS)
+                gro_flush_one(&b, 0);
+
+            gro_start(&b.flow[b.n++], f);
+        }
+    }
+    gro_flush_all(&b);
+    return b.out;
+}
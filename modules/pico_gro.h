@@ -0,0 +1,48 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#ifndef INCLUDE_PICO_GRO
+#define INCLUDE_PICO_GRO
+#include "pico_config.h"
+#include "pico_frame.h"
+
+/* Largest TCP header + payload built by merging received segments */
+#ifndef PICO_GRO_MAX_SIZE
+#define PICO_GRO_MAX_SIZE 65000u
+#endif
+
+/* Flows tracked at once while walking a receive batch */
+#ifndef PICO_GRO_FLOWS
+#define PICO_GRO_FLOWS 8
+#endif
+
+/* Coalesce a chain of frames received by one device in the same poll
+ * batch. Consecutive in-order TCP segments of a flow addressed to this
+ * host are merged into one frame, with checksums verified per segment
+ * and marked with PICO_FRAME_FLAG_CSUM_VALID. Anything else keeps its
+ * place in the chain. Nothing is held across calls.
+ *
+ * Returns the new chain.
+ */
+struct pico_frame *pico_gro_receive(struct pico_frame *list);
+
+#endif
@@ -0,0 +1,133 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_frame.h"
+#include "pico_device.h"
+#include "pico_protocol.h"
+#include "pico_ipv4.h"
+#include "pico_ipv6.h"
+#include "pico_tcp.h"
+#include "pico_gso.h"
+
+/* Lengths and checksums of the segment at f->start, carrying 'len'
+ * payload bytes after a TCP header of 'thlen' bytes. Flags are kept as
+ * they are: the TCP layer only merges segments with identical headers.
+ */
+static void gso_fixup(struct pico_frame *f, uint16_t thlen, uint16_t len)
+{
+    struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)f->transport_hdr;
+    uint16_t nhlen = (uint16_t)(f->transport_hdr - f->net_hdr);
+    uint16_t tlen = (uint16_t)(thlen + len);
+
+    tcp->crc = 0;
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        struct pico_ipv4_pseudo_hdr pseudo;
+
+        hdr->len = short_be((uint16_t)(nhlen + tlen));
+        hdr->crc = 0;
+        hdr->crc = short_be(pico_checksum(hdr, nhlen));
+
+        pseudo.src.addr = hdr->src.addr;
+        pseudo.dst.addr = hdr->dst.addr;
+        pseudo.zeros = 0;
+        pseudo.proto = PICO_PROTO_TCP;
+        pseudo.len = short_be(tlen);
+        tcp->crc = short_be(pico_dualbuffer_checksum(&pseudo, sizeof(pseudo), tcp, tlen));
+    }
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f)) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        struct pico_ipv6_pseudo_hdr pseudo;
+
+        /* The payload length counts the extension headers too */
+        hdr->len = short_be((uint16_t)(nhlen - PICO_SIZE_IP6HDR + tlen));
+
+        pseudo.src = hdr->src;
+        pseudo.dst = hdr->dst;
+        pseudo.len = long_be(tlen);
+        pseudo.zero[0] = 0;
+        pseudo.zero[1] = 0;
+        pseudo.zero[2] = 0;
+        pseudo.nxthdr = PICO_PROTO_TCP;
+        tcp->crc = short_be(pico_dualbuffer_checksum(&pseudo, sizeof(pseudo), tcp, tlen));
+    }
+#endif
+}
+
+/* Slide the headers forward over the 'len' bytes just sent, so that
+ * they sit right before the next segment's payload.
+ */
+static void gso_advance(struct pico_frame *f, uint32_t hlen, uint16_t len)
+{
+    struct pico_tcp_hdr *tcp;
+
+    memmove(f->start + len, f->start, hlen);
+    f->start += len;
+    f->len -= len;
+    if (f->datalink_hdr)
+        f->datalink_hdr += len;
+
+    f->net_hdr += len;
+    f->transport_hdr += len;
+    f->payload += len;
+    f->payload_len = (uint16_t)(f->payload_len - len);
+
+    tcp = (struct pico_tcp_hdr *)f->transport_hdr;
+    tcp->seq = long_be(long_be(tcp->seq) + len);
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(f)) {
+        /* pico_ipv4_frame_push() reserved one id per segment */
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        hdr->id = short_be((uint16_t)(short_be(hdr->id) + 1u));
+    }
+#endif
+}
+
+int pico_gso_xmit(struct pico_device *dev, struct pico_frame *f)
+{
+    struct pico_tcp_hdr *tcp;
+    uint16_t thlen, len;
+    uint32_t hlen;
+    int ret;
+
+    for (;;) {
+        tcp = (struct pico_tcp_hdr *)f->transport_hdr;
+        thlen = (uint16_t)((tcp->len & 0xf0u) >> 2);
+        hlen = (uint32_t)(f->transport_hdr - f->start) + thlen;
+        len = (uint16_t)(((f->len - hlen) > f->gso_size) ? f->gso_size : (f->len - hlen));
+
+        gso_fixup(f, thlen, len);
+        ret = dev->send(dev, f->start, (int)(hlen + len));
+        if (ret <= 0)
+            return 0;
+
+        if ((hlen + len) >= f->len)
+            return ret;
+
+        gso_advance(f, hlen, len);
+    }
+}
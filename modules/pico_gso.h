@@ -0,0 +1,47 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#ifndef INCLUDE_PICO_GSO
+#define INCLUDE_PICO_GSO
+#include "pico_config.h"
+#include "pico_frame.h"
+#include "pico_device.h"
+
+/* Largest TCP header + payload carried by one super-frame. Leaves room
+ * for the IPv4 header within the 16 bit total length.
+ */
+#ifndef PICO_GSO_MAX_SIZE
+#define PICO_GSO_MAX_SIZE 65000u
+#endif
+
+/* Hand a TCP super-frame (f->gso_size != 0) to dev->send() as a train
+ * of segments of at most gso_size payload bytes each. Headers are
+ * replicated in place, in front of each segment's payload, and lengths,
+ * sequence numbers, IPv4 ids and checksums are fixed up.
+ *
+ * Returns the last segment's send() result once the whole frame is out,
+ * 0 if the device is busy: the frame then remembers how far it got, and
+ * the next call resumes from there.
+ */
+int pico_gso_xmit(struct pico_device *dev, struct pico_frame *f);
+
+#endif
@@ -35,11 +35,23 @@
 #include "pico_ipfilter.h"
 #include "pico_tcp.h"
 #include "pico_udp.h"
-#include "pico_tree.h"
+#ifdef PICO_SUPPORT_IPV6
+#include "pico_ipv6.h"
+#include "pico_icmp6.h"
+#endif
 
 /**************** LOCAL MACROS ****************/
 #define MAX_PRIORITY    (10)
 #define MIN_PRIORITY    (-10)
+#define IPF_PRIORITIES  (MAX_PRIORITY - MIN_PRIORITY + 1)
+
+/* Port ranges run up to IPF_NO_PORT, the port of frames that carry none:
+ * only wildcard ranges include it.
+ */
+#define IPF_NO_PORT     0x10000u
+
+/* Small rule sets are cheaper to walk in order than to hash */
+#define IPF_LINEAR_MAX  16u
 
 #ifdef DEBUG_IPF
     #define ipf_dbg dbg
@@ -47,277 +59,382 @@
     #define ipf_dbg(...) do {} while(0)
 #endif
 
-/**************** LOCAL DECLARATIONS ****************/
-struct filter_node;
-/**************** FILTER TREE ****************/
+/**************** RULE SETS ****************/
 
+/* A compiled rule. Addresses are stored masked, in network order. */
 struct filter_node {
+    struct filter_node *next;       /* same bucket, in match order */
     struct pico_device *fdev;
-    /* output address */
-    uint32_t out_addr;
-    uint32_t out_addr_netmask;
-    /* input address */
-    uint32_t in_addr;
-    uint32_t in_addr_netmask;
-    /* transport */
-    uint16_t out_port;
-    uint16_t in_port;
-    /* filter details */
+    uint32_t src[4];
+    uint32_t src_mask[4];
+    uint32_t dst[4];
+    uint32_t dst_mask[4];
+    uint32_t sport_min, sport_max;
+    uint32_t dport_min, dport_max;
+    uint16_t family;
     uint8_t proto;
+    uint8_t action;
     int8_t priority;
     uint8_t tos;
     uint32_t filter_id;
-    int (*function_ptr)(struct filter_node *filter, struct pico_frame *f);
+    uint32_t order;                 /* rank in first-match order */
+    uint32_t hits;
+    uint64_t bytes;
 };
 
+/* Rules sharing address masks, and whether they want one destination
+ * port: a single hash probe finds every candidate among them (tuple space
+ * search). Device, protocol and the other port are checked on the chain.
+ */
+struct filter_tuple {
+    uint16_t family;
+    uint8_t dport;
+    uint32_t src_mask[4];
+    uint32_t dst_mask[4];
+    uint32_t first;                 /* best rank of its rules */
+    uint32_t nrules;
+    uint32_t mask;                  /* buckets - 1 */
+    struct filter_node **bucket;
+};
 
-static inline int ipfilter_uint32_cmp(uint32_t a, uint32_t b)
-{
-    if (a < b)
-        return -1;
+struct pico_ipfilter_set {
+    struct filter_node *rules;      /* by filter id */
+    struct filter_node **sorted;    /* in match order */
+    uint32_t count, max;
+    struct filter_tuple *tuples;    /* by best rank */
+    uint32_t ntuples, tmax;
+    uint32_t pass;                  /* rules letting matching frames through */
+};
 
-    if (b < a)
-        return 1;
+/* What a frame is classified on */
+struct filter_key {
+    struct pico_device *dev;
+    uint32_t src[4];
+    uint32_t dst[4];
+    uint32_t sport, dport;
+    uint32_t len;
+    uint16_t family;
+    uint8_t proto;
+    uint8_t words;
+};
 
-    return 0;
-}
+static uint32_t filter_next_id = 1u;
 
-static inline int ipfilter_uint16_cmp(uint16_t a, uint16_t b)
+static inline uint32_t ipfilter_words(uint16_t family)
 {
-    if (a < b)
-        return -1;
-
-    if (b < a)
-        return 1;
-
-    return 0;
+    return (family == PICO_PROTO_IPV6) ? 4u : 1u;
 }
 
-static inline int ipfilter_uint8_cmp(uint8_t a, uint8_t b)
+static inline uint32_t ipfilter_mix(uint32_t h, uint32_t v)
 {
-    if (a < b)
-        return -1;
-
-    if (b < a)
-        return 1;
-
-    return 0;
+    h ^= v;
+    h = (h << 13) | (h >> 19);
+    return h * 0x9E3779B1u;
 }
 
-static inline int ipfilter_ptr_cmp(void *a, void *b)
+static uint32_t ipfilter_hash(const struct filter_tuple *t, const uint32_t *src, const uint32_t *dst, uint32_t dport)
 {
-    if (a < b)
-        return -1;
+    uint32_t i, h = t->dport;
 
-    if (b < a)
-        return 1;
+    for (i = 0; i < ipfilter_words(t->family); i++) {
+        h = ipfilter_mix(h, src[i] & t->src_mask[i]);
+        h = ipfilter_mix(h, dst[i] & t->dst_mask[i]);
+    }
+    if (t->dport)
+        h = ipfilter_mix(h, dport);
 
-    return 0;
+    return h ^ (h >> 16);
 }
 
+static int ipfilter_node_match(const struct filter_node *n, const struct filter_key *k)
+{
+    uint32_t i;
 
+    if ((n->family != k->family) || (n->fdev && (n->fdev != k->dev)) || (n->proto && (n->proto != k->proto)))
+        return 0;
 
-static inline int filter_compare_ports(struct filter_node *a, struct filter_node *b)
-{
-    int cmp;
-    cmp = ipfilter_uint16_cmp(a->in_port, b->in_port);
-    if (cmp)
-        return cmp;
+    if ((k->sport < n->sport_min) || (k->sport > n->sport_max) ||
+        (k->dport < n->dport_min) || (k->dport > n->dport_max))
+        return 0;
 
-    cmp = ipfilter_uint16_cmp(a->out_port, b->out_port);
-    return cmp;
+    for (i = 0; i < k->words; i++) {
+        if (((k->src[i] & n->src_mask[i]) != n->src[i]) || ((k->dst[i] & n->dst_mask[i]) != n->dst[i]))
+            return 0;
+    }
+    return 1;
 }
 
-static inline int filter_compare_addresses(struct filter_node *a, struct filter_node *b)
+/* First match: tuples are visited by the best rank they hold, and the
+ * scan stops as soon as none of the remaining ones can beat the match
+ * found so far.
+ */
+static struct filter_node *ipfilter_classify(const struct pico_ipfilter_set *set, const struct filter_key *k)
 {
-    int cmp;
-    /* Compare source address */
-    cmp = ipfilter_uint32_cmp((a->in_addr & a->in_addr_netmask), (b->in_addr & b->in_addr_netmask));
-    if (cmp)
-        return cmp;
+    struct filter_node *best = NULL, *n;
+    const struct filter_tuple *t;
+    uint32_t i;
+
+    if (set->count <= IPF_LINEAR_MAX) {
+        for (i = 0; i < set->count; i++) {
+            if (ipfilter_node_match(set->sorted[i], k))
+                return set->sorted[i];
+        }
+        return NULL;
+    }
+
+    for (i = 0; i < set->ntuples; i++) {
+        t = &set->tuples[i];
+        if (best && (best->order < t->first))
+            break;
 
-    /* Compare destination address */
-    cmp = ipfilter_uint32_cmp((a->out_addr & a->out_addr_netmask), (b->out_addr & b->out_addr_netmask));
-    return cmp;
+        if (t->family != k->family)
+            continue;
+
+        n = t->bucket[ipfilter_hash(t, k->src, k->dst, k->dport) & t->mask];
+        for (; n && (!best || (n->order < best->order)); n = n->next) {
+            if (ipfilter_node_match(n, k)) {
+                best = n;
+                break;
+            }
+        }
+    }
+    return best;
 }
 
-static inline int filter_compare_proto(struct filter_node *a, struct filter_node *b)
+static int ipfilter_tuple_fits(const struct filter_tuple *t, const struct filter_node *n)
 {
-    return ipfilter_uint8_cmp(a->proto, b->proto);
+    return (t->family == n->family) && (t->dport == (n->dport_min == n->dport_max)) &&
+           (memcmp(t->src_mask, n->src_mask, sizeof(t->src_mask)) == 0) &&
+           (memcmp(t->dst_mask, n->dst_mask, sizeof(t->dst_mask)) == 0);
 }
 
-static inline int filter_compare_address_port(struct filter_node *a, struct filter_node *b)
+static void ipfilter_compiled_free(struct pico_ipfilter_set *set)
 {
-    int cmp;
-    cmp = filter_compare_addresses(a, b);
-    if (cmp)
-        return cmp;
+    uint32_t i;
+
+    for (i = 0; i < set->ntuples; i++)
+        PICO_FREE(set->tuples[i].bucket);
+    if (set->tuples)
+        PICO_FREE(set->tuples);
+
+    if (set->sorted)
+        PICO_FREE(set->sorted);
 
-    return filter_compare_ports(a, b);
+    set->sorted = NULL;
+    set->tuples = NULL;
+    set->ntuples = 0;
+    set->tmax = 0;
 }
 
-static inline int filter_match_packet_dev(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+static int ipfilter_tuple_get(struct pico_ipfilter_set *set, const struct filter_node *n, uint32_t *idx)
 {
-    int cmp;
-    /* 1. Compare devices */
-    if (rule->fdev) {
-        cmp = ipfilter_ptr_cmp(a->fdev, b->fdev);
-        if (cmp)
-            return cmp;
+    struct filter_tuple *t;
+    uint32_t i;
+
+    for (i = 0; i < set->ntuples; i++) {
+        if (ipfilter_tuple_fits(&set->tuples[i], n)) {
+            *idx = i;
+            return 0;
+        }
     }
 
-    return 0;
+    if (set->ntuples == set->tmax) {
+        uint32_t tmax = set->tmax ? (set->tmax << 1) : 8u;
+        t = PICO_ZALLOC(tmax * sizeof(struct filter_tuple));
+        if (!t)
+            return -1;
 
-}
+        if (set->tuples) {
+            memcpy(t, set->tuples, set->ntuples * sizeof(struct filter_tuple));
+            PICO_FREE(set->tuples);
+        }
 
-static inline int filter_match_packet_proto(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp;
-    /* 2. Compare protocol */
-    if (rule->proto) {
-        cmp = filter_compare_proto(a, b);
-        if (cmp)
-            return cmp;
+        set->tuples = t;
+        set->tmax = tmax;
     }
 
+    t = &set->tuples[set->ntuples];
+    t->family = n->family;
+    t->dport = (n->dport_min == n->dport_max);
+    memcpy(t->src_mask, n->src_mask, sizeof(t->src_mask));
+    memcpy(t->dst_mask, n->dst_mask, sizeof(t->dst_mask));
+    *idx = set->ntuples++;
     return 0;
-
 }
-static inline int filter_match_packet_addr_in(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+
+/* Ranks the rules (priority first, then filter id) and hashes them into
+ * their tuples. Rules are kept by filter id, so a stable counting sort
+ * on the priority is all the ordering it takes.
+ */
+static int ipfilter_compile(struct pico_ipfilter_set *set)
 {
-    int cmp;
-    /* 3. Compare addresses order: in, out */
-    if (rule->in_addr_netmask) {
-        cmp = ipfilter_uint32_cmp(a->in_addr & rule->in_addr_netmask, b->in_addr & rule->in_addr_netmask);
-        if (cmp)
-            return cmp;
+    uint32_t start[IPF_PRIORITIES];
+    struct filter_node **sorted;
+    uint32_t *tidx;
+    struct filter_tuple *t;
+    struct filter_node *n;
+    uint32_t i, b, size, pos = 0;
+
+    ipfilter_compiled_free(set);
+    set->pass = 0;
+    if (set->count == 0)
+        return 0;
+
+    sorted = PICO_ZALLOC(set->count * sizeof(struct filter_node *));
+    tidx = PICO_ZALLOC(set->count * sizeof(uint32_t));
+    if (!sorted || !tidx)
+        goto fail;
+
+    memset(start, 0, sizeof(start));
+    for (i = 0; i < set->count; i++)
+        start[MAX_PRIORITY - set->rules[i].priority]++;
+    for (i = 0; i < IPF_PRIORITIES; i++) {
+        b = start[i];
+        start[i] = pos;
+        pos += b;
+    }
+    for (i = 0; i < set->count; i++) {
+        n = &set->rules[i];
+        n->order = start[MAX_PRIORITY - n->priority]++;
+        sorted[n->order] = n;
+        if (n->action == FILTER_PRIORITY)
+            set->pass++;
     }
 
-    return 0;
-}
-static inline int filter_match_packet_addr_out(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp;
-    if (rule->out_addr_netmask) {
-        cmp = ipfilter_uint32_cmp(a->out_addr & rule->out_addr_netmask, b->out_addr & rule->out_addr_netmask);
-        if (cmp) {
-            return cmp;
-        }
+    for (i = 0; i < set->count; i++) {
+        if (ipfilter_tuple_get(set, sorted[i], &tidx[i]) < 0)
+            goto fail;
+
+        set->tuples[tidx[i]].nrules++;
     }
 
-    return 0;
-}
-static inline int filter_match_packet_port_in(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp;
-    /* 4. Compare ports     order: in, out */
-    if (rule->in_port) {
-        cmp = ipfilter_uint16_cmp(a->in_port, b->in_port);
-        if (cmp)
-            return cmp;
+    for (i = 0; i < set->ntuples; i++) {
+        t = &set->tuples[i];
+        for (size = 2u; size < (t->nrules << 1); size <<= 1)
+            ;
+        t->bucket = PICO_ZALLOC(size * sizeof(struct filter_node *));
+        if (!t->bucket)
+            goto fail;
+
+        t->mask = size - 1u;
     }
 
-    return 0;
-}
-static inline int filter_match_packet_port_out(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp;
-    if (rule->out_port) {
-        cmp = ipfilter_uint16_cmp(a->out_port, b->out_port);
-        if (cmp)
-            return cmp;
+    /* Backwards, so that every chain ends up in match order */
+    for (i = set->count; i-- > 0; ) {
+        n = sorted[i];
+        t = &set->tuples[tidx[i]];
+        b = ipfilter_hash(t, n->src, n->dst, n->dport_min) & t->mask;
+        n->next = t->bucket[b];
+        t->bucket[b] = n;
+        t->first = n->order;
     }
 
+    set->sorted = sorted;
+    PICO_FREE(tidx);
     return 0;
-}
 
-static inline int filter_match_packet_dev_and_proto(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp = filter_match_packet_dev(a, b, rule);
-    if (cmp)
-        return cmp;
+fail:
+    if (sorted)
+        PICO_FREE(sorted);
 
-    return filter_match_packet_proto(a, b, rule);
+    if (tidx)
+        PICO_FREE(tidx);
+
+    ipfilter_compiled_free(set);
+    pico_err = PICO_ERR_ENOMEM;
+    return -1;
 }
 
-static inline int filter_match_packet_addr(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
+static struct pico_ipfilter_set *ipfilter_set_alloc(uint32_t max)
 {
-    int cmp = filter_match_packet_addr_in(a, b, rule);
-    if (cmp)
-        return cmp;
+    struct pico_ipfilter_set *set = PICO_ZALLOC(sizeof(struct pico_ipfilter_set));
 
-    return filter_match_packet_addr_out(a, b, rule);
+    if (!set) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
 
-}
+    if (max) {
+        set->rules = PICO_ZALLOC(max * sizeof(struct filter_node));
+        if (!set->rules) {
+            PICO_FREE(set);
+            pico_err = PICO_ERR_ENOMEM;
+            return NULL;
+        }
 
-static inline int filter_match_packet_port(struct filter_node *a, struct filter_node *b, struct filter_node *rule)
-{
-    int cmp = filter_match_packet_port_in(a, b, rule);
-    if (cmp)
-        return cmp;
+        set->max = max;
+    }
 
-    return filter_match_packet_port_out(a, b, rule);
+    return set;
 }
 
-static inline struct filter_node *filter_match_packet_find_rule(struct filter_node *a, struct filter_node *b)
+/* Copy of the active rules, counters included, without 'skip_id' */
+static struct pico_ipfilter_set *ipfilter_set_clone(struct pico_stack *S, uint32_t skip_id, uint32_t extra)
 {
-    if (!a->filter_id)
-        return b;
+    struct pico_ipfilter_set *old = S->ipfilter;
+    struct pico_ipfilter_set *set;
+    uint32_t i;
+
+    set = ipfilter_set_alloc((old ? old->count : 0u) + extra);
+    if (!set || !old)
+        return set;
 
-    return a;
+    for (i = 0; i < old->count; i++) {
+        if (old->rules[i].filter_id != skip_id)
+            set->rules[set->count++] = old->rules[i];
+    }
+    return set;
 }
 
-static inline int filter_match_packet(struct filter_node *a, struct filter_node *b)
+static uint32_t ipfilter_set_append(struct pico_ipfilter_set *set, const struct filter_node *node)
 {
-    struct filter_node *rule;
-    int cmp = 0;
-    rule = filter_match_packet_find_rule(a, b);
+    struct filter_node *n;
 
-    cmp = filter_match_packet_dev_and_proto(a, b, rule);
-    if (cmp)
-        return cmp;
+    if (set->count == set->max) {
+        uint32_t max = set->max ? (set->max << 1) : 16u;
+        n = PICO_ZALLOC(max * sizeof(struct filter_node));
+        if (!n) {
+            pico_err = PICO_ERR_ENOMEM;
+            return 0;
+        }
 
-    cmp = filter_match_packet_addr(a, b, rule);
-    if (cmp)
-        return cmp;
+        if (set->rules) {
+            memcpy(n, set->rules, set->count * sizeof(struct filter_node));
+            PICO_FREE(set->rules);
+        }
 
-    cmp = filter_match_packet_port(a, b, rule);
-    if (cmp)
-        return cmp;
+        set->rules = n;
+        set->max = max;
+    }
 
-    return 0;
-}
+    n = &set->rules[set->count++];
+    *n = *node;
+    n->filter_id = filter_next_id++;
+    if (filter_next_id == 0)
+        filter_next_id = 1u;
 
+    return n->filter_id;
+}
 
-int filter_compare(void *filterA, void *filterB)
+static struct filter_node *ipfilter_find(struct pico_ipfilter_set *set, uint32_t filter_id)
 {
+    uint32_t lo = 0, hi, mid;
 
-    struct filter_node *a = (struct filter_node *)filterA;
-    struct filter_node *b = (struct filter_node *)filterB;
-    int cmp = 0;
-    if (a->filter_id == 0 || b->filter_id == 0) {
-        return filter_match_packet(a, b);
-    }
-
-    /* improve the search */
-    if(a->filter_id == b->filter_id)
-        return 0;
+    if (!set)
+        return NULL;
 
-    /* 1. Compare devices */
-    cmp = ipfilter_ptr_cmp(a->fdev, a->fdev);
-    if (cmp)
-        return cmp;
+    hi = set->count;
+    while (lo < hi) {
+        mid = lo + ((hi - lo) >> 1);
+        if (set->rules[mid].filter_id == filter_id)
+            return &set->rules[mid];
 
-    /* 2. Compare protocol */
-    cmp = filter_compare_proto(a, b);
-    if(cmp)
-        return cmp;
-
-    /* 3. Compare addresses order: in, out */
-    /* 4. Compare ports     order: in, out */
-    cmp = filter_compare_address_port(a, b);
-
-    return cmp;
+        if (set->rules[mid].filter_id < filter_id)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return NULL;
 }
 
 /**************** FILTER CALLBACKS ****************/
@@ -333,8 +450,12 @@ static int fp_priority(struct filter_node *filter, struct pico_frame *f)
 static int fp_reject(struct filter_node *filter, struct pico_frame *f)
 {
 /* TODO check first if sender is pico itself or not */
-    IGNORE_PARAMETER(filter);
     ipf_dbg("ipfilter> reject\n");
+#ifdef PICO_SUPPORT_IPV6
+    if (filter->family == PICO_PROTO_IPV6)
+        (void)pico_icmp6_packet_filtered(f->dev->stack, f);
+    else
+#endif
     (void)pico_icmp4_packet_filtered(f->dev->stack, f);
     pico_frame_discard(f);
     return 1;
@@ -373,108 +494,301 @@ static int pico_ipv4_filter_add_validate(int8_t priority, enum filter_action act
     return 0;
 }
 
+static void ipfilter_prefix_mask(uint32_t *mask, uint8_t len, uint32_t words)
+{
+    uint32_t i, bits;
+
+    for (i = 0; i < words; i++) {
+        bits = (len > (32u * i)) ? (uint32_t)len - (32u * i) : 0u;
+        if (bits >= 32u)
+            mask[i] = 0xFFFFFFFFu;
+        else if (bits)
+            mask[i] = long_be(0xFFFFFFFFu << (32u - bits));
+        else
+            mask[i] = 0;
+    }
+}
+
+static void ipfilter_port_range(uint16_t min, uint16_t max, uint32_t *lo, uint32_t *hi)
+{
+    if (max == 0) {
+        *lo = 0;
+        *hi = IPF_NO_PORT;
+    } else {
+        *lo = min;
+        *hi = max;
+    }
+}
+
+static int ipfilter_node_from_rule(struct filter_node *n, const struct pico_ipfilter_rule *r)
+{
+    uint32_t i, words = ipfilter_words(r->family);
+
+    if ((pico_ipv4_filter_add_validate(r->priority, r->action) < 0) ||
+        ((r->sport_max != 0) && (r->sport_min > r->sport_max)) ||
+        ((r->dport_max != 0) && (r->dport_min > r->dport_max)))
+        return -1;
+
+    memset(n, 0, sizeof(struct filter_node));
+    if (r->family == PICO_PROTO_IPV4) {
+        if ((r->src_prefix > 32) || (r->dst_prefix > 32))
+            return -1;
+
+        n->src[0] = r->src.ip4.addr;
+        n->dst[0] = r->dst.ip4.addr;
+    } else if (r->family == PICO_PROTO_IPV6) {
+        if ((r->src_prefix > 128) || (r->dst_prefix > 128))
+            return -1;
+
+        memcpy(n->src, r->src.ip6.addr, PICO_SIZE_IP6);
+        memcpy(n->dst, r->dst.ip6.addr, PICO_SIZE_IP6);
+    } else {
+        return -1;
+    }
+
+    ipfilter_prefix_mask(n->src_mask, r->src_prefix, words);
+    ipfilter_prefix_mask(n->dst_mask, r->dst_prefix, words);
+    for (i = 0; i < words; i++) {
+        n->src[i] &= n->src_mask[i];
+        n->dst[i] &= n->dst_mask[i];
+    }
+    ipfilter_port_range(r->sport_min, r->sport_max, &n->sport_min, &n->sport_max);
+    ipfilter_port_range(r->dport_min, r->dport_max, &n->dport_min, &n->dport_max);
+    n->fdev = r->dev;
+    n->family = r->family;
+    n->proto = r->proto;
+    n->priority = r->priority;
+    n->action = (uint8_t)r->action;
+    return 0;
+}
 
 /**************** FILTER API's ****************/
+struct pico_ipfilter_set *pico_ipfilter_set_new(void)
+{
+    return ipfilter_set_alloc(0);
+}
+
+uint32_t pico_ipfilter_set_add(struct pico_ipfilter_set *set, const struct pico_ipfilter_rule *rule)
+{
+    struct filter_node node;
+
+    if (!set || !rule || (ipfilter_node_from_rule(&node, rule) < 0)) {
+        pico_err = PICO_ERR_EINVAL;
+        return 0;
+    }
+
+    return ipfilter_set_append(set, &node);
+}
+
+void pico_ipfilter_set_free(struct pico_ipfilter_set *set)
+{
+    if (!set)
+        return;
+
+    ipfilter_compiled_free(set);
+    if (set->rules)
+        PICO_FREE(set->rules);
+
+    PICO_FREE(set);
+}
+
+int pico_ipfilter_set_commit(struct pico_stack *S, struct pico_ipfilter_set *set)
+{
+    struct pico_ipfilter_set *old;
+
+    if (!S || !set) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if (ipfilter_compile(set) < 0)
+        return -1;
+
+    old = S->ipfilter;
+    S->ipfilter = set;
+    pico_ipfilter_set_free(old);
+    /* Cached forwarding verdicts no longer hold */
+    pico_ipv4_flow_cache_invalidate(S);
+    return 0;
+}
+
+int pico_ipfilter_stats(struct pico_stack *S, uint32_t filter_id, uint32_t *hits, uint64_t *bytes)
+{
+    struct filter_node *n = ipfilter_find(S->ipfilter, filter_id);
+
+    if (!n) {
+        pico_err = PICO_ERR_ENOENT;
+        return -1;
+    }
+
+    if (hits)
+        *hits = n->hits;
+
+    if (bytes)
+        *bytes = n->bytes;
+
+    return 0;
+}
+
+/* Forwarding verdicts may only be cached when no rule needs to see the
+ * frames it lets through.
+ */
+int pico_ipfilter_has_pass_rules(struct pico_stack *S)
+{
+    return S->ipfilter && (S->ipfilter->pass > 0);
+}
+
+void pico_ipfilter_destroy(struct pico_stack *S)
+{
+    pico_ipfilter_set_free(S->ipfilter);
+    S->ipfilter = NULL;
+}
+
 uint32_t pico_ipv4_filter_add(struct pico_device *dev, uint8_t proto,
                               struct pico_ip4 *out_addr, struct pico_ip4 *out_addr_netmask,
                               struct pico_ip4 *in_addr, struct pico_ip4 *in_addr_netmask,
                               uint16_t out_port, uint16_t in_port, int8_t priority,
                               uint8_t tos, enum filter_action action)
 {
-    static uint32_t filter_id = 1u; /* 0 is a special value used in the binary-tree search for packets being processed */
-    struct filter_node *new_filter;
+    struct pico_ipfilter_set *set;
+    struct filter_node node;
+    uint32_t id;
 
-    if (pico_ipv4_filter_add_validate(priority, action) < 0) {
+    if (!dev || (pico_ipv4_filter_add_validate(priority, action) < 0)) {
         pico_err = PICO_ERR_EINVAL;
         return 0;
     }
 
-    new_filter = PICO_ZALLOC(sizeof(struct filter_node));
-    if (!new_filter) {
-        pico_err = PICO_ERR_ENOMEM;
+    memset(&node, 0, sizeof(node));
+    node.fdev = dev;
+    node.family = PICO_PROTO_IPV4;
+    node.proto = proto;
+    node.dst_mask[0] = (!out_addr_netmask) ? (0U) : (out_addr_netmask->addr);
+    node.dst[0] = ((!out_addr) ? (0U) : (out_addr->addr)) & node.dst_mask[0];
+    node.src_mask[0] = (!in_addr_netmask) ? (0U) : (in_addr_netmask->addr);
+    node.src[0] = ((!in_addr) ? (0U) : (in_addr->addr)) & node.src_mask[0];
+    ipfilter_port_range(out_port, out_port, &node.dport_min, &node.dport_max);
+    ipfilter_port_range(in_port, in_port, &node.sport_min, &node.sport_max);
+    node.priority = priority;
+    node.tos = tos;
+    node.action = (uint8_t)action;
+
+    set = ipfilter_set_clone(dev->stack, 0, 1);
+    if (!set)
         return 0;
-    }
 
-    new_filter->fdev = dev;
-    new_filter->proto = proto;
-    new_filter->out_addr = (!out_addr) ? (0U) : (out_addr->addr);
-    new_filter->out_addr_netmask = (!out_addr_netmask) ? (0U) : (out_addr_netmask->addr);
-    new_filter->in_addr = (!in_addr) ? (0U) : (in_addr->addr);
-    new_filter->in_addr_netmask = (!in_addr_netmask) ? (0U) : (in_addr_netmask->addr);
-    new_filter->out_port = out_port;
-    new_filter->in_port = in_port;
-    new_filter->priority = priority;
-    new_filter->tos = tos;
-    new_filter->filter_id = filter_id++;
-    new_filter->function_ptr = fp_function[action].fn;
-
-    if(pico_tree_insert(&dev->stack->ipfilter_tree, new_filter))
-    {
-        PICO_FREE(new_filter);
-        filter_id--;
+    id = ipfilter_set_append(set, &node);
+    if (!id || (pico_ipfilter_set_commit(dev->stack, set) < 0)) {
+        pico_ipfilter_set_free(set);
         return 0;
     }
 
-    return new_filter->filter_id;
+    return id;
 }
 
 int pico_ipv4_filter_del(struct pico_stack *S, uint32_t filter_id)
 {
-    struct filter_node *node = NULL;
-    struct filter_node dummy = {
-        0
-    };
+    struct pico_ipfilter_set *set;
 
-    dummy.filter_id = filter_id;
-    if((node = pico_tree_delete(&S->ipfilter_tree, &dummy)) == NULL)
-    {
+    if (!ipfilter_find(S->ipfilter, filter_id)) {
         ipf_dbg("ipfilter> failed to delete filter :%d\n", filter_id);
         return -1;
     }
 
-    PICO_FREE(node);
-    return 0;
-}
+    set = ipfilter_set_clone(S, filter_id, 0);
+    if (!set)
+        return -1;
 
-static int ipfilter_apply_filter(struct pico_frame *f, struct filter_node *pkt)
-{
-    struct filter_node *filter_frame = NULL;
-    filter_frame = pico_tree_findKey(&f->dev->stack->ipfilter_tree, pkt);
-    if(filter_frame)
-    {
-        filter_frame->function_ptr(filter_frame, f);
-        return 1;
+    if (pico_ipfilter_set_commit(S, set) < 0) {
+        pico_ipfilter_set_free(set);
+        return -1;
     }
 
     return 0;
 }
 
-int ipfilter(struct pico_frame *f)
+/* Returns -1 for frames that must not be filtered */
+static int ipfilter_key(struct pico_frame *f, struct filter_key *k)
 {
-    struct filter_node temp;
-    struct pico_ipv4_hdr *ipv4_hdr = (struct pico_ipv4_hdr *) f->net_hdr;
+    uint8_t *l4 = f->transport_hdr;
     struct pico_trans *trans;
-    struct pico_icmp4_hdr *icmp_hdr;
 
-    memset(&temp, 0u, sizeof(struct filter_node));
+    k->dev = f->dev;
+    k->sport = IPF_NO_PORT;
+    k->dport = IPF_NO_PORT;
+    if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
+        k->family = PICO_PROTO_IPV4;
+        k->words = 1;
+        k->src[0] = hdr->src.addr;
+        k->dst[0] = hdr->dst.addr;
+        k->proto = hdr->proto;
+        k->len = short_be(hdr->len);
+    }
+#ifdef PICO_SUPPORT_IPV6
+    else if (IS_IPV6(f)) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *) f->net_hdr;
+        k->family = PICO_PROTO_IPV6;
+        k->words = 4;
+        memcpy(k->src, hdr->src.addr, PICO_SIZE_IP6);
+        memcpy(k->dst, hdr->dst.addr, PICO_SIZE_IP6);
+        k->proto = hdr->nxthdr;
+        k->len = (uint32_t)short_be(hdr->len) + PICO_SIZE_IP6HDR;
+        if ((k->proto == PICO_PROTO_TCP) || (k->proto == PICO_PROTO_UDP) || (k->proto == PICO_PROTO_ICMP6)) {
+            l4 = f->net_hdr + PICO_SIZE_IP6HDR;
+        } else if ((f->proto == PICO_PROTO_TCP) || (f->proto == PICO_PROTO_UDP) || (f->proto == PICO_PROTO_ICMP6)) {
+            /* past the extension headers */
+            k->proto = f->proto;
+        } else {
+            l4 = NULL;
+        }
+    }
+#endif
+    else {
+        return -1;
+    }
+
+    if (!l4 || ((l4 + 4) > (f->buffer + f->buffer_len)))
+        return 0;
 
-    temp.fdev = f->dev;
-    temp.out_addr = ipv4_hdr->dst.addr;
-    temp.in_addr = ipv4_hdr->src.addr;
-    if ((ipv4_hdr->proto == PICO_PROTO_TCP) || (ipv4_hdr->proto == PICO_PROTO_UDP)) {
-        trans = (struct pico_trans *) f->transport_hdr;
-        temp.out_port = short_be(trans->dport);
-        temp.in_port = short_be(trans->sport);
+    if ((k->proto == PICO_PROTO_TCP) || (k->proto == PICO_PROTO_UDP)) {
+        trans = (struct pico_trans *) l4;
+        k->sport = short_be(trans->sport);
+        k->dport = short_be(trans->dport);
+    } else if ((k->family == PICO_PROTO_IPV4) && (k->proto == PICO_PROTO_ICMP4)) {
+        struct pico_icmp4_hdr *icmp_hdr = (struct pico_icmp4_hdr *) l4;
+        if (icmp_hdr->type == PICO_ICMP_UNREACH && icmp_hdr->code == PICO_ICMP_UNREACH_FILTER_PROHIB)
+            return -1;
     }
-    else if(ipv4_hdr->proto == PICO_PROTO_ICMP4) {
-        icmp_hdr = (struct pico_icmp4_hdr *) f->transport_hdr;
-        if(icmp_hdr->type == PICO_ICMP_UNREACH && icmp_hdr->code == PICO_ICMP_UNREACH_FILTER_PROHIB)
-            return 0;
+#ifdef PICO_SUPPORT_IPV6
+    else if ((k->family == PICO_PROTO_IPV6) && (k->proto == PICO_PROTO_ICMP6)) {
+        struct pico_icmp6_hdr *icmp_hdr = (struct pico_icmp6_hdr *) l4;
+        if (icmp_hdr->type == PICO_ICMP6_DEST_UNREACH && icmp_hdr->code == PICO_ICMP6_UNREACH_ADMIN)
+            return -1;
     }
+#endif
 
-    temp.proto = ipv4_hdr->proto;
-    temp.priority = f->priority;
-    temp.tos = ipv4_hdr->tos;
-    return ipfilter_apply_filter(f, &temp);
+    return 0;
 }
 
+int ipfilter(struct pico_frame *f)
+{
+    struct pico_ipfilter_set *set;
+    struct filter_node *n;
+    struct filter_key k;
+
+    if (!f->dev || !f->net_hdr)
+        return 0;
+
+    set = f->dev->stack->ipfilter;
+    if (!set || (set->count == 0) || (ipfilter_key(f, &k) < 0))
+        return 0;
+
+    n = ipfilter_classify(set, &k);
+    if (!n)
+        return 0;
+
+    n->hits++;
+    n->bytes += k.len;
+    return fp_function[n->action].fn(n, f);
+}
@@ -36,6 +36,30 @@ enum filter_action {
     FILTER_COUNT
 };
 
+/* A classifier rule, IPv4 or IPv6. Addresses are in network order, ports
+ * in host order and ranges inclusive. A NULL device, protocol 0, prefix
+ * length 0 or a port range ending at 0 matches anything. Rules are tried
+ * by decreasing priority, then in the order they were added; the first
+ * match decides.
+ */
+struct pico_ipfilter_rule {
+    struct pico_device *dev;
+    uint16_t family;            /* PICO_PROTO_IPV4 or PICO_PROTO_IPV6 */
+    uint8_t proto;
+    uint8_t src_prefix;
+    uint8_t dst_prefix;
+    union pico_address src;
+    union pico_address dst;
+    uint16_t sport_min;
+    uint16_t sport_max;
+    uint16_t dport_min;
+    uint16_t dport_max;
+    int8_t priority;
+    enum filter_action action;
+};
+
+struct pico_ipfilter_set;
+
 uint32_t pico_ipv4_filter_add(struct pico_device *dev, uint8_t proto,
                               struct pico_ip4 *out_addr, struct pico_ip4 *out_addr_netmask, struct pico_ip4 *in_addr,
                               struct pico_ip4 *in_addr_netmask, uint16_t out_port, uint16_t in_port,
@@ -43,8 +67,20 @@ uint32_t pico_ipv4_filter_add(struct pico_device *dev, uint8_t proto,
 
 int pico_ipv4_filter_del(struct pico_stack *S, uint32_t filter_id);
 
+/* Rule sets are filled off-line and replace the active one in a single
+ * step: packets see either the old rules or the new ones, never a mix.
+ * After a successful commit the set belongs to the stack.
+ */
+struct pico_ipfilter_set *pico_ipfilter_set_new(void);
+uint32_t pico_ipfilter_set_add(struct pico_ipfilter_set *set, const struct pico_ipfilter_rule *rule);
+int pico_ipfilter_set_commit(struct pico_stack *S, struct pico_ipfilter_set *set);
+void pico_ipfilter_set_free(struct pico_ipfilter_set *set);
+
+int pico_ipfilter_stats(struct pico_stack *S, uint32_t filter_id, uint32_t *hits, uint64_t *bytes);
+int pico_ipfilter_has_pass_rules(struct pico_stack *S);
+void pico_ipfilter_destroy(struct pico_stack *S);
+
 int ipfilter(struct pico_frame *f);
-int filter_compare(void *filterA, void *filterB);
 
 #endif /* _INCLUDE_PICO_IPFILTER */
 
@@ -43,6 +43,7 @@
 #include "pico_fragments.h"
 #include "pico_ethernet.h"
 #include "pico_mcast.h"
+#include "pico_arp.h"
 
 #ifdef PICO_SUPPORT_IPV4
 
@@ -294,7 +295,37 @@ static inline int pico_ipv4_crc_check(struct pico_frame *f)
 }
 #endif /* PICO_SUPPORT_CRC */
 
-static int pico_ipv4_forward(struct pico_stack *S, struct pico_frame *f);
+/* Forwarding flow cache.
+ * A forwarded flow, keyed on its 5-tuple and ingress device, remembers
+ * what its first packet went through: the egress device, the next hop's
+ * MAC and the NAT translation. Only flows both filters let through are
+ * cached. Later packets are checked, rewritten and queued after a single
+ * lookup. Each bucket holds the two latest flows hashed to it. Entries
+ * own nothing: FlowCacheGen drops them all at once on route, link, ARP,
+ * filter or NAT setup changes. Translations come and go with traffic, so
+ * a flow names its own by id, and a hit whose translation has expired
+ * takes the slow path.
+ */
+#define PICO_IPV4_FLOW_NAT_IN  1u
+#define PICO_IPV4_FLOW_NAT_OUT 2u
+
+struct pico_ipv4_flow {
+    struct pico_device *in;
+    uint32_t src, dst;
+    uint16_t sport, dport;
+    uint8_t proto;
+    uint8_t nat;
+    uint8_t mac_valid;
+    uint32_t gen;
+    struct pico_device *out;    /* NULL: free slot */
+    uint32_t nat_id;
+    uint16_t nat_port;
+    struct pico_eth mac;
+};
+
+static int pico_ipv4_flow_in(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *key);
+static int pico_ipv4_flow_nat(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl, int outbound);
+static int pico_ipv4_forward(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl);
 #ifdef PICO_SUPPORT_MCAST
 static int pico_ipv4_mcast_filter(struct pico_stack *S, struct pico_frame *f);
 #endif
@@ -367,17 +398,28 @@ static int pico_ipv4_process_mcast_in(struct pico_frame *f)
     return 0;
 }
 
-static int pico_ipv4_process_local_unicast_in(struct pico_stack *S, struct pico_frame *f)
+static void pico_ipv4_process_finally_try_forward(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl);
+
+static int pico_ipv4_process_local_unicast_in(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl)
 {
     struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
     struct pico_ipv4_link test = {
         .address = {.addr = PICO_IP4_ANY}, .dev = NULL
     };
     if (pico_ipv4_link_find(S, &hdr->dst)) {
-        if (pico_ipv4_nat_inbound(S, f, &hdr->dst) == 0)
-            pico_enqueue(pico_proto_ipv4.q_in, f); /* dst changed, reprocess */
-        else
+        if (pico_ipv4_nat_inbound(S, f, &hdr->dst) != 0) {
             pico_transport_receive(f, hdr->proto);
+        } else if (fl && !pico_ipv4_link_find(S, &hdr->dst) && (pico_ipv4_flow_nat(S, f, fl, 0) == 0)) {
+            /* Translated for another host: forward it right away, so the
+             * flow is cached under the tuple it arrived with */
+#ifdef PICO_SUPPORT_IPFILTER
+            if (ipfilter(f))
+                return 1;
+#endif
+            pico_ipv4_process_finally_try_forward(S, f, fl);
+        } else {
+            pico_enqueue(pico_proto_ipv4.q_in, f); /* dst changed, reprocess */
+        }
 
         return 1;
     } else if (pico_tree_findKey(&S->Tree_dev_link, &test)) {
@@ -394,13 +436,13 @@ static int pico_ipv4_process_local_unicast_in(struct pico_stack *S, struct pico_
     return 0;
 }
 
-static void pico_ipv4_process_finally_try_forward(struct pico_stack *S, struct pico_frame *f)
+static void pico_ipv4_process_finally_try_forward(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl)
 {
     struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
     if ((pico_ipv4_is_broadcast(S, hdr->dst.addr)) || ((f->flags & PICO_FRAME_FLAG_BCAST) != 0)) {
         /* don't forward broadcast frame, discard! */
         pico_frame_discard(f);
-    } else if (pico_ipv4_forward(S, f) != 0) {
+    } else if (pico_ipv4_forward(S, f, fl) != 0) {
         pico_frame_discard(f);
         /* dbg("Forward failed.\n"); */
     }
@@ -652,6 +694,7 @@ static void pico_socket_ipv4_process_in(struct pico_frame *f)
 
 static int pico_ipv4_process_in(struct pico_stack *S, struct pico_protocol *self, struct pico_frame *f)
 {
+    struct pico_ipv4_flow flow, *fl;
     uint8_t option_len = 0;
     int ret = 0;
     struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *) f->net_hdr;
@@ -679,6 +722,11 @@ static int pico_ipv4_process_in(struct pico_stack *S, struct pico_protocol *self
         return 0; /* Packet is discarded due to unfeasible length */
     }
 
+    if (pico_ipv4_flow_in(S, f, &flow) > 0)
+        return 0;
+
+    fl = flow.in ? &flow : NULL;
+
 #ifdef PICO_SUPPORT_IPFILTER
     if (ipfilter(f)) {
         /*pico_frame is discarded as result of the filtering*/
@@ -735,10 +783,10 @@ static int pico_ipv4_process_in(struct pico_stack *S, struct pico_protocol *self
     if (pico_ipv4_process_mcast_in(f) > 0)
         return 0;
 
-    if (pico_ipv4_process_local_unicast_in(S, f) > 0)
+    if (pico_ipv4_process_local_unicast_in(S, f, fl) > 0)
         return 0;
 
-    pico_ipv4_process_finally_try_forward(S, f);
+    pico_ipv4_process_finally_try_forward(S, f, fl);
 
     return 0;
 }
@@ -836,6 +884,64 @@ static struct pico_ipv4_route *route_find_default_bcast(struct pico_stack *S)
     return S->default_bcast_route;
 }
 
+/* S->RoutesLPM mirrors S->Routes: for each prefix it holds the route that
+ * the reverse walk of the tree would hit first. Routes with a non-contiguous
+ * netmask cannot be represented in the trie; while any of them exist,
+ * route_find() falls back to the tree walk.
+ */
+static int route_lpm_plen(struct pico_ipv4_route *r)
+{
+    /* A destination with host bits set can never match */
+    if (r->dest.addr & ~r->netmask.addr)
+        return -2;
+
+    return pico_lpm_mask_len((const uint8_t *)&r->netmask.addr, PICO_SIZE_IP4);
+}
+
+static int route_lpm_add(struct pico_stack *S, struct pico_ipv4_route *r)
+{
+    struct pico_ipv4_route *cur;
+    int plen = route_lpm_plen(r);
+
+    if (plen == -1)
+        S->RoutesNonContig++;
+
+    if (plen < 0)
+        return 0;
+
+    cur = pico_lpm_get(&S->RoutesLPM, (const uint8_t *)&r->dest.addr, (uint8_t)plen);
+    if (cur && (ipv4_route_compare(r, cur) < 0))
+        return 0;
+
+    return pico_lpm_insert(&S->RoutesLPM, (const uint8_t *)&r->dest.addr, (uint8_t)plen, r);
+}
+
+static void route_lpm_del(struct pico_stack *S, struct pico_ipv4_route *r)
+{
+    struct pico_tree_node *node;
+    struct pico_ipv4_route *prev;
+    int plen = route_lpm_plen(r);
+
+    if (plen == -1)
+        S->RoutesNonContig--;
+
+    if ((plen < 0) || (pico_lpm_get(&S->RoutesLPM, (const uint8_t *)&r->dest.addr, (uint8_t)plen) != r))
+        return;
+
+    /* Routes for the same prefix are adjacent in the tree, ordered by metric */
+    node = pico_tree_findNode(&S->Routes, r);
+    if (node) {
+        node = pico_tree_prev(node);
+        prev = (node != &LEAF) ? node->keyValue : NULL;
+        if (prev && (prev->dest.addr == r->dest.addr) && (prev->netmask.addr == r->netmask.addr)) {
+            pico_lpm_insert(&S->RoutesLPM, (const uint8_t *)&r->dest.addr, (uint8_t)plen, prev);
+            return;
+        }
+    }
+
+    pico_lpm_remove(&S->RoutesLPM, (const uint8_t *)&r->dest.addr, (uint8_t)plen);
+}
+
 static struct pico_ipv4_route *route_find(struct pico_stack *S, const struct pico_ip4 *addr)
 {
     struct pico_ipv4_route *r;
@@ -846,6 +952,9 @@ static struct pico_ipv4_route *route_find(struct pico_stack *S, const struct pic
     }
 
     if (addr->addr != PICO_IP4_BCAST) {
+        if (!S->RoutesNonContig)
+            return pico_lpm_lookup(&S->RoutesLPM, (const uint8_t *)&addr->addr);
+
         pico_tree_foreach_reverse(index, &S->Routes) {
             r = index->keyValue;
             if ((addr->addr & (r->netmask.addr)) == (r->dest.addr)) {
@@ -1224,11 +1333,60 @@ void dbg_route(void)
 #define dbg_route() do { } while(0)
 #endif
 
+/* Socket frames to the destination they used last skip the route,
+ * own-address and ARP lookups. Route, link and ARP changes invalidate
+ * every socket's entry at once.
+ */
+void pico_ipv4_dst_cache_invalidate(struct pico_stack *S)
+{
+    S->DstCacheGen++;
+    S->FlowCacheGen++;
+}
+
+static struct pico_ipv4_dst_cache *pico_ipv4_dst_cache_get(struct pico_stack *S, struct pico_frame *f, struct pico_ip4 *dst)
+{
+    struct pico_ipv4_dst_cache *dc;
+    struct pico_ipv4_route *route;
+
+    if (!f->sock || IS_BCAST(f))
+        return NULL;
+
+    dc = &f->sock->dst_cache;
+    if (dc->link && (dc->gen == S->DstCacheGen) && (dc->dst.addr == dst->addr))
+        return dc;
+
+    dc->link = NULL;
+    if (pico_ipv4_is_multicast(dst->addr) || pico_ipv4_is_broadcast(S, dst->addr))
+        return NULL;
+
+    route = route_find(S, dst);
+    if (!route || !route->link)
+        return NULL;
+
+    dc->dst.addr = dst->addr;
+    dc->gen = S->DstCacheGen;
+    dc->link = route->link;
+    dc->nexthop.addr = route->gateway.addr ? route->gateway.addr : dst->addr;
+    dc->local = (pico_ipv4_link_get(S, dst) != NULL);
+    dc->mac_valid = 0;
+#if defined(PICO_SUPPORT_ETH)
+    if (!dc->local && dc->link->dev->eth && (dc->link->dev->mode == LL_MODE_ETHERNET)) {
+        struct pico_eth *mac = pico_arp_lookup(S, &dc->nexthop);
+        if (mac) {
+            memcpy(&dc->mac, mac, sizeof(struct pico_eth));
+            dc->mac_valid = 1;
+        }
+    }
+#endif
+    return dc;
+}
+
 int pico_ipv4_frame_push(struct pico_stack *S, struct pico_frame *f, struct pico_ip4 *dst, uint8_t proto)
 {
 
     struct pico_ipv4_route *route;
     struct pico_ipv4_link *link;
+    struct pico_ipv4_dst_cache *dc;
     struct pico_ipv4_hdr *hdr;
     uint8_t ttl = PICO_IPV4_DEFAULT_TTL;
     uint8_t vhl = 0x45; /* version 4, header length 20 */
@@ -1255,8 +1413,12 @@ int pico_ipv4_frame_push(struct pico_stack *S, struct pico_frame *f, struct pico
         goto drop;
     }
 
-    route = route_find(S, dst);
-    if (!route) {
+    f->flags &= (uint8_t)~PICO_FRAME_FLAG_L2_RESOLVED;
+    dc = pico_ipv4_dst_cache_get(S, f, dst);
+    route = dc ? NULL : route_find(S, dst);
+    if (dc) {
+        link = dc->link;
+    } else if (!route) {
         /* dbg("Route to %08x not found.\n", long_be(dst->addr)); */
 
 
@@ -1310,6 +1472,12 @@ int pico_ipv4_frame_push(struct pico_stack *S, struct pico_frame *f, struct pico
         1 )
         S->ipv4_progressive_id++;
 
+#ifdef PICO_SUPPORT_GSO
+    /* One id for each segment of a TCP super-frame, see pico_gso_xmit() */
+    if (f->gso_size)
+        S->ipv4_progressive_id = (uint16_t)(S->ipv4_progressive_id + (f->payload_len - 1u) / f->gso_size);
+#endif
+
     if (f->send_ttl > 0) {
         ttl = f->send_ttl;
     }
@@ -1382,10 +1550,16 @@ int pico_ipv4_frame_push(struct pico_stack *S, struct pico_frame *f, struct pico
     }
 #endif
 
-    if (pico_ipv4_link_get(S, &hdr->dst)) {
+    if (dc ? dc->local : (pico_ipv4_link_get(S, &hdr->dst) != NULL)) {
         /* it's our own IP */
         return pico_enqueue(&S->q_ipv4.in, f);
     } else{
+        /* Next hop known: leave its MAC for the ethernet layer */
+        if (dc && dc->mac_valid && (f->dev == dc->link->dev) && ((f->net_hdr - f->buffer) >= PICO_SIZE_ETHHDR)) {
+            memcpy(((struct pico_eth_hdr *)(f->net_hdr - PICO_SIZE_ETHHDR))->daddr, dc->mac.addr, PICO_SIZE_ETH);
+            f->flags |= PICO_FRAME_FLAG_L2_RESOLVED;
+        }
+
         /* TODO: Check if there are members subscribed here */
         return pico_enqueue(&S->q_ipv4.out, f);
     }
@@ -1475,6 +1649,15 @@ int MOCKABLE pico_ipv4_route_add(struct pico_stack *S, struct pico_ip4 address,
 		return -1;
 	}
 
+    if (route_lpm_add(S, new) < 0) {
+        dbg("IPv4: Failed to insert route in LPM trie\n");
+        pico_tree_delete(&S->Routes, new);
+        PICO_FREE(new);
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    pico_ipv4_dst_cache_invalidate(S);
     dbg_route();
     return 0;
 }
@@ -1490,8 +1673,10 @@ int pico_ipv4_route_del(struct pico_stack *S, struct pico_ip4 address, struct pi
     found = pico_tree_findKey(&S->Routes, &test);
     if (found) {
 
+        route_lpm_del(S, found);
         pico_tree_delete(&S->Routes, found);
         PICO_FREE(found);
+        pico_ipv4_dst_cache_invalidate(S);
 
         dbg_route();
         return 0;
@@ -1562,6 +1747,7 @@ int pico_ipv4_link_add(struct pico_stack *S, struct pico_device *dev, struct pic
 		return -1;
 	}
 
+    pico_ipv4_dst_cache_invalidate(S);
 #ifdef PICO_SUPPORT_MCAST
     do {
         struct pico_ip4 mcast_all_hosts, mcast_addr, mcast_nm, mcast_gw;
@@ -1651,6 +1837,7 @@ int pico_ipv4_link_del(struct pico_stack *S, struct pico_device *dev, struct pic
 
     pico_ipv4_cleanup_routes(S, found);
     pico_tree_delete(&S->Tree_dev_link, found);
+    pico_ipv4_dst_cache_invalidate(S);
     if (S->default_bcast_route->link == found)
         S->default_bcast_route->link = NULL;
 
@@ -1798,10 +1985,27 @@ int pico_ipv4_rebound(struct pico_stack *S, struct pico_frame *f)
     return pico_ipv4_frame_push(S, f, &dst, hdr->proto);
 }
 
+/* If this was the last forwarded packet, silently discard to prevent duplications */
+static int pico_ipv4_forward_dup_check(struct pico_stack *S, struct pico_ipv4_hdr *hdr)
+{
+    if ((S->ipv4_pre_forward_last_src.addr == hdr->src.addr) && (S->ipv4_pre_forward_last_id == hdr->id)
+        && (S->ipv4_pre_forward_last_dst.addr == hdr->dst.addr) && (S->ipv4_pre_forward_last_proto == hdr->proto)) {
+        return -1;
+    } else {
+        S->ipv4_pre_forward_last_src.addr = hdr->src.addr;
+        S->ipv4_pre_forward_last_dst.addr = hdr->dst.addr;
+        S->ipv4_pre_forward_last_id = hdr->id;
+        S->ipv4_pre_forward_last_proto = hdr->proto;
+    }
+
+    return 0;
+}
+
 static int pico_ipv4_pre_forward_checks(struct pico_stack *S, struct pico_frame *f)
 {
 
     struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+    uint16_t ttl_proto = short_be((uint16_t)((hdr->ttl << 8) | hdr->proto));
 
     /* Decrease TTL, check if expired */
     hdr->ttl = (uint8_t)(hdr->ttl - 1);
@@ -1811,25 +2015,14 @@ static int pico_ipv4_pre_forward_checks(struct pico_stack *S, struct pico_frame
         return -1;
     }
 
-    /* HACK: increase crc to compensate decreased TTL */
-    hdr->crc++;
+    /* TTL shares a header word with the protocol: patch the checksum for it */
+    hdr->crc = pico_checksum_adjust16(hdr->crc, ttl_proto, short_be((uint16_t)((hdr->ttl << 8) | hdr->proto)));
 
     /* If source is local, discard anyway (packets bouncing back and forth) */
     if (pico_ipv4_link_get(S, &hdr->src))
         return -1;
 
-    /* If this was the last forwarded packet, silently discard to prevent duplications */
-    if ((S->ipv4_pre_forward_last_src.addr == hdr->src.addr) && (S->ipv4_pre_forward_last_id == hdr->id)
-        && (S->ipv4_pre_forward_last_dst.addr == hdr->dst.addr) && (S->ipv4_pre_forward_last_proto == hdr->proto)) {
-        return -1;
-    } else {
-        S->ipv4_pre_forward_last_src.addr = hdr->src.addr;
-        S->ipv4_pre_forward_last_dst.addr = hdr->dst.addr;
-        S->ipv4_pre_forward_last_id = hdr->id;
-        S->ipv4_pre_forward_last_proto = hdr->proto;
-    }
-
-    return 0;
+    return pico_ipv4_forward_dup_check(S, hdr);
 }
 
 static int pico_ipv4_forward_check_dev(struct pico_stack *S, struct pico_frame *f)
@@ -1845,7 +2038,9 @@ static int pico_ipv4_forward_check_dev(struct pico_stack *S, struct pico_frame *
     return 0;
 }
 
-static int pico_ipv4_forward(struct pico_stack *S, struct pico_frame *f)
+static void pico_ipv4_flow_add(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl, struct pico_ipv4_route *rt);
+
+static int pico_ipv4_forward(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl)
 {
     struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
     struct pico_ipv4_route *rt;
@@ -1864,7 +2059,8 @@ static int pico_ipv4_forward(struct pico_stack *S, struct pico_frame *f)
     if (pico_ipv4_pre_forward_checks(S, f) < 0)
         return -1;
 
-    pico_ipv4_nat_outbound(S, f, &rt->link->address);
+    if ((pico_ipv4_nat_outbound(S, f, &rt->link->address) == 0) && fl)
+        pico_ipv4_flow_nat(S, f, fl, 1);
 
     f->start = f->net_hdr;
 
@@ -1876,7 +2072,244 @@ static int pico_ipv4_forward(struct pico_stack *S, struct pico_frame *f)
         return -1;
     }
 #endif
-    return pico_datalink_send(f);
+    if (fl && fl->in)
+        pico_ipv4_flow_add(S, f, fl, rt);
+
+    /* On success the frame now belongs to the outgoing queue */
+    if (pico_datalink_send(f) < 0)
+        return -1;
+
+    return 0;
+}
+
+void pico_ipv4_flow_cache_invalidate(struct pico_stack *S)
+{
+    S->FlowCacheGen++;
+}
+
+int pico_ipv4_flow_cache_set_size(struct pico_stack *S, uint32_t size)
+{
+    if ((size == 1) || (size & (size - 1))) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    pico_ipv4_flow_cache_destroy(S);
+    S->ipv4_flows_size = size;
+    return 0;
+}
+
+void pico_ipv4_flow_cache_destroy(struct pico_stack *S)
+{
+    if (S->ipv4_flows) {
+        PICO_FREE(S->ipv4_flows);
+        S->ipv4_flows = NULL;
+    }
+}
+
+/* Addresses and ports mostly differ in their last byte, which sits in
+ * the top bits: rotate before each multiply to carry it down.
+ */
+static inline uint32_t pico_ipv4_flow_mix(uint32_t h, uint32_t v)
+{
+    h ^= v;
+    h = (h << 13) | (h >> 19);
+    return h * 0x9E3779B1u;
+}
+
+/* First of the two slots a flow can be kept in */
+static inline struct pico_ipv4_flow *pico_ipv4_flow_bucket(struct pico_stack *S, const struct pico_ipv4_flow *key)
+{
+    uint32_t h = pico_ipv4_flow_mix(key->in->hash, key->src);
+
+    h = pico_ipv4_flow_mix(h, key->dst);
+    h = pico_ipv4_flow_mix(h, ((uint32_t)key->sport << 16) | key->dport);
+    h = pico_ipv4_flow_mix(h, key->proto);
+    h ^= h >> 16;
+    return &S->ipv4_flows[(h << 1) & (S->ipv4_flows_size - 1)];
+}
+
+static inline int pico_ipv4_flow_match(struct pico_stack *S, const struct pico_ipv4_flow *fl, const struct pico_ipv4_flow *key)
+{
+    return fl->out && (fl->gen == S->FlowCacheGen) && (fl->src == key->src) && (fl->dst == key->dst)
+           && (fl->sport == key->sport) && (fl->dport == key->dport) && (fl->proto == key->proto) && (fl->in == key->in);
+}
+
+static struct pico_ipv4_flow *pico_ipv4_flow_find(struct pico_stack *S, const struct pico_ipv4_flow *key)
+{
+    struct pico_ipv4_flow *b = pico_ipv4_flow_bucket(S, key);
+
+    if (pico_ipv4_flow_match(S, &b[0], key))
+        return &b[0];
+
+    if (pico_ipv4_flow_match(S, &b[1], key))
+        return &b[1];
+
+    return NULL;
+}
+
+/* Record the translation a frame of the flow went through. A frame
+ * translated twice is not cached.
+ */
+static int pico_ipv4_flow_nat(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl, int outbound)
+{
+    struct pico_nat_tuple *t = fl->nat ? NULL : pico_ipv4_nat_tuple(S, f, outbound);
+
+    if (!t) {
+        fl->in = NULL;
+        return -1;
+    }
+
+    fl->nat_id = pico_ipv4_nat_tuple_id(t, &fl->nat_port);
+
+    fl->nat = outbound ? PICO_IPV4_FLOW_NAT_OUT : PICO_IPV4_FLOW_NAT_IN;
+    return 0;
+}
+
+/* Called once the frame has passed every check on its way out */
+static void pico_ipv4_flow_add(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *fl, struct pico_ipv4_route *rt)
+{
+    struct pico_ipv4_flow *b;
+
+#ifdef PICO_SUPPORT_IPFILTER
+    /* Rules that let frames through count every one of them */
+    if (pico_ipfilter_has_pass_rules(S))
+        return;
+
+#endif
+    fl->out = f->dev;
+    fl->gen = S->FlowCacheGen;
+    fl->mac_valid = 0;
+#ifdef PICO_SUPPORT_ETH
+    if (fl->out->eth && (fl->out->mode == LL_MODE_ETHERNET)) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        struct pico_ip4 nexthop;
+        struct pico_eth *mac;
+
+        nexthop.addr = rt->gateway.addr ? rt->gateway.addr : hdr->dst.addr;
+        mac = pico_arp_lookup(S, &nexthop);
+        if (!mac)
+            return; /* the next packet tries again */
+
+        memcpy(&fl->mac, mac, sizeof(struct pico_eth));
+        fl->mac_valid = 1;
+    }
+#else
+    (void)rt;
+#endif
+
+    if (!S->ipv4_flows) {
+        S->ipv4_flows = PICO_ZALLOC(S->ipv4_flows_size * sizeof(struct pico_ipv4_flow));
+        if (!S->ipv4_flows)
+            return;
+    }
+
+    /* Reuse a free, stale or matching slot, else the older one goes */
+    b = pico_ipv4_flow_bucket(S, fl);
+    if ((b[0].gen == S->FlowCacheGen) && b[0].out && !pico_ipv4_flow_match(S, &b[0], fl)) {
+        if ((b[1].gen == S->FlowCacheGen) && b[1].out && !pico_ipv4_flow_match(S, &b[1], fl))
+            b[1] = b[0];
+        else
+            b++;
+    }
+
+    *b = *fl;
+    S->ipv4_flow_stats.added++;
+}
+
+/* Fast path for frames of a cached flow. Fills in 'key' for the slow
+ * path to cache the flow, or clears key->in when it cannot be cached.
+ * Returns 1 if the frame was taken.
+ */
+static int pico_ipv4_flow_in(struct pico_stack *S, struct pico_frame *f, struct pico_ipv4_flow *key)
+{
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+    struct pico_nat_tuple *tuple = NULL;
+    struct pico_ipv4_flow *fl;
+    uint16_t ttl_proto;
+
+    key->in = NULL;
+    if (!S->ipv4_flows_size || (hdr->vhl != 0x45)
+        || (hdr->frag & short_be(PICO_IPV4_EVIL | PICO_IPV4_MOREFRAG | PICO_IPV4_FRAG_MASK)))
+        return 0;
+
+#ifdef PICO_SUPPORT_RAWSOCKETS
+    /* Raw sockets get a copy of every frame */
+    if (!pico_tree_empty(&S->IP4Sockets))
+        return 0;
+#endif
+
+    key->src = hdr->src.addr;
+    key->dst = hdr->dst.addr;
+    key->proto = hdr->proto;
+    key->sport = 0;
+    key->dport = 0;
+    if ((hdr->proto == PICO_PROTO_TCP) || (hdr->proto == PICO_PROTO_UDP)) {
+        struct pico_trans *trans = (struct pico_trans *)f->transport_hdr;
+        if (f->transport_len < sizeof(struct pico_trans))
+            return 0;
+
+        key->sport = trans->sport;
+        key->dport = trans->dport;
+    }
+
+    key->nat = 0;
+    key->nat_id = 0;
+    key->in = f->dev;
+
+    if (!S->ipv4_flows)
+        return 0;
+
+    fl = pico_ipv4_flow_find(S, key);
+    if (fl && fl->nat) {
+        tuple = pico_ipv4_nat_tuple_get(S, fl->nat_port, fl->proto, fl->nat_id);
+        if (!tuple) {
+            fl->out = NULL; /* its translation expired */
+            fl = NULL;
+        }
+    }
+
+    if (!fl) {
+        S->ipv4_flow_stats.misses++;
+        return 0;
+    }
+
+    /* Expiring frames go the long way, for the ICMP error */
+    if (hdr->ttl <= 1)
+        return 0;
+
+    if (pico_ipv4_crc_check(f) < 1)
+        return 1;
+
+    if (pico_ipv4_forward_dup_check(S, hdr) < 0) {
+        pico_frame_discard(f);
+        return 1;
+    }
+
+    ttl_proto = short_be((uint16_t)((hdr->ttl << 8) | hdr->proto));
+    hdr->ttl = (uint8_t)(hdr->ttl - 1);
+    hdr->crc = pico_checksum_adjust16(hdr->crc, ttl_proto, short_be((uint16_t)((hdr->ttl << 8) | hdr->proto)));
+
+    if (fl->nat)
+        pico_ipv4_nat_apply(S, tuple, f, fl->nat == PICO_IPV4_FLOW_NAT_OUT);
+
+    f->dev = fl->out;
+    f->start = f->net_hdr;
+    if (pico_ipv4_forward_check_dev(S, f) < 0) {
+        pico_frame_discard(f);
+        return 1;
+    }
+
+    if (fl->mac_valid && ((f->net_hdr - f->buffer) >= PICO_SIZE_ETHHDR)) {
+        memcpy(((struct pico_eth_hdr *)(f->net_hdr - PICO_SIZE_ETHHDR))->daddr, fl->mac.addr, PICO_SIZE_ETH);
+        f->flags |= PICO_FRAME_FLAG_L2_RESOLVED;
+    }
+
+    S->ipv4_flow_stats.hits++;
+    if (pico_datalink_send(f) < 0)
+        pico_frame_discard(f);
+
+    return 1;
 }
 
 int pico_ipv4_is_broadcast(struct pico_stack *S, uint32_t addr)
@@ -47,6 +47,15 @@
     #define PICO_IPV4_FRAG_MAX_SIZE PICO_DEFAULT_SOCKETQ
 #endif
 
+/* Forwarded flows cached per stack, see pico_ipv4_flow_cache_set_size() */
+#ifndef PICO_IPV4_FLOW_CACHE_SIZE
+# ifdef __linux__
+#  define PICO_IPV4_FLOW_CACHE_SIZE 4096u
+# else
+#  define PICO_IPV4_FLOW_CACHE_SIZE 64u
+# endif
+#endif
+
 extern struct pico_protocol pico_proto_ipv4;
 
 PACKED_STRUCT_DEF pico_ipv4_hdr {
@@ -131,6 +140,11 @@ int pico_ipv4_valid_netmask(uint32_t mask);
 int pico_ipv4_is_unicast(uint32_t address);
 int pico_ipv4_is_multicast(uint32_t address);
 int pico_ipv4_is_broadcast(struct pico_stack *S, uint32_t addr);
+void pico_ipv4_dst_cache_invalidate(struct pico_stack *S);
+void pico_ipv4_flow_cache_invalidate(struct pico_stack *S);
+/* Entries in the forwarding flow cache: a power of two, 0 turns it off */
+int pico_ipv4_flow_cache_set_size(struct pico_stack *S, uint32_t size);
+void pico_ipv4_flow_cache_destroy(struct pico_stack *S);
 int pico_ipv4_is_loopback(uint32_t addr);
 int pico_ipv4_is_valid_src(struct pico_stack *S, uint32_t addr, struct pico_device *dev);
 
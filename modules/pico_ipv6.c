@@ -40,6 +40,7 @@
 #include "pico_6lowpan_ll.h"
 #include "pico_mld.h"
 #include "pico_mcast.h"
+#include "pico_ipfilter.h"
 #ifdef PICO_SUPPORT_IPV6
 
 
@@ -409,6 +410,73 @@ int pico_ipv6_is_unspecified(const uint8_t addr[PICO_SIZE_IP6])
     return !memcmp(PICO_IP6_ANY, addr, PICO_SIZE_IP6);
 }
 
+/* S->IPV6RoutesLPM mirrors S->IPV6Routes: for each prefix it holds the route
+ * that the reverse walk of the tree would hit first. While routes with a
+ * non-contiguous netmask exist, pico_ipv6_route_find() walks the tree instead.
+ */
+static int ipv6_route_lpm_plen(struct pico_ipv6_route *r)
+{
+    return pico_lpm_mask_len(r->netmask.addr, PICO_SIZE_IP6);
+}
+
+static int ipv6_route_same_prefix(struct pico_ipv6_route *a, struct pico_ipv6_route *b)
+{
+    int i;
+    if (memcmp(a->netmask.addr, b->netmask.addr, PICO_SIZE_IP6))
+        return 0;
+
+    for (i = 0; i < PICO_SIZE_IP6; i++) {
+        if ((a->dest.addr[i] ^ b->dest.addr[i]) & a->netmask.addr[i])
+            return 0;
+    }
+    return 1;
+}
+
+static int ipv6_route_lpm_add(struct pico_stack *S, struct pico_ipv6_route *r)
+{
+    struct pico_ipv6_route *cur;
+    int plen = ipv6_route_lpm_plen(r);
+
+    if (plen < 0) {
+        S->IPV6RoutesNonContig++;
+        return 0;
+    }
+
+    cur = pico_lpm_get(&S->IPV6RoutesLPM, r->dest.addr, (uint8_t)plen);
+    if (cur && (ipv6_route_compare(r, cur) < 0))
+        return 0;
+
+    return pico_lpm_insert(&S->IPV6RoutesLPM, r->dest.addr, (uint8_t)plen, r);
+}
+
+static void ipv6_route_lpm_del(struct pico_stack *S, struct pico_ipv6_route *r)
+{
+    struct pico_tree_node *node;
+    struct pico_ipv6_route *prev;
+    int plen = ipv6_route_lpm_plen(r);
+
+    if (plen < 0) {
+        S->IPV6RoutesNonContig--;
+        return;
+    }
+
+    if (pico_lpm_get(&S->IPV6RoutesLPM, r->dest.addr, (uint8_t)plen) != r)
+        return;
+
+    /* Routes sharing a prefix are adjacent in the tree */
+    node = pico_tree_findNode(&S->IPV6Routes, r);
+    if (node) {
+        node = pico_tree_prev(node);
+        prev = (node != &LEAF) ? node->keyValue : NULL;
+        if (prev && ipv6_route_same_prefix(prev, r)) {
+            pico_lpm_insert(&S->IPV6RoutesLPM, prev->dest.addr, (uint8_t)plen, prev);
+            return;
+        }
+    }
+
+    pico_lpm_remove(&S->IPV6RoutesLPM, r->dest.addr, (uint8_t)plen);
+}
+
 static struct pico_ipv6_route *pico_ipv6_route_find(struct pico_stack *S, const struct pico_ip6 *addr)
 {
     struct pico_tree_node *index = NULL;
@@ -418,6 +486,9 @@ static struct pico_ipv6_route *pico_ipv6_route_find(struct pico_stack *S, const
         return NULL;
     }
 
+    if (!S->IPV6RoutesNonContig)
+        return pico_lpm_lookup(&S->IPV6RoutesLPM, addr->addr);
+
     pico_tree_foreach_reverse(index, &S->IPV6Routes) {
         r = index->keyValue;
         for (i = 0; i < PICO_SIZE_IP6; ++i) {
@@ -531,6 +602,12 @@ static int pico_ipv6_forward(struct pico_stack *S, struct pico_frame *f)
     }
 
     f->start = f->net_hdr;
+#ifdef PICO_SUPPORT_IPFILTER
+    if (ipfilter(f)) {
+        /*pico_frame is discarded as result of the filtering*/
+        return -1;
+    }
+#endif
 
     return pico_datalink_send(f);
 }
@@ -875,6 +952,13 @@ static int pico_ipv6_process_in(struct pico_stack *S, struct pico_protocol *self
 
     f->proto = (uint8_t)proto;
     ipv6_dbg("IPv6: payload %u net_len %u nxthdr %u\n", short_be(hdr->len), f->net_len, proto);
+#ifdef PICO_SUPPORT_IPFILTER
+    if (ipfilter(f)) {
+        /*pico_frame is discarded as result of the filtering*/
+        return 0;
+    }
+
+#endif
 
     if (pico_ipv6_is_unicast(S, &hdr->dst)) {
         pico_transport_receive(f, f->proto);
@@ -895,6 +979,13 @@ static int pico_ipv6_process_out(struct pico_stack *S, struct pico_protocol *sel
     IGNORE_PARAMETER(S);
 
     f->start = (uint8_t*)f->net_hdr;
+#ifdef PICO_SUPPORT_IPFILTER
+    if (ipfilter(f)) {
+        /*pico_frame is discarded as result of the filtering*/
+        return 0;
+    }
+
+#endif
 
     return pico_datalink_send(f);
 }
@@ -1625,6 +1716,14 @@ int pico_ipv6_route_add(struct pico_stack *S, struct pico_ip6 address, struct pi
 		return -1;
 	}
 
+    if (ipv6_route_lpm_add(S, new) < 0) {
+        ipv6_dbg("IPv6: Failed to insert route in LPM trie\n");
+        pico_tree_delete(&S->IPV6Routes, new);
+        PICO_FREE(new);
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
     pico_ipv6_dbg_route();
     return 0;
 }
@@ -1646,6 +1745,7 @@ int pico_ipv6_route_del(struct pico_stack *S, struct pico_ip6 address, struct pi
 
     found = pico_tree_findKey(&S->IPV6Routes, &test);
     if (found) {
+        ipv6_route_lpm_del(S, found);
         pico_tree_delete(&S->IPV6Routes, found);
         PICO_FREE(found);
         pico_ipv6_dbg_route();
@@ -44,19 +44,43 @@
 #define nat_dbg(...) do {} while(0)
 #endif
 
+/* Idle timeouts: UDP and other protocols, and TCP once closed */
 #define PICO_NAT_TIMEWAIT  240000 /* msec (4 mins) */
+/* Idle timeout of a TCP connection still open */
+#define PICO_NAT_TCP_TIMEOUT 86400000 /* msec (24 hours) */
+
+/* Expiry timing wheel: slots (power of two) and slot width in msec */
+#ifndef PICO_NAT_WHEEL_SLOTS
+#define PICO_NAT_WHEEL_SLOTS 256u
+#endif
+#ifndef PICO_NAT_WHEEL_TICK
+#define PICO_NAT_WHEEL_TICK 1000u
+#endif
+
+/* Initial buckets (power of two) and mean chain length before growing */
+#define PICO_NAT_HASH_INIT 64u
+#define PICO_NAT_HASH_LOAD 2u
+
+/* Ports handed out to translations */
+#define PICO_NAT_PORT_MIN   1024u
+#define PICO_NAT_PORT_RANGE (65536u - PICO_NAT_PORT_MIN)
 
 #define PICO_NAT_INBOUND   0
 #define PICO_NAT_OUTBOUND  1
 
 struct pico_nat_tuple {
+    struct pico_nat_tuple *out_next;    /* by src_addr, src_port, proto */
+    struct pico_nat_tuple *in_next;     /* by nat_port, proto */
+    struct pico_nat_tuple *wheel_prev, *wheel_next;
+    pico_time expire;
+    uint32_t id;                        /* never reused while the table lives */
+    uint16_t wheel_slot;
     uint8_t proto;
-    uint16_t conn_active : 11;
-    uint16_t portforward : 1;
-    uint16_t rst : 1;
-    uint16_t syn : 1;
-    uint16_t fin_in : 1;
-    uint16_t fin_out : 1;
+    uint8_t portforward : 1;
+    uint8_t rst : 1;
+    uint8_t syn : 1;
+    uint8_t fin_in : 1;
+    uint8_t fin_out : 1;
     uint16_t src_port;
     uint16_t dst_port;
     uint16_t nat_port;
@@ -65,101 +89,219 @@ struct pico_nat_tuple {
     struct pico_ip4 nat_addr;
 };
 
+/* Translations of a stack.
+ * Both directions are hashed on their lookup key, in two tables of the
+ * same size that grow together. Entries other than port forwards sit
+ * in a timing wheel: each slot holds the entries expiring within one
+ * tick of a rotation, and one timer walks a slot per tick. Traffic only
+ * pushes the expiry time back; an entry found early in its slot is
+ * moved on then, so the per-packet cost does not depend on the table.
+ */
+struct pico_nat_table {
+    struct pico_nat_tuple **out_hash;
+    struct pico_nat_tuple **in_hash;
+    uint32_t size;
+    uint32_t count;
+    uint32_t last_id;
+    struct pico_nat_tuple *wheel[PICO_NAT_WHEEL_SLOTS];
+    pico_time wheel_tick;   /* last tick walked */
+    uint32_t wheel_count;
+    uint32_t timer;
+};
+
 static struct pico_ipv4_link *nat_link = NULL;
 
-static int nat_cmp_natport(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static inline uint32_t nat_hash_mix(uint32_t h, uint32_t v)
 {
+    h ^= v;
+    return h * 0x9E3779B1u; /* Knuth multiplicative step */
+}
 
-    if (a->nat_port < b->nat_port)
-        return -1;
+static uint32_t nat_hash_out(uint32_t src_addr, uint16_t src_port, uint8_t proto)
+{
+    uint32_t h = nat_hash_mix(((uint32_t)src_port << 8) | proto, src_addr);
+    return h ^ (h >> 16);
+}
 
-    if (a->nat_port > b->nat_port)
+static uint32_t nat_hash_in(uint16_t nat_port, uint8_t proto)
+{
+    uint32_t h = nat_hash_mix(((uint32_t)nat_port << 8) | proto, 0);
+    return h ^ (h >> 16);
+}
 
-        return 1;
+void pico_ipv4_nat_print_table(struct pico_stack *S)
+{
+    struct pico_nat_table *nt = S->NAT;
+    struct pico_nat_tuple *t = NULL;
+    uint32_t i;
+    (void)t;
 
-    return 0;
+    if (!nt)
+        return;
+
+    nat_dbg("+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
+    nat_dbg("+                                                        NAT table                                                        +\n");
+    nat_dbg("+-------------------------------------------------------------------------------------------------------------------------+\n");
+    nat_dbg("+ src_addr | src_port | dst_addr | dst_port | nat_addr | nat_port | proto |    expire    | FIN1 | FIN2 | SYN | RST | FORW +\n");
+    nat_dbg("+-------------------------------------------------------------------------------------------------------------------------+\n");
 
+    for (i = 0; i < nt->size; i++) {
+        for (t = nt->out_hash[i]; t; t = t->out_next) {
+            nat_dbg("+ %08X |  %05u   | %08X |  %05u   | %08X |  %05u   |  %03u  | %12lu |   %u  |   %u  |  %u  |  %u  |   %u  +\n",
+                    long_be(t->src_addr.addr), t->src_port, long_be(t->dst_addr.addr), t->dst_port, long_be(t->nat_addr.addr), t->nat_port,
+                    t->proto, (unsigned long)t->expire, t->fin_in, t->fin_out, t->syn, t->rst, t->portforward);
+        }
+    }
+    nat_dbg("+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
 }
 
-static int nat_cmp_srcport(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static int nat_table_resize(struct pico_nat_table *nt, uint32_t size)
 {
+    struct pico_nat_tuple **out, **in;
+    struct pico_nat_tuple *t, *next;
+    uint32_t i, b;
 
-    if (a->src_port < b->src_port)
+    out = PICO_ZALLOC(size * sizeof(struct pico_nat_tuple *));
+    if (!out)
         return -1;
 
-    if (a->src_port > b->src_port)
+    in = PICO_ZALLOC(size * sizeof(struct pico_nat_tuple *));
+    if (!in) {
+        PICO_FREE(out);
+        return -1;
+    }
 
-        return 1;
+    for (i = 0; i < nt->size; i++) {
+        for (t = nt->out_hash[i]; t; t = next) {
+            next = t->out_next;
+            b = nat_hash_out(t->src_addr.addr, t->src_port, t->proto) & (size - 1);
+            t->out_next = out[b];
+            out[b] = t;
+        }
+        for (t = nt->in_hash[i]; t; t = next) {
+            next = t->in_next;
+            b = nat_hash_in(t->nat_port, t->proto) & (size - 1);
+            t->in_next = in[b];
+            in[b] = t;
+        }
+    }
+    if (nt->out_hash) {
+        PICO_FREE(nt->out_hash);
+        PICO_FREE(nt->in_hash);
+    }
 
+    nt->out_hash = out;
+    nt->in_hash = in;
+    nt->size = size;
     return 0;
-
 }
 
-static int nat_cmp_proto(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static struct pico_nat_table *nat_table_get(struct pico_stack *S)
 {
-    if (a->proto < b->proto)
-        return -1;
+    struct pico_nat_table *nt = S->NAT;
+    if (nt)
+        return nt;
 
-    if (a->proto > b->proto)
-        return 1;
+    nt = PICO_ZALLOC(sizeof(struct pico_nat_table));
+    if (!nt) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
 
-    return 0;
+    if (nat_table_resize(nt, PICO_NAT_HASH_INIT) < 0) {
+        PICO_FREE(nt);
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    nt->wheel_tick = PICO_TIME_MS() / PICO_NAT_WHEEL_TICK;
+    S->NAT = nt;
+    return nt;
 }
 
-static int nat_cmp_address(struct pico_nat_tuple *a, struct pico_nat_tuple *b)
+static struct pico_nat_tuple *nat_find_outbound(struct pico_nat_table *nt, struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto)
 {
-    return pico_ipv4_compare(&a->src_addr, &b->src_addr);
+    struct pico_nat_tuple *t = nt->out_hash[nat_hash_out(src_addr->addr, src_port, proto) & (nt->size - 1)];
+
+    for (; t; t = t->out_next) {
+        if ((t->src_addr.addr == src_addr->addr) && (t->src_port == src_port) && (t->proto == proto))
+            return t;
+    }
+    return NULL;
 }
 
-int nat_cmp_inbound(void *ka, void *kb)
+static struct pico_nat_tuple *nat_find_inbound(struct pico_nat_table *nt, uint16_t nat_port, uint8_t proto)
 {
-    struct pico_nat_tuple *a = ka, *b = kb;
-    int cport = nat_cmp_natport(a, b);
-    if (cport)
-        return cport;
-    return nat_cmp_proto(a, b);
+    struct pico_nat_tuple *t = nt->in_hash[nat_hash_in(nat_port, proto) & (nt->size - 1)];
+
+    for (; t; t = t->in_next) {
+        if ((t->nat_port == nat_port) && (t->proto == proto))
+            return t;
+    }
+    return NULL;
 }
 
+static void nat_wheel_timer(pico_time now, void *arg);
 
-int nat_cmp_outbound(void *ka, void *kb)
+static void nat_wheel_link(struct pico_stack *S, struct pico_nat_table *nt, struct pico_nat_tuple *t)
 {
-    struct pico_nat_tuple *a = ka, *b = kb;
-    int caddr, cport;
-
-    caddr = nat_cmp_address(a, b);
-    if (caddr)
-        return caddr;
+    /* First walked once t->expire has passed */
+    pico_time tick = (t->expire / PICO_NAT_WHEEL_TICK) + 1u;
+    uint32_t slot;
+
+    if (tick <= nt->wheel_tick)
+        tick = nt->wheel_tick + 1u;
+
+    slot = (uint32_t)(tick & (PICO_NAT_WHEEL_SLOTS - 1u));
+    t->wheel_slot = (uint16_t)slot;
+    t->wheel_prev = NULL;
+    t->wheel_next = nt->wheel[slot];
+    if (t->wheel_next)
+        t->wheel_next->wheel_prev = t;
+
+    nt->wheel[slot] = t;
+    nt->wheel_count++;
+
+    if (!nt->timer) {
+        nt->timer = pico_timer_add(S, PICO_NAT_WHEEL_TICK, nat_wheel_timer, S);
+        if (!nt->timer)
+            nat_dbg("NAT: Failed to start expiry timer\n");
+    }
+}
 
-    cport = nat_cmp_srcport(a, b);
+static void nat_wheel_unlink(struct pico_nat_table *nt, struct pico_nat_tuple *t)
+{
+    if (t->wheel_prev)
+        t->wheel_prev->wheel_next = t->wheel_next;
+    else
+        nt->wheel[t->wheel_slot] = t->wheel_next;
 
-    if (cport)
-        return cport;
+    if (t->wheel_next)
+        t->wheel_next->wheel_prev = t->wheel_prev;
 
-    return nat_cmp_proto(a, b);
+    t->wheel_prev = NULL;
+    t->wheel_next = NULL;
+    nt->wheel_count--;
 }
 
-void pico_ipv4_nat_print_table(struct pico_stack *S)
+/* Idle for timeout msec from now: pushing expiry back is only a store */
+static void nat_set_expire(struct pico_stack *S, struct pico_nat_tuple *t, pico_time timeout)
 {
-    struct pico_nat_tuple *t = NULL;
-    struct pico_tree_node *index = NULL;
-    (void)t;
+    struct pico_nat_table *nt = S->NAT;
+    pico_time expire = PICO_TIME_MS() + timeout;
 
-    nat_dbg("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-    nat_dbg("+                                                        NAT table                                                       +\n");
-    nat_dbg("+------------------------------------------------------------------------------------------------------------------------+\n");
-    nat_dbg("+ src_addr | src_port | dst_addr | dst_port | nat_addr | nat_port | proto | conn active | FIN1 | FIN2 | SYN | RST | FORW +\n");
-    nat_dbg("+------------------------------------------------------------------------------------------------------------------------+\n");
+    if (t->portforward)
+        return;
 
-    pico_tree_foreach(index, &S->NATOutbound)
-    {
-        t = index->keyValue;
-        nat_dbg("+ %08X |  %05u   | %08X |  %05u   | %08X |  %05u   |  %03u  |     %03u     |   %u  |   %u  |  %u  |  %u  |   %u  +\n",
-                long_be(t->src_addr.addr), t->src_port, long_be(t->dst_addr.addr), t->dst_port, long_be(t->nat_addr.addr), t->nat_port,
-                t->proto, t->conn_active, t->fin_in, t->fin_out, t->syn, t->rst, t->portforward);
+    if (expire >= t->expire) {
+        t->expire = expire;
+        return;
     }
-    nat_dbg("++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++\n");
-}
 
+    nat_wheel_unlink(nt, t);
+    t->expire = expire;
+    nat_wheel_link(S, nt, t);
+}
 /*
    2 options:
     find on nat_port and proto
@@ -168,25 +310,17 @@ void pico_ipv4_nat_print_table(struct pico_stack *S)
  */
 static struct pico_nat_tuple *pico_ipv4_nat_find_tuple(struct pico_stack *S, uint16_t nat_port, struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto)
 {
-    struct pico_nat_tuple *found = NULL, test = {
+    struct pico_ip4 any = {
         0
     };
 
-    test.nat_port = nat_port;
-    test.src_port = src_port;
-    test.proto = proto;
-    if (src_addr)
-        test.src_addr = *src_addr;
+    if (!S->NAT)
+        return NULL;
 
     if (nat_port)
-        found = pico_tree_findKey(&S->NATInbound, &test);
-    else
-        found = pico_tree_findKey(&S->NATOutbound, &test);
+        return nat_find_inbound(S->NAT, nat_port, proto);
 
-    if (found)
-        return found;
-    else
-        return NULL;
+    return nat_find_outbound(S->NAT, src_addr ? src_addr : &any, src_port, proto);
 }
 
 int pico_ipv4_nat_find(struct pico_stack *S, uint16_t nat_port, struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto)
@@ -203,7 +337,21 @@ int pico_ipv4_nat_find(struct pico_stack *S, uint16_t nat_port, struct pico_ip4
 static struct pico_nat_tuple *pico_ipv4_nat_add(struct pico_stack *S, struct pico_ip4 dst_addr, uint16_t dst_port, struct pico_ip4 src_addr, uint16_t src_port,
                                                 struct pico_ip4 nat_addr, uint16_t nat_port, uint8_t proto)
 {
-    struct pico_nat_tuple *t = PICO_ZALLOC(sizeof(struct pico_nat_tuple));
+    struct pico_nat_table *nt = nat_table_get(S);
+    struct pico_nat_tuple *t;
+    uint32_t b;
+
+    if (!nt)
+        return NULL;
+
+    if (nat_find_outbound(nt, &src_addr, src_port, proto) || nat_find_inbound(nt, nat_port, proto))
+        return NULL;
+
+    /* On allocation failure the chains just get longer */
+    if (nt->count >= (nt->size * PICO_NAT_HASH_LOAD))
+        nat_table_resize(nt, nt->size << 1);
+
+    t = PICO_ZALLOC(sizeof(struct pico_nat_tuple));
     if (!t) {
         pico_err = PICO_ERR_ENOMEM;
         return NULL;
@@ -216,25 +364,40 @@ static struct pico_nat_tuple *pico_ipv4_nat_add(struct pico_stack *S, struct pic
     t->nat_addr = nat_addr;
     t->nat_port = nat_port;
     t->proto = proto;
-    t->conn_active = 1;
-    t->portforward = 0;
-    t->rst = 0;
-    t->syn = 0;
-    t->fin_in = 0;
-    t->fin_out = 0;
-
-    if (pico_tree_insert(&S->NATOutbound, t)) {
-        PICO_FREE(t);
-        return NULL;
-    }
+    if (++nt->last_id == 0)
+        nt->last_id = 1;
+    t->id = nt->last_id;
+
+    b = nat_hash_out(src_addr.addr, src_port, proto) & (nt->size - 1);
+    t->out_next = nt->out_hash[b];
+    nt->out_hash[b] = t;
+    b = nat_hash_in(nat_port, proto) & (nt->size - 1);
+    t->in_next = nt->in_hash[b];
+    nt->in_hash[b] = t;
+    nt->count++;
+    return t;
+}
 
-    if (pico_tree_insert(&S->NATInbound, t)) {
-        pico_tree_delete(&S->NATOutbound, t);
-        PICO_FREE(t);
-        return NULL;
-    }
+/* Off the wheel already, or never on it. Forwarding flows that used it
+ * find it gone by its id.
+ */
+static void nat_tuple_del(struct pico_stack *S, struct pico_nat_tuple *t)
+{
+    struct pico_nat_table *nt = S->NAT;
+    struct pico_nat_tuple **pp;
 
-    return t;
+    pp = &nt->out_hash[nat_hash_out(t->src_addr.addr, t->src_port, t->proto) & (nt->size - 1)];
+    while (*pp != t)
+        pp = &(*pp)->out_next;
+    *pp = t->out_next;
+
+    pp = &nt->in_hash[nat_hash_in(t->nat_port, t->proto) & (nt->size - 1)];
+    while (*pp != t)
+        pp = &(*pp)->in_next;
+    *pp = t->in_next;
+
+    nt->count--;
+    PICO_FREE(t);
 }
 
 static int pico_ipv4_nat_del(struct pico_stack *S, uint16_t nat_port, uint8_t proto)
@@ -242,9 +405,10 @@ static int pico_ipv4_nat_del(struct pico_stack *S, uint16_t nat_port, uint8_t pr
     struct pico_nat_tuple *t = NULL;
     t = pico_ipv4_nat_find_tuple(S, nat_port, NULL, 0, proto);
     if (t) {
-        pico_tree_delete(&S->NATOutbound, t);
-        pico_tree_delete(&S->NATInbound, t);
-        PICO_FREE(t);
+        if (!t->portforward)
+            nat_wheel_unlink(S->NAT, t);
+
+        nat_tuple_del(S, t);
     }
 
     return 0;
@@ -277,29 +441,36 @@ static struct pico_nat_tuple *pico_ipv4_nat_generate_tuple(struct pico_stack *S,
 {
     struct pico_trans *trans = NULL;
     struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
+    struct pico_nat_tuple *t;
     uint16_t nport = 0;
-    uint8_t retry = 32;
+    uint32_t start, i;
 
-    /* generate NAT port */
-    do {
-        uint32_t rand = pico_rand();
-        nport = (uint16_t) (rand & 0xFFFFU);
-        nport = (uint16_t)((nport % (65535 - 1024)) + 1024U);
-        nport = short_be(nport);
+    if (!nat_table_get(S))
+        return NULL;
 
-        if (pico_is_port_free(S, net->proto, nport, NULL, &pico_proto_ipv4))
+    /* generate NAT port, free for both sockets and translations:
+     * random start, then probe linearly so a crowded table still finds one */
+    start = pico_rand() % PICO_NAT_PORT_RANGE;
+    for (i = 0; i < PICO_NAT_PORT_RANGE; i++) {
+        nport = short_be((uint16_t)(((start + i) % PICO_NAT_PORT_RANGE) + PICO_NAT_PORT_MIN));
+        if (pico_is_port_free(S, net->proto, nport, NULL, &pico_proto_ipv4) && !nat_find_inbound(S->NAT, nport, net->proto))
             break;
-    } while (--retry);
+    }
 
-    if (!retry)
+    if (i == PICO_NAT_PORT_RANGE)
         return NULL;
 
     trans = pico_nat_generate_tuple_trans(net, f);
     if(!trans)
         return NULL;
 
-    return pico_ipv4_nat_add(S, net->dst, trans->dport, net->src, trans->sport, nat_link->address, nport, net->proto);
-    /* XXX return pico_ipv4_nat_add(nat_link->address, port, net->src, trans->sport, net->proto); */
+    t = pico_ipv4_nat_add(S, net->dst, trans->dport, net->src, trans->sport, nat_link->address, nport, net->proto);
+    if (t) {
+        t->expire = PICO_TIME_MS() + PICO_NAT_TIMEWAIT;
+        nat_wheel_link(S, S->NAT, t);
+    }
+
+    return t;
 }
 
 static inline void pico_ipv4_nat_set_tcp_flags(struct pico_nat_tuple *t, struct pico_frame *f, uint8_t direction)
@@ -318,7 +489,7 @@ static inline void pico_ipv4_nat_set_tcp_flags(struct pico_nat_tuple *t, struct
         t->fin_out = 1;
 }
 
-static int pico_ipv4_nat_sniff_session(struct pico_nat_tuple *t, struct pico_frame *f, uint8_t direction)
+static int pico_ipv4_nat_sniff_session(struct pico_stack *S, struct pico_nat_tuple *t, struct pico_frame *f, uint8_t direction)
 {
     struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
 
@@ -326,15 +497,16 @@ static int pico_ipv4_nat_sniff_session(struct pico_nat_tuple *t, struct pico_fra
     case PICO_PROTO_TCP:
     {
         pico_ipv4_nat_set_tcp_flags(t, f, direction);
+        if (t->rst || (t->fin_in && t->fin_out))
+            nat_set_expire(S, t, PICO_NAT_TIMEWAIT);
+        else
+            nat_set_expire(S, t, PICO_NAT_TCP_TIMEOUT);
+
         break;
     }
 
     case PICO_PROTO_UDP:
-        t->conn_active = 1;
-        break;
-
-    case PICO_PROTO_ICMP4:
-        /* XXX: implement */
+        nat_set_expire(S, t, PICO_NAT_TIMEWAIT);
         break;
 
     default:
@@ -344,67 +516,80 @@ static int pico_ipv4_nat_sniff_session(struct pico_nat_tuple *t, struct pico_fra
     return 0;
 }
 
-static void pico_ipv4_nat_table_cleanup(pico_time now, void *_stack)
+/* Walk the slots of the ticks elapsed up to now: entries past their
+ * expiry go, those pushed back since they were linked move on.
+ */
+static void nat_wheel_advance(struct pico_stack *S, struct pico_nat_table *nt, pico_time now)
 {
-    struct pico_tree_node *index = NULL, *_tmp = NULL;
-    struct pico_nat_tuple *t = NULL;
-    struct pico_stack *S = (struct pico_stack *)_stack;
-    IGNORE_PARAMETER(now);
-
-    nat_dbg("NAT: before table cleanup:\n");
-    pico_ipv4_nat_print_table(S);
-
-    pico_tree_foreach_reverse_safe(index, &S->NATOutbound, _tmp)
-    {
-        t = index->keyValue;
-        switch (t->proto)
-        {
-        case PICO_PROTO_TCP:
-            if (t->portforward)
-                break;
-            else if (t->conn_active == 0 || t->conn_active > 360) /* conn active for > 24 hours */
-                pico_ipv4_nat_del(S, t->nat_port, t->proto);
-            else if (t->rst || (t->fin_in && t->fin_out))
-                t->conn_active = 0;
-            else
-                t->conn_active++;
-
-            break;
-
-        case PICO_PROTO_UDP:
-            if (t->portforward)
-                break;
-            else if (t->conn_active > 1)
-                pico_ipv4_nat_del(S, t->nat_port, t->proto);
+    pico_time now_tick = now / PICO_NAT_WHEEL_TICK;
+    struct pico_nat_tuple *t, *next;
+    uint32_t slot;
+
+    if (now_tick <= nt->wheel_tick)
+        return;
+
+    /* One rotation visits every entry */
+    if ((now_tick - nt->wheel_tick) > PICO_NAT_WHEEL_SLOTS)
+        nt->wheel_tick = now_tick - PICO_NAT_WHEEL_SLOTS;
+
+    while (nt->wheel_tick < now_tick) {
+        nt->wheel_tick++;
+        slot = (uint32_t)(nt->wheel_tick & (PICO_NAT_WHEEL_SLOTS - 1u));
+        t = nt->wheel[slot];
+        nt->wheel[slot] = NULL;
+        for (; t; t = next) {
+            next = t->wheel_next;
+            nt->wheel_count--;
+            t->wheel_prev = NULL;
+            t->wheel_next = NULL;
+            if (t->expire <= now)
+                nat_tuple_del(S, t);
             else
-                t->conn_active++;
-
-            break;
-
-        case PICO_PROTO_ICMP4:
-            if (t->conn_active > 1)
-                pico_ipv4_nat_del(S, t->nat_port, t->proto);
-            else
-                t->conn_active++;
-            break;
-
-        default:
-            /* unknown protocol in NAT table, delete when it has existed NAT_TIMEWAIT */
-            if (t->conn_active > 1)
-                pico_ipv4_nat_del(S, t->nat_port, t->proto);
-            else
-                t->conn_active++;
+                nat_wheel_link(S, nt, t);
         }
     }
+}
 
-    nat_dbg("NAT: after table cleanup:\n");
-    pico_ipv4_nat_print_table(S);
-    if (!pico_timer_add(S, PICO_NAT_TIMEWAIT, pico_ipv4_nat_table_cleanup, S)) {
-        nat_dbg("NAT: Failed to start cleanup timer\n");
-        /* TODO no more NAT table cleanup now */
+static void nat_wheel_timer(pico_time now, void *arg)
+{
+    struct pico_stack *S = (struct pico_stack *)arg;
+    struct pico_nat_table *nt = S->NAT;
+
+    if (!nt)
+        return;
+
+    nt->timer = 0;
+    nat_wheel_advance(S, nt, now);
+    if (nt->wheel_count && !nt->timer) {
+        nt->timer = pico_timer_add(S, PICO_NAT_WHEEL_TICK, nat_wheel_timer, S);
+        if (!nt->timer)
+            nat_dbg("NAT: Failed to start expiry timer\n");
     }
 }
 
+void pico_ipv4_nat_destroy(struct pico_stack *S)
+{
+    struct pico_nat_table *nt = S->NAT;
+    struct pico_nat_tuple *t, *next;
+    uint32_t i;
+
+    if (!nt)
+        return;
+
+    pico_timer_cancel(S, nt->timer);
+    for (i = 0; i < nt->size; i++) {
+        for (t = nt->out_hash[i]; t; t = next) {
+            next = t->out_next;
+            PICO_FREE(t);
+        }
+    }
+    PICO_FREE(nt->out_hash);
+    PICO_FREE(nt->in_hash);
+    PICO_FREE(nt);
+    S->NAT = NULL;
+    pico_ipv4_flow_cache_invalidate(S);
+}
+
 int pico_ipv4_port_forward(struct pico_stack *S, struct pico_ip4 nat_addr, uint16_t nat_port, struct pico_ip4 src_addr, uint16_t src_port, uint8_t proto, uint8_t flag)
 {
     struct pico_nat_tuple *t = NULL;
@@ -423,6 +608,7 @@ int pico_ipv4_port_forward(struct pico_stack *S, struct pico_ip4 nat_addr, uint1
         }
 
         t->portforward = 1;
+        pico_ipv4_flow_cache_invalidate(S);
         break;
 
     case PICO_NAT_PORT_FORWARD_DEL:
@@ -437,6 +623,65 @@ int pico_ipv4_port_forward(struct pico_stack *S, struct pico_ip4 nat_addr, uint1
     return 0;
 }
 
+/* Incremental transport checksum update for a rewritten address and port */
+static uint16_t pico_ipv4_nat_adjust_crc(uint16_t crc, uint32_t old_addr, uint32_t new_addr, uint16_t old_port, uint16_t new_port)
+{
+    crc = pico_checksum_adjust32(crc, old_addr, new_addr);
+    return pico_checksum_adjust16(crc, old_port, new_port);
+}
+
+/* A zero UDP checksum means "none": a computed zero is sent as all ones */
+static uint16_t pico_ipv4_nat_adjust_udp_crc(uint16_t crc, uint32_t old_addr, uint32_t new_addr, uint16_t old_port, uint16_t new_port)
+{
+    crc = pico_ipv4_nat_adjust_crc(crc, old_addr, new_addr, old_port, new_port);
+    return crc ? crc : 0xFFFFu;
+}
+
+/* Rewrite f for translation t: the destination on the way in, the
+ * source on the way out. Checksums are patched, not recomputed.
+ */
+static void nat_translate(struct pico_stack *S, struct pico_nat_tuple *t, struct pico_frame *f, uint8_t direction)
+{
+    struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
+    struct pico_trans *trans = pico_nat_generate_tuple_trans(net, f);
+    uint32_t old_addr;
+    uint16_t old_port;
+
+    if (direction == PICO_NAT_INBOUND) {
+        old_addr = net->dst.addr;
+        old_port = trans->dport;
+        net->dst = t->src_addr;
+        trans->dport = t->src_port;
+    } else {
+        old_addr = net->src.addr;
+        old_port = trans->sport;
+        net->src = t->nat_addr;
+        trans->sport = t->nat_port;
+    }
+
+    if (net->proto == PICO_PROTO_TCP) {
+        struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)f->transport_hdr;
+        /* patch CRC for the rewritten pseudo-header address and port */
+        if (direction == PICO_NAT_INBOUND)
+            tcp->crc = pico_ipv4_nat_adjust_crc(tcp->crc, old_addr, net->dst.addr, old_port, trans->dport);
+        else
+            tcp->crc = pico_ipv4_nat_adjust_crc(tcp->crc, old_addr, net->src.addr, old_port, trans->sport);
+    } else {
+        struct pico_udp_hdr *udp = (struct pico_udp_hdr *)f->transport_hdr;
+        /* patch CRC, unless the sender did not use one */
+        if (udp->crc && (direction == PICO_NAT_INBOUND))
+            udp->crc = pico_ipv4_nat_adjust_udp_crc(udp->crc, old_addr, net->dst.addr, old_port, trans->dport);
+        else if (udp->crc)
+            udp->crc = pico_ipv4_nat_adjust_udp_crc(udp->crc, old_addr, net->src.addr, old_port, trans->sport);
+    }
+
+    pico_ipv4_nat_sniff_session(S, t, f, direction);
+    if (direction == PICO_NAT_INBOUND)
+        net->crc = pico_checksum_adjust32(net->crc, old_addr, net->dst.addr);
+    else
+        net->crc = pico_checksum_adjust32(net->crc, old_addr, net->src.addr);
+}
+
 int pico_ipv4_nat_inbound(struct pico_stack *S, struct pico_frame *f, struct pico_ip4 *link_addr)
 {
     struct pico_nat_tuple *tuple = NULL;
@@ -449,52 +694,27 @@ int pico_ipv4_nat_inbound(struct pico_stack *S, struct pico_frame *f, struct pic
     switch (net->proto) {
 #ifdef PICO_SUPPORT_TCP
     case PICO_PROTO_TCP:
-    {
-        struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)f->transport_hdr;
-        trans = (struct pico_trans *)&tcp->trans;
-        tuple = pico_ipv4_nat_find_tuple(S, trans->dport, 0, 0, net->proto);
-        if (!tuple)
-            return -1;
-
-        /* replace dst IP and dst PORT */
-        net->dst = tuple->src_addr;
-        trans->dport = tuple->src_port;
-        /* recalculate CRC */
-        tcp->crc = 0;
-        tcp->crc = short_be(pico_tcp_checksum_ipv4(f));
-        break;
-    }
 #endif
 #ifdef PICO_SUPPORT_UDP
     case PICO_PROTO_UDP:
-    {
-        struct pico_udp_hdr *udp = (struct pico_udp_hdr *)f->transport_hdr;
-        trans = (struct pico_trans *)&udp->trans;
+#endif
+        trans = pico_nat_generate_tuple_trans(net, f);
         tuple = pico_ipv4_nat_find_tuple(S, trans->dport, 0, 0, net->proto);
         if (!tuple)
             return -1;
 
-        /* replace dst IP and dst PORT */
-        net->dst = tuple->src_addr;
-        trans->dport = tuple->src_port;
-        /* recalculate CRC */
-        udp->crc = 0;
-        udp->crc = short_be(pico_udp_checksum_ipv4(f));
         break;
-    }
-#endif
+
     case PICO_PROTO_ICMP4:
-        /* XXX reimplement */
-        break;
+        /* XXX reimplement: not translated, deliver locally */
+        return -1;
 
     default:
         nat_dbg("NAT ERROR: inbound NAT on erroneous protocol\n");
         return -1;
     }
 
-    pico_ipv4_nat_sniff_session(tuple, f, PICO_NAT_INBOUND);
-    net->crc = 0;
-    net->crc = short_be(pico_checksum(net, f->net_len));
+    nat_translate(S, tuple, f, PICO_NAT_INBOUND);
 
     nat_dbg("NAT: inbound translation {dst.addr, dport}: {%08X,%u} -> {%08X,%u}\n",
             tuple->nat_addr.addr, short_be(tuple->nat_port), tuple->src_addr.addr, short_be(tuple->src_port));
@@ -514,52 +734,30 @@ int pico_ipv4_nat_outbound(struct pico_stack *S, struct pico_frame *f, struct pi
     switch (net->proto) {
 #ifdef PICO_SUPPORT_TCP
     case PICO_PROTO_TCP:
-    {
-        struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)f->transport_hdr;
-        trans = (struct pico_trans *)&tcp->trans;
-        tuple = pico_ipv4_nat_find_tuple(S, 0, &net->src, trans->sport, net->proto);
-        if (!tuple)
-            tuple = pico_ipv4_nat_generate_tuple(S, f);
-
-        /* replace src IP and src PORT */
-        net->src = tuple->nat_addr;
-        trans->sport = tuple->nat_port;
-        /* recalculate CRC */
-        tcp->crc = 0;
-        tcp->crc = short_be(pico_tcp_checksum_ipv4(f));
-        break;
-    }
 #endif
 #ifdef PICO_SUPPORT_UDP
     case PICO_PROTO_UDP:
-    {
-        struct pico_udp_hdr *udp = (struct pico_udp_hdr *)f->transport_hdr;
-        trans = (struct pico_trans *)&udp->trans;
+#endif
+        trans = pico_nat_generate_tuple_trans(net, f);
         tuple = pico_ipv4_nat_find_tuple(S, 0, &net->src, trans->sport, net->proto);
         if (!tuple)
             tuple = pico_ipv4_nat_generate_tuple(S, f);
 
-        /* replace src IP and src PORT */
-        net->src = tuple->nat_addr;
-        trans->sport = tuple->nat_port;
-        /* recalculate CRC */
-        udp->crc = 0;
-        udp->crc = short_be(pico_udp_checksum_ipv4(f));
+        if (!tuple)
+            return -1;
+
         break;
-    }
-#endif
+
     case PICO_PROTO_ICMP4:
         /* XXX reimplement */
-        break;
+        return -1;
 
     default:
         nat_dbg("NAT ERROR: outbound NAT on erroneous protocol\n");
         return -1;
     }
 
-    pico_ipv4_nat_sniff_session(tuple, f, PICO_NAT_OUTBOUND);
-    net->crc = 0;
-    net->crc = short_be(pico_checksum(net, f->net_len));
+    nat_translate(S, tuple, f, PICO_NAT_OUTBOUND);
 
     nat_dbg("NAT: outbound translation {src.addr, sport}: {%08X,%u} -> {%08X,%u}\n",
             tuple->src_addr.addr, short_be(tuple->src_port), tuple->nat_addr.addr, short_be(tuple->nat_port));
@@ -567,6 +765,47 @@ int pico_ipv4_nat_outbound(struct pico_stack *S, struct pico_frame *f, struct pi
     return 0;
 }
 
+struct pico_nat_tuple *pico_ipv4_nat_tuple(struct pico_stack *S, struct pico_frame *f, int outbound)
+{
+    struct pico_ipv4_hdr *net = (struct pico_ipv4_hdr *)f->net_hdr;
+    struct pico_trans *trans = pico_nat_generate_tuple_trans(net, f);
+
+    if (!trans || !S->NAT)
+        return NULL;
+
+    /* Already rewritten: the source now carries the NAT port, or the
+     * destination the translated host */
+    if (outbound)
+        return nat_find_inbound(S->NAT, trans->sport, net->proto);
+
+    return nat_find_outbound(S->NAT, &net->dst, trans->dport, net->proto);
+}
+
+uint32_t pico_ipv4_nat_tuple_id(struct pico_nat_tuple *t, uint16_t *nat_port)
+{
+    *nat_port = t->nat_port;
+    return t->id;
+}
+
+struct pico_nat_tuple *pico_ipv4_nat_tuple_get(struct pico_stack *S, uint16_t nat_port, uint8_t proto, uint32_t id)
+{
+    struct pico_nat_tuple *t;
+
+    if (!S->NAT)
+        return NULL;
+
+    t = nat_find_inbound(S->NAT, nat_port, proto);
+    if (!t || (t->id != id))
+        return NULL;
+
+    return t;
+}
+
+void pico_ipv4_nat_apply(struct pico_stack *S, struct pico_nat_tuple *t, struct pico_frame *f, int outbound)
+{
+    nat_translate(S, t, f, outbound ? PICO_NAT_OUTBOUND : PICO_NAT_INBOUND);
+}
+
 int pico_ipv4_nat_enable(struct pico_ipv4_link *link)
 {
     if (link == NULL) {
@@ -574,18 +813,20 @@ int pico_ipv4_nat_enable(struct pico_ipv4_link *link)
         return -1;
     }
 
-    if (!pico_timer_add(link->dev->stack, PICO_NAT_TIMEWAIT, pico_ipv4_nat_table_cleanup, &link->dev->stack)) {
-        nat_dbg("NAT: Failed to start cleanup timer\n");
-        return -1;
-    }
+    if (nat_link)
+        pico_ipv4_flow_cache_invalidate(nat_link->dev->stack);
 
     nat_link = link;
+    pico_ipv4_flow_cache_invalidate(link->dev->stack);
 
     return 0;
 }
 
 int pico_ipv4_nat_disable(void)
 {
+    if (nat_link)
+        pico_ipv4_flow_cache_invalidate(nat_link->dev->stack);
+
     nat_link = NULL;
     return 0;
 }
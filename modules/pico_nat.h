@@ -32,8 +32,8 @@
 #define PICO_NAT_PORT_FORWARD_DEL 0
 #define PICO_NAT_PORT_FORWARD_ADD 1
 
-int nat_cmp_inbound(void *ka, void *kb);
-int nat_cmp_outbound(void *ka, void *kb);
+struct pico_nat_tuple;
+
 #ifdef PICO_SUPPORT_NAT
 void pico_ipv4_nat_print_table(struct pico_stack *S);
 int pico_ipv4_nat_find(struct pico_stack *S, uint16_t nat_port, struct pico_ip4 *src_addr, uint16_t src_port, uint8_t proto);
@@ -44,6 +44,18 @@ int pico_ipv4_nat_outbound(struct pico_stack *S, struct pico_frame *f, struct pi
 int pico_ipv4_nat_enable(struct pico_ipv4_link *link);
 int pico_ipv4_nat_disable(void);
 int pico_ipv4_nat_is_enabled(struct pico_ip4 *link_addr);
+void pico_ipv4_nat_destroy(struct pico_stack *S);
+
+/* Translation a frame went through, found from its rewritten header.
+ * Translations expire at any time: keep its id and NAT port, not the
+ * pointer, and get it back with pico_ipv4_nat_tuple_get().
+ */
+struct pico_nat_tuple *pico_ipv4_nat_tuple(struct pico_stack *S, struct pico_frame *f, int outbound);
+uint32_t pico_ipv4_nat_tuple_id(struct pico_nat_tuple *t, uint16_t *nat_port);
+/* The translation with that id, NULL if it is gone */
+struct pico_nat_tuple *pico_ipv4_nat_tuple_get(struct pico_stack *S, uint16_t nat_port, uint8_t proto, uint32_t id);
+/* Translate another frame of that flow, without looking it up again */
+void pico_ipv4_nat_apply(struct pico_stack *S, struct pico_nat_tuple *t, struct pico_frame *f, int outbound);
 #else
 
 #define pico_ipv4_nat_print_table() do {} while(0)
@@ -63,6 +75,38 @@ static inline int pico_ipv4_nat_outbound(struct pico_stack *S, struct pico_frame
     return -1;
 }
 
+static inline struct pico_nat_tuple *pico_ipv4_nat_tuple(struct pico_stack *S, struct pico_frame *f, int outbound)
+{
+    (void)S;
+    (void)f;
+    (void)outbound;
+    return NULL;
+}
+
+static inline uint32_t pico_ipv4_nat_tuple_id(struct pico_nat_tuple *t, uint16_t *nat_port)
+{
+    (void)t;
+    *nat_port = 0;
+    return 0;
+}
+
+static inline struct pico_nat_tuple *pico_ipv4_nat_tuple_get(struct pico_stack *S, uint16_t nat_port, uint8_t proto, uint32_t id)
+{
+    (void)S;
+    (void)nat_port;
+    (void)proto;
+    (void)id;
+    return NULL;
+}
+
+static inline void pico_ipv4_nat_apply(struct pico_stack *S, struct pico_nat_tuple *t, struct pico_frame *f, int outbound)
+{
+    (void)S;
+    (void)t;
+    (void)f;
+    (void)outbound;
+}
+
 static inline int pico_ipv4_nat_enable(struct pico_ipv4_link *link)
 {
     (void)link;
@@ -25,6 +25,7 @@
  *
  *********************************************************************/
 #include "pico_config.h"
+#include "pico_stack.h"
 #include "pico_socket.h"
 #include "pico_ipv4.h"
 #include "pico_ipv6.h"
@@ -58,6 +59,18 @@ int pico_getsockopt_tcp(struct pico_socket *s, int option, void *value)
         *(int *)value = PICO_SOCKET_GETOPT(s, PICO_SOCKET_OPT_TCPNODELAY);
         return 0;
     }
+    else if (option == PICO_TCP_RX_ZEROCOPY) {
+        *(int *)value = PICO_SOCKET_GETOPT(s, PICO_SOCKET_OPT_TCPRXZEROCOPY);
+        return 0;
+    }
+    else if (option == PICO_TCP_ACK_DELAY) {
+        *(int *)value = (int)pico_tcp_get_ack_delay(s);
+        return 0;
+    }
+    else if (option == PICO_TCP_CONGESTION) {
+        *(int *)value = (int)pico_tcp_get_congestion(s);
+        return 0;
+    }
     else if (option == PICO_SOCKET_OPT_RCVBUF) {
         return pico_tcp_get_bufsize_in(s, (uint32_t *)value);
     }
@@ -65,6 +78,18 @@ int pico_getsockopt_tcp(struct pico_socket *s, int option, void *value)
     else if (option == PICO_SOCKET_OPT_SNDBUF) {
         return pico_tcp_get_bufsize_out(s, (uint32_t *)value);
     }
+    else if (option == PICO_SOCKET_OPT_KEEPCNT) {
+        *(uint32_t *)value = pico_tcp_get_keepalive_probes(s);
+        return 0;
+    }
+    else if (option == PICO_SOCKET_OPT_KEEPIDLE) {
+        *(uint32_t *)value = pico_tcp_get_keepalive_time(s);
+        return 0;
+    }
+    else if (option == PICO_SOCKET_OPT_KEEPINTVL) {
+        *(uint32_t *)value = pico_tcp_get_keepalive_intvl(s);
+        return 0;
+    }
 
 #endif
     return -1;
@@ -82,6 +107,15 @@ static void tcp_set_nagle_option(struct pico_socket *s, void *value)
     }
 }
 
+/* Queue received segments by reference to their frame instead of copying */
+static void tcp_set_rx_zerocopy_option(struct pico_socket *s, void *value)
+{
+    if (*(int *)value > 0)
+        PICO_SOCKET_SETOPT_EN(s, PICO_SOCKET_OPT_TCPRXZEROCOPY);
+    else
+        PICO_SOCKET_SETOPT_DIS(s, PICO_SOCKET_OPT_TCPRXZEROCOPY);
+}
+
 int pico_setsockopt_tcp(struct pico_socket *s, int option, void *value)
 {
     if (sockopt_validate_args(s, value) < 0)
@@ -92,6 +126,26 @@ int pico_setsockopt_tcp(struct pico_socket *s, int option, void *value)
         tcp_set_nagle_option(s, value);
         return 0;
     }
+    else if (option == PICO_TCP_RX_ZEROCOPY) {
+        tcp_set_rx_zerocopy_option(s, value);
+        return 0;
+    }
+    else if (option == PICO_TCP_ACK_DELAY) {
+        if (*(int *)value < 0) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+
+        return pico_tcp_set_ack_delay(s, (uint32_t)(*(int *)value));
+    }
+    else if (option == PICO_TCP_CONGESTION) {
+        if ((*(int *)value < 0) || (*(int *)value > 0xFF)) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+
+        return pico_tcp_set_congestion(s, (uint8_t)(*(int *)value));
+    }
     else if (option == PICO_SOCKET_OPT_RCVBUF) {
         uint32_t *val = (uint32_t*)value;
         pico_tcp_set_bufsize_in(s, *val);
@@ -139,11 +193,270 @@ void pico_socket_tcp_cleanup(struct pico_socket *sock)
 }
 
 
+#ifdef PICO_SUPPORT_TCP
+/* Connection lookup table.
+ * Connected sockets are chained into a per-stack hash table keyed on the
+ * 4-tuple, so that demultiplexing an incoming segment for an established
+ * connection does not require walking the whole sockport tree. Listening
+ * sockets (remote_port == 0) are never hashed: they are still found by the
+ * tree walk in pico_socket_tcp_deliver().
+ */
+static inline uint32_t tcp_hash_mix(uint32_t h, uint32_t v)
+{
+    h ^= v;
+    return h * 0x9E3779B1u; /* Knuth multiplicative step */
+}
+
+static uint32_t tcp_hash_tuple(uint16_t net, const union pico_address *local, uint16_t lport,
+                               const union pico_address *remote, uint16_t rport)
+{
+    uint32_t h = ((uint32_t)lport << 16) | rport;
+#ifdef PICO_SUPPORT_IPV6
+    if (net == PICO_PROTO_IPV6) {
+        uint32_t w;
+        int i;
+        for (i = 0; i < PICO_SIZE_IP6; i += 4) {
+            memcpy(&w, local->ip6.addr + i, sizeof(w));
+            h = tcp_hash_mix(h, w);
+            memcpy(&w, remote->ip6.addr + i, sizeof(w));
+            h = tcp_hash_mix(h, w);
+        }
+        return h ^ (h >> 16);
+    }
+#endif
+    (void)net;
+    h = tcp_hash_mix(h, local->ip4.addr);
+    h = tcp_hash_mix(h, remote->ip4.addr);
+    return h ^ (h >> 16);
+}
+
+static uint32_t tcp_hash_socket(struct pico_socket *s)
+{
+    return tcp_hash_tuple(s->net->proto_number, &s->local_addr, s->local_port,
+                          &s->remote_addr, s->remote_port);
+}
+
+static int tcp_hash_resize(struct pico_stack *S, uint32_t size)
+{
+    struct pico_socket **table;
+    struct pico_socket *s, *next;
+    uint32_t i, b;
+
+    table = PICO_ZALLOC(size * sizeof(struct pico_socket *));
+    if (!table)
+        return -1;
+
+    for (i = 0; i < S->TCPConnHashSize; i++) {
+        s = S->TCPConnHash[i];
+        while (s) {
+            next = s->hash_next;
+            b = tcp_hash_socket(s) & (size - 1);
+            s->hash_next = table[b];
+            table[b] = s;
+            s = next;
+        }
+    }
+    if (S->TCPConnHash)
+        PICO_FREE(S->TCPConnHash);
+
+    S->TCPConnHash = table;
+    S->TCPConnHashSize = size;
+    return 0;
+}
+
+int pico_socket_tcp_hash_add(struct pico_socket *s)
+{
+    struct pico_stack *S = s->stack;
+    struct pico_socket *cur;
+    uint32_t b;
+
+    if (s->remote_port == 0)
+        return 0;
+
+    if (!S->TCPConnHash || (S->TCPConnHashCount >= (S->TCPConnHashSize * PICO_TCP_CONN_HASH_LOAD))) {
+        uint32_t size = S->TCPConnHashSize ? (S->TCPConnHashSize << 1) : PICO_TCP_CONN_HASH_INIT;
+        /* On allocation failure keep the current table: an unhashed socket
+         * is still reachable through the sockport tree. */
+        if ((tcp_hash_resize(S, size) < 0) && !S->TCPConnHash)
+            return -1;
+    }
+
+    b = tcp_hash_socket(s) & (S->TCPConnHashSize - 1);
+    for (cur = S->TCPConnHash[b]; cur; cur = cur->hash_next) {
+        if (cur == s)
+            return 0;
+    }
+    s->hash_next = S->TCPConnHash[b];
+    S->TCPConnHash[b] = s;
+    S->TCPConnHashCount++;
+    return 0;
+}
+
+void pico_socket_tcp_hash_del(struct pico_socket *s)
+{
+    struct pico_stack *S = s->stack;
+    struct pico_socket **pp;
+
+    if (!S->TCPConnHash || (s->remote_port == 0))
+        return;
+
+    pp = &S->TCPConnHash[tcp_hash_socket(s) & (S->TCPConnHashSize - 1)];
+    while (*pp) {
+        if (*pp == s) {
+            *pp = s->hash_next;
+            s->hash_next = NULL;
+            S->TCPConnHashCount--;
+            return;
+        }
+
+        pp = &(*pp)->hash_next;
+    }
+}
+
+void pico_socket_tcp_hash_destroy(struct pico_stack *S)
+{
+    if (S->TCPConnHash)
+        PICO_FREE(S->TCPConnHash);
+
+    S->TCPConnHash = NULL;
+    S->TCPConnHashSize = 0;
+    S->TCPConnHashCount = 0;
+}
+
+static struct pico_socket *socket_tcp_hash_find(struct pico_sockport *sp, struct pico_frame *f)
+{
+    struct pico_stack *S = sp->stack;
+    struct pico_trans *tr = (struct pico_trans *) f->transport_hdr;
+    union pico_address local, remote;
+    struct pico_socket *s;
+    uint16_t net;
+
+    if (!S->TCPConnHash)
+        return NULL;
+
+    memset(&local, 0, sizeof(local));
+    memset(&remote, 0, sizeof(remote));
+    if (0) {}
+#ifdef PICO_SUPPORT_IPV4
+    else if (IS_IPV4(f)) {
+        struct pico_ipv4_hdr *ip4hdr = (struct pico_ipv4_hdr*)(f->net_hdr);
+        net = PICO_PROTO_IPV4;
+        local.ip4.addr = ip4hdr->dst.addr;
+        remote.ip4.addr = ip4hdr->src.addr;
+    }
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    else if (IS_IPV6(f)) {
+        struct pico_ipv6_hdr *ip6hdr = (struct pico_ipv6_hdr *)(f->net_hdr);
+        net = PICO_PROTO_IPV6;
+        local.ip6 = ip6hdr->dst;
+        remote.ip6 = ip6hdr->src;
+    }
+#endif
+    else {
+        return NULL;
+    }
+
+    s = S->TCPConnHash[tcp_hash_tuple(net, &local, sp->number, &remote, tr->sport) & (S->TCPConnHashSize - 1)];
+    for (; s; s = s->hash_next) {
+        if ((s->local_port != sp->number) || (s->remote_port != tr->sport) || (s->net->proto_number != net))
+            continue;
+
+        if (!pico_address_compare(&s->local_addr, &local, net) && !pico_address_compare(&s->remote_addr, &remote, net))
+            return s;
+    }
+    return NULL;
+}
+
+/* Accept queue.
+ * Children that complete the handshake are appended to their listener's
+ * FIFO (backlog -> next -> ... -> backlog_tail), so pico_socket_accept()
+ * does not have to search the sockport tree.
+ */
+void pico_socket_tcp_accept_queue_add(struct pico_socket *s)
+{
+    struct pico_socket *l = s->parent;
+    if (!l || s->next || (l->backlog_tail == s))
+        return; /* No listener, or already queued */
+
+    if (l->backlog_tail)
+        l->backlog_tail->next = s;
+    else
+        l->backlog = s;
+
+    l->backlog_tail = s;
+}
+
+struct pico_socket *pico_socket_tcp_accept_queue_pop(struct pico_socket *l)
+{
+    struct pico_socket *s = l->backlog;
+    if (!s)
+        return NULL;
+
+    l->backlog = s->next;
+    if (!l->backlog)
+        l->backlog_tail = NULL;
+
+    s->next = NULL;
+    return s;
+}
+
+static void pico_socket_tcp_accept_queue_del(struct pico_socket *s)
+{
+    struct pico_socket *l = s->parent, *prev = NULL, *cur;
+    for (cur = l->backlog; cur; prev = cur, cur = cur->next) {
+        if (cur != s)
+            continue;
+
+        if (prev)
+            prev->next = s->next;
+        else
+            l->backlog = s->next;
+
+        if (l->backlog_tail == s)
+            l->backlog_tail = prev;
+
+        s->next = NULL;
+        return;
+    }
+}
+
+/* A listener going away: its pending children no longer have a parent */
+static void pico_socket_tcp_orphan_children(struct pico_socket *l)
+{
+    struct pico_sockport *sp = pico_get_sockport(l->stack, PICO_PROTO_TCP, l->local_port);
+    struct pico_tree_node *index;
+    struct pico_socket *s;
+
+    pico_tcp_synq_drop(l);
+    if (sp) {
+        pico_tree_foreach(index, &sp->socks) {
+            s = index->keyValue;
+            if (s->parent == l) {
+                s->parent = NULL;
+                s->next = NULL;
+            }
+        }
+    }
+
+    l->backlog = NULL;
+    l->backlog_tail = NULL;
+    l->number_of_pending_conn = 0;
+}
+#endif
+
 void pico_socket_tcp_delete(struct pico_socket *s)
 {
 #ifdef PICO_SUPPORT_TCP
-    if(s->parent)
+    pico_socket_tcp_hash_del(s);
+    if(s->parent) {
+        pico_socket_tcp_accept_queue_del(s);
         s->parent->number_of_pending_conn--;
+        s->parent = NULL;
+    }
+
+    if (s->number_of_pending_conn || s->backlog)
+        pico_socket_tcp_orphan_children(s);
 
 #endif
 }
@@ -213,6 +526,7 @@ static int socket_tcp_do_deliver(struct pico_socket *s, struct pico_frame *f)
                 s->ev_pending = 0;
         }
 
+        pico_socket_schedule(s);
         return 0;
     }
 
@@ -228,6 +542,11 @@ int pico_socket_tcp_deliver(struct pico_sockport *sp, struct pico_frame *f)
     struct pico_tree_node *_tmp;
     struct pico_socket *s = NULL;
 
+    /* Fast path: established connection */
+    target = socket_tcp_hash_find(sp, f);
+    if (target)
+        return socket_tcp_do_deliver(target, f);
+
     pico_tree_foreach_safe(index, &sp->socks, _tmp){
         s = index->keyValue;
         /* 4-tuple identification of socket (port-IP) */
@@ -242,12 +561,19 @@ int pico_socket_tcp_deliver(struct pico_sockport *sp, struct pico_frame *f)
         if (found)
         {
             target = found;
-            if ( found->remote_port != 0)
-                /* only break if it's connected */
+            if ( found->remote_port != 0) {
+                /* only break if it's connected. Not hashed yet (e.g. bound
+                 * before connecting): make the next lookup a direct hit. */
+                pico_socket_tcp_hash_add(found);
                 break;
+            }
         }
     } /* FOREACH */
 
+    /* No connection: the tuple may be in TIME_WAIT */
+    if ((!target || (target->remote_port == 0)) && (pico_tcp_timewait_input(sp->stack, f) == 0))
+        return 0;
+
     return socket_tcp_do_deliver(target, f);
 }
 
@@ -288,6 +614,29 @@ int pico_socket_tcp_read(struct pico_socket *s, void *buf, uint32_t len)
 #endif
 }
 
+int pico_socket_tcp_read_zc(struct pico_socket *s, void **data)
+{
+#ifdef PICO_SUPPORT_TCP
+    if ((s->state & PICO_SOCKET_STATE_SHUT_REMOTE) && pico_tcp_queue_in_is_empty(s)) {
+        pico_err = PICO_ERR_ESHUTDOWN;
+        return -1;
+    }
+
+    return (int)pico_tcp_read_zc(s, data);
+#else
+    return 0;
+#endif
+}
+
+int pico_socket_tcp_read_zc_done(struct pico_socket *s, uint32_t len)
+{
+#ifdef PICO_SUPPORT_TCP
+    return (int)pico_tcp_read_zc_done(s, len);
+#else
+    return 0;
+#endif
+}
+
 void transport_flags_update(struct pico_frame *f, struct pico_socket *s)
 {
 #ifdef PICO_SUPPORT_TCP
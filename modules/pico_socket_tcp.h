@@ -30,6 +30,16 @@
 
 #ifdef PICO_SUPPORT_TCP
 
+/* Initial number of buckets of the connection lookup table (power of two) */
+#ifndef PICO_TCP_CONN_HASH_INIT
+# define PICO_TCP_CONN_HASH_INIT 16u
+#endif
+
+/* Average chain length that triggers doubling the connection lookup table */
+#ifndef PICO_TCP_CONN_HASH_LOAD
+# define PICO_TCP_CONN_HASH_LOAD 2u
+#endif
+
 /* Functions/macros: conditional! */
 
 # define IS_NAGLE_ENABLED(s) (!(!(!(s->opt_flags & (1 << PICO_SOCKET_OPT_TCPNODELAY)))))
@@ -37,9 +47,16 @@ int pico_setsockopt_tcp(struct pico_socket *s, int option, void *value);
 int pico_getsockopt_tcp(struct pico_socket *s, int option, void *value);
 int pico_socket_tcp_deliver(struct pico_sockport *sp, struct pico_frame *f);
 void pico_socket_tcp_delete(struct pico_socket *s);
+void pico_socket_tcp_accept_queue_add(struct pico_socket *s);
+struct pico_socket *pico_socket_tcp_accept_queue_pop(struct pico_socket *l);
+int pico_socket_tcp_hash_add(struct pico_socket *s);
+void pico_socket_tcp_hash_del(struct pico_socket *s);
+void pico_socket_tcp_hash_destroy(struct pico_stack *S);
 void pico_socket_tcp_cleanup(struct pico_socket *sock);
 struct pico_socket *pico_socket_tcp_open(struct pico_stack *S, uint16_t family);
 int pico_socket_tcp_read(struct pico_socket *s, void *buf, uint32_t len);
+int pico_socket_tcp_read_zc(struct pico_socket *s, void **data);
+int pico_socket_tcp_read_zc_done(struct pico_socket *s, uint32_t len);
 void transport_flags_update(struct pico_frame *, struct pico_socket *);
 
 #else
@@ -48,9 +65,16 @@ void transport_flags_update(struct pico_frame *, struct pico_socket *);
 #   define pico_socket_tcp_deliver(...) (-1)
 #   define IS_NAGLE_ENABLED(s) (0)
 #   define pico_socket_tcp_delete(...) do {} while(0)
+#   define pico_socket_tcp_accept_queue_add(...) do {} while(0)
+#   define pico_socket_tcp_accept_queue_pop(...) (NULL)
+#   define pico_socket_tcp_hash_add(...) (0)
+#   define pico_socket_tcp_hash_del(...) do {} while(0)
+#   define pico_socket_tcp_hash_destroy(...) do {} while(0)
 #   define pico_socket_tcp_cleanup(...) do {} while(0)
 #   define pico_socket_tcp_open(f) (NULL)
 #   define pico_socket_tcp_read(...) (-1)
+#   define pico_socket_tcp_read_zc(...) (-1)
+#   define pico_socket_tcp_read_zc_done(...) (-1)
 #   define transport_flags_update(...) do {} while(0)
 
 #endif
@@ -25,6 +25,9 @@
  *
  *********************************************************************/
 #include "pico_tcp.h"
+#include "pico_tcp_cc.h"
+#include "pico_tcp_sack.h"
+#include "pico_gso.h"
 #include "pico_config.h"
 #include "pico_eth.h"
 #include "pico_socket.h"
@@ -44,9 +47,9 @@
 
 #define PICO_TCP_RTO_MIN (70)
 #define PICO_TCP_RTO_MAX (120000)
-#define PICO_TCP_IW          2
 #define PICO_TCP_SYN_TO  2000u
 #define PICO_TCP_ZOMBIE_TO 30000
+#define PICO_TCP_DELACK_TO   40
 
 #define PICO_TCP_MAX_RETRANS         10
 #define PICO_TCP_MAX_CONNECT_RETRIES 3
@@ -67,6 +70,7 @@
 #define IS_TCP_HOLDQ_EMPTY(t)   (t->tcpq_hold.size == 0)
 
 #define IS_INPUT_QUEUE(q)  (q->pool.compare == input_segment_compare)
+#define IS_RX_ZEROCOPY(t)  PICO_SOCKET_GETOPT((&(t)->sock), PICO_SOCKET_OPT_TCPRXZEROCOPY)
 #define TCP_INPUT_OVERHEAD (sizeof(struct tcp_input_segment) + sizeof(struct pico_tree_node))
 
 
@@ -102,6 +106,8 @@ struct tcp_input_segment
     /* Pointer to payload */
     unsigned char *payload;
     uint16_t payload_len;
+    /* In zero-copy mode, reference to the frame that owns the payload */
+    struct pico_frame *frame;
 };
 
 /* Function to compare input segments */
@@ -111,7 +117,7 @@ static int input_segment_compare(void *ka, void *kb)
     return pico_seq_compare(a->seq, b->seq);
 }
 
-static struct tcp_input_segment *segment_from_frame(struct pico_frame *f)
+static struct tcp_input_segment *segment_from_frame(struct pico_frame *f, int zerocopy)
 {
     struct tcp_input_segment *seg;
 
@@ -122,6 +128,24 @@ static struct tcp_input_segment *segment_from_frame(struct pico_frame *f)
     if (!seg)
         return NULL;
 
+    seg->seq = SEQN(f);
+    seg->payload_len = f->payload_len;
+
+    /* Keep a reference to the frame instead of copying the payload.
+     * Segments using less than a quarter of their buffer are still copied,
+     * so that small segments do not pin full-sized buffers in the queue.
+     */
+    if (zerocopy && ((uint32_t)f->payload_len >= (f->buffer_len >> 2))) {
+        seg->frame = pico_frame_copy(f);
+        if (!seg->frame) {
+            PICO_FREE(seg);
+            return NULL;
+        }
+
+        seg->payload = f->payload;
+        return seg;
+    }
+
     seg->payload = PICO_ZALLOC(f->payload_len);
     if(!seg->payload)
     {
@@ -129,12 +153,20 @@ static struct tcp_input_segment *segment_from_frame(struct pico_frame *f)
         return NULL;
     }
 
-    seg->seq = SEQN(f);
-    seg->payload_len = f->payload_len;
     memcpy(seg->payload, f->payload, seg->payload_len);
     return seg;
 }
 
+static void segment_free(struct tcp_input_segment *seg)
+{
+    if (seg->frame)
+        pico_frame_discard(seg->frame);
+    else
+        PICO_FREE(seg->payload);
+
+    PICO_FREE(seg);
+}
+
 static int segment_compare(void *ka, void *kb)
 {
     struct pico_frame *a = ka, *b = kb;
@@ -266,9 +298,7 @@ static void pico_discard_segment(struct pico_tcp_queue *tq, void *f)
 
     if(f1 && IS_INPUT_QUEUE(tq))
     {
-        struct tcp_input_segment *inp = f1;
-        PICO_FREE(inp->payload);
-        PICO_FREE(inp);
+        segment_free(f1);
     }
     else
         pico_frame_discard(f);
@@ -276,13 +306,10 @@ static void pico_discard_segment(struct pico_tcp_queue *tq, void *f)
     PICOTCP_MUTEX_UNLOCK(Mutex);
 }
 
-/* Structure for TCP socket */
-struct tcp_sack_block {
-    uint32_t left;
-    uint32_t right;
-    struct tcp_sack_block *next;
-};
+/* SACK blocks that fit next to the timestamp option */
+#define PICO_TCP_SACK_RCV_BLOCKS 3
 
+/* Structure for TCP socket */
 struct pico_socket_tcp {
     struct pico_socket sock;
 
@@ -305,9 +332,10 @@ struct pico_socket_tcp {
     uint32_t in_flight;
     uint32_t retrans_tmr;
     pico_time retrans_tmr_due;
-    uint16_t cwnd_counter;
-    uint16_t cwnd;
-    uint16_t ssthresh;
+    struct pico_tcp_cc cc;
+    uint32_t pacing_credit;
+    pico_time pacing_stamp;
+    uint16_t cwnd_counter; /* duplicate ACKs since the last deflation */
     uint16_t recv_wnd;
     uint16_t recv_wnd_scale;
 
@@ -326,7 +354,9 @@ struct pico_socket_tcp {
     uint8_t ts_ok;
     uint8_t mss_ok;
     uint8_t scale_ok;
-    struct tcp_sack_block *sacks;
+    struct pico_tcp_sack_blk sacks[PICO_TCP_SACK_RCV_BLOCKS]; /* to report, network order */
+    uint8_t sacks_n;
+    struct pico_tcp_scoreboard scoreboard;
     uint32_t linger_timeout;
 
     /* Transmission */
@@ -345,6 +375,21 @@ struct pico_socket_tcp {
 
     /* FIN timer */
     uint32_t fin_tmr;
+
+    /* Delayed ACK (RFC 1122, 4.2.3.2) */
+    uint32_t delack_tmr;
+    uint16_t delack_to;
+    uint16_t rcv_mss; /* largest segment received so far */
+
+    /* Receive buffer autotuning */
+    uint32_t rcvbuf_grant;     /* bytes above the initial size, charged to the stack */
+    uint32_t rcv_space_copied; /* read by the application since rcv_space_stamp */
+    pico_time rcv_space_stamp;
+    uint32_t rcv_rtt;          /* receiver side RTT estimate (ms), 0 if unknown */
+    uint32_t rcv_rtt_seq;
+    pico_time rcv_rtt_stamp;
+    uint32_t rcv_wnd_edge;     /* highest right edge offered so far */
+    uint8_t rcvbuf_locked;     /* size set by the user, no autotuning */
 };
 
 /* If Nagle enabled, this function can make 1 new segment from smaller segments in hold queue */
@@ -394,9 +439,10 @@ static int release_until(struct pico_tcp_queue *q, uint32_t seq)
 
         if (seq_result <= 0)
         {
-            head = next_segment(q, cur);
-            /* tcp_dbg("Releasing %08x, len: %d\n", SEQN((struct pico_frame *)head), ((struct pico_frame *)head)->payload_len); */
+            /* Re-read the head: after a retransmission with different
+             * boundaries the next segment need not start where cur ends. */
             pico_discard_segment(q, cur);
+            head = first_segment(q);
             ret++;
         } else {
             break;
@@ -580,25 +626,49 @@ static uint32_t pico_paws(void)
 static inline void tcp_add_sack_option(struct pico_socket_tcp *ts, struct pico_frame *f, uint16_t flags, uint32_t *ii)
 {
     if (flags & PICO_TCP_ACK) {
-        struct tcp_sack_block *sb;
         uint32_t len_off;
+        uint8_t n;
 
-        if (ts->sack_ok && ts->sacks) {
+        if (ts->sack_ok && ts->sacks_n) {
             f->start[(*ii)++] = PICO_TCP_OPTION_SACK;
             len_off = *ii;
             f->start[(*ii)++] = PICO_TCPOPTLEN_SACK;
-            while(ts->sacks) {
-                sb = ts->sacks;
-                ts->sacks = sb->next;
-                memcpy(f->start + *ii, sb, 2 * sizeof(uint32_t));
+            for (n = 0; n < ts->sacks_n; n++) {
+                memcpy(f->start + *ii, &ts->sacks[n], 2 * sizeof(uint32_t));
                 *ii += (2 * (uint32_t)sizeof(uint32_t));
                 f->start[len_off] = (uint8_t)(f->start[len_off] + (2 * sizeof(uint32_t)));
-                PICO_FREE(sb);
             }
+            ts->sacks_n = 0;
         }
     }
 }
 
+/* Largest window a receive queue may offer */
+static uint32_t tcp_space_ceiling(uint32_t max_size, int locked)
+{
+    if (max_size == 0)
+        return ONE_GIGABYTE;
+
+    /* Peers only learn the scale from the SYN: size it for the
+     * largest window autotuning may offer, so it never changes.
+     */
+    if (!locked && (max_size < PICO_TCP_RCVBUF_MAX))
+        return PICO_TCP_RCVBUF_MAX;
+
+    return max_size;
+}
+
+/* Window scale needed to offer ceiling */
+static uint8_t tcp_wnd_shift(uint32_t ceiling)
+{
+    uint8_t shift = 0;
+
+    while ((ceiling >> shift) > 0xFFFF)
+        shift++;
+
+    return shift;
+}
+
 static void tcp_add_options(struct pico_socket_tcp *ts, struct pico_frame *f, uint16_t flags, uint16_t optsiz)
 {
     uint32_t tsval = long_be((uint32_t)TCP_TIME);
@@ -617,9 +687,18 @@ static void tcp_add_options(struct pico_socket_tcp *ts, struct pico_frame *f, ui
         f->start[i++] = PICO_TCPOPTLEN_SACK_OK;
     }
 
-    f->start[i++] = PICO_TCP_OPTION_WS;
-    f->start[i++] = PICO_TCPOPTLEN_WS;
-    f->start[i++] = (uint8_t)(ts->wnd_scale);
+    if ((flags & PICO_TCP_SYNACK) == PICO_TCP_SYN) {
+        /* Not negotiated yet: offer the scale we would use */
+        f->start[i++] = PICO_TCP_OPTION_WS;
+        f->start[i++] = PICO_TCPOPTLEN_WS;
+        f->start[i++] = tcp_wnd_shift(tcp_space_ceiling(ts->tcpq_in.max_size, ts->rcvbuf_locked));
+    } else if (ts->scale_ok) {
+        f->start[i++] = PICO_TCP_OPTION_WS;
+        f->start[i++] = PICO_TCPOPTLEN_WS;
+        f->start[i++] = (uint8_t)(ts->wnd_scale);
+    } else {
+        i += PICO_TCPOPTLEN_WS; /* no scaling: left as noops */
+    }
 
     if ((flags & PICO_TCP_SYN) || ts->ts_ok) {
         f->start[i++] = PICO_TCP_OPTION_TIMESTAMP;
@@ -661,10 +740,13 @@ static void tcp_add_options_frame(struct pico_socket_tcp *ts, struct pico_frame
 
     memset(f->start, PICO_TCP_OPTION_NOOP, optsiz); /* fill blanks with noop */
 
-
-    f->start[i++] = PICO_TCP_OPTION_WS;
-    f->start[i++] = PICO_TCPOPTLEN_WS;
-    f->start[i++] = (uint8_t)(ts->wnd_scale);
+    if (ts->scale_ok) {
+        f->start[i++] = PICO_TCP_OPTION_WS;
+        f->start[i++] = PICO_TCPOPTLEN_WS;
+        f->start[i++] = (uint8_t)(ts->wnd_scale);
+    } else {
+        i += PICO_TCPOPTLEN_WS;
+    }
 
     if (f->transport_flags_saved) {
         f->start[i++] = PICO_TCP_OPTION_TIMESTAMP;
@@ -701,29 +783,150 @@ static inline void tcp_set_space_check_winupdate(struct pico_socket_tcp *t, int3
 static void tcp_set_space(struct pico_socket_tcp *t)
 {
     int32_t space;
-    uint32_t shift = 0;
+    uint32_t shift;
+    uint32_t ceiling, edge;
 
-    if (t->tcpq_in.max_size == 0) {
+    if (t->tcpq_in.max_size == 0)
         space = ONE_GIGABYTE;
-    } else {
+    else
         space = (int32_t)(t->tcpq_in.max_size - t->tcpq_in.size);
-    }
+
+    ceiling = tcp_space_ceiling(t->tcpq_in.max_size, t->rcvbuf_locked);
 
     if (space < 0)
         space = 0;
 
-    while(space > 0xFFFF) {
-        space = (int32_t)(((uint32_t)space >> 1u));
-        shift++;
+    /* Without the peer's window scale option, 64 KiB is all we can offer */
+    if (!t->scale_ok) {
+        if (ceiling > 0xFFFFu)
+            ceiling = 0xFFFFu;
+
+        if (space > 0xFFFF)
+            space = 0xFFFF;
     }
+
+    shift = tcp_wnd_shift(ceiling);
+    space = (int32_t)((uint32_t)space >> shift);
+    edge = t->rcv_nxt + ((uint32_t)space << shift);
+    if ((pico_seq_compare(edge, t->rcv_wnd_edge) > 0) || ((uint32_t)(t->rcv_wnd_edge - t->rcv_nxt) > ceiling))
+        t->rcv_wnd_edge = edge;
+
     tcp_set_space_check_winupdate(t, space, shift);
 }
 
+/* Receive buffer autotuning (dynamic right-sizing, as in Linux).
+ * Once per receiver RTT, the buffer is grown to hold twice what the
+ * application read during the last RTT, so that the advertised window
+ * never limits a sender the application keeps up with. Growth is
+ * charged to a per-stack budget; above it, buffers shrink back on the
+ * next read.
+ */
+static void tcp_rcvbuf_charge(struct pico_socket_tcp *t, uint32_t bytes)
+{
+    t->tcpq_in.max_size += bytes;
+    t->rcvbuf_grant += bytes;
+    t->sock.stack->TCPRcvBufUsed += bytes;
+}
+
+static void tcp_rcvbuf_release(struct pico_socket_tcp *t, uint32_t bytes)
+{
+    if (bytes > t->rcvbuf_grant)
+        bytes = t->rcvbuf_grant;
+
+    t->tcpq_in.max_size -= bytes;
+    t->rcvbuf_grant -= bytes;
+    t->sock.stack->TCPRcvBufUsed -= bytes;
+}
+
+/* Receiver side RTT: the echoed timestamp of in-order data if available,
+ * otherwise the time it takes to receive one advertised window.
+ */
+static void tcp_rcv_rtt_measure(struct pico_socket_tcp *t, struct pico_frame *f)
+{
+    uint32_t now = (uint32_t)TCP_TIME;
+    uint32_t sample;
+
+    if (t->ts_ok && f->timestamp) {
+        sample = now - (uint32_t)f->timestamp;
+        if (sample == 0)
+            sample = 1;
+
+        if (sample < PICO_TCP_RTO_MAX)
+            t->rcv_rtt = t->rcv_rtt ? ((7u * t->rcv_rtt + sample) >> 3) : sample;
+
+        return;
+    }
+
+    if (t->rcv_rtt_stamp && (pico_seq_compare(t->rcv_nxt, t->rcv_rtt_seq) < 0))
+        return;
+
+    if (t->rcv_rtt_stamp) {
+        sample = (uint32_t)(TCP_TIME - t->rcv_rtt_stamp);
+        if (sample == 0)
+            sample = 1;
+
+        /* An upper bound of the RTT: keep the smallest */
+        if (!t->rcv_rtt || (sample < t->rcv_rtt))
+            t->rcv_rtt = sample;
+    }
+
+    t->rcv_rtt_seq = t->rcv_nxt + ((uint32_t)t->wnd << t->wnd_scale);
+    t->rcv_rtt_stamp = TCP_TIME;
+}
+
+static void tcp_rcvbuf_adjust(struct pico_socket_tcp *t, uint32_t copied)
+{
+    struct pico_stack *S = t->sock.stack;
+    uint32_t offered = 0, keep, want, mss;
+
+    if (t->rcvbuf_locked || (t->tcpq_in.max_size == 0))
+        return;
+
+    if (S->TCPRcvBufUsed > S->TCPRcvBufLimit) {
+        /* Never move the right edge of the offered window back */
+        if (pico_seq_compare(t->rcv_wnd_edge, t->rcv_nxt) > 0)
+            offered = t->rcv_wnd_edge - t->rcv_nxt;
+
+        keep = t->tcpq_in.size + offered;
+        if (t->tcpq_in.max_size > keep)
+            tcp_rcvbuf_release(t, t->tcpq_in.max_size - keep);
+
+        return;
+    }
+
+    t->rcv_space_copied += copied;
+    if (!t->rcv_rtt || ((TCP_TIME - t->rcv_space_stamp) < t->rcv_rtt))
+        return;
+
+    /* Two RTTs of reads, plus room for the sender to keep growing */
+    mss = t->rcv_mss ? t->rcv_mss : t->mss;
+    want = (t->rcv_space_copied << 1) + (16u * mss);
+    t->rcv_space_copied = 0;
+    t->rcv_space_stamp = TCP_TIME;
+    if (want > PICO_TCP_RCVBUF_MAX)
+        want = PICO_TCP_RCVBUF_MAX;
+
+    if (!t->scale_ok && (want > 0xFFFFu))
+        want = 0xFFFFu;
+
+    if (want <= t->tcpq_in.max_size)
+        return;
+
+    want -= t->tcpq_in.max_size;
+    if (want > (S->TCPRcvBufLimit - S->TCPRcvBufUsed))
+        want = S->TCPRcvBufLimit - S->TCPRcvBufUsed;
+
+    if (want == 0)
+        return;
+
+    tcp_rcvbuf_charge(t, want);
+    tcp_dbg("TCP> receive buffer grown to %u (rtt %u)\n", t->tcpq_in.max_size, t->rcv_rtt);
+}
+
 /* Return 32-bit aligned option size */
 static uint16_t tcp_options_size(struct pico_socket_tcp *t, uint16_t flags)
 {
     uint16_t size = 0;
-    struct tcp_sack_block *sb = t->sacks;
 
     if (flags & PICO_TCP_SYN) { /* Full options */
         size = PICO_TCPOPTLEN_MSS + PICO_TCP_OPTION_SACK_OK + PICO_TCPOPTLEN_WS + PICO_TCPOPTLEN_TIMESTAMP;
@@ -738,13 +941,8 @@ static uint16_t tcp_options_size(struct pico_socket_tcp *t, uint16_t flags)
         size = (uint16_t)(size + PICO_TCPOPTLEN_END);
     }
 
-    if ((flags & PICO_TCP_ACK) && (t->sack_ok && sb)) {
-        size = (uint16_t)(size + 2);
-        while(sb) {
-            size = (uint16_t)(size + (2 * sizeof(uint32_t)));
-            sb = sb->next;
-        }
-    }
+    if ((flags & PICO_TCP_ACK) && (t->sack_ok && t->sacks_n))
+        size = (uint16_t)(size + 2 + (t->sacks_n * 2 * sizeof(uint32_t)));
 
     size = (uint16_t)(((size + 3u) >> 2u) << 2u);
     return size;
@@ -759,46 +957,14 @@ uint16_t pico_tcp_overhead(struct pico_socket *s)
 
 }
 
-static inline int tcp_sack_marker(struct pico_frame *f, uint32_t start, uint32_t end, uint16_t *count)
-{
-    int cmp;
-    cmp = pico_seq_compare(SEQN(f), start);
-    if (cmp > 0)
-        return 0;
-
-    if (cmp == 0) {
-        cmp = pico_seq_compare(SEQN(f) + f->payload_len, end);
-        if (cmp > 0) {
-            tcp_dbg("Invalid SACK: ignoring.\n");
-        }
-
-        tcp_dbg("Marking (by SACK) segment %08x BLK:[%08x::%08x]\n", SEQN(f), start, end);
-        f->flags |= PICO_FRAME_FLAG_SACKED;
-        (*count)++;
-    }
-
-    return cmp;
-}
-
 static void tcp_process_sack(struct pico_socket_tcp *t, uint32_t start, uint32_t end)
 {
-    struct pico_frame *f;
-    struct pico_tree_node *index, *temp;
-    uint16_t count = 0;
-
-    pico_tree_foreach_safe(index, &t->tcpq_out.pool, temp){
-        f = index->keyValue;
-        if (tcp_sack_marker(f, start, end, &count) == 0)
-            goto done;
-    }
+    struct pico_frame *una = first_segment(&t->tcpq_out);
+    if (!una)
+        return;
 
-done:
-    if (t->x_mode > PICO_TCP_LOOKAHEAD) {
-        if (t->in_flight > (count))
-            t->in_flight -= (count);
-        else
-            t->in_flight = 0;
-    }
+    if (pico_tcp_sack_add(&t->scoreboard, SEQN(una), t->snd_last + 1, start, end) == 0)
+        tcp_dbg("Ignoring SACK BLK:[%08x::%08x]\n", start, end);
 }
 
 inline static void tcp_add_header(struct pico_socket_tcp *t, struct pico_frame *f)
@@ -843,11 +1009,20 @@ static int tcpopt_len_check(uint32_t *idx, uint8_t len, uint8_t expected)
     return 0;
 }
 
-static inline void tcp_parse_option_ws(struct pico_socket_tcp *t, uint8_t len, uint8_t *opt, uint32_t *idx)
+static inline void tcp_parse_option_ws(struct pico_socket_tcp *t, struct pico_frame *f, uint8_t len, uint8_t *opt, uint32_t *idx)
 {
     if (tcpopt_len_check(idx, len, PICO_TCPOPTLEN_WS) < 0)
         return;
 
+    /* Scaling is on only if the peer's SYN asked for it */
+    if (((struct pico_tcp_hdr *)(f->transport_hdr))->flags & PICO_TCP_SYN)
+        t->scale_ok = 1;
+
+    if (!t->scale_ok) {
+        (*idx)++;
+        return;
+    }
+
     t->recv_wnd_scale = opt[(*idx)++];
     tcp_dbg_options("TCP Window scale: received %d\n", t->recv_wnd_scale);
 
@@ -913,7 +1088,7 @@ static void tcp_parse_options(struct pico_frame *f)
         case PICO_TCP_OPTION_END:
             break;
         case PICO_TCP_OPTION_WS:
-            tcp_parse_option_ws(t, len, opt, &i);
+            tcp_parse_option_ws(t, f, len, opt, &i);
             break;
         case PICO_TCP_OPTION_SACK_OK:
             tcp_parse_option_sack_ok(t, f, len, &i);
@@ -987,7 +1162,7 @@ static inline int tcp_send_try_enqueue(struct pico_socket_tcp *ts, struct pico_f
 
 }
 
-static int tcp_send(struct pico_socket_tcp *ts, struct pico_frame *f)
+static void tcp_send_prepare(struct pico_socket_tcp *ts, struct pico_frame *f)
 {
     struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *) f->transport_hdr;
     hdr->trans.sport = ts->sock.local_port;
@@ -999,6 +1174,13 @@ static int tcp_send(struct pico_socket_tcp *ts, struct pico_frame *f)
 
     f->start = f->transport_hdr + PICO_SIZE_TCPHDR;
     hdr->rwnd = short_be(ts->wnd);
+}
+
+static int tcp_send(struct pico_socket_tcp *ts, struct pico_frame *f)
+{
+    struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *) f->transport_hdr;
+
+    tcp_send_prepare(ts, f);
     hdr->crc = 0;
     hdr->crc = short_be(pico_tcp_checksum(f));
 
@@ -1006,6 +1188,128 @@ static int tcp_send(struct pico_socket_tcp *ts, struct pico_frame *f)
 
 }
 
+#ifdef PICO_SUPPORT_GSO
+/* Consecutive segments leaving in one transmission opportunity. They
+ * stay in tcpq_out one by one for retransmission, but go down the stack
+ * as a single super-frame, segmented again by the device layer.
+ */
+struct tcp_gso_batch {
+    struct pico_frame *first;
+    uint32_t count;
+    uint32_t len;
+    uint32_t max;    /* payload limit, 0 if segments must go one by one */
+    uint8_t probed;  /* max is valid */
+};
+
+/* A destination on this host would take the super-frame as it is */
+static uint32_t tcp_gso_limit(struct pico_socket_tcp *t)
+{
+    struct pico_socket *s = &t->sock;
+    struct pico_device *dev = get_sock_dev(s);
+    uint32_t max;
+
+    if (!dev || (dev->gso_max_size < (2u * t->mss)))
+        return 0;
+
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_SOCK_IPV4(s) && pico_ipv4_link_get(s->stack, &s->remote_addr.ip4))
+        return 0;
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_SOCK_IPV6(s) && pico_ipv6_link_get(s->stack, &s->remote_addr.ip6))
+        return 0;
+#endif
+
+    max = (dev->gso_max_size < PICO_GSO_MAX_SIZE) ? dev->gso_max_size : PICO_GSO_MAX_SIZE;
+    return max - pico_tcp_overhead(s);
+}
+
+/* Copy the batch into one frame carrying the first segment's header */
+static struct pico_frame *tcp_gso_frame(struct pico_socket_tcp *t, struct tcp_gso_batch *b)
+{
+    struct pico_frame *sf, *f = b->first;
+    uint16_t off = pico_tcp_overhead(&t->sock);
+    uint32_t i, pos = 0;
+
+    sf = pico_socket_frame_alloc(&t->sock, get_sock_dev(&t->sock), (uint16_t)(off + b->len));
+    if (!sf)
+        return NULL;
+
+    sf->payload += off;
+    sf->payload_len = (uint16_t)(sf->payload_len - off);
+    sf->sock = &t->sock;
+    memcpy(sf->transport_hdr, f->transport_hdr, off);
+    for (i = 0; (i < b->count) && f; i++) {
+        memcpy(sf->payload + pos, f->payload, f->payload_len);
+        pos += f->payload_len;
+        f = next_segment(&t->tcpq_out, f);
+    }
+
+    tcp_send_prepare(t, sf);
+    /* Checksums are computed per segment by pico_gso_xmit() */
+    ((struct pico_tcp_hdr *)sf->transport_hdr)->crc = 0;
+    sf->gso_size = b->first->payload_len;
+    return sf;
+}
+
+static void tcp_gso_flush(struct pico_socket_tcp *t, struct tcp_gso_batch *b)
+{
+    struct pico_frame *f;
+
+    if (b->count == 0)
+        return;
+
+    if (b->count == 1) {
+        f = pico_frame_copy(b->first);
+        if (f) {
+            struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *) f->transport_hdr;
+            tcp_send_prepare(t, f);
+            hdr->crc = 0;
+            hdr->crc = short_be(pico_tcp_checksum(f));
+        }
+    } else {
+        f = tcp_gso_frame(t, b);
+    }
+
+    /* Already accounted as sent: a failure here is a loss, repaired by
+     * retransmission like any other.
+     */
+    if (!f)
+        pico_err = PICO_ERR_ENOMEM;
+    else if (pico_enqueue(&t->sock.stack->q_tcp.out, f) <= 0)
+        pico_frame_discard(f);
+
+    b->first = NULL;
+    b->count = 0;
+    b->len = 0;
+}
+
+static void tcp_gso_add(struct pico_socket_tcp *t, struct tcp_gso_batch *b, struct pico_frame *f)
+{
+    if (b->count > 0) {
+        if (!b->probed) {
+            b->max = tcp_gso_limit(t);
+            b->probed = 1;
+        }
+
+        /* Only the last segment of a super-frame may be short */
+        if ((b->len != (b->count * b->first->payload_len)) ||
+            (f->payload_len > b->first->payload_len) ||
+            (SEQN(f) != (SEQN(b->first) + b->len)) ||
+            ((b->len + f->payload_len) > b->max))
+            tcp_gso_flush(t, b);
+    }
+
+    if (b->count == 0)
+        b->first = f;
+
+    b->count++;
+    b->len += f->payload_len;
+    t->in_flight++;
+    t->snd_nxt += f->payload_len;
+}
+#endif
+
 /* #define PICO_TCP_SUPPORT_SOCKET_STATS */
 
 #ifdef PICO_TCP_SUPPORT_SOCKET_STATS
@@ -1013,7 +1317,7 @@ static void sock_stats(uint32_t when, void *arg)
 {
     struct pico_socket_tcp *t = (struct pico_socket_tcp *)arg;
     tcp_dbg("STATISTIC> [%lu] socket state: %02x --> local port:%d remote port: %d queue size: %d snd_una: %08x snd_nxt: %08x cwnd: %d\n",
-            when, t->sock.state, short_be(t->sock.local_port), short_be(t->sock.remote_port), t->tcpq_out.size, SEQN((struct pico_frame *)first_segment(&t->tcpq_out)), t->snd_nxt, t->cwnd);
+            when, t->sock.state, short_be(t->sock.local_port), short_be(t->sock.remote_port), t->tcpq_out.size, SEQN((struct pico_frame *)first_segment(&t->tcpq_out)), t->snd_nxt, t->cc.cwnd);
     if (!pico_timer_add(t->sock.stack, 2000, sock_stats, t)) {
         tcp_dbg("TCP: Failed to start socket statistics timer\n");
     }
@@ -1097,6 +1401,8 @@ struct pico_socket *pico_tcp_open(struct pico_stack *S, uint16_t family)
 
     /* Set default linger for the socket */
     t->linger_timeout = PICO_SOCKET_LINGER_TIMEOUT;
+    t->delack_to = PICO_TCP_DELACK_TO;
+    pico_tcp_cc_reset(&t->cc, t->mss, TCP_TIME);
 
 
 #ifdef PICO_TCP_SUPPORT_SOCKET_STATS
@@ -1120,7 +1426,20 @@ struct pico_socket *pico_tcp_open(struct pico_stack *S, uint16_t family)
 static uint32_t tcp_read_finish(struct pico_socket *s, uint32_t tot_rd_len)
 {
     struct pico_socket_tcp *t = TCP_SOCK(s);
+    uint32_t offered = 0;
+
+    if (pico_seq_compare(t->rcv_wnd_edge, t->rcv_nxt) > 0)
+        offered = t->rcv_wnd_edge - t->rcv_nxt;
+
+    tcp_rcvbuf_adjust(t, tot_rd_len);
     tcp_set_space(t);
+    /* Reading made the window at least twice as large as the one the
+     * sender knows about: tell it now rather than with the next ACK.
+     */
+    if ((((uint32_t)t->wnd << t->wnd_scale) >= ((offered << 1) + t->mss)) &&
+        ((s->state & PICO_SOCKET_STATE_TCP) == PICO_SOCKET_STATE_TCP_ESTABLISHED))
+        tcp_send_windowUpdate(t);
+
     if (t->tcpq_in.size == 0) {
         s->ev_pending &= (uint16_t)(~PICO_SOCK_EV_RD);
     }
@@ -1134,6 +1453,8 @@ static uint32_t tcp_read_finish(struct pico_socket *s, uint32_t tot_rd_len)
         if (s->wakeup) {
             s->wakeup(PICO_SOCK_EV_CLOSE, s);
         }
+
+        pico_socket_schedule(s);
     }
 
     return tot_rd_len;
@@ -1161,13 +1482,17 @@ static inline uint32_t tcp_read_in_frame_len(struct tcp_input_segment *f, int32_
 
 }
 
-static inline void tcp_read_check_segment_done(struct pico_socket_tcp *t, struct tcp_input_segment *f, uint32_t in_frame_len)
+/* Drop the segment as soon as its last byte is read, also when it was
+ * consumed in several reads: in zero-copy mode it pins a frame buffer.
+ */
+static inline void tcp_read_check_segment_done(struct pico_socket_tcp *t, struct tcp_input_segment *f, int32_t in_frame_off, uint32_t in_frame_len)
 {
-    if ((in_frame_len == 0u) || (in_frame_len == (uint32_t)f->payload_len)) {
+    if ((in_frame_len == 0u) || (((uint32_t)in_frame_off + in_frame_len) >= (uint32_t)f->payload_len)) {
         pico_discard_segment(&t->tcpq_in, f);
     }
 }
 
+/* Consume up to len in-order bytes, copying them to buf unless it is NULL */
 uint32_t pico_tcp_read(struct pico_socket *s, void *buf, uint32_t len)
 {
     struct pico_socket_tcp *t = TCP_SOCK(s);
@@ -1193,16 +1518,48 @@ uint32_t pico_tcp_read(struct pico_socket *s, void *buf, uint32_t len)
         in_frame_len = tcp_read_in_frame_len(f, in_frame_off, tot_rd_len, len);
 
 
-        memcpy((uint8_t *)buf + tot_rd_len, f->payload + in_frame_off, in_frame_len);
+        if (buf)
+            memcpy((uint8_t *)buf + tot_rd_len, f->payload + in_frame_off, in_frame_len);
+
         tot_rd_len += in_frame_len;
         t->rcv_processed += in_frame_len;
 
-        tcp_read_check_segment_done(t, f, in_frame_len);
+        tcp_read_check_segment_done(t, f, in_frame_off, in_frame_len);
 
     }
     return tcp_read_finish(s, tot_rd_len);
 }
 
+/* Zero-copy read: point *data to the next contiguous run of in-order
+ * received bytes and return its length. Nothing is consumed: the data
+ * stays valid until pico_tcp_read_zc_done() or the next read.
+ */
+uint32_t pico_tcp_read_zc(struct pico_socket *s, void **data)
+{
+    struct pico_socket_tcp *t = TCP_SOCK(s);
+    struct tcp_input_segment *f;
+    int32_t in_frame_off;
+
+    *data = NULL;
+    release_until(&t->tcpq_in, t->rcv_processed);
+    f = first_segment(&t->tcpq_in);
+    if (!f)
+        return 0;
+
+    in_frame_off = pico_seq_compare(t->rcv_processed, f->seq);
+    if ((in_frame_off < 0) || ((uint32_t)in_frame_off >= f->payload_len))
+        return 0;
+
+    *data = f->payload + in_frame_off;
+    return f->payload_len - (uint32_t)in_frame_off;
+}
+
+/* Release len bytes handed out by pico_tcp_read_zc() */
+uint32_t pico_tcp_read_zc_done(struct pico_socket *s, uint32_t len)
+{
+    return pico_tcp_read(s, NULL, len);
+}
+
 int pico_tcp_initconn(struct pico_socket *s);
 static void initconn_retry(pico_time when, void *arg)
 {
@@ -1247,10 +1604,9 @@ int pico_tcp_initconn(struct pico_socket *s)
         ts->snd_nxt = long_be(pico_paws());
 
     ts->snd_last = ts->snd_nxt;
-    ts->cwnd = PICO_TCP_IW;
     mtu = (uint16_t)pico_socket_get_mss(s);
     ts->mss = (uint16_t)(mtu - PICO_SIZE_TCPHDR);
-    ts->ssthresh = (uint16_t)((uint16_t)(PICO_DEFAULT_SOCKETQ / ts->mss) -  (((uint16_t)(PICO_DEFAULT_SOCKETQ / ts->mss)) >> 3u));
+    pico_tcp_cc_reset(&ts->cc, ts->mss, TCP_TIME);
     syn->sock = s;
     hdr->seq = long_be(ts->snd_nxt);
     hdr->len = (uint8_t)((PICO_SIZE_TCPHDR + opt_len) << 2);
@@ -1616,66 +1972,50 @@ static void tcp_send_fin(struct pico_socket_tcp *t)
     tcp_linger(t);
 }
 
-static void tcp_sack_prepare(struct pico_socket_tcp *t)
+/* Rebuild the SACK blocks for the next ACK from the out of order
+ * queue. The block holding seq, the segment just received, goes
+ * first (RFC 2018, section 4); the others follow in sequence order.
+ */
+static void tcp_sack_prepare(struct pico_socket_tcp *t, uint32_t seq)
 {
     struct tcp_input_segment *pkt;
     uint32_t left = 0, right = 0;
-    struct tcp_sack_block *sb;
-    int n = 0;
-    if (t->sacks) /* previous sacks are pending */
-        return;
+    uint8_t n = 1;
+    int have_first = 0;
 
+    t->sacks_n = 0;
     pkt = first_segment(&t->tcpq_in);
-    while(n < 3) {
-        if (!pkt) {
-            if(left) {
-                sb = PICO_ZALLOC(sizeof(struct tcp_sack_block));
-                if (!sb)
-                    break;
-
-                sb->left = long_be(left);
-                sb->right = long_be(right);
-                n++;
-                sb->next = t->sacks;
-                t->sacks = sb;
-                left = 0;
-                right = 0;
-            }
-
-            break;
-        }
-
-        if (pkt->seq < t->rcv_nxt) {
+    while (pkt && (n < PICO_TCP_SACK_RCV_BLOCKS || !have_first)) {
+        if (pico_seq_compare(pkt->seq, t->rcv_nxt) < 0) {
             pkt = next_segment(&t->tcpq_in, pkt);
             continue;
         }
 
-        if (!left) {
-            left = pkt->seq;
-            right = pkt->seq + pkt->payload_len;
-            pkt = next_segment(&t->tcpq_in, pkt);
-            continue;
-        }
-
-        if(pkt->seq == right) {
+        left = pkt->seq;
+        right = pkt->seq + pkt->payload_len;
+        pkt = next_segment(&t->tcpq_in, pkt);
+        while (pkt && (pkt->seq == right)) {
             right += pkt->payload_len;
             pkt = next_segment(&t->tcpq_in, pkt);
-            continue;
-        } else {
-            sb = PICO_ZALLOC(sizeof(struct tcp_sack_block));
-            if (!sb)
-                break;
+        }
 
-            sb->left = long_be(left);
-            sb->right = long_be(right);
+        if (!have_first && (pico_seq_compare(seq, left) >= 0) && (pico_seq_compare(seq, right) < 0)) {
+            t->sacks[0].left = long_be(left);
+            t->sacks[0].right = long_be(right);
+            have_first = 1;
+        } else if (n < PICO_TCP_SACK_RCV_BLOCKS) {
+            t->sacks[n].left = long_be(left);
+            t->sacks[n].right = long_be(right);
             n++;
-            sb->next = t->sacks;
-            t->sacks = sb;
-            left = 0;
-            right = 0;
-            pkt = next_segment(&t->tcpq_in, pkt);
         }
     }
+
+    if (have_first) {
+        t->sacks_n = n;
+    } else if (n > 1) {
+        memmove(&t->sacks[0], &t->sacks[1], (size_t)(n - 1) * sizeof(struct pico_tcp_sack_blk));
+        t->sacks_n = (uint8_t)(n - 1);
+    }
 }
 
 void pico_tcp_out_all(struct pico_stack *S, void *arg);
@@ -1684,7 +2024,7 @@ static inline int tcp_data_in_expected(struct pico_socket_tcp *t, struct pico_fr
     struct tcp_input_segment *nxt;
     if (pico_seq_compare(SEQN(f), t->rcv_nxt) == 0) { /* Exactly what we expected */
         /* Create new segment and enqueue it */
-        struct tcp_input_segment *input = segment_from_frame(f);
+        struct tcp_input_segment *input = segment_from_frame(f, IS_RX_ZEROCOPY(t));
         if (!input) {
             pico_err = PICO_ERR_ENOMEM;
             return -1;
@@ -1693,8 +2033,7 @@ static inline int tcp_data_in_expected(struct pico_socket_tcp *t, struct pico_fr
         if(pico_enqueue_segment(&t->tcpq_in, input) <= 0)
         {
             /* failed to enqueue, destroy segment */
-            PICO_FREE(input->payload);
-            PICO_FREE(input);
+            segment_free(input);
             return -1;
         } else {
             t->rcv_nxt = SEQN(f) + f->payload_len;
@@ -1718,7 +2057,7 @@ static inline int tcp_data_in_high_segment(struct pico_socket_tcp *t, struct pic
 {
     tcp_dbg("TCP> hi segment. Possible packet loss. I'll dupack this. (exp: %x got: %x)\n", t->rcv_nxt, SEQN(f));
     if (t->sack_ok) {
-        struct tcp_input_segment *input = segment_from_frame(f);
+        struct tcp_input_segment *input = segment_from_frame(f, IS_RX_ZEROCOPY(t));
         if (!input) {
             pico_err = PICO_ERR_ENOMEM;
             return -1;
@@ -1726,26 +2065,88 @@ static inline int tcp_data_in_high_segment(struct pico_socket_tcp *t, struct pic
 
         if(pico_enqueue_segment(&t->tcpq_in, input) <= 0) {
             /* failed to enqueue, destroy segment */
-            PICO_FREE(input->payload);
-            PICO_FREE(input);
+            segment_free(input);
             return -1;
         }
 
-        tcp_sack_prepare(t);
+        tcp_sack_prepare(t, SEQN(f));
     }
 
     return 0;
 }
 
-static inline void tcp_data_in_send_ack(struct pico_socket_tcp *t, struct pico_frame *f)
+static void tcp_delack_timeout(pico_time now, void *arg)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)arg;
+    IGNORE_PARAMETER(now);
+    t->delack_tmr = 0;
+    /* Any segment sent in the meantime carried the ACK already */
+    if (pico_seq_compare(t->rcv_ackd, t->rcv_nxt) != 0)
+        tcp_send_ack(t);
+}
+
+/* The ACK for an in-order segment can wait, unless two full segments
+ * are unacknowledged, the segment is a short PSH closing a burst, it
+ * filled a hole in the sequence space, or the receive buffer is close
+ * to full. Out-of-order and duplicate segments are acked right away.
+ * "Full" is the largest segment received so far.
+ */
+static int tcp_ack_can_wait(struct pico_socket_tcp *t, struct pico_frame *f, uint32_t rcv_nxt_before)
+{
+    struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *) f->transport_hdr;
+    struct tcp_input_segment *last;
+    uint16_t rcv_mss = t->rcv_mss;
+    uint16_t seg = f->payload_len;
+
+#ifdef PICO_SUPPORT_GRO
+    /* Segments merged on receive count as what was on the wire */
+    if (f->gso_size)
+        seg = f->gso_size;
+#endif
+    if (seg > t->rcv_mss)
+        t->rcv_mss = seg;
+
+    /* Nothing to compare the size with yet: ack the first segment */
+    if ((t->delack_to == 0) || (rcv_mss == 0))
+        return 0;
+
+    if ((pico_seq_compare(SEQN(f), rcv_nxt_before) != 0) || (pico_seq_compare(t->rcv_nxt, rcv_nxt_before) <= 0))
+        return 0;
+
+    if ((uint32_t)(t->rcv_nxt - t->rcv_ackd) >= (2u * t->rcv_mss))
+        return 0;
+
+    if ((hdr->flags & PICO_TCP_PSH) && (f->payload_len < t->rcv_mss))
+        return 0;
+
+    last = pico_tree_last(&t->tcpq_in.pool);
+    if (last && (pico_seq_compare(last->seq + last->payload_len, t->rcv_nxt) > 0))
+        return 0;
+
+    if ((t->tcpq_in.max_size - t->tcpq_in.size) < (2u * t->rcv_mss))
+        return 0;
+
+    return 1;
+}
+
+static inline void tcp_data_in_send_ack(struct pico_socket_tcp *t, struct pico_frame *f, uint32_t rcv_nxt_before)
 {
     struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *) f->transport_hdr;
     /* In either case, ack til recv_nxt, unless received data raises a RST flag. */
     if (((t->sock.state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_CLOSE_WAIT) &&
         ((t->sock.state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_SYN_SENT) &&
         ((t->sock.state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_SYN_RECV) &&
-        ((hdr->flags & PICO_TCP_RST) == 0))
+        ((hdr->flags & PICO_TCP_RST) == 0)) {
+        if (tcp_ack_can_wait(t, f, rcv_nxt_before)) {
+            if (!t->delack_tmr)
+                t->delack_tmr = pico_timer_add(t->sock.stack, t->delack_to, tcp_delack_timeout, t);
+
+            if (t->delack_tmr)
+                return;
+        }
+
         tcp_send_ack(t);
+    }
 }
 
 static int tcp_data_in(struct pico_socket *s, struct pico_frame *f)
@@ -1753,6 +2154,7 @@ static int tcp_data_in(struct pico_socket *s, struct pico_frame *f)
     struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
     struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *) f->transport_hdr;
     uint16_t payload_len = (uint16_t)(f->transport_len - ((hdr->len & 0xf0u) >> 2u));
+    uint32_t rcv_nxt_before = t->rcv_nxt;
     int ret = 0;
     (void)hdr;
 
@@ -1764,11 +2166,13 @@ static int tcp_data_in(struct pico_socket *s, struct pico_frame *f)
 
         if (pico_seq_compare(SEQN(f), t->rcv_nxt) <= 0) {
             ret = tcp_data_in_expected(t, f);
+            if (pico_seq_compare(t->rcv_nxt, rcv_nxt_before) > 0)
+                tcp_rcv_rtt_measure(t, f);
         } else {
             ret = tcp_data_in_high_segment(t, f);
         }
 
-        tcp_data_in_send_ack(t, f);
+        tcp_data_in_send_ack(t, f, rcv_nxt_before);
         return ret;
     } else {
         tcp_dbg("TCP: invalid data in pkt len, exp: %d, got %d\n", (hdr->len & 0xf0) >> 2, f->transport_len);
@@ -1837,23 +2241,29 @@ static void tcp_rtt(struct pico_socket_tcp *t, uint32_t rtt)
     tcp_dbg(" -----=============== RTT CUR: %u AVG: %u RTTVAR: %u RTO: %u ======================----\n", rtt, t->avg_rtt, t->rttvar, t->rto);
 }
 
-static void tcp_congestion_control(struct pico_socket_tcp *t)
+/* Congestion window in segments, to be compared with in_flight */
+static uint32_t tcp_cwnd_segments(struct pico_socket_tcp *t)
+{
+    uint32_t segs = t->cc.cwnd / t->mss;
+    return segs ? segs : 1u;
+}
+
+static void tcp_cc_sync(struct pico_socket_tcp *t)
+{
+    t->cc.mss = t->mss;
+    t->cc.flight = t->in_flight * t->mss;
+}
+
+static void tcp_congestion_control(struct pico_socket_tcp *t, uint32_t acked, uint32_t rtt)
 {
-    if (t->x_mode > PICO_TCP_LOOKAHEAD)
+    if ((t->x_mode > PICO_TCP_LOOKAHEAD) || (acked == 0))
         return;
 
     tcp_dbg("Doing congestion control\n");
-    if (t->cwnd < t->ssthresh) {
-        t->cwnd++;
-    } else {
-        t->cwnd_counter++;
-        if (t->cwnd_counter >= t->cwnd) {
-            t->cwnd++;
-            t->cwnd_counter = 0;
-        }
-    }
+    tcp_cc_sync(t);
+    t->cc.ops->on_ack(&t->cc, acked, rtt, TCP_TIME);
 
-    tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cwnd, t->ssthresh, t->in_flight);
+    tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cc.cwnd, t->cc.ssthresh, t->in_flight);
 }
 
 static void add_retransmission_timer(struct pico_socket_tcp *t, pico_time next_ts);
@@ -1864,7 +2274,8 @@ static void add_retransmission_timer(struct pico_socket_tcp *t, pico_time next_t
 static void tcp_first_timeout(struct pico_socket_tcp *t)
 {
     t->x_mode = PICO_TCP_BLACKOUT;
-    t->cwnd = PICO_TCP_IW;
+    tcp_cc_sync(t);
+    t->cc.ops->on_rto(&t->cc, TCP_TIME);
     t->in_flight = 0;
 }
 
@@ -1881,7 +2292,7 @@ static int tcp_rto_xmit(struct pico_socket_tcp *t, struct pico_frame *f)
     if (pico_enqueue(&t->sock.stack->q_tcp.out, cpy) > 0) {
         t->snd_last_out = SEQN(cpy);
         add_retransmission_timer(t, (t->rto << (++t->backoff)) + TCP_TIME);
-        tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cwnd, t->ssthresh, t->in_flight);
+        tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cc.cwnd, t->cc.ssthresh, t->in_flight);
         tcp_dbg("Sending RTO!\n");
         return 1;
     } else {
@@ -2000,7 +2411,10 @@ static void add_retransmission_timer(struct pico_socket_tcp *t, pico_time next_t
 
         pico_tree_foreach(index, &t->tcpq_out.pool){
             f = index->keyValue;
-            if ((next_ts == 0) || ((f->timestamp < next_ts) && (f->timestamp > 0))) {
+            if (f->timestamp == 0) /* not sent yet */
+                continue;
+
+            if ((next_ts == 0) || (f->timestamp < next_ts)) {
                 next_ts = f->timestamp;
                 val = next_ts + (t->rto << t->backoff);
             }
@@ -2104,19 +2518,99 @@ static void tcp_ack_dbg(struct pico_socket *s, struct pico_frame *f)
 }
 #endif
 
-static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
+static void tcp_enter_recovery(struct pico_socket_tcp *t)
 {
-    struct pico_frame *f_new;              /* use with Nagle to push to out queue */
-    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
-    struct pico_tcp_hdr *hdr;
-    uint32_t rtt = 0;
-    uint16_t acked = 0;
-    pico_time acked_timestamp = 0;
-    struct pico_frame *una = NULL;
+    struct pico_frame *una = first_segment(&t->tcpq_out);
 
-    if (!f || !s) {
-        pico_err = PICO_ERR_EINVAL;
-        return -1;
+    t->x_mode = PICO_TCP_RECOVER;
+    t->snd_retry = SEQN(una);
+    tcp_cc_sync(t);
+    t->cc.ops->on_loss(&t->cc, TCP_TIME);
+    if (t->sack_ok) {
+        /* The scoreboard tells what is still in flight: no need to
+         * inflate the window while duplicate ACKs arrive.
+         */
+        t->scoreboard.recovery_point = t->snd_nxt;
+        if (t->cc.cwnd > t->cc.ssthresh)
+            t->cc.cwnd = t->cc.ssthresh;
+
+        /* The segment at snd_una goes out right away (step 4.3) */
+        tcp_retrans(t, una);
+        t->scoreboard.high_rxt = SEQN(una) + una->payload_len;
+    }
+}
+
+/* RFC 6675 NextSeg(), rule 1: the first hole below the highest SACKed
+ * sequence that is not retransmitted yet and is presumed lost.
+ */
+static struct pico_frame *tcp_sack_next_seg(struct pico_socket_tcp *t, uint32_t una)
+{
+    struct pico_tcp_scoreboard *sb = &t->scoreboard;
+    uint32_t high = pico_tcp_sack_high(sb, una);
+    uint32_t seq = (pico_seq_compare(sb->high_rxt, una) > 0) ? sb->high_rxt : una;
+    struct pico_frame *f;
+
+    seq = pico_tcp_sack_skip(sb, seq);
+    if ((pico_seq_compare(seq, high) >= 0) || !pico_tcp_sack_is_lost(sb, seq, t->mss))
+        return NULL;
+
+    f = peek_segment(&t->tcpq_out, seq);
+    if (f && (pico_seq_compare(SEQN(f), t->snd_nxt) >= 0))
+        return NULL;
+
+    return f;
+}
+
+/* SACK based loss recovery: retransmit lost holes first, then new
+ * data, as long as the estimated pipe leaves room in cwnd.
+ */
+static void tcp_sack_recover(struct pico_socket_tcp *t, int partial_ack)
+{
+    struct pico_frame *una, *f;
+    uint32_t pipe;
+
+    /* A partial ACK with nothing SACKed above the new snd_una still
+     * points at a loss: resend that segment (RFC 6582, 3.2).
+     */
+    una = first_segment(&t->tcpq_out);
+    if (partial_ack && una && (pico_seq_compare(t->scoreboard.high_rxt, SEQN(una)) <= 0)) {
+        tcp_retrans(t, una);
+        t->scoreboard.high_rxt = SEQN(una) + una->payload_len;
+    }
+
+    while ((una = first_segment(&t->tcpq_out)) != NULL) {
+        pipe = pico_tcp_sack_pipe(&t->scoreboard, SEQN(una), t->snd_nxt, t->mss);
+        t->in_flight = (pipe + t->mss - 1u) / t->mss;
+        if ((pipe + t->mss) > t->cc.cwnd)
+            break;
+
+        f = tcp_sack_next_seg(t, SEQN(una));
+        if (f) {
+            tcp_retrans(t, f);
+            t->scoreboard.high_rxt = SEQN(f) + f->payload_len;
+            continue;
+        }
+
+        if (!peek_segment(&t->tcpq_out, t->snd_nxt) || (pico_tcp_output(&t->sock, 1) > 0))
+            break;
+    }
+}
+
+static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
+{
+    struct pico_frame *f_new;              /* use with Nagle to push to out queue */
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+    struct pico_tcp_hdr *hdr;
+    uint32_t rtt = 0;
+    uint16_t acked = 0;
+    uint32_t acked_bytes = 0;
+    pico_time acked_timestamp = 0;
+    struct pico_frame *una = NULL;
+    int partial_ack = 0;
+
+    if (!f || !s) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
     }
 
     hdr = (struct pico_tcp_hdr *) f->transport_hdr;
@@ -2131,10 +2625,29 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
     tcp_parse_options(f);
     t->recv_wnd = short_be(hdr->rwnd);
 
+    una = first_segment(&t->tcpq_out);
+    if (una && (pico_seq_compare(ACKN(f), SEQN(una)) > 0))
+        acked_bytes = ACKN(f) - SEQN(una);
+
     acked = (uint16_t)tcp_ack_advance_una(t, f, &acked_timestamp);
     una = first_segment(&t->tcpq_out);
     t->ack_timestamp = TCP_TIME;
 
+    /* A late ACK for data sent before snd_nxt was pulled back (RTO or
+     * window full) must not leave snd_nxt behind snd_una. In SYN_SENT
+     * the caller accounts for the SYN itself.
+     */
+    if (una) {
+        if (pico_seq_compare(SEQN(una), t->snd_nxt) > 0)
+            t->snd_nxt = SEQN(una);
+    } else if (!TCP_IS_STATE(s, PICO_SOCKET_STATE_TCP_SYN_SENT) &&
+               (pico_seq_compare(ACKN(f), t->snd_nxt) > 0) && (pico_seq_compare(ACKN(f), t->snd_last + 1) <= 0)) {
+        t->snd_nxt = ACKN(f);
+    }
+
+    if (t->sack_ok)
+        pico_tcp_sack_advance(&t->scoreboard, una ? SEQN(una) : ACKN(f));
+
     if ((t->x_mode == PICO_TCP_BLACKOUT) ||
         ((t->x_mode == PICO_TCP_WINDOW_FULL) && ((t->recv_wnd << t->recv_wnd_scale) > t->mss))) {
         int prev_mode = t->x_mode;
@@ -2157,8 +2670,14 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
         t->in_flight--;
 
     if (!una || acked > 0) {
-        t->x_mode = PICO_TCP_LOOKAHEAD;
-        tcp_dbg("Mode: Look-ahead. In flight: %d/%d buf: %d\n", t->in_flight, t->cwnd, t->tcpq_out.frames);
+        /* With SACK, a partial ACK does not end the recovery */
+        if ((t->x_mode != PICO_TCP_RECOVER) || !t->sack_ok || !una ||
+            (pico_seq_compare(ACKN(f), t->scoreboard.recovery_point) >= 0))
+            t->x_mode = PICO_TCP_LOOKAHEAD;
+        else
+            partial_ack = 1;
+
+        tcp_dbg("Mode: Look-ahead. In flight: %d/%d buf: %d\n", t->in_flight, t->cc.cwnd, t->tcpq_out.frames);
         t->backoff = 0;
 
         /* Do rtt/rttvar/rto calculations */
@@ -2174,7 +2693,7 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
                 tcp_rtt(t, rtt);
         }
 
-        tcp_dbg("TCP ACK> FRESH ACK %08x (acked %d) Queue size: %u/%u frames: %u cwnd: %u in_flight: %u snd_una: %u\n", ACKN(f), acked, t->tcpq_out.size, t->tcpq_out.max_size, t->tcpq_out.frames, t->cwnd, t->in_flight, SEQN(una));
+        tcp_dbg("TCP ACK> FRESH ACK %08x (acked %d) Queue size: %u/%u frames: %u cwnd: %u in_flight: %u snd_una: %u\n", ACKN(f), acked, t->tcpq_out.size, t->tcpq_out.max_size, t->tcpq_out.frames, t->cc.cwnd, t->in_flight, SEQN(una));
         if (acked > t->in_flight) {
             tcp_dbg("WARNING: in flight < 0\n");
             t->in_flight = 0;
@@ -2191,32 +2710,15 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
             t->x_mode++;
             tcp_dbg("Mode: DUPACK %d, due to PURE ACK %0x, len = %d\n", t->x_mode, SEQN(f), f->payload_len);
             /* tcp_dbg("ACK: %x - QUEUE: %x\n", ACKN(f), SEQN(first_segment(&t->tcpq_out))); */
-            if (t->x_mode == PICO_TCP_RECOVER) {              /* Switching mode */
-                if (t->in_flight > PICO_TCP_IW)
-                    t->cwnd = (uint16_t)t->in_flight;
-                else
-                    t->cwnd = PICO_TCP_IW;
-
-                t->snd_retry = SEQN((struct pico_frame *)first_segment(&t->tcpq_out));
-                if (t->ssthresh > t->cwnd)
-                    t->ssthresh >>= 2;
-                else
-                    t->ssthresh = (t->cwnd >> 1);
-
-                if (t->ssthresh < 2)
-                    t->ssthresh = 2;
-            }
-        } else if (t->x_mode == PICO_TCP_RECOVER) {
+            if (t->x_mode == PICO_TCP_RECOVER)              /* Switching mode */
+                tcp_enter_recovery(t);
+        } else if ((t->x_mode == PICO_TCP_RECOVER) && !t->sack_ok) {
             /* tcp_dbg("TCP RECOVER> DUPACK! snd_una: %08x, snd_nxt: %08x, acked now: %08x\n", SEQN(first_segment(&t->tcpq_out)), t->snd_nxt, ACKN(f)); */
-            if (t->in_flight <= t->cwnd) {
+            if (t->in_flight <= tcp_cwnd_segments(t)) {
                 struct pico_frame *nxt = peek_segment(&t->tcpq_out, t->snd_retry);
                 if (!nxt)
                     nxt = first_segment(&t->tcpq_out);
 
-                while (nxt && (nxt->flags & PICO_FRAME_FLAG_SACKED) && (nxt != first_segment(&t->tcpq_out))) {
-                    tcp_dbg("Skipping %08x because it is sacked.\n", SEQN(nxt));
-                    nxt = next_segment(&t->tcpq_out, nxt);
-                }
                 if (nxt && (pico_seq_compare(SEQN(nxt), t->snd_nxt)) > 0)
                     nxt = NULL;
 
@@ -2233,9 +2735,10 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
             }
 
             if (++t->cwnd_counter > 1) {
-                t->cwnd--;
-                if (t->cwnd < 2)
-                    t->cwnd = 2;
+                if (t->cc.cwnd > ((PICO_TCP_CC_LW + 1u) * t->mss))
+                    t->cc.cwnd -= t->mss;
+                else
+                    t->cc.cwnd = PICO_TCP_CC_LW * t->mss;
 
                 t->cwnd_counter = 0;
             }
@@ -2245,6 +2748,13 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
         }
     }              /* End case duplicate ack detection */
 
+    if (t->sack_ok && una && (t->x_mode < PICO_TCP_RECOVER) &&
+        pico_tcp_sack_is_lost(&t->scoreboard, SEQN(una), t->mss))
+        tcp_enter_recovery(t);
+
+    if ((t->x_mode == PICO_TCP_RECOVER) && t->sack_ok)
+        tcp_sack_recover(t, partial_ack);
+
     /* Linux very special zero-window probe detection (see bug #107) */
     if ((0 == (hdr->flags & (PICO_TCP_PSH | PICO_TCP_SYN))) && /* This is a pure ack, and... */
         (ACKN(f) == t->snd_nxt) &&                           /* it's acking our snd_nxt, and... */
@@ -2255,7 +2765,7 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
 
 
     /* Do congestion control */
-    tcp_congestion_control(t);
+    tcp_congestion_control(t, acked_bytes, rtt);
     if ((acked > 0) && t->sock.wakeup) {
         if (t->tcpq_out.size < t->tcpq_out.max_size)
             t->sock.wakeup(PICO_SOCK_EV_WR, &(t->sock));
@@ -2279,10 +2789,17 @@ static int tcp_ack(struct pico_socket *s, struct pico_frame *f)
     }
 
     /* If some space was created, put a few segments out. */
-    tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cwnd, t->ssthresh, t->in_flight);
+    tcp_dbg("TCP_CWND, %lu, %u, %u, %u\n", TCP_TIME, t->cc.cwnd, t->cc.ssthresh, t->in_flight);
     if (t->x_mode ==  PICO_TCP_LOOKAHEAD) {
-        if ((t->cwnd >= t->in_flight) && (t->snd_nxt > t->snd_last_out)) {
-            pico_tcp_output(&t->sock, (int)t->cwnd - (int)t->in_flight);
+        if ((tcp_cwnd_segments(t) >= t->in_flight) && (t->snd_nxt > t->snd_last_out)) {
+#ifdef PICO_SUPPORT_GSO
+            /* Wait for the other ACKs of this burst: pico_sockets_loop()
+             * or the output job sends what they open as one super-frame.
+             */
+            pico_schedule_job(t->sock.stack, pico_tcp_out_all, t);
+#else
+            pico_tcp_output(&t->sock, (int)tcp_cwnd_segments(t) - (int)t->in_flight);
+#endif
         }
     }
 
@@ -2311,156 +2828,1137 @@ static int tcp_finwaitack(struct pico_socket *s, struct pico_frame *f)
     return 0;
 }
 
-static void tcp_deltcb(pico_time when, void *arg)
+static void tcp_deltcb(pico_time when, void *arg)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)arg;
+    IGNORE_PARAMETER(when);
+
+    /* send RST if not yet in TIME_WAIT */
+    if ((((t->sock).state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_TIME_WAIT)
+        && (((t->sock).state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_CLOSING)) {
+        tcp_dbg("Called deltcb in state = %04x (sending reset!)\n", (t->sock).state);
+        tcp_do_send_rst(&t->sock, long_be(t->snd_nxt));
+    } else {
+        tcp_dbg("Called deltcb in state = %04x\n", (t->sock).state);
+    }
+
+    /* update state */
+    (t->sock).state &= 0x00FFU;
+    (t->sock).state |= PICO_SOCKET_STATE_TCP_CLOSED;
+    (t->sock).state &= 0xFF00U;
+    (t->sock).state |= PICO_SOCKET_STATE_CLOSED;
+    /* call EV_FIN wakeup before deleting */
+    if (t->sock.wakeup) {
+        (t->sock).wakeup(PICO_SOCK_EV_FIN, &(t->sock));
+    }
+
+    /* delete socket */
+    pico_socket_del(&t->sock);
+}
+
+/* TIME_WAIT.
+ * All a connection closed on both sides has left to do is acknowledge a
+ * retransmitted FIN until 2MSL have passed. Rather than keeping the whole
+ * socket around for that, its tuple and sequence numbers go to a small
+ * per-stack table, hashed on the 4-tuple and listed in expiry order for
+ * a single sweep timer, and the socket is released at once. The local
+ * port stays taken until the record goes: a second index by port lets
+ * port allocation see it.
+ */
+struct tcp_tw_entry {
+    struct tcp_tw_entry *hash_next;
+    struct tcp_tw_entry *port_next;
+    struct tcp_tw_entry *prev, *next; /* first to expire first */
+    union pico_address local, remote;
+    pico_time expire;
+    uint32_t bucket;
+    uint32_t lifetime;
+    uint32_t snd_nxt;
+    uint32_t rcv_nxt;
+    uint32_t ts_nxt;
+    uint16_t net;
+    uint16_t local_port, remote_port;
+    uint16_t rwnd;
+    uint8_t ts_ok;
+};
+
+struct pico_tcp_tw {
+    struct tcp_tw_entry *hash[PICO_TCP_TW_HASH];
+    struct tcp_tw_entry *port_hash[PICO_TCP_TW_HASH];
+    struct tcp_tw_entry *oldest, *newest;
+    uint32_t count;
+    uint32_t timer;
+    uint64_t key[2];
+};
+
+static uint64_t tcp_siphash(const uint64_t *key, const uint8_t *in, uint32_t len);
+
+static uint32_t tcp_tw_bucket(const struct pico_tcp_tw *q, const struct tcp_tw_entry *e)
+{
+    uint8_t msg[(2 * PICO_SIZE_IP6) + 4];
+    uint32_t alen = PICO_SIZE_IP4, len;
+
+#ifdef PICO_SUPPORT_IPV6
+    if (e->net == PICO_PROTO_IPV6)
+        alen = PICO_SIZE_IP6;
+#endif
+    memcpy(msg, &e->local, alen);
+    memcpy(msg + alen, &e->remote, alen);
+    len = alen << 1;
+    memcpy(msg + len, &e->local_port, 2);
+    memcpy(msg + len + 2, &e->remote_port, 2);
+    return (uint32_t)tcp_siphash(q->key, msg, len + 4u) & (PICO_TCP_TW_HASH - 1u);
+}
+
+static uint32_t tcp_tw_port_bucket(uint16_t port)
+{
+    return (uint32_t)short_be(port) & (PICO_TCP_TW_HASH - 1u);
+}
+
+static struct pico_tcp_tw *tcp_tw_get(struct pico_stack *S)
+{
+    struct pico_tcp_tw *q = S->TCPTimeWait;
+    if (q)
+        return q;
+
+    q = PICO_ZALLOC(sizeof(struct pico_tcp_tw));
+    if (!q) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    q->key[0] = ((uint64_t)pico_rand() << 32) | pico_rand();
+    q->key[1] = ((uint64_t)pico_rand() << 32) | pico_rand();
+    S->TCPTimeWait = q;
+    return q;
+}
+
+/* The connection an incoming segment belongs to */
+static int tcp_tw_key(struct pico_frame *f, struct tcp_tw_entry *k)
+{
+    memset(k, 0, sizeof(struct tcp_tw_entry));
+    k->local_port = ((struct pico_trans *)f->transport_hdr)->dport;
+    k->remote_port = ((struct pico_trans *)f->transport_hdr)->sport;
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(f)) {
+        k->net = PICO_PROTO_IPV4;
+        k->remote.ip4.addr = ((struct pico_ipv4_hdr *)(f->net_hdr))->src.addr;
+        k->local.ip4.addr = ((struct pico_ipv4_hdr *)(f->net_hdr))->dst.addr;
+        return 0;
+    }
+
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f)) {
+        k->net = PICO_PROTO_IPV6;
+        k->remote.ip6 = ((struct pico_ipv6_hdr *)(f->net_hdr))->src;
+        k->local.ip6 = ((struct pico_ipv6_hdr *)(f->net_hdr))->dst;
+        return 0;
+    }
+
+#endif
+    return -1;
+}
+
+static struct tcp_tw_entry *tcp_tw_find(struct pico_tcp_tw *q, struct tcp_tw_entry *k, uint32_t b)
+{
+    struct tcp_tw_entry *e;
+
+    for (e = q->hash[b]; e; e = e->hash_next) {
+        if ((e->net == k->net) && (e->local_port == k->local_port) && (e->remote_port == k->remote_port) &&
+            !pico_address_compare(&e->remote, &k->remote, k->net) && !pico_address_compare(&e->local, &k->local, k->net))
+            return e;
+    }
+    return NULL;
+}
+
+static void tcp_tw_sweep(pico_time now, void *arg);
+
+/* One timer for the whole table, due when the first record expires */
+static void tcp_tw_arm(struct pico_stack *S, struct pico_tcp_tw *q)
+{
+    pico_time now = TCP_TIME;
+
+    pico_timer_cancel(S, q->timer);
+    q->timer = 0;
+    if (!q->oldest)
+        return;
+
+    /* Should this fail, expired records go on the next lookup */
+    q->timer = pico_timer_add(S, (q->oldest->expire > now) ? (q->oldest->expire - now) : 1u, tcp_tw_sweep, S);
+}
+
+static void tcp_tw_link(struct pico_stack *S, struct pico_tcp_tw *q, struct tcp_tw_entry *e)
+{
+    struct tcp_tw_entry *after = q->newest;
+
+    /* Lifetimes follow the linger timeout of each socket: mostly, but
+     * not always, the new record goes last. */
+    while (after && (after->expire > e->expire))
+        after = after->prev;
+
+    e->prev = after;
+    e->next = after ? after->next : q->oldest;
+    if (e->next)
+        e->next->prev = e;
+    else
+        q->newest = e;
+
+    if (after)
+        after->next = e;
+    else
+        q->oldest = e;
+
+    e->hash_next = q->hash[e->bucket];
+    q->hash[e->bucket] = e;
+    e->port_next = q->port_hash[tcp_tw_port_bucket(e->local_port)];
+    q->port_hash[tcp_tw_port_bucket(e->local_port)] = e;
+    q->count++;
+    if (!q->timer || (q->oldest == e))
+        tcp_tw_arm(S, q);
+}
+
+static void tcp_tw_unlink(struct pico_tcp_tw *q, struct tcp_tw_entry *e)
+{
+    struct tcp_tw_entry **pp = &q->hash[e->bucket];
+
+    while (*pp != e)
+        pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+
+    pp = &q->port_hash[tcp_tw_port_bucket(e->local_port)];
+    while (*pp != e)
+        pp = &(*pp)->port_next;
+    *pp = e->port_next;
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        q->oldest = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        q->newest = e->prev;
+
+    q->count--;
+}
+
+static void tcp_tw_del(struct pico_tcp_tw *q, struct tcp_tw_entry *e)
+{
+    tcp_tw_unlink(q, e);
+    PICO_FREE(e);
+}
+
+static void tcp_tw_expire(struct pico_tcp_tw *q)
+{
+    pico_time now = TCP_TIME;
+
+    while (q->oldest && (q->oldest->expire <= now))
+        tcp_tw_del(q, q->oldest);
+}
+
+static void tcp_tw_sweep(pico_time now, void *arg)
+{
+    struct pico_stack *S = (struct pico_stack *)arg;
+    struct pico_tcp_tw *q = S->TCPTimeWait;
+    IGNORE_PARAMETER(now);
+
+    if (!q)
+        return;
+
+    q->timer = 0;
+    tcp_tw_expire(q);
+    tcp_tw_arm(S, q);
+}
+
+/* Record t, which has just entered TIME_WAIT. Not while the application
+ * still has data to read, or we have some to send: then t lingers.
+ */
+static int tcp_tw_add(struct pico_socket_tcp *t)
+{
+    struct pico_stack *S = t->sock.stack;
+    struct tcp_tw_entry *e, *old;
+    struct pico_tcp_tw *q;
+
+    if ((t->tcpq_in.frames > 0) || (t->tcpq_out.frames > 0) || (t->linger_timeout == 0))
+        return -1;
+
+    q = tcp_tw_get(S);
+    if (!q)
+        return -1;
+
+    e = PICO_ZALLOC(sizeof(struct tcp_tw_entry));
+    if (!e) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    e->net = t->sock.net->proto_number;
+    e->local = t->sock.local_addr;
+    e->remote = t->sock.remote_addr;
+    e->local_port = t->sock.local_port;
+    e->remote_port = t->sock.remote_port;
+    e->snd_nxt = t->snd_nxt;
+    e->rcv_nxt = t->rcv_nxt;
+    e->rwnd = t->wnd;
+    e->ts_ok = t->ts_ok;
+    e->ts_nxt = t->ts_nxt;
+    e->lifetime = t->linger_timeout;
+    e->expire = TCP_TIME + e->lifetime;
+    e->bucket = tcp_tw_bucket(q, e);
+
+    old = tcp_tw_find(q, e, e->bucket);
+    if (old)
+        tcp_tw_del(q, old);
+
+    if (q->count >= PICO_TCP_TW_MAX)
+        tcp_tw_del(q, q->oldest);
+
+    tcp_tw_link(S, q, e);
+    return 0;
+}
+
+/* Enter TIME_WAIT: as if the linger timer had already fired, but with
+ * the connection remembered by its record.
+ */
+static void tcp_time_wait(struct pico_socket_tcp *t)
+{
+    if (tcp_tw_add(t) < 0) {
+        tcp_linger(t);
+        return;
+    }
+
+    pico_timer_cancel(t->sock.stack, t->fin_tmr);
+    t->fin_tmr = 0;
+    tcp_deltcb((pico_time)0, t);
+}
+
+/* The ACK of a record, in answer to fr, sent like pico_tcp_reply_rst() */
+static int tcp_tw_send_ack(struct pico_stack *S, struct pico_frame *fr, const struct tcp_tw_entry *e)
+{
+    uint16_t optsiz = e->ts_ok ? (uint16_t)(PICO_TCPOPTLEN_TIMESTAMP + 2u) : 0u;
+    uint32_t tsval = long_be((uint32_t)TCP_TIME);
+    uint32_t tsecr = long_be(e->ts_nxt);
+    struct pico_protocol *net = NULL;
+    struct pico_tcp_hdr *hdr;
+    struct pico_frame *f;
+
+#ifdef PICO_SUPPORT_IPV4
+    if (e->net == PICO_PROTO_IPV4)
+        net = &pico_proto_ipv4;
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (e->net == PICO_PROTO_IPV6)
+        net = &pico_proto_ipv6;
+#endif
+    if (!net)
+        return -1;
+
+    f = net->alloc(S, net, NULL, (uint16_t)(PICO_SIZE_TCPHDR + optsiz));
+    if (!f) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    tcp_fill_rst_payload(fr, f);
+    hdr = (struct pico_tcp_hdr *) f->transport_hdr;
+    hdr->len = (uint8_t)((PICO_SIZE_TCPHDR + optsiz) << 2);
+    hdr->flags = PICO_TCP_ACK;
+    hdr->seq = long_be(e->snd_nxt);
+    hdr->ack = long_be(e->rcv_nxt);
+    hdr->rwnd = short_be(e->rwnd);
+
+    f->start = f->transport_hdr + PICO_SIZE_TCPHDR;
+    if (optsiz) {
+        f->start[0] = PICO_TCP_OPTION_NOOP;
+        f->start[1] = PICO_TCP_OPTION_NOOP;
+        f->start[2] = PICO_TCP_OPTION_TIMESTAMP;
+        f->start[3] = PICO_TCPOPTLEN_TIMESTAMP;
+        memcpy(f->start + 4, &tsval, 4);
+        memcpy(f->start + 8, &tsecr, 4);
+    }
+
+    hdr->crc = 0;
+    hdr->crc = short_be(pico_tcp_checksum(f));
+
+    if (0) {
+#ifdef PICO_SUPPORT_IPV4
+    } else if (IS_IPV4(f)) {
+        pico_ipv4_frame_push(S, f, &(((struct pico_ipv4_hdr *)(f->net_hdr))->dst), PICO_PROTO_TCP);
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    } else {
+        pico_ipv6_frame_push(S, f, NULL, &(((struct pico_ipv6_hdr *)(f->net_hdr))->dst), PICO_PROTO_TCP, 0);
+#endif
+    }
+
+    return 0;
+}
+
+/* A segment with no connection to go to. Consumed if its tuple is in
+ * TIME_WAIT; -1 otherwise, or when a new SYN ends TIME_WAIT early
+ * (RFC 1122, 4.2.2.13): then it goes on to a listener.
+ */
+int pico_tcp_timewait_input(struct pico_stack *S, struct pico_frame *f)
+{
+    struct pico_tcp_tw *q = S->TCPTimeWait;
+    struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *) f->transport_hdr;
+    struct tcp_tw_entry k, *e;
+
+    if (!q || !q->count)
+        return -1;
+
+    tcp_tw_expire(q);
+    if (tcp_tw_key(f, &k) < 0)
+        return -1;
+
+    e = tcp_tw_find(q, &k, tcp_tw_bucket(q, &k));
+    if (!e)
+        return -1;
+
+    /* RFC 1337: a RST must not cut TIME_WAIT short */
+    if (hdr->flags & PICO_TCP_RST) {
+        pico_frame_discard(f);
+        return 0;
+    }
+
+    if (((hdr->flags & PICO_TCP_SYNACK) == PICO_TCP_SYN) && (pico_seq_compare(long_be(hdr->seq), e->rcv_nxt) > 0)) {
+        tcp_tw_del(q, e);
+        return -1;
+    }
+
+    /* A retransmitted FIN: our last ACK was lost, restart 2MSL */
+    if (hdr->flags & PICO_TCP_FIN) {
+        tcp_tw_unlink(q, e);
+        e->expire = TCP_TIME + e->lifetime;
+        tcp_tw_link(S, q, e);
+    }
+
+    tcp_tw_send_ack(S, f, e);
+    pico_frame_discard(f);
+    return 0;
+}
+
+/* Whether a connection in TIME_WAIT still holds port on addr.
+ * A NULL addr stands for any address, of any family.
+ */
+int pico_tcp_timewait_port_in_use(struct pico_stack *S, uint16_t port, void *addr, uint16_t net)
+{
+    struct pico_tcp_tw *q = S->TCPTimeWait;
+    union pico_address any;
+    struct tcp_tw_entry *e;
+
+    if (!q || !q->count)
+        return 0;
+
+    tcp_tw_expire(q);
+    memset(&any, 0, sizeof(any));
+    for (e = q->port_hash[tcp_tw_port_bucket(port)]; e; e = e->port_next) {
+        if (e->local_port != port)
+            continue;
+
+        if (!addr)
+            return 1;
+
+        if ((e->net == net) && (!pico_address_compare((union pico_address *)addr, &any, net) ||
+                                !pico_address_compare((union pico_address *)addr, &e->local, net)))
+            return 1;
+    }
+    return 0;
+}
+
+void pico_tcp_timewait_destroy(struct pico_stack *S)
+{
+    struct pico_tcp_tw *q = S->TCPTimeWait;
+    if (!q)
+        return;
+
+    pico_timer_cancel(S, q->timer);
+    while (q->oldest)
+        tcp_tw_del(q, q->oldest);
+    PICO_FREE(q);
+    S->TCPTimeWait = NULL;
+}
+
+static int tcp_finwaitfin(struct pico_socket *s, struct pico_frame *f)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+    struct pico_tcp_hdr *hdr  = (struct pico_tcp_hdr *) (f->transport_hdr);
+    tcp_dbg("TCP> received fin in FIN_WAIT2\n");
+    /* received FIN, increase ACK nr */
+    t->rcv_nxt = long_be(hdr->seq) + 1;
+    s->state &= 0x00FFU;
+    s->state |= PICO_SOCKET_STATE_TCP_TIME_WAIT;
+    /* set SHUT_REMOTE */
+    s->state |= PICO_SOCKET_STATE_SHUT_REMOTE;
+    if (s->wakeup)
+        s->wakeup(PICO_SOCK_EV_CLOSE, s);
+
+    if (f->payload_len > 0)              /* needed?? */
+        tcp_data_in(s, f);
+
+    /* send ACK */
+    tcp_send_ack(t);
+    tcp_time_wait(t);
+    return 0;
+}
+
+static int tcp_closing_ack(struct pico_socket *s, struct pico_frame *f)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+    tcp_dbg("TCP> received ack in CLOSING\n");
+    /* acking part */
+    tcp_ack(s, f);
+
+    /* update TCP state DLA TODO: Only if FIN is acked! */
+    tcp_dbg("CLOSING: ack is %08x - snd_nxt is %08x\n", ACKN(f), t->snd_nxt);
+    if (ACKN(f) == t->snd_nxt) {
+        s->state &= 0x00FFU;
+        s->state |= PICO_SOCKET_STATE_TCP_TIME_WAIT;
+        tcp_time_wait(t);
+    }
+
+    return 0;
+}
+
+static int tcp_lastackwait(struct pico_socket *s, struct pico_frame *f)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+    tcp_dbg("LAST_ACK: ack is %08x - snd_nxt is %08x\n", ACKN(f), t->snd_nxt);
+    if (ACKN(f) == t->snd_nxt) {
+        s->state &= 0x00FFU;
+        s->state |= PICO_SOCKET_STATE_TCP_CLOSED;
+        s->state &= 0xFF00U;
+        s->state |= PICO_SOCKET_STATE_CLOSED;
+        /* call socket wakeup with EV_FIN */
+        if (s->wakeup)
+            s->wakeup(PICO_SOCK_EV_FIN, s);
+
+        /* delete socket */
+        pico_socket_del(s);
+    }
+
+    return 0;
+}
+
+/* Half-open connections.
+ * A SYN to a listener does not clone a socket any more: what the
+ * handshake needs is kept in a small per-stack table, hashed on the
+ * 4-tuple and listed oldest first for expiry, and the socket is only
+ * created by the final ACK. When the listener's backlog or the table is
+ * full, a SYN cookie is sent instead (see below), so that a SYN flood
+ * costs no memory at all.
+ */
+struct tcp_synq_entry {
+    struct tcp_synq_entry *hash_next;
+    struct tcp_synq_entry *prev, *next; /* oldest first */
+    struct pico_socket *listener;
+    union pico_address local, remote;
+    pico_time stamp;
+    uint32_t bucket;
+    uint32_t irs;       /* peer's initial sequence number */
+    uint32_t iss;       /* ours */
+    uint32_t ts_nxt;
+    uint16_t remote_port;
+    uint16_t mss;       /* offered by the peer, 0 if none */
+    uint16_t rwnd;
+    uint8_t wscale;
+    uint8_t ws_ok;
+    uint8_t sack_ok;
+    uint8_t ts_ok;
+};
+
+struct pico_tcp_synq {
+    struct tcp_synq_entry *hash[PICO_TCP_SYNQ_HASH];
+    struct tcp_synq_entry *oldest, *newest;
+    uint32_t count;
+    uint64_t key[2];
+};
+
+#define SIP_ROTL(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+#define SIP_ROUND(v0, v1, v2, v3) \
+    do { \
+        v0 += v1; v1 = SIP_ROTL(v1, 13); v1 ^= v0; v0 = SIP_ROTL(v0, 32); \
+        v2 += v3; v3 = SIP_ROTL(v3, 16); v3 ^= v2; \
+        v0 += v3; v3 = SIP_ROTL(v3, 21); v3 ^= v0; \
+        v2 += v1; v1 = SIP_ROTL(v1, 17); v1 ^= v2; v2 = SIP_ROTL(v2, 32); \
+    } while (0)
+
+/* SipHash-2-4. Keyed, so that remote hosts can neither compute cookies
+ * nor aim a flood at a single bucket.
+ */
+static uint64_t tcp_siphash(const uint64_t *key, const uint8_t *in, uint32_t len)
+{
+    uint64_t v0 = key[0] ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = key[1] ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = key[0] ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = key[1] ^ 0x7465646279746573ULL;
+    uint64_t m;
+    uint32_t i, j;
+
+    for (i = 0; (i + 8u) <= len; i += 8u) {
+        m = 0;
+        for (j = 0; j < 8u; j++)
+            m |= (uint64_t)in[i + j] << (8u * j);
+        v3 ^= m;
+        SIP_ROUND(v0, v1, v2, v3);
+        SIP_ROUND(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+    m = (uint64_t)len << 56;
+    for (j = 0; (i + j) < len; j++)
+        m |= (uint64_t)in[i + j] << (8u * j);
+    v3 ^= m;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    v0 ^= m;
+    v2 ^= 0xFFu;
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    SIP_ROUND(v0, v1, v2, v3);
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+/* Keyed hash of the 4-tuple of e, and two more words */
+static uint32_t tcp_synq_hash(const struct pico_tcp_synq *q, const struct tcp_synq_entry *e, uint32_t w0, uint32_t w1)
+{
+    uint8_t msg[(2 * PICO_SIZE_IP6) + 12];
+    uint32_t alen = PICO_SIZE_IP4, len;
+
+#ifdef PICO_SUPPORT_IPV6
+    if (e->listener->net == &pico_proto_ipv6)
+        alen = PICO_SIZE_IP6;
+#endif
+    memcpy(msg, &e->local, alen);
+    memcpy(msg + alen, &e->remote, alen);
+    len = alen << 1;
+    memcpy(msg + len, &e->listener->local_port, 2);
+    memcpy(msg + len + 2, &e->remote_port, 2);
+    memcpy(msg + len + 4, &w0, 4);
+    memcpy(msg + len + 8, &w1, 4);
+    return (uint32_t)tcp_siphash(q->key, msg, len + 12u);
+}
+
+static uint32_t tcp_synq_bucket(const struct pico_tcp_synq *q, const struct tcp_synq_entry *e)
+{
+    return tcp_synq_hash(q, e, 0, 0) & (PICO_TCP_SYNQ_HASH - 1u);
+}
+
+static struct pico_tcp_synq *tcp_synq_get(struct pico_stack *S)
+{
+    struct pico_tcp_synq *q = S->TCPSynq;
+    if (q)
+        return q;
+
+    q = PICO_ZALLOC(sizeof(struct pico_tcp_synq));
+    if (!q) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    q->key[0] = ((uint64_t)pico_rand() << 32) | pico_rand();
+    q->key[1] = ((uint64_t)pico_rand() << 32) | pico_rand();
+    S->TCPSynq = q;
+    return q;
+}
+
+/* The half-open connection a segment to listener s would belong to */
+static void tcp_synq_key(struct pico_socket *s, struct pico_frame *f, struct tcp_synq_entry *k)
+{
+    memset(k, 0, sizeof(struct tcp_synq_entry));
+    k->listener = s;
+    k->remote_port = ((struct pico_trans *)f->transport_hdr)->sport;
+#ifdef PICO_SUPPORT_IPV4
+    if (IS_IPV4(f)) {
+        k->remote.ip4.addr = ((struct pico_ipv4_hdr *)(f->net_hdr))->src.addr;
+        k->local.ip4.addr = ((struct pico_ipv4_hdr *)(f->net_hdr))->dst.addr;
+    }
+
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    if (IS_IPV6(f)) {
+        k->remote.ip6 = ((struct pico_ipv6_hdr *)(f->net_hdr))->src;
+        k->local.ip6 = ((struct pico_ipv6_hdr *)(f->net_hdr))->dst;
+    }
+
+#endif
+}
+
+static struct tcp_synq_entry *tcp_synq_find(struct pico_tcp_synq *q, struct tcp_synq_entry *k, uint32_t b)
+{
+    struct tcp_synq_entry *e;
+    uint16_t net = k->listener->net->proto_number;
+
+    for (e = q->hash[b]; e; e = e->hash_next) {
+        if ((e->listener == k->listener) && (e->remote_port == k->remote_port) &&
+            !pico_address_compare(&e->remote, &k->remote, net) && !pico_address_compare(&e->local, &k->local, net))
+            return e;
+    }
+    return NULL;
+}
+
+/* A new entry counts as a pending connection of its listener */
+static struct tcp_synq_entry *tcp_synq_add(struct pico_tcp_synq *q, const struct tcp_synq_entry *k, uint32_t b)
+{
+    struct tcp_synq_entry *e = PICO_ZALLOC(sizeof(struct tcp_synq_entry));
+    if (!e) {
+        pico_err = PICO_ERR_ENOMEM;
+        return NULL;
+    }
+
+    *e = *k;
+    e->bucket = b;
+    e->stamp = TCP_TIME;
+    e->hash_next = q->hash[b];
+    q->hash[b] = e;
+    e->next = NULL;
+    e->prev = q->newest;
+    if (q->newest)
+        q->newest->next = e;
+    else
+        q->oldest = e;
+
+    q->newest = e;
+    q->count++;
+    e->listener->number_of_pending_conn++;
+    return e;
+}
+
+static void tcp_synq_del(struct pico_tcp_synq *q, struct tcp_synq_entry *e)
+{
+    struct tcp_synq_entry **pp = &q->hash[e->bucket];
+
+    while (*pp != e)
+        pp = &(*pp)->hash_next;
+    *pp = e->hash_next;
+
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        q->oldest = e->next;
+
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        q->newest = e->prev;
+
+    q->count--;
+    PICO_FREE(e);
+}
+
+static void tcp_synq_drop_entry(struct pico_tcp_synq *q, struct tcp_synq_entry *e)
+{
+    e->listener->number_of_pending_conn--;
+    tcp_synq_del(q, e);
+}
+
+/* Peers that never complete the handshake: same timeout as a socket
+ * left in SYN_RECV, see pico_socket_sanity_check().
+ */
+static void tcp_synq_expire(struct pico_tcp_synq *q)
+{
+    while (q->oldest && ((TCP_TIME - q->oldest->stamp) >= PICO_SOCKET_BOUND_TIMEOUT))
+        tcp_synq_drop_entry(q, q->oldest);
+}
+
+void pico_tcp_synq_drop(struct pico_socket *l)
+{
+    struct pico_tcp_synq *q = l->stack->TCPSynq;
+    struct tcp_synq_entry *e, *next;
+
+    if (!q)
+        return;
+
+    for (e = q->oldest; e; e = next) {
+        next = e->next;
+        if (e->listener == l)
+            tcp_synq_drop_entry(q, e);
+    }
+}
+
+void pico_tcp_synq_destroy(struct pico_stack *S)
+{
+    struct pico_tcp_synq *q = S->TCPSynq;
+    if (!q)
+        return;
+
+    while (q->oldest)
+        tcp_synq_del(q, q->oldest);
+    PICO_FREE(q);
+    S->TCPSynq = NULL;
+}
+
+/* What the peer offers in its SYN */
+static void tcp_synq_parse_options(struct pico_frame *f, struct tcp_synq_entry *e)
+{
+    uint8_t *opt = f->transport_hdr + PICO_SIZE_TCPHDR;
+    uint32_t hlen = (uint32_t)((((struct pico_tcp_hdr *)f->transport_hdr)->len & 0xf0u) >> 2u);
+    uint32_t i = 0, optlen;
+    uint8_t type, len;
+
+    if ((hlen < PICO_SIZE_TCPHDR) || (hlen > f->transport_len))
+        return;
+
+    optlen = hlen - PICO_SIZE_TCPHDR;
+    while (i < optlen) {
+        type = opt[i];
+        if (type == PICO_TCP_OPTION_END)
+            break;
+
+        if (type == PICO_TCP_OPTION_NOOP) {
+            i++;
+            continue;
+        }
+
+        if (((i + 1u) >= optlen) || (opt[i + 1] < 2u) || ((i + opt[i + 1]) > optlen))
+            break;
+
+        len = opt[i + 1];
+        if ((type == PICO_TCP_OPTION_MSS) && (len == PICO_TCPOPTLEN_MSS)) {
+            e->mss = short_be(short_from(opt + i + 2));
+        } else if ((type == PICO_TCP_OPTION_WS) && (len == PICO_TCPOPTLEN_WS)) {
+            e->wscale = (opt[i + 2] > 14u) ? 14u : opt[i + 2];
+            e->ws_ok = 1;
+        } else if ((type == PICO_TCP_OPTION_SACK_OK) && (len == PICO_TCPOPTLEN_SACK_OK)) {
+            e->sack_ok = 1;
+        } else if ((type == PICO_TCP_OPTION_TIMESTAMP) && (len == PICO_TCPOPTLEN_TIMESTAMP)) {
+            e->ts_ok = 1;
+            e->ts_nxt = long_be(long_from(opt + i + 2));
+        }
+
+        i += len;
+    }
+}
+
+/* Receive queue of the connections accepted by listener l */
+static uint32_t tcp_synq_rcvbuf(struct pico_socket_tcp *l)
+{
+    if (l->rcvbuf_locked)
+        return l->tcpq_in.max_size;
+
+    return PICO_DEFAULT_SOCKETQ;
+}
+
+/* Our MSS on the device the SYN came in from */
+static uint16_t tcp_synq_mss(struct pico_socket *l, struct pico_frame *f)
+{
+    uint32_t overhead = PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR;
+
+#ifdef PICO_SUPPORT_IPV6
+    if (l->net == &pico_proto_ipv6)
+        overhead = PICO_SIZE_IP6HDR + PICO_SIZE_TCPHDR;
+#endif
+    if (!f->dev || (f->dev->mtu <= overhead))
+        return 536u; /* RFC 1122 default */
+
+    return (uint16_t)(f->dev->mtu - overhead);
+}
+
+/* The SYN-ACK for e, in answer to the SYN fr, sent without a socket
+ * like pico_tcp_reply_rst(). Options are those tcp_send_synack() sends.
+ */
+static int tcp_synq_send_synack(struct pico_socket *l, struct pico_frame *fr, const struct tcp_synq_entry *e)
+{
+    struct pico_socket_tcp *lt = TCP_SOCK(l);
+    uint32_t rcvbuf = tcp_synq_rcvbuf(lt);
+    uint32_t ceiling = tcp_space_ceiling(rcvbuf, lt->rcvbuf_locked);
+    uint32_t tsval = long_be((uint32_t)TCP_TIME);
+    uint32_t tsecr = long_be(e->ts_nxt);
+    uint16_t optsiz = tcp_options_size(lt, PICO_TCP_SYNACK);
+    uint16_t mss = tcp_synq_mss(l, fr);
+    struct pico_tcp_hdr *hdr;
+    struct pico_frame *f;
+    uint32_t i = 0;
+
+    f = l->net->alloc(l->stack, l->net, NULL, (uint16_t)(PICO_SIZE_TCPHDR + optsiz));
+    if (!f) {
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    tcp_fill_rst_payload(fr, f);
+    hdr = (struct pico_tcp_hdr *) f->transport_hdr;
+    hdr->len = (uint8_t)((PICO_SIZE_TCPHDR + optsiz) << 2);
+    hdr->flags = PICO_TCP_SYNACK;
+    hdr->seq = long_be(e->iss);
+    hdr->ack = long_be(e->irs + 1u);
+    /* The window of a SYN is never scaled */
+    hdr->rwnd = short_be((uint16_t)(((rcvbuf == 0) || (rcvbuf > 0xFFFF)) ? 0xFFFF : rcvbuf));
+
+    f->start = f->transport_hdr + PICO_SIZE_TCPHDR;
+    memset(f->start, PICO_TCP_OPTION_NOOP, optsiz);
+    f->start[i++] = PICO_TCP_OPTION_MSS;
+    f->start[i++] = PICO_TCPOPTLEN_MSS;
+    f->start[i++] = (uint8_t)((mss >> 8) & 0xFF);
+    f->start[i++] = (uint8_t)(mss & 0xFF);
+    f->start[i++] = PICO_TCP_OPTION_SACK_OK;
+    f->start[i++] = PICO_TCPOPTLEN_SACK_OK;
+    if (e->ws_ok) {
+        f->start[i++] = PICO_TCP_OPTION_WS;
+        f->start[i++] = PICO_TCPOPTLEN_WS;
+        f->start[i++] = tcp_wnd_shift(ceiling);
+    } else {
+        i += PICO_TCPOPTLEN_WS; /* no scaling: left as noops */
+    }
+
+    f->start[i++] = PICO_TCP_OPTION_TIMESTAMP;
+    f->start[i++] = PICO_TCPOPTLEN_TIMESTAMP;
+    memcpy(f->start + i, &tsval, 4);
+    i += 4;
+    memcpy(f->start + i, &tsecr, 4);
+    i += 4;
+    if (i < optsiz)
+        f->start[optsiz - 1] = PICO_TCP_OPTION_END;
+
+    hdr->crc = 0;
+    hdr->crc = short_be(pico_tcp_checksum(f));
+
+    if (0) {
+#ifdef PICO_SUPPORT_IPV4
+    } else if (IS_IPV4(f)) {
+        pico_ipv4_frame_push(l->stack, f, &(((struct pico_ipv4_hdr *)(f->net_hdr))->dst), PICO_PROTO_TCP);
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    } else {
+        pico_ipv6_frame_push(l->stack, f, NULL, &(((struct pico_ipv6_hdr *)(f->net_hdr))->dst), PICO_PROTO_TCP, 0);
+#endif
+    }
+
+    return 0;
+}
+
+/* SYN cookies.
+ * With no state kept, our ISN carries what the final ACK needs to
+ * set up the connection:
+ *
+ *   31                          11 10      7    6    5      2 1   0
+ *  +------------------------------+---------+------+--------+-----+
+ *  |       keyed hash             | counter | SACK | wscale | MSS |
+ *  +------------------------------+---------+------+--------+-----+
+ *
+ * A wscale of 15 stands for a SYN without the option.
+ * The hash covers the 4-tuple, the peer's ISN and the low 11 bits, so
+ * none of them can be forged. The counter ticks every 65 seconds, and
+ * cookies from before the previous tick are refused. Timestamps come
+ * back on if the ACK carries them.
+ */
+#define SYNCOOKIE_HASH_SHIFT  11u
+#define SYNCOOKIE_LOW_MASK    0x7FFu
+#define SYNCOOKIE_COUNT_SHIFT 7u
+#define SYNCOOKIE_SACK        0x40u
+#define SYNCOOKIE_WS_SHIFT    2u
+#define SYNCOOKIE_WS_NONE     0xFu
+
+static const uint16_t tcp_syncookie_mss[4] = {
+    536, 1220, 1440, 1460
+};
+
+static uint32_t tcp_syncookie_count(void)
 {
-    struct pico_socket_tcp *t = (struct pico_socket_tcp *)arg;
-    IGNORE_PARAMETER(when);
+    return (uint32_t)(TCP_TIME >> 16) & 0xFu;
+}
 
-    /* send RST if not yet in TIME_WAIT */
-    if ((((t->sock).state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_TIME_WAIT)
-        && (((t->sock).state & PICO_SOCKET_STATE_TCP) != PICO_SOCKET_STATE_TCP_CLOSING)) {
-        tcp_dbg("Called deltcb in state = %04x (sending reset!)\n", (t->sock).state);
-        tcp_do_send_rst(&t->sock, long_be(t->snd_nxt));
-    } else {
-        tcp_dbg("Called deltcb in state = %04x\n", (t->sock).state);
-    }
+static uint32_t tcp_syncookie_make(const struct pico_tcp_synq *q, const struct tcp_synq_entry *e)
+{
+    uint32_t idx = 0, low;
 
-    /* update state */
-    (t->sock).state &= 0x00FFU;
-    (t->sock).state |= PICO_SOCKET_STATE_TCP_CLOSED;
-    (t->sock).state &= 0xFF00U;
-    (t->sock).state |= PICO_SOCKET_STATE_CLOSED;
-    /* call EV_FIN wakeup before deleting */
-    if (t->sock.wakeup) {
-        (t->sock).wakeup(PICO_SOCK_EV_FIN, &(t->sock));
-    }
+    while ((idx < 3u) && (tcp_syncookie_mss[idx + 1u] <= e->mss))
+        idx++;
+    low = (tcp_syncookie_count() << SYNCOOKIE_COUNT_SHIFT) | idx;
+    low |= (e->ws_ok ? (uint32_t)e->wscale : SYNCOOKIE_WS_NONE) << SYNCOOKIE_WS_SHIFT;
+    if (e->sack_ok)
+        low |= SYNCOOKIE_SACK;
 
-    /* delete socket */
-    pico_socket_del(&t->sock);
+    return (tcp_synq_hash(q, e, e->irs, low) << SYNCOOKIE_HASH_SHIFT) | low;
 }
 
-static int tcp_finwaitfin(struct pico_socket *s, struct pico_frame *f)
+/* Fills e from a cookie, if it is one of ours */
+static int tcp_syncookie_check(const struct pico_tcp_synq *q, struct tcp_synq_entry *e, uint32_t cookie)
 {
-    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
-    struct pico_tcp_hdr *hdr  = (struct pico_tcp_hdr *) (f->transport_hdr);
-    tcp_dbg("TCP> received fin in FIN_WAIT2\n");
-    /* received FIN, increase ACK nr */
-    t->rcv_nxt = long_be(hdr->seq) + 1;
-    s->state &= 0x00FFU;
-    s->state |= PICO_SOCKET_STATE_TCP_TIME_WAIT;
-    /* set SHUT_REMOTE */
-    s->state |= PICO_SOCKET_STATE_SHUT_REMOTE;
-    if (s->wakeup)
-        s->wakeup(PICO_SOCK_EV_CLOSE, s);
+    uint32_t low = cookie & SYNCOOKIE_LOW_MASK;
 
-    if (f->payload_len > 0)              /* needed?? */
-        tcp_data_in(s, f);
+    if (((tcp_syncookie_count() - (low >> SYNCOOKIE_COUNT_SHIFT)) & 0xFu) > 1u)
+        return -1;
 
-    /* send ACK */
-    tcp_send_ack(t);
-    /* linger */
-    tcp_linger(t);
+    if ((tcp_synq_hash(q, e, e->irs, low) << SYNCOOKIE_HASH_SHIFT) != (cookie & ~SYNCOOKIE_LOW_MASK))
+        return -1;
+
+    e->iss = cookie;
+    e->mss = tcp_syncookie_mss[low & 0x3u];
+    e->wscale = (uint8_t)((low >> SYNCOOKIE_WS_SHIFT) & 0xFu);
+    e->ws_ok = (e->wscale != SYNCOOKIE_WS_NONE) ? 1u : 0u;
+    if (!e->ws_ok)
+        e->wscale = 0;
+    e->sack_ok = (low & SYNCOOKIE_SACK) ? 1u : 0u;
     return 0;
 }
 
-static int tcp_closing_ack(struct pico_socket *s, struct pico_frame *f)
+static int tcp_syn(struct pico_socket *s, struct pico_frame *f)
 {
-    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
-    tcp_dbg("TCP> received ack in CLOSING\n");
-    /* acking part */
-    tcp_ack(s, f);
+    struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *)f->transport_hdr;
+    struct pico_tcp_synq *q = tcp_synq_get(s->stack);
+    uint8_t cookies = s->stack->TCPSynCookies;
+    struct tcp_synq_entry k, *e;
+    uint32_t b;
 
-    /* update TCP state DLA TODO: Only if FIN is acked! */
-    tcp_dbg("CLOSING: ack is %08x - snd_nxt is %08x\n", ACKN(f), t->snd_nxt);
-    if (ACKN(f) == t->snd_nxt) {
-        s->state &= 0x00FFU;
-        s->state |= PICO_SOCKET_STATE_TCP_TIME_WAIT;
-        /* set timer */
-        tcp_linger(t);
-    }
+    if (!q)
+        return -1;
 
-    return 0;
-}
+    tcp_synq_expire(q);
+    tcp_synq_key(s, f, &k);
+    k.irs = long_be(hdr->seq);
+    k.rwnd = short_be(hdr->rwnd);
+    tcp_synq_parse_options(f, &k);
 
-static int tcp_lastackwait(struct pico_socket *s, struct pico_frame *f)
-{
-    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
-    tcp_dbg("LAST_ACK: ack is %08x - snd_nxt is %08x\n", ACKN(f), t->snd_nxt);
-    if (ACKN(f) == t->snd_nxt) {
-        s->state &= 0x00FFU;
-        s->state |= PICO_SOCKET_STATE_TCP_CLOSED;
-        s->state &= 0xFF00U;
-        s->state |= PICO_SOCKET_STATE_CLOSED;
-        /* call socket wakeup with EV_FIN */
-        if (s->wakeup)
-            s->wakeup(PICO_SOCK_EV_FIN, s);
+    b = tcp_synq_bucket(q, &k);
+    e = tcp_synq_find(q, &k, b);
+    if (e) {
+        /* Retransmitted SYN: same answer. A new ISN is a new attempt. */
+        if (e->irs == k.irs)
+            return tcp_synq_send_synack(s, f, e);
 
-        /* delete socket */
-        pico_socket_del(s);
+        tcp_synq_drop_entry(q, e);
     }
 
-    return 0;
+    if ((cookies == PICO_TCP_SYNCOOKIES_ALWAYS) || (s->number_of_pending_conn >= s->max_backlog) ||
+        (q->count >= PICO_TCP_SYNQ_MAX)) {
+        if (cookies == PICO_TCP_SYNCOOKIES_OFF)
+            return -1;
+
+        k.iss = tcp_syncookie_make(q, &k);
+        tcp_dbg("TCP> SYN cookie %08x sent\n", k.iss);
+        return tcp_synq_send_synack(s, f, &k);
+    }
+
+    k.iss = long_be(pico_paws());
+    e = tcp_synq_add(q, &k, b);
+    if (!e)
+        return -1;
+
+    tcp_dbg("SYNACK sent, half-open connection added. iss is %08x\n", e->iss);
+    return tcp_synq_send_synack(s, f, e);
 }
 
-static int tcp_syn(struct pico_socket *s, struct pico_frame *f)
+/* The socket of a connection whose handshake is complete */
+static struct pico_socket_tcp *tcp_synq_child(struct pico_socket *s, const struct tcp_synq_entry *e)
 {
-    struct pico_socket_tcp *new = NULL;
-    struct pico_tcp_hdr *hdr = NULL;
+    struct pico_socket_tcp *new = (struct pico_socket_tcp *)pico_socket_clone(s);
     uint16_t mtu;
-    if(s->number_of_pending_conn >= s->max_backlog)
-        return -1;
 
-    new = (struct pico_socket_tcp *)pico_socket_clone(s);
-    hdr = (struct pico_tcp_hdr *)f->transport_hdr;
     if (!new)
-        return -1;
+        return NULL;
 
 #ifdef PICO_TCP_SUPPORT_SOCKET_STATS
-    if (!pico_timer_add(t->sock.stack, 2000, sock_stats, s)) {
+    if (!pico_timer_add(s->stack, 2000, sock_stats, new)) {
         tcp_dbg("TCP: Failed to start socket statistics timer\n");
-        return -1;
-    }
-#endif
-
-    new->sock.remote_port = ((struct pico_trans *)f->transport_hdr)->sport;
-#ifdef PICO_SUPPORT_IPV4
-    if (IS_IPV4(f)) {
-        new->sock.remote_addr.ip4.addr = ((struct pico_ipv4_hdr *)(f->net_hdr))->src.addr;
-        new->sock.local_addr.ip4.addr = ((struct pico_ipv4_hdr *)(f->net_hdr))->dst.addr;
     }
-
 #endif
-#ifdef PICO_SUPPORT_IPV6
-    if (IS_IPV6(f)) {
-        new->sock.remote_addr.ip6 = ((struct pico_ipv6_hdr *)(f->net_hdr))->src;
-        new->sock.local_addr.ip6 = ((struct pico_ipv6_hdr *)(f->net_hdr))->dst;
-    }
 
-#endif
-    f->sock = &new->sock;
+    new->sock.remote_port = e->remote_port;
+    new->sock.local_addr = e->local;
+    new->sock.remote_addr = e->remote;
     mtu = (uint16_t)pico_socket_get_mss(&new->sock);
     new->mss = (uint16_t)(mtu - PICO_SIZE_TCPHDR);
-    tcp_parse_options(f);
+    if (e->mss) {
+        new->mss_ok = 1;
+        if (new->mss > e->mss)
+            new->mss = e->mss;
+    }
+
+    new->sack_ok = e->sack_ok;
+    new->recv_wnd_scale = e->wscale;
+    new->scale_ok = e->ws_ok;
+    new->ts_ok = e->ts_ok;
+    new->ts_nxt = e->ts_nxt;
     new->sock.stack = s->stack;
-    new->tcpq_in.max_size = PICO_DEFAULT_SOCKETQ;
+    new->tcpq_in.max_size = tcp_synq_rcvbuf(TCP_SOCK(s));
+    new->rcvbuf_locked = TCP_SOCK(s)->rcvbuf_locked;
     new->tcpq_out.max_size = PICO_DEFAULT_SOCKETQ;
     new->tcpq_hold.max_size = 2u * mtu;
-    new->rcv_nxt = long_be(hdr->seq) + 1;
-    new->snd_nxt = long_be(pico_paws());
-    new->snd_last = new->snd_nxt;
-    new->cwnd = PICO_TCP_IW;
-    new->ssthresh = (uint16_t)((uint16_t)(PICO_DEFAULT_SOCKETQ / new->mss) -  (((uint16_t)(PICO_DEFAULT_SOCKETQ / new->mss)) >> 3u));
-    new->recv_wnd = short_be(hdr->rwnd);
+    new->rcv_nxt = e->irs + 1u;
+    new->rcv_ackd = new->rcv_nxt;
+    new->snd_nxt = e->iss + 1u;
+    new->snd_last = e->iss;
+    new->cc.ops = TCP_SOCK(s)->cc.ops;
+    pico_tcp_cc_reset(&new->cc, new->mss, TCP_TIME);
+    new->recv_wnd = e->rwnd;
     new->linger_timeout = PICO_SOCKET_LINGER_TIMEOUT;
-    s->number_of_pending_conn++;
+    new->delack_to = TCP_SOCK(s)->delack_to;
     new->sock.parent = s;
     new->sock.wakeup = s->wakeup;
     rto_set(new, PICO_TCP_RTO_MIN);
-    /* Initialize timestamp values */
     new->sock.state = PICO_SOCKET_STATE_BOUND | PICO_SOCKET_STATE_CONNECTED | PICO_SOCKET_STATE_TCP_SYN_RECV;
+    tcp_set_space(new);
     pico_socket_add(&new->sock);
-    tcp_send_synack(&new->sock);
-    tcp_dbg("SYNACK sent, socket added. snd_nxt is %08x\n", new->snd_nxt);
+    return new;
+}
+
+/* The final ACK of a handshake: a known half-open connection or a valid
+ * cookie gets its socket, which then takes the segment like any ACK in
+ * SYN_RECV.
+ */
+static int tcp_listen_ack(struct pico_socket *s, struct pico_frame *f)
+{
+    struct pico_tcp_synq *q = s->stack->TCPSynq;
+    struct tcp_synq_entry k, *e = NULL;
+    struct pico_socket_tcp *new;
+    struct pico_frame *cpy;
+
+    tcp_synq_key(s, f, &k);
+    k.irs = SEQN(f) - 1u;
+    if (q)
+        e = tcp_synq_find(q, &k, tcp_synq_bucket(q, &k));
+
+    if (e) {
+        if ((ACKN(f) != (e->iss + 1u)) || (SEQN(f) != (e->irs + 1u)))
+            return pico_tcp_reply_rst(s->stack, f);
+
+        new = tcp_synq_child(s, e);
+        if (!new)
+            return -1; /* Keep the entry, the peer will send again */
+
+        /* Already counted as pending */
+        tcp_synq_del(q, e);
+    } else {
+        if (!q || (s->stack->TCPSynCookies == PICO_TCP_SYNCOOKIES_OFF) ||
+            (tcp_syncookie_check(q, &k, ACKN(f) - 1u) < 0))
+            return pico_tcp_reply_rst(s->stack, f);
+
+        if (s->number_of_pending_conn >= s->max_backlog)
+            return -1; /* Still full, the peer will send again */
+
+        new = tcp_synq_child(s, &k);
+        if (!new)
+            return -1;
+
+        s->number_of_pending_conn++;
+        tcp_dbg("TCP> SYN cookie %08x accepted\n", k.iss);
+    }
+
+    pico_socket_schedule(&new->sock);
+    cpy = pico_frame_copy(f);
+    if (cpy)
+        pico_tcp_input(&new->sock, cpy);
+
+    return 0;
+}
+
+/* The peer gave up on a half-open connection */
+static int tcp_listen_rst(struct pico_socket *s, struct pico_frame *f)
+{
+    struct pico_tcp_synq *q = s->stack->TCPSynq;
+    struct tcp_synq_entry k, *e;
+
+    if (!q)
+        return 0;
+
+    tcp_synq_key(s, f, &k);
+    e = tcp_synq_find(q, &k, tcp_synq_bucket(q, &k));
+    if (e && (SEQN(f) == (e->irs + 1u)))
+        tcp_synq_drop_entry(q, e);
+
     return 0;
 }
 
@@ -2555,6 +4053,7 @@ static int tcp_first_ack(struct pico_socket *s, struct pico_frame *f)
             s->wakeup(PICO_SOCK_EV_CONN,  s);
         }
 
+        pico_socket_tcp_accept_queue_add(s);
         if (s->parent && s->parent->wakeup) {
             tcp_dbg("FIRST ACK - Parent found -> listening socket\n");
             s->wakeup = s->parent->wakeup;
@@ -2665,7 +4164,7 @@ static int tcp_finack(struct pico_socket *s, struct pico_frame *f)
     /* set SHUT_REMOTE */
     s->state |= PICO_SOCKET_STATE_SHUT_REMOTE;
 
-    tcp_linger(t);
+    tcp_time_wait(t);
 
     return 0;
 }
@@ -2770,7 +4269,7 @@ static const struct tcp_action_entry tcp_fsm[] = {
     /* State                              syn              synack             ack                data             fin              finack           rst*/
     { PICO_SOCKET_STATE_TCP_UNDEF,        NULL,            NULL,              NULL,              NULL,            NULL,            NULL,            NULL     },
     { PICO_SOCKET_STATE_TCP_CLOSED,       NULL,            NULL,              NULL,              NULL,            NULL,            NULL,            NULL     },
-    { PICO_SOCKET_STATE_TCP_LISTEN,       &tcp_syn,        NULL,              NULL,              NULL,            NULL,            NULL,            NULL     },
+    { PICO_SOCKET_STATE_TCP_LISTEN,       &tcp_syn,        NULL,              &tcp_listen_ack,   NULL,            NULL,            &tcp_listen_ack, &tcp_listen_rst },
     { PICO_SOCKET_STATE_TCP_SYN_SENT,     NULL,            &tcp_synack,       NULL,              NULL,            NULL,            NULL,            &tcp_rst },
     { PICO_SOCKET_STATE_TCP_SYN_RECV,     &tcp_synrecv_syn, NULL,              &tcp_first_ack,    &tcp_data_in,    NULL,            &tcp_closeconn,  &tcp_rst },
     { PICO_SOCKET_STATE_TCP_ESTABLISHED,  &tcp_halfopencon, &tcp_ack,         &tcp_ack,          &tcp_data_in,    &tcp_closewait,  &tcp_closewait,  &tcp_rst },
@@ -2789,7 +4288,7 @@ static uint8_t invalid_flags(struct pico_socket *s, uint8_t flags)
     static const uint8_t valid_flags[PICO_SOCKET_STATE_TCP_ARRAYSIZ][MAX_VALID_FLAGS] = {
         { /* PICO_SOCKET_STATE_TCP_UNDEF      */ 0, },
         { /* PICO_SOCKET_STATE_TCP_CLOSED     */ 0, },
-        { /* PICO_SOCKET_STATE_TCP_LISTEN     */ PICO_TCP_SYN },
+        { /* PICO_SOCKET_STATE_TCP_LISTEN     */ PICO_TCP_SYN, PICO_TCP_ACK, PICO_TCP_PSHACK, PICO_TCP_FINACK, PICO_TCP_FINPSHACK, PICO_TCP_RST },
         { /* PICO_SOCKET_STATE_TCP_SYN_SENT   */ PICO_TCP_SYNACK, PICO_TCP_RST, PICO_TCP_RSTACK},
         { /* PICO_SOCKET_STATE_TCP_SYN_RECV   */ PICO_TCP_SYN, PICO_TCP_ACK, PICO_TCP_PSH, PICO_TCP_PSHACK, PICO_TCP_FINACK, PICO_TCP_FINPSHACK, PICO_TCP_RST},
         { /* PICO_SOCKET_STATE_TCP_ESTABLISHED*/ PICO_TCP_SYN, PICO_TCP_SYNACK, PICO_TCP_ACK, PICO_TCP_PSH, PICO_TCP_PSHACK, PICO_TCP_FIN, PICO_TCP_FINACK, PICO_TCP_FINPSHACK, PICO_TCP_RST, PICO_TCP_RSTACK},
@@ -2909,10 +4408,25 @@ static struct pico_frame *tcp_split_segment(struct pico_socket_tcp *t, struct pi
     f2 = pico_socket_frame_alloc(&t->sock, get_sock_dev(&t->sock), (uint16_t) (size2 + overhead));
 
     if (!f1 || !f2) {
+        if (f1)
+            pico_frame_discard(f1);
+
+        if (f2)
+            pico_frame_discard(f2);
+
         pico_err = PICO_ERR_ENOMEM;
         return NULL;
     }
 
+    /* Both halves take the place of f in the retransmission queue, with
+     * one header more: leave f whole until ACKs make room for it.
+     */
+    if ((t->tcpq_out.size - f->buffer_len + f1->buffer_len + f2->buffer_len) > t->tcpq_out.max_size) {
+        pico_frame_discard(f1);
+        pico_frame_discard(f2);
+        return NULL;
+    }
+
     /* Advance payload pointer to the beginning of segment data */
     f1->payload += overhead;
     f1->payload_len = (uint16_t)(f1->payload_len - overhead);
@@ -2942,8 +4456,14 @@ static struct pico_frame *tcp_split_segment(struct pico_socket_tcp *t, struct pi
     /* Get rid of the full frame */
     pico_discard_segment(&t->tcpq_out, f);
 
-    /* Enqueue f2 for later send... */
-    if (pico_enqueue_segment(&t->tcpq_out, f2) < 0) {
+    /* f1 goes out now, f2 waits for the window: both stay queued until acknowledged */
+    if (pico_enqueue_segment(&t->tcpq_out, f1) <= 0) {
+        tcp_dbg("Discarding invalid segment\n");
+        pico_frame_discard(f1);
+        f1 = NULL;
+    }
+
+    if (pico_enqueue_segment(&t->tcpq_out, f2) <= 0) {
         tcp_dbg("Discarding invalid segment\n");
         pico_frame_discard(f2);
     }
@@ -2952,6 +4472,38 @@ static struct pico_frame *tcp_split_segment(struct pico_socket_tcp *t, struct pi
     return f1;
 }
 
+/* Token bucket on the rate requested by the congestion control module.
+ * Segments held back here are retried by pico_sockets_loop().
+ */
+static int tcp_pacing_allows(struct pico_socket_tcp *t, uint16_t len)
+{
+    uint32_t rate = t->cc.ops->pacing_rate ? t->cc.ops->pacing_rate(&t->cc) : 0;
+    uint32_t burst, add;
+    pico_time now = TCP_TIME;
+
+    if (rate == 0)
+        return 1;
+
+    burst = rate / 500u; /* 2 ms worth of data */
+    if (burst < (2u * t->mss))
+        burst = 2u * t->mss;
+
+    /* The rate may have dropped since the credit was earned */
+    if (t->pacing_credit > burst)
+        t->pacing_credit = burst;
+
+    add = (uint32_t)(((uint64_t)rate * (now - t->pacing_stamp)) / 1000u);
+    if (add > 0) {
+        t->pacing_credit = (add > burst - t->pacing_credit) ? burst : t->pacing_credit + add;
+        t->pacing_stamp = now;
+    }
+
+    if ((t->pacing_credit < len) && (t->pacing_credit < burst))
+        return 0;
+
+    t->pacing_credit = (t->pacing_credit > len) ? t->pacing_credit - len : 0;
+    return 1;
+}
 
 int pico_tcp_output(struct pico_socket *s, int loop_score)
 {
@@ -2960,11 +4512,23 @@ int pico_tcp_output(struct pico_socket *s, int loop_score)
     int sent = 0;
     int data_sent = 0;
     int32_t seq_diff = 0;
+#ifdef PICO_SUPPORT_GSO
+    struct tcp_gso_batch gso = {
+        0
+    };
+#endif
 
     una = first_segment(&t->tcpq_out);
     f = peek_segment(&t->tcpq_out, t->snd_nxt);
 
-    while((f) && (t->cwnd >= t->in_flight)) {
+    while((f) && (tcp_cwnd_segments(t) >= t->in_flight) && tcp_pacing_allows(t, f->payload_len)) {
+        if ((t->scoreboard.n > 0) && pico_tcp_sack_covered(&t->scoreboard, SEQN(f), f->payload_len)) {
+            /* Already at the receiver, e.g. after a go-back-N reset */
+            t->snd_nxt = SEQN(f) + f->payload_len;
+            f = next_segment(&t->tcpq_out, f);
+            continue;
+        }
+
         f->timestamp = TCP_TIME;
         add_retransmission_timer(t, t->rto + TCP_TIME);
         tcp_add_options_frame(t, f);
@@ -2974,9 +4538,12 @@ int pico_tcp_output(struct pico_socket *s, int loop_score)
             break;
         }
 
-        /* Check if advertised window is full */
+        /* Check if advertised window is full. With data in flight, its
+         * ACKs will open the window again: only a closed window needs
+         * probing.
+         */
         if ((uint32_t)seq_diff >= (uint32_t)(t->recv_wnd << t->recv_wnd_scale)) {
-            if (t->x_mode != PICO_TCP_WINDOW_FULL) {
+            if ((seq_diff == 0) && (t->x_mode != PICO_TCP_WINDOW_FULL)) {
                 tcp_dbg("TCP> RIGHT SIZING (rwnd: %d, frame len: %d\n", t->recv_wnd << t->recv_wnd_scale, f->payload_len);
                 tcp_dbg("In window full...\n");
                 t->snd_nxt = SEQN(una);
@@ -2989,18 +4556,27 @@ int pico_tcp_output(struct pico_socket *s, int loop_score)
 
         /* Check if the advertised window is too small to receive the current frame */
         if ((uint32_t)(seq_diff + f->payload_len) > (uint32_t)(t->recv_wnd << t->recv_wnd_scale)) {
-            f = tcp_split_segment(t, f, (uint16_t)(t->recv_wnd << t->recv_wnd_scale));
+            f = tcp_split_segment(t, f, (uint16_t)((uint32_t)(t->recv_wnd << t->recv_wnd_scale) - (uint32_t)seq_diff));
             if (!f)
                 break;
 
             /* Limit sending window to packets in flight (right sizing) */
-            t->cwnd = (uint16_t)t->in_flight;
-            if (t->cwnd < 1)
-                t->cwnd = 1;
+            t->cc.cwnd = t->in_flight * t->mss;
+            if (t->cc.cwnd < t->mss)
+                t->cc.cwnd = t->mss;
         }
 
         tcp_dbg("TCP> DEQUEUED (for output) frame %08x, acks %08x len= %d, remaining frames %d\n", SEQN(f), ACKN(f), f->payload_len, t->tcpq_out.frames);
+#ifdef PICO_SUPPORT_GSO
+        if (f->payload_len > 0) {
+            tcp_gso_add(t, &gso, f);
+        } else {
+            tcp_gso_flush(t, &gso);
+            tcp_send(t, f);
+        }
+#else
         tcp_send(t, f);
+#endif
         sent++;
         loop_score--;
         t->snd_last_out = SEQN(f);
@@ -3014,6 +4590,9 @@ int pico_tcp_output(struct pico_socket *s, int loop_score)
             f = NULL;
         }
     }
+#ifdef PICO_SUPPORT_GSO
+    tcp_gso_flush(t, &gso);
+#endif
     if ((sent > 0 && data_sent > 0)) {
         rto_set(t, t->rto);
     } else {
@@ -3047,10 +4626,33 @@ void pico_tcp_out_all(struct pico_stack *S, void *arg)
         if(pico_socket_sanity_check(s) < 0)
         {
             pico_socket_del(s);
+            return;
         }
+
+        pico_socket_schedule(s);
     }
 }
 
+/* Work left for pico_sockets_loop(): segments still waiting for the
+ * window, a FIN to send once the queue drains, or a half-open
+ * connection that may need to expire.
+ */
+int pico_tcp_output_pending(struct pico_socket *s)
+{
+    struct pico_socket_tcp *t = TCP_SOCK(s);
+    if (TCP_IS_STATE(s, PICO_SOCKET_STATE_TCP_SYN_RECV))
+        return 1;
+
+    if (peek_segment(&t->tcpq_out, t->snd_nxt))
+        return 1;
+
+    if ((t->tcpq_out.frames == 0) && (s->state & PICO_SOCKET_STATE_SHUT_LOCAL) &&
+        (TCP_IS_STATE(s, PICO_SOCKET_STATE_TCP_ESTABLISHED) || TCP_IS_STATE(s, PICO_SOCKET_STATE_TCP_CLOSE_WAIT)))
+        return 1;
+
+    return 0;
+}
+
 /* function to make new segment from hold queue with specific size (mss) */
 static struct pico_frame *pico_hold_segment_make(struct pico_socket_tcp *t)
 {
@@ -3166,10 +4768,44 @@ static int pico_tcp_push_nagle_hold(struct pico_socket_tcp *t, struct pico_frame
 }
 
 
+/* A zero-copy segment is never coalesced: copying it into the hold queue
+ * would release the application buffer before the data is acknowledged.
+ * What is held in front of it goes out first, so the stream stays in order.
+ */
+static int pico_tcp_push_nagle_zc(struct pico_socket_tcp *t, struct pico_frame *f)
+{
+    struct pico_frame *f_new;
+
+    while (!IS_TCP_HOLDQ_EMPTY(t) && ((t->tcpq_out.max_size - t->tcpq_out.size) >= t->mss)) {
+        f_new = pico_hold_segment_make(t);
+        if (f_new == NULL)
+            break;
+
+        if (pico_enqueue_segment(&t->tcpq_out, f_new) <= 0) {
+            tcp_dbg_nagle("TCP_PUSH - NAGLE - enqueue out failed, f_new = %p\n", f_new);
+            pico_frame_discard(f_new);
+            break;
+        }
+    }
+
+    if (!IS_TCP_HOLDQ_EMPTY(t)) {
+        pico_err = PICO_ERR_EAGAIN;
+        return 0;
+    }
+
+    return pico_tcp_push_nagle_enqueue(t, f);
+}
+
 static int pico_tcp_push_nagle_on(struct pico_socket_tcp *t, struct pico_frame *f)
 {
-    /* Nagle's algorithm enabled, check if ready to send, or put frame in hold queue */
-    if (IS_TCP_IDLE(t) && IS_TCP_HOLDQ_EMPTY(t))
+    if (f->flags & PICO_FRAME_FLAG_EXT_BUFFER)
+        return pico_tcp_push_nagle_zc(t, f);
+
+    /* Nagle's algorithm enabled, check if ready to send, or put frame in hold queue.
+     * A full-sized segment may always go out (RFC 896): queue it as is instead
+     * of copying it through the hold queue.
+     */
+    if (IS_TCP_HOLDQ_EMPTY(t) && (IS_TCP_IDLE(t) || ((uint32_t)(f->payload_len + tcp_options_size(t, 0)) >= t->mss)))
         return pico_tcp_push_nagle_enqueue(t, f);
 
     return pico_tcp_push_nagle_hold(t, f);
@@ -3183,6 +4819,7 @@ int pico_tcp_push(struct pico_stack *S, struct pico_protocol *self, struct pico_
 {
     struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *)f->transport_hdr;
     struct pico_socket_tcp *t = (struct pico_socket_tcp *) f->sock;
+    int ret;
     (void)S;
     IGNORE_PARAMETER(self);
     pico_err = PICO_ERR_NOERR;
@@ -3202,15 +4839,20 @@ int pico_tcp_push(struct pico_stack *S, struct pico_protocol *self, struct pico_
             pico_schedule_job(t->sock.stack, pico_tcp_out_all, t);
             tcp_dbg_nagle("TCP_PUSH - NO NAGLE - Pushing segment %08x, len %08x to socket %p\n", t->snd_last + 1, f->payload_len, t);
             t->snd_last += f->payload_len;
-            return f->payload_len;
+            ret = f->payload_len;
         } else {
             tcp_dbg("Enqueue failed.\n");
-            return 0;
+            ret = 0;
         }
     } else {
-        return pico_tcp_push_nagle_on(t, f);
+        ret = pico_tcp_push_nagle_on(t, f);
     }
 
+    /* The output job only runs in tickless builds: make sure
+     * pico_sockets_loop() picks up the new segments.
+     */
+    pico_socket_schedule(&t->sock);
+    return ret;
 }
 
 static void tcp_discard_all_segments(struct pico_tcp_queue *tq)
@@ -3226,9 +4868,7 @@ static void tcp_discard_all_segments(struct pico_tcp_queue *tq)
         pico_tree_delete(&tq->pool, f);
         if(IS_INPUT_QUEUE(tq))
         {
-            struct tcp_input_segment *inp = (struct tcp_input_segment *)f;
-            PICO_FREE(inp->payload);
-            PICO_FREE(inp);
+            segment_free((struct tcp_input_segment *)f);
         }
         else
             pico_frame_discard(f);
@@ -3244,11 +4884,14 @@ void pico_tcp_cleanup_queues(struct pico_socket *sck)
     pico_timer_cancel(tcp->sock.stack, tcp->retrans_tmr);
     pico_timer_cancel(tcp->sock.stack, tcp->keepalive_tmr);
     pico_timer_cancel(tcp->sock.stack, tcp->fin_tmr);
+    pico_timer_cancel(tcp->sock.stack, tcp->delack_tmr);
 
     tcp->retrans_tmr = 0;
     tcp->keepalive_tmr = 0;
     tcp->fin_tmr = 0;
+    tcp->delack_tmr = 0;
 
+    tcp_rcvbuf_release(tcp, tcp->rcvbuf_grant);
     tcp_discard_all_segments(&tcp->tcpq_in);
     tcp_discard_all_segments(&tcp->tcpq_out);
     tcp_discard_all_segments(&tcp->tcpq_hold);
@@ -3315,6 +4958,8 @@ void pico_tcp_flags_update(struct pico_frame *f, struct pico_socket *s)
 int pico_tcp_set_bufsize_in(struct pico_socket *s, uint32_t value)
 {
     struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+    tcp_rcvbuf_release(t, t->rcvbuf_grant);
+    t->rcvbuf_locked = 1;
     t->tcpq_in.max_size = value;
     return 0;
 }
@@ -3340,6 +4985,32 @@ int pico_tcp_get_bufsize_out(struct pico_socket *s, uint32_t *value)
     return 0;
 }
 
+/* Total receive buffer growth allowed to autotuning in this stack.
+ * Lowering it below the current use makes buffers shrink on their
+ * next read.
+ */
+int pico_tcp_set_rcvbuf_limit(struct pico_stack *S, uint32_t value)
+{
+    if (!S) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    S->TCPRcvBufLimit = value;
+    return 0;
+}
+
+int pico_tcp_set_syncookies(struct pico_stack *S, uint8_t mode)
+{
+    if (!S || (mode > PICO_TCP_SYNCOOKIES_ALWAYS)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    S->TCPSynCookies = mode;
+    return 0;
+}
+
 int pico_tcp_set_keepalive_probes(struct pico_socket *s, uint32_t value)
 {
     struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
@@ -3361,6 +5032,21 @@ int pico_tcp_set_keepalive_time(struct pico_socket *s, uint32_t value)
     return 0;
 }
 
+uint32_t pico_tcp_get_keepalive_probes(struct pico_socket *s)
+{
+    return ((struct pico_socket_tcp *)s)->ka_probes;
+}
+
+uint32_t pico_tcp_get_keepalive_intvl(struct pico_socket *s)
+{
+    return ((struct pico_socket_tcp *)s)->ka_intvl;
+}
+
+uint32_t pico_tcp_get_keepalive_time(struct pico_socket *s)
+{
+    return ((struct pico_socket_tcp *)s)->ka_time;
+}
+
 int pico_tcp_set_linger(struct pico_socket *s, uint32_t value)
 {
     struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
@@ -3368,4 +5054,39 @@ int pico_tcp_set_linger(struct pico_socket *s, uint32_t value)
     return 0;
 }
 
+int pico_tcp_set_ack_delay(struct pico_socket *s, uint32_t value)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+    /* RFC 1122: the delay must be less than 0.5 seconds */
+    if (value >= 500) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    t->delack_to = (uint16_t)value;
+    if ((value == 0) && t->delack_tmr) {
+        pico_timer_cancel(t->sock.stack, t->delack_tmr);
+        t->delack_tmr = 0;
+        tcp_delack_timeout((pico_time)0, t);
+    }
+
+    return 0;
+}
+
+uint32_t pico_tcp_get_ack_delay(struct pico_socket *s)
+{
+    return ((struct pico_socket_tcp *)s)->delack_to;
+}
+
+int pico_tcp_set_congestion(struct pico_socket *s, uint8_t algo)
+{
+    struct pico_socket_tcp *t = (struct pico_socket_tcp *)s;
+    return pico_tcp_cc_select(&t->cc, algo, TCP_TIME);
+}
+
+uint8_t pico_tcp_get_congestion(struct pico_socket *s)
+{
+    return ((struct pico_socket_tcp *)s)->cc.ops->id;
+}
+
 #endif /* PICO_SUPPORT_TCP */
@@ -88,6 +88,51 @@ PACKED_STRUCT_DEF tcp_pseudo_hdr_ipv4
 #define PICO_TCP_FINPSHACK (PICO_TCP_FIN | PICO_TCP_PSH | PICO_TCP_ACK)
 #define PICO_TCP_RSTACK    (PICO_TCP_RST | PICO_TCP_ACK)
 
+/* Half-open connections (SYN received, final ACK pending) kept by a
+ * stack, across all of its listeners.
+ */
+#ifndef PICO_TCP_SYNQ_MAX
+# ifdef __linux__
+#  define PICO_TCP_SYNQ_MAX 1024u
+# else
+#  define PICO_TCP_SYNQ_MAX 16u
+# endif
+#endif
+
+/* Buckets of the half-open connection table (power of two) */
+#ifndef PICO_TCP_SYNQ_HASH
+# define PICO_TCP_SYNQ_HASH 64u
+#endif
+
+/* SYN cookies: never, when the backlog or the half-open table is full,
+ * or for every SYN.
+ */
+#define PICO_TCP_SYNCOOKIES_OFF      0u
+#define PICO_TCP_SYNCOOKIES_OVERFLOW 1u
+#define PICO_TCP_SYNCOOKIES_ALWAYS   2u
+#ifndef PICO_TCP_SYNCOOKIES
+# define PICO_TCP_SYNCOOKIES PICO_TCP_SYNCOOKIES_OVERFLOW
+#endif
+
+/* Connections in TIME_WAIT kept by a stack. When full, the record that
+ * would expire first is dropped.
+ */
+#ifndef PICO_TCP_TW_MAX
+# ifdef __linux__
+#  define PICO_TCP_TW_MAX 4096u
+# else
+#  define PICO_TCP_TW_MAX 32u
+# endif
+#endif
+
+/* Buckets of the TIME_WAIT table (power of two) */
+#ifndef PICO_TCP_TW_HASH
+# ifdef __linux__
+#  define PICO_TCP_TW_HASH 256u
+# else
+#  define PICO_TCP_TW_HASH 16u
+# endif
+#endif
 
 PACKED_STRUCT_DEF pico_tcp_option
 {
@@ -97,6 +142,8 @@ PACKED_STRUCT_DEF pico_tcp_option
 
 struct pico_socket *pico_tcp_open(struct pico_stack *S, uint16_t family);
 uint32_t pico_tcp_read(struct pico_socket *s, void *buf, uint32_t len);
+uint32_t pico_tcp_read_zc(struct pico_socket *s, void **data);
+uint32_t pico_tcp_read_zc_done(struct pico_socket *s, uint32_t len);
 int pico_tcp_initconn(struct pico_socket *s);
 int pico_tcp_input(struct pico_socket *s, struct pico_frame *f);
 uint16_t pico_tcp_checksum(struct pico_frame *f);
@@ -106,6 +153,7 @@ uint16_t pico_tcp_checksum_ipv6(struct pico_frame *f);
 #endif
 uint16_t pico_tcp_overhead(struct pico_socket *s);
 int pico_tcp_output(struct pico_socket *s, int loop_score);
+int pico_tcp_output_pending(struct pico_socket *s);
 int pico_tcp_queue_in_is_empty(struct pico_socket *s);
 int pico_tcp_queue_in_size(struct pico_socket *s);
 int pico_tcp_reply_rst(struct pico_stack *S, struct pico_frame *f);
@@ -116,10 +164,24 @@ int pico_tcp_set_bufsize_in(struct pico_socket *s, uint32_t value);
 int pico_tcp_set_bufsize_out(struct pico_socket *s, uint32_t value);
 int pico_tcp_get_bufsize_in(struct pico_socket *s, uint32_t *value);
 int pico_tcp_get_bufsize_out(struct pico_socket *s, uint32_t *value);
+int pico_tcp_set_rcvbuf_limit(struct pico_stack *S, uint32_t value);
+int pico_tcp_set_syncookies(struct pico_stack *S, uint8_t mode);
+void pico_tcp_synq_drop(struct pico_socket *l);
+void pico_tcp_synq_destroy(struct pico_stack *S);
+int pico_tcp_timewait_input(struct pico_stack *S, struct pico_frame *f);
+int pico_tcp_timewait_port_in_use(struct pico_stack *S, uint16_t port, void *addr, uint16_t net);
+void pico_tcp_timewait_destroy(struct pico_stack *S);
 int pico_tcp_set_keepalive_probes(struct pico_socket *s, uint32_t value);
 int pico_tcp_set_keepalive_intvl(struct pico_socket *s, uint32_t value);
 int pico_tcp_set_keepalive_time(struct pico_socket *s, uint32_t value);
+uint32_t pico_tcp_get_keepalive_probes(struct pico_socket *s);
+uint32_t pico_tcp_get_keepalive_intvl(struct pico_socket *s);
+uint32_t pico_tcp_get_keepalive_time(struct pico_socket *s);
 int pico_tcp_set_linger(struct pico_socket *s, uint32_t value);
+int pico_tcp_set_ack_delay(struct pico_socket *s, uint32_t value);
+uint32_t pico_tcp_get_ack_delay(struct pico_socket *s);
+int pico_tcp_set_congestion(struct pico_socket *s, uint8_t algo);
+uint8_t pico_tcp_get_congestion(struct pico_socket *s);
 uint16_t pico_tcp_get_socket_mss(struct pico_socket *s);
 int pico_tcp_check_listen_close(struct pico_socket *s);
 
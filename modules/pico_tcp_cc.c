@@ -0,0 +1,457 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#include "pico_config.h"
+#include "pico_tcp_cc.h"
+
+#define cc_dbg(...) do {} while(0)
+
+#define CC_LW(cc) (PICO_TCP_CC_LW * (cc)->mss)
+
+/* Growth is only allowed while the window is actually being used,
+ * so that an application-limited sender cannot inflate cwnd forever.
+ */
+static int cc_cwnd_limited(struct pico_tcp_cc *cc, uint32_t acked)
+{
+    return ((cc->flight + acked) << 1) >= cc->cwnd;
+}
+
+/* Slow start with appropriate byte counting, L = 2 (RFC 3465) */
+static void cc_slow_start(struct pico_tcp_cc *cc, uint32_t acked)
+{
+    uint32_t limit = cc->mss << 1;
+    cc->cwnd += (acked < limit) ? acked : limit;
+}
+
+/*** Reno (RFC 5681) ***/
+
+static void reno_init(struct pico_tcp_cc *cc, pico_time now)
+{
+    IGNORE_PARAMETER(now);
+    cc->bytes_acked = 0;
+}
+
+static void reno_on_ack(struct pico_tcp_cc *cc, uint32_t acked, uint32_t rtt, pico_time now)
+{
+    IGNORE_PARAMETER(rtt);
+    IGNORE_PARAMETER(now);
+    if (!cc_cwnd_limited(cc, acked))
+        return;
+
+    if (cc->cwnd < cc->ssthresh) {
+        cc_slow_start(cc, acked);
+        return;
+    }
+
+    cc->bytes_acked += acked;
+    if (cc->bytes_acked >= cc->cwnd) {
+        cc->bytes_acked -= cc->cwnd;
+        cc->cwnd += cc->mss;
+    }
+}
+
+static void reno_on_loss(struct pico_tcp_cc *cc, pico_time now)
+{
+    IGNORE_PARAMETER(now);
+    cc->ssthresh = cc->flight >> 1;
+    if (cc->ssthresh < CC_LW(cc))
+        cc->ssthresh = CC_LW(cc);
+
+    /* Keep the retransmissions going: the window is deflated by the
+     * TCP layer while duplicate ACKs arrive.
+     */
+    cc->cwnd = (cc->flight > CC_LW(cc)) ? cc->flight : CC_LW(cc);
+    cc->bytes_acked = 0;
+}
+
+static void reno_on_rto(struct pico_tcp_cc *cc, pico_time now)
+{
+    reno_on_loss(cc, now);
+    cc->cwnd = CC_LW(cc);
+}
+
+static const struct pico_tcp_cc_ops cc_reno = {
+    PICO_TCP_CC_RENO, "reno",
+    reno_init, reno_on_ack, reno_on_loss, reno_on_rto, NULL
+};
+
+/*** CUBIC (RFC 8312) ***/
+
+#define CUBIC_BETA       717u  /* 0.7 in 1/1024 units */
+#define CUBIC_MAX_T      60000 /* clamp on |t - K|, ms */
+
+static uint32_t cc_cbrt(uint64_t x)
+{
+    uint32_t lo = 0, hi = 1u << 21, mid;
+    while (lo < hi) {
+        mid = (lo + hi + 1u) >> 1;
+        if ((uint64_t)mid * mid * mid <= x)
+            lo = mid;
+        else
+            hi = mid - 1u;
+    }
+    return lo;
+}
+
+static void cubic_init(struct pico_tcp_cc *cc, pico_time now)
+{
+    IGNORE_PARAMETER(now);
+    memset(&cc->priv.cubic, 0, sizeof(cc->priv.cubic));
+    cc->bytes_acked = 0;
+}
+
+/* W_cubic(t) = C * (t - K)^3 + origin, with C = 0.4 segments/s^3 */
+static uint32_t cubic_target(struct pico_tcp_cc *cc, pico_time now)
+{
+    struct pico_tcp_cc_cubic *c = &cc->priv.cubic;
+    int64_t d = (int64_t)(now - c->epoch_start) - (int64_t)c->k;
+    int64_t offs, w;
+
+    if (d > CUBIC_MAX_T)
+        d = CUBIC_MAX_T;
+
+    if (d < -CUBIC_MAX_T)
+        d = -CUBIC_MAX_T;
+
+    offs = (((d * d * d) / 10000) * 4 * (int64_t)cc->mss) / 1000000;
+    w = (int64_t)c->origin + offs;
+    if (w < (int64_t)CC_LW(cc))
+        w = (int64_t)CC_LW(cc);
+
+    return (uint32_t)w;
+}
+
+/* Window of a standard TCP flow over the same epoch (TCP-friendly region) */
+static uint32_t cubic_reno_estimate(struct pico_tcp_cc *cc, uint32_t rtt, pico_time now)
+{
+    struct pico_tcp_cc_cubic *c = &cc->priv.cubic;
+    uint64_t t = (uint64_t)(now - c->epoch_start);
+    if (!rtt)
+        return 0;
+
+    /* 3 * (1 - beta) / (1 + beta) = 0.529 */
+    return (uint32_t)(((uint64_t)c->w_max * CUBIC_BETA >> 10) +
+                      ((uint64_t)cc->mss * 529u * t) / (1000u * (uint64_t)rtt));
+}
+
+static void cubic_on_ack(struct pico_tcp_cc *cc, uint32_t acked, uint32_t rtt, pico_time now)
+{
+    struct pico_tcp_cc_cubic *c = &cc->priv.cubic;
+    uint32_t target, est, inc;
+
+    if (!cc_cwnd_limited(cc, acked))
+        return;
+
+    if (cc->cwnd < cc->ssthresh) {
+        cc_slow_start(cc, acked);
+        return;
+    }
+
+    if (!c->epoch_start) {
+        c->epoch_start = now;
+        cc->bytes_acked = 0;
+        if (cc->cwnd < c->w_max) {
+            /* K = cbrt((W_max - cwnd) / C), in ms */
+            c->k = cc_cbrt(((uint64_t)(c->w_max - cc->cwnd) * 2500000000ull) / cc->mss);
+            c->origin = c->w_max;
+        } else {
+            c->k = 0;
+            c->origin = cc->cwnd;
+        }
+    }
+
+    target = cubic_target(cc, now);
+    est = cubic_reno_estimate(cc, rtt, now);
+    if (target < est)
+        target = est;
+
+    if (target <= cc->cwnd)
+        return;
+
+    cc->bytes_acked += acked;
+    inc = (uint32_t)(((uint64_t)(target - cc->cwnd) * cc->bytes_acked) / cc->cwnd);
+    if (inc > 0) {
+        /* At most 1.5x per round trip */
+        if (inc > (cc->bytes_acked >> 1))
+            inc = cc->bytes_acked >> 1;
+
+        cc->cwnd += inc;
+        cc->bytes_acked = 0;
+    }
+
+    cc_dbg("CUBIC: cwnd %u target %u K %u\n", cc->cwnd, target, c->k);
+}
+
+static void cubic_reduce(struct pico_tcp_cc *cc)
+{
+    struct pico_tcp_cc_cubic *c = &cc->priv.cubic;
+    uint32_t base = cc->cwnd;
+
+    c->epoch_start = 0;
+    /* Fast convergence: release bandwidth to newer flows */
+    if (base < c->w_max)
+        c->w_max = (uint32_t)(((uint64_t)base * (1024u + CUBIC_BETA)) >> 11);
+    else
+        c->w_max = base;
+
+    cc->ssthresh = (uint32_t)(((uint64_t)base * CUBIC_BETA) >> 10);
+    if (cc->ssthresh < CC_LW(cc))
+        cc->ssthresh = CC_LW(cc);
+
+    cc->bytes_acked = 0;
+}
+
+static void cubic_on_loss(struct pico_tcp_cc *cc, pico_time now)
+{
+    IGNORE_PARAMETER(now);
+    cubic_reduce(cc);
+    cc->cwnd = (cc->flight > CC_LW(cc)) ? cc->flight : CC_LW(cc);
+}
+
+static void cubic_on_rto(struct pico_tcp_cc *cc, pico_time now)
+{
+    IGNORE_PARAMETER(now);
+    cubic_reduce(cc);
+    cc->cwnd = CC_LW(cc);
+}
+
+static const struct pico_tcp_cc_ops cc_cubic = {
+    PICO_TCP_CC_CUBIC, "cubic",
+    cubic_init, cubic_on_ack, cubic_on_loss, cubic_on_rto, NULL
+};
+
+/*** BBR-style model: bottleneck bandwidth and min RTT ***/
+
+#define BBR_STARTUP      0u
+#define BBR_DRAIN        1u
+#define BBR_PROBE_BW     2u
+#define BBR_PROBE_RTT    3u
+
+#define BBR_UNIT         256u
+#define BBR_HIGH_GAIN    739u  /* 2 / ln(2) */
+#define BBR_DRAIN_GAIN   88u   /* 1 / high gain */
+#define BBR_CWND_GAIN    512u
+#define BBR_MIN_RTT_WIN  10000u
+#define BBR_PROBE_RTT_MS 200u
+#define BBR_BW_ROUNDS    10u
+#define BBR_MIN_CWND(cc) (4u * (cc)->mss)
+
+static const uint16_t bbr_cycle_gain[8] = {
+    320, 192, 256, 256, 256, 256, 256, 256
+};
+
+static void bbr_init(struct pico_tcp_cc *cc, pico_time now)
+{
+    struct pico_tcp_cc_bbr *b = &cc->priv.bbr;
+    memset(b, 0, sizeof(*b));
+    b->mode = BBR_STARTUP;
+    b->rate_stamp = now;
+    b->min_rtt_stamp = now;
+    b->bw_stamp = now;
+    cc->bytes_acked = 0;
+}
+
+static uint32_t bbr_rtt(struct pico_tcp_cc_bbr *b)
+{
+    return b->min_rtt ? b->min_rtt : 1u;
+}
+
+static uint32_t bbr_pacing_gain(struct pico_tcp_cc_bbr *b)
+{
+    switch (b->mode) {
+    case BBR_STARTUP:
+        return BBR_HIGH_GAIN;
+    case BBR_DRAIN:
+        return BBR_DRAIN_GAIN;
+    case BBR_PROBE_BW:
+        return bbr_cycle_gain[b->cycle];
+    default:
+        return BBR_UNIT;
+    }
+}
+
+static uint32_t bbr_bdp(struct pico_tcp_cc *cc, uint32_t gain)
+{
+    struct pico_tcp_cc_bbr *b = &cc->priv.bbr;
+    uint64_t bdp = ((uint64_t)b->btl_bw * bbr_rtt(b)) / 1000u;
+    bdp = (bdp * gain) / BBR_UNIT;
+    if (bdp < BBR_MIN_CWND(cc))
+        bdp = BBR_MIN_CWND(cc);
+
+    if (bdp > 0x7FFFFFFFu)
+        bdp = 0x7FFFFFFFu;
+
+    return (uint32_t)bdp;
+}
+
+/* One delivery rate sample per round trip; each sample counts as a round. */
+static void bbr_new_round(struct pico_tcp_cc *cc, uint32_t bw, pico_time now)
+{
+    struct pico_tcp_cc_bbr *b = &cc->priv.bbr;
+
+    if ((bw >= b->btl_bw) || ((now - b->bw_stamp) > (pico_time)(BBR_BW_ROUNDS * bbr_rtt(b)))) {
+        b->btl_bw = bw;
+        b->bw_stamp = now;
+    }
+
+    switch (b->mode) {
+    case BBR_STARTUP:
+        /* Pipe is full when bandwidth stops growing by 25% for 3 rounds */
+        if (b->btl_bw >= b->full_bw + (b->full_bw >> 2)) {
+            b->full_bw = b->btl_bw;
+            b->full_bw_cnt = 0;
+        } else if (++b->full_bw_cnt >= 3) {
+            b->mode = BBR_DRAIN;
+        }
+
+        break;
+    case BBR_PROBE_BW:
+        b->cycle = (uint8_t)((b->cycle + 1u) & 7u);
+        break;
+    default:
+        break;
+    }
+}
+
+static void bbr_on_ack(struct pico_tcp_cc *cc, uint32_t acked, uint32_t rtt, pico_time now)
+{
+    struct pico_tcp_cc_bbr *b = &cc->priv.bbr;
+    int expired = (now - b->min_rtt_stamp) > BBR_MIN_RTT_WIN;
+    pico_time interval;
+    uint32_t target;
+
+    if (rtt && (!b->min_rtt || (rtt <= b->min_rtt) || expired)) {
+        b->min_rtt = rtt;
+        b->min_rtt_stamp = now;
+    }
+
+    if (expired && (b->mode != BBR_PROBE_RTT)) {
+        b->mode = BBR_PROBE_RTT;
+        b->probe_rtt_end = now + BBR_PROBE_RTT_MS;
+        b->min_rtt_stamp = now;
+    }
+
+    b->delivered += acked;
+    interval = now - b->rate_stamp;
+    if (interval >= bbr_rtt(b)) {
+        uint64_t bw = ((uint64_t)(b->delivered - b->rate_delivered) * 1000u) / interval;
+        bbr_new_round(cc, (bw > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (uint32_t)bw, now);
+        b->rate_stamp = now;
+        b->rate_delivered = b->delivered;
+    }
+
+    if ((b->mode == BBR_DRAIN) && (cc->flight <= bbr_bdp(cc, BBR_UNIT)))
+        b->mode = BBR_PROBE_BW;
+
+    if (b->mode == BBR_PROBE_RTT) {
+        cc->cwnd = BBR_MIN_CWND(cc);
+        if (now >= b->probe_rtt_end)
+            b->mode = (b->full_bw_cnt >= 3) ? BBR_PROBE_BW : BBR_STARTUP;
+
+        return;
+    }
+
+    if (!b->btl_bw) {
+        /* No model yet: grow as in slow start */
+        cc->cwnd += acked;
+        return;
+    }
+
+    target = bbr_bdp(cc, (b->mode == BBR_STARTUP) ? BBR_HIGH_GAIN : BBR_CWND_GAIN);
+    if ((cc->cwnd + acked) <= target)
+        cc->cwnd += acked;
+    else if (b->full_bw_cnt >= 3)
+        cc->cwnd = target;
+
+    if (cc->cwnd < BBR_MIN_CWND(cc))
+        cc->cwnd = BBR_MIN_CWND(cc);
+
+    cc_dbg("BBR: mode %u bw %u min_rtt %u cwnd %u\n", b->mode, b->btl_bw, b->min_rtt, cc->cwnd);
+}
+
+/* Losses do not shrink the model; just keep the retransmissions going. */
+static void bbr_on_loss(struct pico_tcp_cc *cc, pico_time now)
+{
+    IGNORE_PARAMETER(now);
+    if (cc->cwnd < cc->flight)
+        cc->cwnd = cc->flight;
+
+    if (cc->cwnd < BBR_MIN_CWND(cc))
+        cc->cwnd = BBR_MIN_CWND(cc);
+}
+
+static void bbr_on_rto(struct pico_tcp_cc *cc, pico_time now)
+{
+    IGNORE_PARAMETER(now);
+    cc->cwnd = CC_LW(cc);
+}
+
+static uint32_t bbr_pacing_rate(struct pico_tcp_cc *cc)
+{
+    struct pico_tcp_cc_bbr *b = &cc->priv.bbr;
+    uint64_t rate = ((uint64_t)b->btl_bw * bbr_pacing_gain(b)) / BBR_UNIT;
+    return (rate > 0xFFFFFFFFu) ? 0xFFFFFFFFu : (uint32_t)rate;
+}
+
+static const struct pico_tcp_cc_ops cc_bbr = {
+    PICO_TCP_CC_BBR, "bbr",
+    bbr_init, bbr_on_ack, bbr_on_loss, bbr_on_rto, bbr_pacing_rate
+};
+
+static const struct pico_tcp_cc_ops *const cc_table[] = {
+    &cc_reno, &cc_cubic, &cc_bbr
+};
+
+const struct pico_tcp_cc_ops *pico_tcp_cc_get(uint8_t id)
+{
+    uint32_t i;
+    for (i = 0; i < sizeof(cc_table) / sizeof(cc_table[0]); i++) {
+        if (cc_table[i]->id == id)
+            return cc_table[i];
+    }
+    return NULL;
+}
+
+void pico_tcp_cc_reset(struct pico_tcp_cc *cc, uint32_t mss, pico_time now)
+{
+    if (!cc->ops)
+        cc->ops = pico_tcp_cc_get(PICO_TCP_CC_DEFAULT);
+
+    cc->mss = mss;
+    cc->flight = 0;
+    cc->cwnd = PICO_TCP_CC_IW(mss);
+    cc->ssthresh = 0xFFFFFFFFu;
+    cc->ops->init(cc, now);
+}
+
+int pico_tcp_cc_select(struct pico_tcp_cc *cc, uint8_t id, pico_time now)
+{
+    const struct pico_tcp_cc_ops *ops = pico_tcp_cc_get(id);
+    if (!ops) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    cc->ops = ops;
+    ops->init(cc, now);
+    return 0;
+}
@@ -0,0 +1,96 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#ifndef INCLUDE_PICO_TCP_CC
+#define INCLUDE_PICO_TCP_CC
+#include "pico_config.h"
+#include "pico_socket.h"
+
+/* Initial window in bytes (RFC 6928) */
+#define PICO_TCP_CC_IW(mss) \
+    (((10u * (mss)) < 14600u) ? (10u * (mss)) : \
+     (((2u * (mss)) > 14600u) ? (2u * (mss)) : 14600u))
+
+/* Window after a retransmission timeout, in segments */
+#define PICO_TCP_CC_LW 2u
+
+#ifndef PICO_TCP_CC_DEFAULT
+#define PICO_TCP_CC_DEFAULT PICO_TCP_CC_RENO
+#endif
+
+struct pico_tcp_cc_cubic {
+    pico_time epoch_start;
+    uint32_t w_max;      /* window before the last reduction */
+    uint32_t origin;     /* plateau of the current cubic epoch */
+    uint32_t k;          /* ms from epoch_start to origin */
+};
+
+struct pico_tcp_cc_bbr {
+    uint32_t btl_bw;     /* max delivery rate, bytes/s */
+    pico_time bw_stamp;
+    uint32_t min_rtt;    /* ms, 0 until sampled */
+    pico_time min_rtt_stamp;
+    uint32_t full_bw;
+    uint32_t delivered;
+    uint32_t rate_delivered;
+    pico_time rate_stamp;
+    pico_time probe_rtt_end;
+    uint8_t mode;
+    uint8_t full_bw_cnt;
+    uint8_t cycle;
+};
+
+/* Congestion state of one connection. cwnd and ssthresh are in bytes;
+ * mss and flight (bytes in flight) are refreshed by the TCP layer
+ * before each callback.
+ */
+struct pico_tcp_cc {
+    const struct pico_tcp_cc_ops *ops;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t bytes_acked; /* congestion avoidance accumulator */
+    uint32_t mss;
+    uint32_t flight;
+    union {
+        struct pico_tcp_cc_cubic cubic;
+        struct pico_tcp_cc_bbr bbr;
+    } priv;
+};
+
+struct pico_tcp_cc_ops {
+    uint8_t id;
+    const char *name;
+    void (*init)(struct pico_tcp_cc *cc, pico_time now);
+    /* New data acknowledged; rtt is 0 when no sample was taken */
+    void (*on_ack)(struct pico_tcp_cc *cc, uint32_t acked, uint32_t rtt, pico_time now);
+    /* Entering fast recovery */
+    void (*on_loss)(struct pico_tcp_cc *cc, pico_time now);
+    void (*on_rto)(struct pico_tcp_cc *cc, pico_time now);
+    /* Bytes per second, or 0 to send as fast as cwnd allows. May be NULL. */
+    uint32_t (*pacing_rate)(struct pico_tcp_cc *cc);
+};
+
+const struct pico_tcp_cc_ops *pico_tcp_cc_get(uint8_t id);
+void pico_tcp_cc_reset(struct pico_tcp_cc *cc, uint32_t mss, pico_time now);
+int pico_tcp_cc_select(struct pico_tcp_cc *cc, uint8_t id, pico_time now);
+
+#endif
@@ -0,0 +1,212 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_tcp_sack.h"
+
+#define SEQ_LT(a, b) (pico_seq_compare((a), (b)) < 0)
+#define SEQ_LE(a, b) (pico_seq_compare((a), (b)) <= 0)
+
+void pico_tcp_sack_reset(struct pico_tcp_scoreboard *sb, uint32_t una)
+{
+    sb->n = 0;
+    sb->sacked = 0;
+    sb->high_rxt = una;
+    sb->recovery_point = una;
+}
+
+static void sack_remove(struct pico_tcp_scoreboard *sb, uint8_t i)
+{
+    sb->sacked -= sb->blk[i].right - sb->blk[i].left;
+    sb->n--;
+    if (i < sb->n)
+        memmove(&sb->blk[i], &sb->blk[i + 1], (size_t)(sb->n - i) * sizeof(struct pico_tcp_sack_blk));
+}
+
+/* Record a SACK block. Blocks outside (una, high] are ignored as
+ * stale or bogus. Returns 1 if bytes not known before were SACKed.
+ */
+int pico_tcp_sack_add(struct pico_tcp_scoreboard *sb, uint32_t una, uint32_t high, uint32_t left, uint32_t right)
+{
+    uint32_t before = sb->sacked;
+    uint8_t i = 0;
+    int grew = 0;
+
+    if (!SEQ_LT(left, right) || !SEQ_LT(una, right) || SEQ_LT(high, right))
+        return 0;
+
+    if (SEQ_LT(left, una))
+        left = una;
+
+    /* Find the first block that ends at or after the new one starts */
+    while ((i < sb->n) && SEQ_LT(sb->blk[i].right, left))
+        i++;
+
+    if ((i < sb->n) && SEQ_LE(sb->blk[i].left, right)) {
+        /* Overlapping or adjacent: grow blk[i], then swallow followers */
+        if (SEQ_LT(left, sb->blk[i].left)) {
+            sb->sacked += sb->blk[i].left - left;
+            sb->blk[i].left = left;
+        }
+
+        if (SEQ_LT(sb->blk[i].right, right)) {
+            sb->sacked += right - sb->blk[i].right;
+            sb->blk[i].right = right;
+        }
+
+        while (((i + 1) < sb->n) && SEQ_LE(sb->blk[i + 1].left, sb->blk[i].right)) {
+            uint32_t r = sb->blk[i + 1].right;
+            sb->sacked -= (SEQ_LT(r, sb->blk[i].right) ? r : sb->blk[i].right) - sb->blk[i + 1].left;
+            if (SEQ_LT(sb->blk[i].right, r))
+                sb->blk[i].right = r;
+
+            sb->n--;
+            if ((i + 1) < sb->n)
+                memmove(&sb->blk[i + 1], &sb->blk[i + 2], (size_t)(sb->n - i - 1) * sizeof(struct pico_tcp_sack_blk));
+        }
+    } else {
+        if (sb->n == PICO_TCP_SACK_BLOCKS) {
+            /* Full: forget the highest range, the lower ones decide
+             * what gets retransmitted first.
+             */
+            if (i == sb->n)
+                return 0;
+
+            sack_remove(sb, (uint8_t)(sb->n - 1));
+        }
+
+        if (i < sb->n)
+            memmove(&sb->blk[i + 1], &sb->blk[i], (size_t)(sb->n - i) * sizeof(struct pico_tcp_sack_blk));
+
+        sb->blk[i].left = left;
+        sb->blk[i].right = right;
+        sb->sacked += right - left;
+        sb->n++;
+        grew = 1;
+    }
+
+    return grew || (sb->sacked != before);
+}
+
+/* snd_una moved: drop what the cumulative ACK now covers */
+void pico_tcp_sack_advance(struct pico_tcp_scoreboard *sb, uint32_t una)
+{
+    while ((sb->n > 0) && SEQ_LE(sb->blk[0].right, una))
+        sack_remove(sb, 0);
+
+    if ((sb->n > 0) && SEQ_LT(sb->blk[0].left, una)) {
+        sb->sacked -= una - sb->blk[0].left;
+        sb->blk[0].left = una;
+    }
+
+    if (SEQ_LT(sb->high_rxt, una))
+        sb->high_rxt = una;
+}
+
+int pico_tcp_sack_covered(struct pico_tcp_scoreboard *sb, uint32_t seq, uint32_t len)
+{
+    uint8_t i;
+    for (i = 0; i < sb->n; i++) {
+        if (SEQ_LT(seq, sb->blk[i].left))
+            return 0;
+
+        if (SEQ_LE(seq + len, sb->blk[i].right))
+            return 1;
+    }
+    return 0;
+}
+
+/* First sequence number at or after seq that is not SACKed */
+uint32_t pico_tcp_sack_skip(struct pico_tcp_scoreboard *sb, uint32_t seq)
+{
+    uint8_t i;
+    for (i = 0; i < sb->n; i++) {
+        if (SEQ_LT(seq, sb->blk[i].left))
+            break;
+
+        if (SEQ_LT(seq, sb->blk[i].right))
+            seq = sb->blk[i].right;
+    }
+    return seq;
+}
+
+/* Highest SACKed sequence number, or una if nothing is SACKed */
+uint32_t pico_tcp_sack_high(struct pico_tcp_scoreboard *sb, uint32_t una)
+{
+    return (sb->n > 0) ? sb->blk[sb->n - 1].right : una;
+}
+
+/* Hole below blk[i]: lost once DupThresh ranges, or more than
+ * (DupThresh - 1) * SMSS bytes, have been SACKed above it.
+ */
+static int sack_hole_lost(struct pico_tcp_scoreboard *sb, uint8_t i, uint32_t mss)
+{
+    uint32_t above = 0;
+    uint8_t j;
+
+    if ((uint32_t)(sb->n - i) >= PICO_TCP_SACK_DUPTHRESH)
+        return 1;
+
+    for (j = i; j < sb->n; j++)
+        above += sb->blk[j].right - sb->blk[j].left;
+    return above > ((PICO_TCP_SACK_DUPTHRESH - 1u) * mss);
+}
+
+int pico_tcp_sack_is_lost(struct pico_tcp_scoreboard *sb, uint32_t seq, uint32_t mss)
+{
+    uint8_t i = 0;
+    while ((i < sb->n) && SEQ_LT(sb->blk[i].left, seq + 1))
+        i++;
+
+    if (i == sb->n)
+        return 0;
+
+    return sack_hole_lost(sb, i, mss);
+}
+
+/* RFC 6675 SetPipe(): bytes between una and nxt that are neither
+ * SACKed nor presumed lost, plus the lost ones already retransmitted.
+ * Ranges above nxt (after a go-back-N reset) are not counted.
+ */
+uint32_t pico_tcp_sack_pipe(struct pico_tcp_scoreboard *sb, uint32_t una, uint32_t nxt, uint32_t mss)
+{
+    uint32_t start = una, out = 0;
+    uint8_t i;
+
+    if (!SEQ_LT(una, nxt))
+        return 0;
+
+    for (i = 0; (i < sb->n) && SEQ_LT(sb->blk[i].left, nxt); i++) {
+        if (!sack_hole_lost(sb, i, mss))
+            out += sb->blk[i].left - start;
+        else if (SEQ_LT(start, sb->high_rxt))
+            out += (SEQ_LT(sb->high_rxt, sb->blk[i].left) ? sb->high_rxt : sb->blk[i].left) - start;
+
+        start = sb->blk[i].right;
+    }
+
+    if (SEQ_LT(start, nxt))
+        out += nxt - start;
+
+    return out;
+}
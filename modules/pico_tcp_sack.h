@@ -0,0 +1,60 @@
+/*********************************************************************
+ * PicoTCP-NG
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#ifndef INCLUDE_PICO_TCP_SACK
+#define INCLUDE_PICO_TCP_SACK
+#include "pico_config.h"
+
+/* Intervals kept by the sender; the receiver never reports more than
+ * four blocks per segment, so a few more cover most loss patterns.
+ */
+#define PICO_TCP_SACK_BLOCKS 8
+
+/* RFC 6675 DupThresh */
+#define PICO_TCP_SACK_DUPTHRESH 3u
+
+struct pico_tcp_sack_blk {
+    uint32_t left;
+    uint32_t right;
+};
+
+/* Sender side scoreboard (RFC 6675): SACKed ranges above snd_una,
+ * sorted and disjoint, plus the recovery state that goes with them.
+ */
+struct pico_tcp_scoreboard {
+    struct pico_tcp_sack_blk blk[PICO_TCP_SACK_BLOCKS];
+    uint32_t sacked;         /* bytes covered by blk[] */
+    uint32_t high_rxt;       /* HighRxt: end of the last retransmission */
+    uint32_t recovery_point; /* HighData when recovery started */
+    uint8_t n;
+};
+
+void pico_tcp_sack_reset(struct pico_tcp_scoreboard *sb, uint32_t una);
+int pico_tcp_sack_add(struct pico_tcp_scoreboard *sb, uint32_t una, uint32_t high, uint32_t left, uint32_t right);
+void pico_tcp_sack_advance(struct pico_tcp_scoreboard *sb, uint32_t una);
+int pico_tcp_sack_covered(struct pico_tcp_scoreboard *sb, uint32_t seq, uint32_t len);
+uint32_t pico_tcp_sack_skip(struct pico_tcp_scoreboard *sb, uint32_t seq);
+uint32_t pico_tcp_sack_high(struct pico_tcp_scoreboard *sb, uint32_t una);
+int pico_tcp_sack_is_lost(struct pico_tcp_scoreboard *sb, uint32_t seq, uint32_t mss);
+uint32_t pico_tcp_sack_pipe(struct pico_tcp_scoreboard *sb, uint32_t una, uint32_t nxt, uint32_t mss);
+
+#endif
@@ -0,0 +1 @@
+OPTIONS+=-DPICO_SUPPORT_FRAME_POOL
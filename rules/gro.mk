@@ -0,0 +1,2 @@
+OPTIONS+=-DPICO_SUPPORT_GRO
+MOD_OBJ+=$(LIBBASE)modules/pico_gro.o
@@ -0,0 +1,2 @@
+OPTIONS+=-DPICO_SUPPORT_GSO
+MOD_OBJ+=$(LIBBASE)modules/pico_gso.o
@@ -39,6 +39,7 @@
 #include "pico_6lowpan.h"
 #include "pico_6lowpan_ll.h"
 #include "pico_addressing.h"
+#include "pico_gso.h"
 #define PICO_DEVICE_DEFAULT_MTU (1500)
 
 int pico_dev_cmp(void *ka, void *kb)
@@ -257,6 +258,15 @@ int pico_device_init(struct pico_stack *S, struct pico_device *dev, const char *
     if (!dev->mtu)
         dev->mtu = PICO_DEVICE_DEFAULT_MTU;
 
+#ifdef PICO_SUPPORT_GSO
+    if (!dev->gso_max_size && !PICO_DEV_IS_6LOWPAN(dev))
+        dev->gso_max_size = PICO_GSO_MAX_SIZE;
+#endif
+#ifdef PICO_SUPPORT_GRO
+    if (!PICO_DEV_IS_6LOWPAN(dev))
+        dev->offload |= PICO_DEV_OFFLOAD_GRO;
+#endif
+
 #ifdef PICO_SUPPORT_6LOWPAN
     if (PICO_DEV_IS_6LOWPAN(dev) && LL_MODE_ETHERNET == dev->mode)
         return -1;
@@ -334,18 +344,13 @@ static int check_dev_serve_polling(struct pico_device *dev, int loop_score)
 
 static int devloop_in(struct pico_device *dev, int loop_score)
 {
-    struct pico_frame *f;
-    while(loop_score > 0) {
-        if (dev->q_in->frames == 0)
-            break;
+    struct pico_frame *list;
+    if ((loop_score <= 0) || (dev->q_in->frames == 0))
+        return loop_score;
 
-        /* Receive */
-        f = pico_dequeue(dev->q_in);
-        if (f) {
-            pico_datalink_receive(f);
-            loop_score--;
-        }
-    }
+    /* Receive: hand all pending frames to the datalink layer in one go */
+    list = pico_dequeue_list(dev->q_in, loop_score);
+    loop_score -= pico_datalink_receive_burst(list);
     return loop_score;
 }
 
@@ -355,13 +360,90 @@ static int devloop_sendto_dev(struct pico_device *dev, struct pico_frame *f)
     if (PICO_DEV_IS_6LOWPAN(dev)) {
         return (pico_6lowpan_ll_sendto_dev(dev, f) <= 0);
     }
+#endif
+#ifdef PICO_SUPPORT_GSO
+    if (f->gso_size)
+        return (pico_gso_xmit(dev, f) <= 0);
 #endif
     return (dev->send(dev, f->start, (int)f->len) <= 0);
 }
 
+#define DEV_BURST_MAX 32
+
+/* Offer up to 'max' frames from the head of the output queue to the
+ * driver's send_burst hook and discard the ones it took.
+ * Returns the number of frames sent, 0 if the device is busy.
+ */
+static int devloop_send_burst(struct pico_device *dev, int max)
+{
+    struct pico_frame *burst[DEV_BURST_MAX];
+    struct pico_frame *f = pico_queue_peek(dev->q_out);
+    int n = 0, sent;
+
+    if (max > DEV_BURST_MAX)
+        max = DEV_BURST_MAX;
+
+    while (f && (n < max) && ((uint32_t)n < dev->q_out->frames)) {
+#ifdef PICO_SUPPORT_GSO
+        /* Super-frames are segmented one at a time, unless the driver does it */
+        if (f->gso_size && !(dev->offload & PICO_DEV_OFFLOAD_TSO))
+            break;
+#endif
+        burst[n++] = f;
+        f = f->next;
+    }
+#ifdef PICO_SUPPORT_GSO
+    if ((n == 0) && f && f->gso_size) {
+        if (devloop_sendto_dev(dev, f) != 0)
+            return 0;
+
+        pico_frame_discard(pico_dequeue(dev->q_out));
+        return 1;
+    }
+#endif
+    if (n == 0)
+        return 0;
+
+    sent = dev->send_burst(dev, burst, n);
+    if (sent <= 0)
+        return 0;
+
+    if (sent > n)
+        sent = n;
+
+    f = pico_dequeue_list(dev->q_out, sent);
+    while (f) {
+        struct pico_frame *next = f->next;
+        pico_frame_discard(f); /* SINGLE POINT OF DISCARD for OUTGOING FRAMES */
+        f = next;
+    }
+    return sent;
+}
+
+static int devloop_has_send_burst(struct pico_device *dev)
+{
+#ifdef PICO_SUPPORT_6LOWPAN
+    if (PICO_DEV_IS_6LOWPAN(dev))
+        return 0;
+#endif
+    return (dev->send_burst != NULL);
+}
+
 static int devloop_out(struct pico_device *dev, int loop_score)
 {
     struct pico_frame *f;
+
+    if (devloop_has_send_burst(dev)) {
+        while ((loop_score > 0) && (dev->q_out->frames > 0)) {
+            int sent = devloop_send_burst(dev, loop_score);
+            if (sent == 0)
+                break; /* Busy */
+
+            loop_score -= sent;
+        }
+        return loop_score;
+    }
+
     while(loop_score > 0) {
         if (dev->q_out->frames == 0)
             break;
@@ -389,6 +471,17 @@ static void devloop_all_out(struct pico_stack *S, void *arg)
     struct pico_device *dev = (struct pico_device *)arg;
     struct pico_frame *f;
     (void)S;
+
+    if (devloop_has_send_burst(dev)) {
+        while (dev->q_out->frames > 0) {
+            if (devloop_send_burst(dev, DEV_BURST_MAX) == 0) {
+                pico_schedule_job(dev->stack, devloop_all_out, dev);
+                break;
+            }
+        }
+        return;
+    }
+
     while(1) {
         if (dev->q_out->frames <= 0)
             break;
@@ -32,10 +32,210 @@
 #include "pico_stack.h"
 #include "pico_socket.h"
 
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
 #ifdef PICO_SUPPORT_DEBUG_MEMORY
 static int n_frames_allocated;
 #endif
 
+#ifdef PICO_SUPPORT_FRAME_POOL
+static const uint32_t frame_pool_class_size[PICO_FRAME_POOL_CLASSES] = {
+    PICO_FRAME_POOL_SMALL, PICO_FRAME_POOL_MTU, PICO_FRAME_POOL_JUMBO
+};
+
+/* Free objects are chained through their first word. For frame headers
+ * that is the 'next' queue connector.
+ */
+static void *frame_pool_get(void **list, struct pico_frame_pool_stats *st, size_t size, size_t zero)
+{
+    void *obj = *list;
+    if (obj) {
+        *list = *(void **)obj;
+        st->cached--;
+        st->hits++;
+        memset(obj, 0, zero);
+    } else {
+        obj = PICO_ZALLOC(size);
+        if (!obj)
+            return NULL;
+
+        st->misses++;
+    }
+
+    if (++st->in_use > st->peak)
+        st->peak = st->in_use;
+
+    return obj;
+}
+
+static void frame_pool_put(struct pico_frame_pool *pool, void **list, struct pico_frame_pool_stats *st, void *obj)
+{
+    st->in_use--;
+    if (st->cached >= pool->max_cached) {
+        PICO_FREE(obj);
+        return;
+    }
+
+    *(void **)obj = *list;
+    *list = obj;
+    st->cached++;
+}
+
+static void frame_pool_flush(void **list, struct pico_frame_pool_stats *st)
+{
+    void *obj;
+    while (*list) {
+        obj = *list;
+        *list = *(void **)obj;
+        PICO_FREE(obj);
+    }
+    st->cached = 0;
+}
+
+static int frame_pool_class(uint32_t size)
+{
+    int i;
+    for (i = 0; i < PICO_FRAME_POOL_CLASSES; i++) {
+        if (size <= frame_pool_class_size[i])
+            return i;
+    }
+    return -1;
+}
+
+void pico_frame_pool_init(struct pico_frame_pool *pool, uint32_t max_cached)
+{
+    memset(pool, 0, sizeof(struct pico_frame_pool));
+    pool->max_cached = max_cached;
+}
+
+void pico_frame_pool_destroy(struct pico_frame_pool *pool)
+{
+    int i;
+    frame_pool_flush(&pool->frames, &pool->frame_stats);
+    for (i = 0; i < PICO_FRAME_POOL_CLASSES; i++)
+        frame_pool_flush(&pool->buffers[i], &pool->buffer_stats[i]);
+    frame_pool_flush(&pool->counters, &pool->counter_stats);
+}
+#endif
+
+/* Round 'size' up so that the usage counter placed after it is aligned */
+static uint32_t frame_buffer_size(uint32_t size)
+{
+    unsigned int align = size % sizeof(uint32_t);
+    if (align)
+        size += (uint32_t)sizeof(uint32_t) - align;
+
+    return size;
+}
+
+static struct pico_frame *frame_header_alloc(struct pico_frame_pool *pool)
+{
+    struct pico_frame *f;
+#ifdef PICO_SUPPORT_FRAME_POOL
+    if (pool) {
+        f = frame_pool_get(&pool->frames, &pool->frame_stats, sizeof(struct pico_frame), sizeof(struct pico_frame));
+        if (f)
+            f->pool = pool;
+
+        return f;
+    }
+#else
+    IGNORE_PARAMETER(pool);
+#endif
+    f = PICO_ZALLOC(sizeof(struct pico_frame));
+    return f;
+}
+
+static void frame_header_free(struct pico_frame *f)
+{
+#ifdef PICO_SUPPORT_FRAME_POOL
+    if (f->pool) {
+        frame_pool_put(f->pool, &f->pool->frames, &f->pool->frame_stats, f);
+        return;
+    }
+#endif
+    PICO_FREE(f);
+}
+
+/* Attach a new buffer of 'size' bytes, with the usage counter at its end */
+static int frame_buffer_alloc(struct pico_frame *f, struct pico_frame_pool *pool, uint32_t size)
+{
+    uint32_t frame_buffer_len = frame_buffer_size(size);
+#ifdef PICO_SUPPORT_FRAME_POOL
+    int cls = pool ? frame_pool_class(size) : -1;
+    if (cls >= 0) {
+        frame_buffer_len = frame_buffer_size(frame_pool_class_size[cls]);
+        f->buffer = frame_pool_get(&pool->buffers[cls], &pool->buffer_stats[cls],
+                                   (size_t)frame_buffer_len + sizeof(uint32_t), (size_t)size);
+        if (!f->buffer)
+            return -1;
+
+        f->pool_class = (uint8_t)(cls + 1);
+        f->usage_count = (uint32_t *)(((uint8_t*)f->buffer) + frame_buffer_len);
+        return 0;
+    }
+
+    f->pool_class = 0;
+#else
+    IGNORE_PARAMETER(pool);
+#endif
+    f->buffer = PICO_ZALLOC((size_t)frame_buffer_len + sizeof(uint32_t));
+    if (!f->buffer)
+        return -1;
+
+    f->usage_count = (uint32_t *)(((uint8_t*)f->buffer) + frame_buffer_len);
+    return 0;
+}
+
+static void frame_buffer_free(struct pico_frame *f, uint8_t *buf, uint8_t pool_class)
+{
+#ifdef PICO_SUPPORT_FRAME_POOL
+    if (pool_class && f->pool) {
+        frame_pool_put(f->pool, &f->pool->buffers[pool_class - 1], &f->pool->buffer_stats[pool_class - 1], buf);
+        return;
+    }
+#else
+    IGNORE_PARAMETER(f);
+    IGNORE_PARAMETER(pool_class);
+#endif
+    PICO_FREE(buf);
+}
+
+static uint32_t *frame_counter_alloc(struct pico_frame_pool *pool)
+{
+#ifdef PICO_SUPPORT_FRAME_POOL
+    /* Counters double as list links while cached */
+    if (pool)
+        return frame_pool_get(&pool->counters, &pool->counter_stats, sizeof(void *), sizeof(void *));
+#else
+    IGNORE_PARAMETER(pool);
+#endif
+    return PICO_ZALLOC(sizeof(uint32_t));
+}
+
+static void frame_counter_free(struct pico_frame *f, uint32_t *counter)
+{
+#ifdef PICO_SUPPORT_FRAME_POOL
+    if (f->pool) {
+        frame_pool_put(f->pool, &f->pool->counters, &f->pool->counter_stats, counter);
+        return;
+    }
+#else
+    IGNORE_PARAMETER(f);
+#endif
+    PICO_FREE(counter);
+}
+
+#ifdef PICO_SUPPORT_FRAME_POOL
+#define FRAME_POOL_CLASS(f) ((f)->pool_class)
+#else
+#define FRAME_POOL_CLASS(f) (0u)
+#endif
+
 /** frame alloc/dealloc/copy **/
 void pico_frame_discard(struct pico_frame *f)
 {
@@ -45,14 +245,14 @@ void pico_frame_discard(struct pico_frame *f)
     (*f->usage_count)--;
     if (*f->usage_count == 0) {
         if (f->flags & PICO_FRAME_FLAG_EXT_USAGE_COUNTER)
-            PICO_FREE(f->usage_count);
+            frame_counter_free(f, f->usage_count);
 
 #ifdef PICO_SUPPORT_DEBUG_MEMORY
         dbg("Discarded buffer @%p, caller: %p\n", f->buffer, __builtin_return_address(3));
         dbg("DEBUG MEMORY: %d frames in use.\n", --n_frames_allocated);
 #endif
         if (!(f->flags & PICO_FRAME_FLAG_EXT_BUFFER))
-            PICO_FREE(f->buffer);
+            frame_buffer_free(f, f->buffer, FRAME_POOL_CLASS(f));
         else if (f->notify_free)
             f->notify_free(f->buffer);
 
@@ -65,12 +265,16 @@ void pico_frame_discard(struct pico_frame *f)
         dbg("Removed frame @%p(copy), usage count now: %d\n", f, *f->usage_count);
     }
 #endif
-    PICO_FREE(f);
+    frame_header_free(f);
 }
 
 struct pico_frame *pico_frame_copy(struct pico_frame *f)
 {
-    struct pico_frame *new = PICO_ZALLOC(sizeof(struct pico_frame));
+#ifdef PICO_SUPPORT_FRAME_POOL
+    struct pico_frame *new = frame_header_alloc(f->pool);
+#else
+    struct pico_frame *new = frame_header_alloc(NULL);
+#endif
     if (!new)
         return NULL;
 
@@ -83,40 +287,30 @@ struct pico_frame *pico_frame_copy(struct pico_frame *f)
     return new;
 }
 
-static struct pico_frame *pico_frame_do_alloc(uint32_t size, int zerocopy, int ext_buffer)
+static struct pico_frame *pico_frame_do_alloc(struct pico_frame_pool *pool, uint32_t size, int zerocopy, int ext_buffer)
 {
     struct pico_frame *p = NULL;
-    uint32_t frame_buffer_size = size;
 
     if (ext_buffer && !zerocopy) {
         /* external buffer implies zerocopy flag! */
         return NULL;
     }
 
-    p = PICO_ZALLOC(sizeof(struct pico_frame));
+    p = frame_header_alloc(pool);
     if (!p)
         return NULL;
 
     if (!zerocopy) {
-        unsigned int align = size % sizeof(uint32_t);
-        /* Ensure that usage_count starts on an aligned address */
-        if (align) {
-            frame_buffer_size += (uint32_t)sizeof(uint32_t) - align;
-        }
-
-        p->buffer = PICO_ZALLOC((size_t)frame_buffer_size + sizeof(uint32_t));
-        if (!p->buffer) {
-            PICO_FREE(p);
+        if (frame_buffer_alloc(p, pool, size) < 0) {
+            frame_header_free(p);
             return NULL;
         }
-
-        p->usage_count = (uint32_t *)(((uint8_t*)p->buffer) + frame_buffer_size);
     } else {
         p->buffer = NULL;
         p->flags |= PICO_FRAME_FLAG_EXT_USAGE_COUNTER;
-        p->usage_count = PICO_ZALLOC(sizeof(uint32_t));
+        p->usage_count = frame_counter_alloc(pool);
         if (!p->usage_count) {
-            PICO_FREE(p);
+            frame_header_free(p);
             return NULL;
         }
     }
@@ -145,49 +339,54 @@ static struct pico_frame *pico_frame_do_alloc(uint32_t size, int zerocopy, int e
 
 struct pico_frame *pico_frame_alloc(uint32_t size)
 {
-    return pico_frame_do_alloc(size, 0, 0);
+    return pico_frame_do_alloc(NULL, size, 0, 0);
+}
+
+/* Like pico_frame_alloc(), taking header and buffer from 'pool' when not NULL */
+struct pico_frame *pico_frame_alloc_pool(struct pico_frame_pool *pool, uint32_t size)
+{
+    return pico_frame_do_alloc(pool, size, 0, 0);
 }
 
 static uint8_t *
-pico_frame_new_buffer(struct pico_frame *f, uint32_t size, uint32_t *oldsize)
+pico_frame_new_buffer(struct pico_frame *f, uint32_t size, uint32_t *oldsize, uint8_t *oldclass)
 {
     uint8_t *oldbuf;
     uint32_t usage_count, *p_old_usage;
-    uint32_t frame_buffer_size;
-    unsigned int align;
 
     if (!f || (size < f->buffer_len)) {
         return NULL;
     }
 
-    align = size % sizeof(uint32_t);
-    frame_buffer_size = size;
-    if (align) {
-        frame_buffer_size += (uint32_t)sizeof(uint32_t) - align;
-    }
-
     oldbuf = f->buffer;
     *oldsize = f->buffer_len;
+    *oldclass = FRAME_POOL_CLASS(f);
     usage_count = *(f->usage_count);
     p_old_usage = f->usage_count;
-    f->buffer = PICO_ZALLOC((size_t)frame_buffer_size + sizeof(uint32_t));
-    if (!f->buffer) {
+#ifdef PICO_SUPPORT_FRAME_POOL
+    if (frame_buffer_alloc(f, f->pool, size) < 0) {
+#else
+    if (frame_buffer_alloc(f, NULL, size) < 0) {
+#endif
         f->buffer = oldbuf;
+        f->usage_count = p_old_usage;
+#ifdef PICO_SUPPORT_FRAME_POOL
+        f->pool_class = *oldclass;
+#endif
         return NULL;
     }
 
-    f->usage_count = (uint32_t *)(((uint8_t*)f->buffer) + frame_buffer_size);
     *f->usage_count = usage_count;
     f->buffer_len = size;
 
     if (f->flags & PICO_FRAME_FLAG_EXT_USAGE_COUNTER)
-        PICO_FREE(p_old_usage);
+        frame_counter_free(f, p_old_usage);
     /* Now, the frame is not zerocopy anymore, and the usage counter has been moved within it */
     return oldbuf;
 }
 
 static int
-pico_frame_update_pointers(struct pico_frame *f, ptrdiff_t addr_diff, uint8_t *oldbuf)
+pico_frame_update_pointers(struct pico_frame *f, ptrdiff_t addr_diff, uint8_t *oldbuf, uint8_t oldclass)
 {
     f->net_hdr += addr_diff;
     f->datalink_hdr += addr_diff;
@@ -197,7 +396,7 @@ pico_frame_update_pointers(struct pico_frame *f, ptrdiff_t addr_diff, uint8_t *o
     f->payload += addr_diff;
 
     if (!(f->flags & PICO_FRAME_FLAG_EXT_BUFFER))
-        PICO_FREE(oldbuf);
+        frame_buffer_free(f, oldbuf, oldclass);
     else if (f->notify_free)
         f->notify_free(oldbuf);
 
@@ -209,7 +408,8 @@ int pico_frame_grow_head(struct pico_frame *f, uint32_t size)
 {
     ptrdiff_t addr_diff = 0;
     uint32_t oldsize = 0;
-    uint8_t *oldbuf = pico_frame_new_buffer(f, size, &oldsize);
+    uint8_t oldclass = 0;
+    uint8_t *oldbuf = pico_frame_new_buffer(f, size, &oldsize, &oldclass);
     if (!oldbuf)
         return -1;
 
@@ -217,14 +417,15 @@ int pico_frame_grow_head(struct pico_frame *f, uint32_t size)
     memcpy(f->buffer + f->buffer_len - oldsize, oldbuf, (size_t)oldsize);
     addr_diff = (ptrdiff_t)(f->buffer + f->buffer_len - oldsize - oldbuf);
 
-    return pico_frame_update_pointers(f, addr_diff, oldbuf);
+    return pico_frame_update_pointers(f, addr_diff, oldbuf, oldclass);
 }
 
 int pico_frame_grow(struct pico_frame *f, uint32_t size)
 {
     ptrdiff_t addr_diff = 0;
     uint32_t oldsize = 0;
-    uint8_t *oldbuf = pico_frame_new_buffer(f, size, &oldsize);
+    uint8_t oldclass = 0;
+    uint8_t *oldbuf = pico_frame_new_buffer(f, size, &oldsize, &oldclass);
     if (!oldbuf)
         return -1;
 
@@ -232,12 +433,17 @@ int pico_frame_grow(struct pico_frame *f, uint32_t size)
     memcpy(f->buffer, oldbuf, (size_t)oldsize);
     addr_diff = (ptrdiff_t)(f->buffer - oldbuf);
 
-    return pico_frame_update_pointers(f, addr_diff, oldbuf);
+    return pico_frame_update_pointers(f, addr_diff, oldbuf, oldclass);
 }
 
 struct pico_frame *pico_frame_alloc_skeleton(uint32_t size, int ext_buffer)
 {
-    return pico_frame_do_alloc(size, 1, ext_buffer);
+    return pico_frame_do_alloc(NULL, size, 1, ext_buffer);
+}
+
+struct pico_frame *pico_frame_alloc_skeleton_pool(struct pico_frame_pool *pool, uint32_t size, int ext_buffer)
+{
+    return pico_frame_do_alloc(pool, size, 1, ext_buffer);
 }
 
 int pico_frame_skeleton_set_buffer(struct pico_frame *f, void *buf)
@@ -250,9 +456,55 @@ int pico_frame_skeleton_set_buffer(struct pico_frame *f, void *buf)
     return 0;
 }
 
+/* Move a frame that nobody else references onto a caller-owned buffer of
+ * 'len' bytes. The current contents are copied to the front of 'buf' and
+ * header pointers keep their offsets; notify_free(buf) is called when the
+ * last copy is discarded.
+ */
+int pico_frame_set_ext_buffer(struct pico_frame *f, uint8_t *buf, uint32_t len, void (*notify_free)(uint8_t *))
+{
+    uint8_t *oldbuf;
+    uint8_t oldclass;
+    uint32_t *counter;
+
+    if (!f || !buf || (*f->usage_count != 1) || (f->flags & PICO_FRAME_FLAG_EXT_BUFFER) || (len < f->buffer_len))
+        return -1;
+
+#ifdef PICO_SUPPORT_FRAME_POOL
+    counter = frame_counter_alloc(f->pool);
+#else
+    counter = frame_counter_alloc(NULL);
+#endif
+    if (!counter)
+        return -1;
+
+    if (f->flags & PICO_FRAME_FLAG_EXT_USAGE_COUNTER)
+        frame_counter_free(f, f->usage_count);
+
+    oldbuf = f->buffer;
+    oldclass = FRAME_POOL_CLASS(f);
+    memcpy(buf, oldbuf, f->buffer_len);
+    *counter = 1;
+    f->usage_count = counter;
+    f->buffer = buf;
+    f->buffer_len = len;
+#ifdef PICO_SUPPORT_FRAME_POOL
+    f->pool_class = 0;
+#endif
+    pico_frame_update_pointers(f, (ptrdiff_t)(buf - oldbuf), oldbuf, oldclass);
+    f->flags = PICO_FRAME_FLAG_EXT_BUFFER | PICO_FRAME_FLAG_EXT_USAGE_COUNTER;
+    f->notify_free = notify_free;
+    return 0;
+}
+
 struct pico_frame *pico_frame_deepcopy(struct pico_frame *f)
 {
+#ifdef PICO_SUPPORT_FRAME_POOL
+    struct pico_frame *new = pico_frame_alloc_pool(f->pool, f->buffer_len);
+    uint8_t pool_class;
+#else
     struct pico_frame *new = pico_frame_alloc(f->buffer_len);
+#endif
     ptrdiff_t addr_diff;
     unsigned char *buf;
     uint32_t *uc;
@@ -262,6 +514,9 @@ struct pico_frame *pico_frame_deepcopy(struct pico_frame *f)
     /* Save the two key pointers... */
     buf = new->buffer;
     uc  = new->usage_count;
+#ifdef PICO_SUPPORT_FRAME_POOL
+    pool_class = new->pool_class;
+#endif
 
     /* Overwrite all fields with originals */
     memcpy(new, f, sizeof(struct pico_frame));
@@ -269,6 +524,12 @@ struct pico_frame *pico_frame_deepcopy(struct pico_frame *f)
     /* ...restore the two key pointers */
     new->buffer = buf;
     new->usage_count = uc;
+#ifdef PICO_SUPPORT_FRAME_POOL
+    new->pool_class = pool_class;
+#endif
+    /* The copy owns a regular buffer with an embedded counter */
+    new->flags = (uint8_t)(new->flags & ~(PICO_FRAME_FLAG_EXT_BUFFER | PICO_FRAME_FLAG_EXT_USAGE_COUNTER));
+    new->notify_free = NULL;
 
     /* Update in-buffer pointers with offset */
     addr_diff = (ptrdiff_t)(new->buffer - f->buffer);
@@ -296,26 +557,116 @@ struct pico_frame *pico_frame_deepcopy(struct pico_frame *f)
 }
 
 
+/* Checksum accumulation works on whole machine words: by RFC 1071 the
+ * one's complement sum of 16-bit words can be computed on any wider word
+ * and folded down afterwards. Vector variants are picked at build time
+ * from the compiler's target flags; the scalar path handles the tail.
+ */
+static inline uint64_t pico_checksum_fold64(uint64_t acc)
+{
+    acc = (acc & 0xFFFFFFFFu) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFFu) + (acc >> 32);
+    return acc;
+}
+
+#if defined(__AVX2__)
+static inline uint64_t pico_checksum_vector(uint64_t acc, const uint8_t **data, uint32_t *len)
+{
+    const uint8_t *p = *data;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i sum = _mm256_setzero_si256();
+    uint64_t lanes[4];
+
+    while (*len >= 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(const void *)p);
+        sum = _mm256_add_epi64(sum, _mm256_unpacklo_epi32(v, zero));
+        sum = _mm256_add_epi64(sum, _mm256_unpackhi_epi32(v, zero));
+        p += 32;
+        *len -= 32;
+    }
+    _mm256_storeu_si256((__m256i *)(void *)lanes, sum);
+    *data = p;
+    return acc + pico_checksum_fold64(lanes[0]) + pico_checksum_fold64(lanes[1]) +
+           pico_checksum_fold64(lanes[2]) + pico_checksum_fold64(lanes[3]);
+}
+#elif defined(__SSE2__)
+static inline uint64_t pico_checksum_vector(uint64_t acc, const uint8_t **data, uint32_t *len)
+{
+    const uint8_t *p = *data;
+    __m128i zero = _mm_setzero_si128();
+    __m128i sum = _mm_setzero_si128();
+    uint64_t lanes[2];
+
+    while (*len >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(const void *)p);
+        sum = _mm_add_epi64(sum, _mm_unpacklo_epi32(v, zero));
+        sum = _mm_add_epi64(sum, _mm_unpackhi_epi32(v, zero));
+        p += 16;
+        *len -= 16;
+    }
+    _mm_storeu_si128((__m128i *)(void *)lanes, sum);
+    *data = p;
+    return acc + pico_checksum_fold64(lanes[0]) + pico_checksum_fold64(lanes[1]);
+}
+#elif defined(__ARM_NEON)
+static inline uint64_t pico_checksum_vector(uint64_t acc, const uint8_t **data, uint32_t *len)
+{
+    const uint8_t *p = *data;
+    uint64x2_t sum = vdupq_n_u64(0);
+
+    while (*len >= 16) {
+        sum = vpadalq_u32(sum, vreinterpretq_u32_u8(vld1q_u8(p)));
+        p += 16;
+        *len -= 16;
+    }
+    *data = p;
+    return acc + pico_checksum_fold64(vgetq_lane_u64(sum, 0)) + pico_checksum_fold64(vgetq_lane_u64(sum, 1));
+}
+#endif
+
 static inline uint32_t pico_checksum_adder(uint32_t sum, void *data, uint32_t len)
 {
-    uint16_t *buf = (uint16_t *)data;
-    uint16_t *stop;
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t acc = sum;
+    uint64_t w64;
+    uint32_t w32;
+    uint16_t w16;
+
+#if defined(__AVX2__) || defined(__SSE2__) || defined(__ARM_NEON)
+    acc = pico_checksum_vector(acc, &p, &len);
+#endif
+
+    while (len >= 8) {
+        memcpy(&w64, p, sizeof(w64));
+        acc += w64;
+        acc += (acc < w64); /* end-around carry */
+        p += 8;
+        len -= 8;
+    }
+    acc = pico_checksum_fold64(acc);
+    if (len >= 4) {
+        memcpy(&w32, p, sizeof(w32));
+        acc += w32;
+        p += 4;
+        len -= 4;
+    }
+
+    if (len >= 2) {
+        memcpy(&w16, p, sizeof(w16));
+        acc += w16;
+        p += 2;
+        len -= 2;
+    }
 
-    if (len & 0x01) {
-        --len;
+    if (len) {
 #ifdef PICO_BIGENDIAN
-        sum += (((uint8_t *)data)[len]) << 8;
+        acc += (uint32_t)(*p) << 8;
 #else
-        sum += ((uint8_t *)data)[len];
+        acc += *p;
 #endif
     }
 
-    stop = (uint16_t *)(((uint8_t *)data) + len);
-
-    while (buf < stop) {
-        sum += *buf++;
-    }
-    return sum;
+    return (uint32_t)pico_checksum_fold64(acc);
 }
 
 static inline uint16_t pico_checksum_finalize(uint32_t sum)
@@ -347,3 +698,26 @@ uint16_t pico_dualbuffer_checksum(void *inbuf1, uint32_t len1, void *inbuf2, uin
     return pico_checksum_finalize(sum);
 }
 
+/**
+ * Update a checksum after a 16-bit word of the covered data changed from
+ * old_val to new_val, without touching the rest of the data (RFC 1624,
+ * eqn. 3). Checksum and words are taken as they appear in the packet.
+ */
+uint16_t pico_checksum_adjust16(uint16_t crc, uint16_t old_val, uint16_t new_val)
+{
+    uint32_t sum = (uint16_t)~crc;
+
+    sum += (uint16_t)~old_val;
+    sum += new_val;
+    sum = (sum & 0x0000FFFF) + (sum >> 16);
+    sum = (sum & 0x0000FFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/* Same as above for a 32-bit field, e.g. an IPv4 address */
+uint16_t pico_checksum_adjust32(uint16_t crc, uint32_t old_val, uint32_t new_val)
+{
+    crc = pico_checksum_adjust16(crc, (uint16_t)(old_val >> 16), (uint16_t)(new_val >> 16));
+    return pico_checksum_adjust16(crc, (uint16_t)old_val, (uint16_t)new_val);
+}
+
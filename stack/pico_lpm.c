@@ -0,0 +1,276 @@
+/*********************************************************************
+ * PicoTCP-NG 
+ * Copyright (c) 2020 Daniele Lacamera <root@danielinux.net>
+ *
+ * SPDX-License-Identifier: GPL-2.0-only OR GPL-3.0-only
+ *
+ * PicoTCP-NG is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) version 3.
+ *
+ * PicoTCP-NG is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1335, USA
+ *
+ *
+ *********************************************************************/
+#include "pico_config.h"
+#include "pico_lpm.h"
+
+static inline uint8_t lpm_bit(const uint8_t *key, uint8_t pos)
+{
+    return (uint8_t)((key[pos >> 3] >> (7u - (pos & 7u))) & 1u);
+}
+
+/* Number of leading bits shared by a and b, at most 'max' */
+static uint8_t lpm_common_bits(const uint8_t *a, const uint8_t *b, uint8_t max)
+{
+    uint8_t i = 0;
+    uint8_t x;
+
+    while ((uint8_t)(i + 8u) <= max) {
+        x = (uint8_t)(a[i >> 3] ^ b[i >> 3]);
+        if (x)
+            break;
+
+        i = (uint8_t)(i + 8u);
+    }
+    while ((i < max) && (lpm_bit(a, i) == lpm_bit(b, i)))
+        i++;
+    return i;
+}
+
+static int lpm_prefix_match(const uint8_t *prefix, const uint8_t *key, uint8_t plen)
+{
+    uint8_t bytes = (uint8_t)(plen >> 3);
+    uint8_t rem = (uint8_t)(plen & 7u);
+
+    if (bytes && memcmp(prefix, key, bytes))
+        return 0;
+
+    if (rem) {
+        uint8_t mask = (uint8_t)(0xFFu << (8u - rem));
+        if ((prefix[bytes] ^ key[bytes]) & mask)
+            return 0;
+    }
+
+    return 1;
+}
+
+static struct pico_lpm_node *lpm_node_new(struct pico_lpm *t, const uint8_t *key, uint8_t plen, void *value)
+{
+    struct pico_lpm_node *n = PICO_ZALLOC(sizeof(struct pico_lpm_node));
+    uint8_t i;
+    if (!n)
+        return NULL;
+
+    /* Store the key masked to the prefix length */
+    for (i = 0; i < t->keylen; i++) {
+        if ((uint8_t)(i << 3) + 8u <= plen)
+            n->key[i] = key[i];
+        else if ((uint8_t)(i << 3) < plen)
+            n->key[i] = (uint8_t)(key[i] & (0xFFu << (8u - (plen & 7u))));
+    }
+    n->plen = plen;
+    n->value = value;
+    return n;
+}
+
+void pico_lpm_init(struct pico_lpm *t, uint8_t keylen)
+{
+    t->root = NULL;
+    t->count = 0;
+    t->keylen = keylen;
+}
+
+int pico_lpm_insert(struct pico_lpm *t, const uint8_t *key, uint8_t plen, void *value)
+{
+    struct pico_lpm_node **pp = &t->root;
+    struct pico_lpm_node *n, *leaf, *glue;
+    uint8_t common;
+
+    if (!value || (plen > (uint8_t)(t->keylen << 3)))
+        return -1;
+
+    while (1) {
+        n = *pp;
+        if (!n) {
+            leaf = lpm_node_new(t, key, plen, value);
+            if (!leaf)
+                return -1;
+
+            *pp = leaf;
+            t->count++;
+            return 0;
+        }
+
+        common = lpm_common_bits(n->key, key, (n->plen < plen) ? n->plen : plen);
+        if (common == n->plen) {
+            if (n->plen == plen) {
+                if (!n->value)
+                    t->count++;
+
+                n->value = value;
+                return 0;
+            }
+
+            pp = &n->child[lpm_bit(key, n->plen)];
+            continue;
+        }
+
+        /* n is not a prefix of key: split above n */
+        if (common == plen) {
+            leaf = lpm_node_new(t, key, plen, value);
+            if (!leaf)
+                return -1;
+
+            leaf->child[lpm_bit(n->key, plen)] = n;
+            *pp = leaf;
+            t->count++;
+            return 0;
+        }
+
+        glue = lpm_node_new(t, key, common, NULL);
+        leaf = lpm_node_new(t, key, plen, value);
+        if (!glue || !leaf) {
+            if (glue)
+                PICO_FREE(glue);
+
+            if (leaf)
+                PICO_FREE(leaf);
+
+            return -1;
+        }
+
+        glue->child[lpm_bit(key, common)] = leaf;
+        glue->child[lpm_bit(n->key, common)] = n;
+        *pp = glue;
+        t->count++;
+        return 0;
+    }
+}
+
+/* Drop n if it no longer carries a value and has at most one child */
+static void lpm_compact(struct pico_lpm_node **pp)
+{
+    struct pico_lpm_node *n = *pp;
+    if (!n || n->value || (n->child[0] && n->child[1]))
+        return;
+
+    *pp = n->child[0] ? n->child[0] : n->child[1];
+    PICO_FREE(n);
+}
+
+static void *lpm_remove(struct pico_lpm *t, struct pico_lpm_node **pp, const uint8_t *key, uint8_t plen)
+{
+    struct pico_lpm_node *n = *pp;
+    void *value;
+
+    if (!n || (n->plen > plen) || !lpm_prefix_match(n->key, key, n->plen))
+        return NULL;
+
+    if (n->plen == plen) {
+        value = n->value;
+        if (value) {
+            n->value = NULL;
+            t->count--;
+            lpm_compact(pp);
+        }
+
+        return value;
+    }
+
+    value = lpm_remove(t, &n->child[lpm_bit(key, n->plen)], key, plen);
+    if (value)
+        lpm_compact(pp);
+
+    return value;
+}
+
+void *pico_lpm_remove(struct pico_lpm *t, const uint8_t *key, uint8_t plen)
+{
+    return lpm_remove(t, &t->root, key, plen);
+}
+
+void *pico_lpm_get(struct pico_lpm *t, const uint8_t *key, uint8_t plen)
+{
+    struct pico_lpm_node *n = t->root;
+
+    while (n && (n->plen <= plen) && lpm_prefix_match(n->key, key, n->plen)) {
+        if (n->plen == plen)
+            return n->value;
+
+        n = n->child[lpm_bit(key, n->plen)];
+    }
+    return NULL;
+}
+
+void *pico_lpm_lookup(struct pico_lpm *t, const uint8_t *key)
+{
+    struct pico_lpm_node *n = t->root;
+    uint8_t maxbits = (uint8_t)(t->keylen << 3);
+    void *best = NULL;
+
+    while (n && lpm_prefix_match(n->key, key, n->plen)) {
+        if (n->value)
+            best = n->value;
+
+        if (n->plen >= maxbits)
+            break;
+
+        n = n->child[lpm_bit(key, n->plen)];
+    }
+    return best;
+}
+
+static void lpm_destroy(struct pico_lpm_node *n)
+{
+    if (!n)
+        return;
+
+    lpm_destroy(n->child[0]);
+    lpm_destroy(n->child[1]);
+    PICO_FREE(n);
+}
+
+void pico_lpm_destroy(struct pico_lpm *t)
+{
+    lpm_destroy(t->root);
+    t->root = NULL;
+    t->count = 0;
+}
+
+int pico_lpm_mask_len(const uint8_t *mask, uint8_t keylen)
+{
+    uint8_t i;
+    int len = 0;
+
+    for (i = 0; i < keylen; i++) {
+        uint8_t b = mask[i];
+        if (b == 0xFFu) {
+            len += 8;
+            continue;
+        }
+
+        /* Leading ones, then all-zero for the remainder */
+        while (b & 0x80u) {
+            len++;
+            b = (uint8_t)(b << 1);
+        }
+        if (b)
+            return -1;
+
+        for (i++; i < keylen; i++) {
+            if (mask[i])
+                return -1;
+        }
+        break;
+    }
+    return len;
+}
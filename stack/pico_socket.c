@@ -340,6 +340,23 @@ static int pico_generic_port_in_use(uint16_t proto, uint16_t port, struct pico_s
     return 0;
 }
 
+/* A TCP port stays taken while a connection on it is in TIME_WAIT */
+static int pico_port_in_timewait(struct pico_stack *S, uint16_t proto, uint16_t port, void *addr, void *net)
+{
+#ifdef PICO_SUPPORT_TCP
+    if (proto == PICO_PROTO_TCP)
+        return pico_tcp_timewait_port_in_use(S, port, addr, net ? ((struct pico_protocol *)net)->proto_number : 0);
+
+#else
+    IGNORE_PARAMETER(S);
+    IGNORE_PARAMETER(proto);
+    IGNORE_PARAMETER(port);
+    IGNORE_PARAMETER(addr);
+    IGNORE_PARAMETER(net);
+#endif
+    return 0;
+}
+
 int pico_is_port_free(struct pico_stack *S, uint16_t proto, uint16_t port, void *addr, void *net)
 {
     struct pico_sockport *sp;
@@ -348,6 +365,9 @@ int pico_is_port_free(struct pico_stack *S, uint16_t proto, uint16_t port, void
     if (pico_generic_port_in_use(proto, port, sp, addr, net))
         return 0;
 
+    if (pico_port_in_timewait(S, proto, port, addr, net))
+        return 0;
+
     return 1;
 }
 
@@ -443,6 +463,10 @@ int8_t pico_socket_add(struct pico_socket *s)
 		PICOTCP_MUTEX_UNLOCK(s->stack->SockMutex);
 		return -1;
 	}
+#ifdef PICO_SUPPORT_TCP
+    if (PROTO(s) == PICO_PROTO_TCP)
+        pico_socket_tcp_hash_add(s);
+#endif
     s->state |= PICO_SOCKET_STATE_BOUND;
     PICOTCP_MUTEX_UNLOCK(s->stack->SockMutex);
 #ifdef DEBUG_SOCKET_TREE
@@ -459,6 +483,8 @@ int8_t pico_socket_add(struct pico_socket *s)
     return 0;
 }
 
+static void pico_socket_active_del(struct pico_socket *s);
+
 static void socket_clean_queues(struct pico_socket *sock)
 {
     struct pico_frame *f_in = pico_dequeue(&sock->q_in);
@@ -487,6 +513,7 @@ static void socket_garbage_collect(pico_time now, void *arg)
     struct pico_socket *s = (struct pico_socket *) arg;
     IGNORE_PARAMETER(now);
 
+    pico_socket_active_del(s);
     socket_clean_queues(s);
     PICO_FREE(s);
 }
@@ -508,12 +535,6 @@ static void pico_socket_check_empty_sockport(struct pico_socket *s, struct pico_
         }
 #endif
 
-        if(s->stack->sp_tcp == sp)
-            s->stack->sp_tcp = NULL;
-
-        if(s->stack->sp_udp == sp)
-            s->stack->sp_udp = NULL;
-
         PICO_FREE(sp);
     }
 }
@@ -533,6 +554,7 @@ int8_t pico_socket_del(struct pico_socket *s)
     pico_multicast_delete(s);
 #endif
     pico_socket_tcp_delete(s);
+    pico_socket_active_del(s);
     s->state = PICO_SOCKET_STATE_CLOSED;
     if (!pico_timer_add(s->stack, (pico_time)10, socket_garbage_collect, s)) {
         dbg("SOCKET: Failed to start garbage collect timer, doing garbage collection now\n");
@@ -602,6 +624,12 @@ static int pico_socket_deliver(struct pico_stack *S, struct pico_protocol *p, st
 
     sp = pico_get_sockport(S, p->proto_number, localport);
     if (!sp) {
+#ifdef PICO_SUPPORT_TCP
+        /* The last socket on the port may have gone to TIME_WAIT */
+        if ((p->proto_number == PICO_PROTO_TCP) && (pico_tcp_timewait_input(S, f) == 0))
+            return 0;
+
+#endif
         dbg("No such port %d\n", short_be(localport));
         return -1;
     }
@@ -793,6 +821,55 @@ int pico_socket_read(struct pico_socket *s, void *buf, int len)
     return pico_socket_transport_read(s, buf, len);
 }
 
+static int pico_socket_read_zc_check(struct pico_socket *s)
+{
+    if (!s || (pico_check_socket(s) != 0)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if ((s->state & PICO_SOCKET_STATE_BOUND) == 0) {
+        pico_err = PICO_ERR_EIO;
+        return -1;
+    }
+
+    if (PROTO(s) != PICO_PROTO_TCP) {
+        pico_err = PICO_ERR_EPROTONOSUPPORT;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Zero-copy read, TCP only: *data points to the next received bytes, which
+ * remain owned by the socket until released with pico_socket_read_zc_done().
+ */
+int pico_socket_read_zc(struct pico_socket *s, void **data)
+{
+    if (!data) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if (pico_socket_read_zc_check(s) < 0)
+        return -1;
+
+    return pico_socket_tcp_read_zc(s, data);
+}
+
+int pico_socket_read_zc_done(struct pico_socket *s, int len)
+{
+    if (len < 0) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if (pico_socket_read_zc_check(s) < 0)
+        return -1;
+
+    return pico_socket_tcp_read_zc_done(s, (uint32_t)len);
+}
+
 static int pico_socket_write_check_state(struct pico_socket *s)
 {
     if ((s->state & PICO_SOCKET_STATE_BOUND) == 0) {
@@ -841,7 +918,7 @@ int pico_socket_write(struct pico_socket *s, const void *buf, int len)
 
 static uint16_t pico_socket_high_port(struct pico_stack *S, uint16_t proto)
 {
-    uint16_t port;
+    uint16_t port, start;
     if (0 ||
 #ifdef PICO_SUPPORT_TCP
         (proto == PICO_PROTO_TCP) ||
@@ -850,16 +927,20 @@ static uint16_t pico_socket_high_port(struct pico_stack *S, uint16_t proto)
         (proto == PICO_PROTO_UDP) ||
 #endif
         0) {
+        /* Random starting point, then probe linearly: pico_rand() can repeat
+         * within a tick, so retrying random draws may never terminate.
+         */
+        start = (uint16_t)((pico_rand() % (65535U - 1024U)) + 1024U);
+        port = start;
         do {
-            uint32_t rand = pico_rand();
-            port = (uint16_t) (rand & 0xFFFFU);
-            port = (uint16_t)((port % (65535 - 1024)) + 1024U);
-            if (pico_is_port_free(S, proto, port, NULL, NULL)) {
+            if (!pico_get_sockport(S, proto, short_be(port)) && !pico_port_in_timewait(S, proto, short_be(port), NULL, NULL))
                 return short_be(port);
-            }
-        } while(1);
+
+            port = (port >= 65534U) ? 1024U : (uint16_t)(port + 1U);
+        } while (port != start);
     }
-    else return 0U;
+
+    return 0U;
 }
 
 static void *pico_socket_sendto_get_ip4_src(struct pico_socket *s, struct pico_ip4 *dst)
@@ -1111,8 +1192,30 @@ static int pico_socket_final_xmit(struct pico_socket *s, struct pico_frame *f)
     }
 }
 
-static int pico_socket_xmit_one(struct pico_socket *s, const void *buf, const int len, void *src,
-                                struct pico_remote_endpoint *ep, struct pico_msginfo *msginfo)
+/* Gather 'len' bytes starting at offset 'off' of the iovec into 'dst' */
+static void pico_socket_iov_copy(uint8_t *dst, const struct pico_iovec *iov, int iovcnt, int off, int len)
+{
+    int i;
+    for (i = 0; (i < iovcnt) && (len > 0); i++) {
+        int chunk = (int)iov[i].len;
+        if (off >= chunk) {
+            off -= chunk;
+            continue;
+        }
+
+        chunk -= off;
+        if (chunk > len)
+            chunk = len;
+
+        memcpy(dst, (const uint8_t *)iov[i].base + off, (size_t)chunk);
+        dst += chunk;
+        len -= chunk;
+        off = 0;
+    }
+}
+
+static int pico_socket_xmit_one(struct pico_socket *s, const struct pico_iovec *iov, int iovcnt, int off, const int len,
+                                void *src, struct pico_remote_endpoint *ep, struct pico_msginfo *msginfo)
 {
     struct pico_frame *f;
     struct pico_device *dev = NULL;
@@ -1167,7 +1270,7 @@ static int pico_socket_xmit_one(struct pico_socket *s, const void *buf, const in
         f->send_tos = (uint8_t)msginfo->tos;
     }
 
-    memcpy(f->payload, (const uint8_t *)buf, f->payload_len);
+    pico_socket_iov_copy(f->payload, iov, iovcnt, off, f->payload_len);
     /* dbg("Pushing segment, hdr len: %d, payload_len: %d\n", header_offset, f->payload_len); */
     ret = pico_socket_final_xmit(s, f);
     return ret;
@@ -1202,7 +1305,7 @@ static void pico_socket_xmit_next_fragment_setup(struct pico_frame *f, int hdr_o
 #endif
 
 /* Implies ep discarding! */
-static int pico_socket_xmit_fragments(struct pico_socket *s, const void *buf, const int len,
+static int pico_socket_xmit_fragments(struct pico_socket *s, const struct pico_iovec *iov, int iovcnt, const int len,
                                       void *src, struct pico_remote_endpoint *ep, struct pico_msginfo *msginfo)
 {
     int space = pico_socket_xmit_avail_space(s);
@@ -1218,7 +1321,7 @@ static int pico_socket_xmit_fragments(struct pico_socket *s, const void *buf, co
     }
 
     if (space > len) {
-        retval = pico_socket_xmit_one(s, buf, len, src, ep, msginfo);
+        retval = pico_socket_xmit_one(s, iov, iovcnt, 0, len, src, ep, msginfo);
         pico_endpoint_free(ep);
         return retval;
     }
@@ -1226,7 +1329,7 @@ static int pico_socket_xmit_fragments(struct pico_socket *s, const void *buf, co
 #ifdef PICO_SUPPORT_IPV6
     /* Can't fragment IPv6 */
     if (is_sock_ipv6(s)) {
-        retval =  pico_socket_xmit_one(s, buf, space, src, ep, msginfo);
+        retval =  pico_socket_xmit_one(s, iov, iovcnt, 0, space, src, ep, msginfo);
         pico_endpoint_free(ep);
         return retval;
     }
@@ -1270,7 +1373,7 @@ static int pico_socket_xmit_fragments(struct pico_socket *s, const void *buf, co
             pico_socket_xmit_next_fragment_setup(f, pico_socket_sendto_transport_offset(s), total_payload_written, len);
         }
 
-        memcpy(f->payload, (const uint8_t *)buf + total_payload_written, f->payload_len);
+        pico_socket_iov_copy(f->payload, iov, iovcnt, total_payload_written, f->payload_len);
         transport_flags_update(f, s);
         if (s->proto->push(s->stack, s->proto, f) > 0) {
             total_payload_written += f->payload_len;
@@ -1290,7 +1393,7 @@ static int pico_socket_xmit_fragments(struct pico_socket *s, const void *buf, co
     (void) f;
     (void) hdr_offset;
     (void) total_payload_written;
-    retval = pico_socket_xmit_one(s, buf, space, src, ep, msginfo);
+    retval = pico_socket_xmit_one(s, iov, iovcnt, 0, space, src, ep, msginfo);
     pico_endpoint_free(ep);
     return retval;
 
@@ -1382,7 +1485,7 @@ static int pico_socket_xmit_avail_space(struct pico_socket *s)
 }
 
 
-static int pico_socket_xmit(struct pico_socket *s, const void *buf, const int len, void *src,
+static int pico_socket_xmit(struct pico_socket *s, const struct pico_iovec *iov, int iovcnt, const int len, void *src,
                             struct pico_remote_endpoint *ep, struct pico_msginfo *msginfo)
 {
     int space = pico_socket_xmit_avail_space(s);
@@ -1396,7 +1499,7 @@ static int pico_socket_xmit(struct pico_socket *s, const void *buf, const int le
 
 
     if ((PROTO(s) != PICO_PROTO_TCP) && (len > space)) {
-        total_payload_written = pico_socket_xmit_fragments(s, buf, len, src, ep, msginfo);
+        total_payload_written = pico_socket_xmit_fragments(s, iov, iovcnt, len, src, ep, msginfo);
         /* Implies ep discarding */
         return total_payload_written;
     }
@@ -1406,7 +1509,7 @@ static int pico_socket_xmit(struct pico_socket *s, const void *buf, const int le
         if (chunk_len > space)
             chunk_len = space;
 
-        w = pico_socket_xmit_one(s, (const void *)((const uint8_t *)buf + total_payload_written), chunk_len, src, ep, msginfo);
+        w = pico_socket_xmit_one(s, iov, iovcnt, total_payload_written, chunk_len, src, ep, msginfo);
         if (w <= 0) {
             break;
         }
@@ -1429,30 +1532,15 @@ static void pico_socket_sendto_set_dport(struct pico_socket *s, uint16_t port)
 }
 
 
-int MOCKABLE pico_socket_sendto_extended(struct pico_socket *s, const void *buf, const int len,
-                                         void *dst, uint16_t remote_port, struct pico_msginfo *msginfo)
+/* Common tail of sendto and writev: pick a source address and hand the
+ * payload described by 'iov' to the transport.
+ */
+static int pico_socket_sendto_iov(struct pico_socket *s, const struct pico_iovec *iov, int iovcnt, const int len,
+                                  void *dst, uint16_t remote_port, struct pico_msginfo *msginfo)
 {
     struct pico_remote_endpoint *remote_endpoint = NULL;
     void *src = NULL;
 
-    if(len == 0)
-        return 0;
-
-#ifdef PICO_SUPPORT_PACKET_SOCKETS
-    if (PROTO(s) == PICO_AF_PACKET)
-        return pico_socket_ll_sendto(s, buf, (uint32_t)len, dst);
-#endif
-
-    if (pico_socket_sendto_initial_checks(s, buf, len, dst, remote_port) < 0)
-        return -1;
-
-#ifdef PICO_SUPPORT_RAWSOCKETS
-    /* Skip src assignment for raw sockets */
-    if (PROTO(s) == PICO_PROTO_IPV4) {
-        return pico_socket_ipv4_sendto(s, buf, (uint32_t)len, dst);
-    }
-#endif
-
     src = pico_socket_sendto_get_src(s, dst);
     if (!src) {
 #ifdef PICO_SUPPORT_IPV6
@@ -1470,7 +1558,7 @@ int MOCKABLE pico_socket_sendto_extended(struct pico_socket *s, const void *buf,
     remote_endpoint = pico_socket_sendto_destination(s, dst, remote_port);
 
     if (PROTO(s) == PICO_PROTO_ICMP4) {
-        if (pico_socket_icmp4_sendto_check(s, buf, len, dst, remote_port) < 0)
+        if (pico_socket_icmp4_sendto_check(s, iov[0].base, len, dst, remote_port) < 0)
             return -1;
     }
     if ((PROTO(s) == PICO_PROTO_UDP) || (PROTO(s) == PICO_PROTO_TCP)) {
@@ -1480,7 +1568,35 @@ int MOCKABLE pico_socket_sendto_extended(struct pico_socket *s, const void *buf,
         }
     }
     pico_socket_sendto_set_dport(s, remote_port);
-    return pico_socket_xmit(s, buf, len, src, remote_endpoint, msginfo); /* Implies discarding the endpoint */
+    return pico_socket_xmit(s, iov, iovcnt, len, src, remote_endpoint, msginfo); /* Implies discarding the endpoint */
+}
+
+int MOCKABLE pico_socket_sendto_extended(struct pico_socket *s, const void *buf, const int len,
+                                         void *dst, uint16_t remote_port, struct pico_msginfo *msginfo)
+{
+    struct pico_iovec iov;
+
+    if(len == 0)
+        return 0;
+
+#ifdef PICO_SUPPORT_PACKET_SOCKETS
+    if (PROTO(s) == PICO_AF_PACKET)
+        return pico_socket_ll_sendto(s, buf, (uint32_t)len, dst);
+#endif
+
+    if (pico_socket_sendto_initial_checks(s, buf, len, dst, remote_port) < 0)
+        return -1;
+
+#ifdef PICO_SUPPORT_RAWSOCKETS
+    /* Skip src assignment for raw sockets */
+    if (PROTO(s) == PICO_PROTO_IPV4) {
+        return pico_socket_ipv4_sendto(s, buf, (uint32_t)len, dst);
+    }
+#endif
+
+    iov.base = buf;
+    iov.len = (uint32_t)len;
+    return pico_socket_sendto_iov(s, &iov, 1, len, dst, remote_port, msginfo);
 }
 
 int MOCKABLE pico_socket_sendto(struct pico_socket *s, const void *buf, const int len, void *dst, uint16_t remote_port)
@@ -1510,6 +1626,147 @@ int pico_socket_send(struct pico_socket *s, const void *buf, int len)
     return pico_socket_sendto(s, buf, len, &s->remote_addr, s->remote_port);
 }
 
+static int pico_socket_stream_check(struct pico_socket *s)
+{
+    if (!s || pico_check_socket(s) != 0) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if ((PROTO(s) != PICO_PROTO_TCP) && (PROTO(s) != PICO_PROTO_UDP)) {
+        pico_err = PICO_ERR_EPROTONOSUPPORT;
+        return -1;
+    }
+
+    return 0;
+}
+
+int pico_socket_writev(struct pico_socket *s, const struct pico_iovec *iov, int iovcnt)
+{
+    uint32_t len = 0;
+    int i;
+
+    if (pico_socket_stream_check(s) < 0)
+        return -1;
+
+    if (!iov || (iovcnt <= 0)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    for (i = 0; i < iovcnt; i++) {
+        if ((!iov[i].base && iov[i].len) || (iov[i].len > (uint32_t)0x7FFFFFFF - len)) {
+            pico_err = PICO_ERR_EINVAL;
+            return -1;
+        }
+
+        len += iov[i].len;
+    }
+
+    if (pico_socket_write_check_state(s) < 0)
+        return -1;
+
+    if (len == 0)
+        return 0;
+
+    if (pico_socket_sendto_dest_check(s, &s->remote_addr, s->remote_port) < 0)
+        return -1;
+
+    return pico_socket_sendto_iov(s, iov, iovcnt, (int)len, &s->remote_addr, s->remote_port, NULL);
+}
+
+/* Header-only frame laid out the way pico_socket_xmit_one would build it:
+ * everything in front of f->payload is headroom the stack writes into.
+ */
+static struct pico_frame *pico_socket_zc_frame_alloc(struct pico_socket *s)
+{
+    struct pico_device *dev = get_sock_dev(s);
+    uint16_t hdr_offset = (uint16_t)pico_socket_sendto_transport_offset(s);
+    struct pico_frame *f;
+
+    if (!dev) {
+        pico_err = PICO_ERR_EHOSTUNREACH;
+        return NULL;
+    }
+
+    f = pico_socket_frame_alloc(s, dev, hdr_offset);
+    if (!f)
+        return NULL;
+
+    f->payload = f->transport_hdr + hdr_offset;
+    f->payload_len = 0;
+    return f;
+}
+
+int pico_socket_zc_headroom(struct pico_socket *s)
+{
+    struct pico_frame *f;
+    int headroom;
+
+    if (pico_socket_stream_check(s) < 0)
+        return -1;
+
+    f = pico_socket_zc_frame_alloc(s);
+    if (!f)
+        return -1;
+
+    headroom = (int)(f->payload - f->buffer);
+    pico_frame_discard(f);
+    return headroom;
+}
+
+int pico_socket_send_zc(struct pico_socket *s, uint8_t *buf, int len, void (*notify_free)(uint8_t *buf))
+{
+    struct pico_remote_endpoint *ep = NULL;
+    struct pico_frame *f;
+    int headroom;
+
+    if (pico_socket_stream_check(s) < 0)
+        return -1;
+
+    if (!buf || (len <= 0)) {
+        pico_err = PICO_ERR_EINVAL;
+        return -1;
+    }
+
+    if (pico_socket_write_check_state(s) < 0)
+        return -1;
+
+    if (len > pico_socket_xmit_avail_space(s)) {
+        pico_err = PICO_ERR_EMSGSIZE;
+        return -1;
+    }
+
+    if (PROTO(s) == PICO_PROTO_UDP) {
+        ep = pico_socket_sendto_destination(s, &s->remote_addr, s->remote_port);
+        if (!ep)
+            return -1;
+    }
+
+    f = pico_socket_zc_frame_alloc(s);
+    if (!f) {
+        pico_endpoint_free(ep);
+        return -1;
+    }
+
+    headroom = (int)(f->payload - f->buffer);
+    if (pico_frame_set_ext_buffer(f, buf, (uint32_t)(headroom + len), notify_free) < 0) {
+        pico_frame_discard(f);
+        pico_endpoint_free(ep);
+        pico_err = PICO_ERR_ENOMEM;
+        return -1;
+    }
+
+    /* From here on the buffer belongs to the stack until notify_free() */
+    f->payload_len = (uint16_t)len;
+    f->transport_len = (uint16_t)(f->transport_len + len);
+    f->len += (uint32_t)len;
+    f->info = ep;
+    transport_flags_update(f, s);
+    pico_xmit_frame_set_nofrag(f);
+    return pico_socket_final_xmit(s, f);
+}
+
 int pico_socket_recvfrom_extended(struct pico_socket *s, void *buf, int len, void *orig,
                                   uint16_t *remote_port, struct pico_msginfo *msginfo)
 {
@@ -1944,32 +2201,25 @@ struct pico_socket *pico_socket_accept(struct pico_socket *s, void *orig, uint16
     }
 
     if (TCPSTATE(s) == PICO_SOCKET_STATE_TCP_LISTEN) {
-        struct pico_sockport *sp = pico_get_sockport(s->stack, PICO_PROTO_TCP, s->local_port);
         struct pico_socket *found;
         uint32_t socklen = sizeof(struct pico_ip4);
         /* If at this point no incoming connection socket is found,
          * the accept call is valid, but no connection is established yet.
          */
         pico_err = PICO_ERR_EAGAIN;
-        if (sp) {
-            struct pico_tree_node *index;
-            /* RB_FOREACH(found, socket_tree, &sp->socks) { */
-            pico_tree_foreach(index, &sp->socks){
-                found = index->keyValue;
-                if ((s == found->parent) && ((found->state & PICO_SOCKET_STATE_TCP) == PICO_SOCKET_STATE_TCP_ESTABLISHED)) {
-                    found->parent = NULL;
-                    pico_err = PICO_ERR_NOERR;
-                    #ifdef PICO_SUPPORT_IPV6
-                    if (is_sock_ipv6(s))
-                        socklen = sizeof(struct pico_ip6);
-
-                    #endif
-                    memcpy(orig, &found->remote_addr, socklen);
-                    *port = found->remote_port;
-                    s->number_of_pending_conn--;
-                    return found;
-                }
-            }
+        found = pico_socket_tcp_accept_queue_pop(s);
+        if (found) {
+            found->parent = NULL;
+            pico_err = PICO_ERR_NOERR;
+            #ifdef PICO_SUPPORT_IPV6
+            if (is_sock_ipv6(s))
+                socklen = sizeof(struct pico_ip6);
+
+            #endif
+            memcpy(orig, &found->remote_addr, socklen);
+            *port = found->remote_port;
+            s->number_of_pending_conn--;
+            return found;
         }
     }
 
@@ -2088,6 +2338,8 @@ int pico_socket_shutdown(struct pico_socket *s, int mode)
         } else if (mode & PICO_SHUT_RD)
             pico_socket_alter_state(s, PICO_SOCKET_STATE_SHUT_REMOTE, 0, 0);
 
+        pico_socket_schedule(s);
+
     }
 
 #endif
@@ -2120,42 +2372,37 @@ int MOCKABLE pico_socket_close(struct pico_socket *s)
 
 void pico_socket_destroy_all(struct pico_stack *S)
 {
-    struct pico_sockport *start = NULL;
+    struct pico_sockport *sp;
     struct pico_socket *s;
-    struct pico_tree_node *sp_node, *sp_safe;
     struct pico_tree_node *index, *safe;
     PICOTCP_MUTEX_LOCK(S->SockMutex);
 
-    if (S->sp_udp) {
-        pico_tree_foreach_safe(sp_node, &S->sp_udp->socks, sp_safe) {
-            start = sp_node->keyValue;
-            pico_tree_foreach_safe(index, &start->socks, safe){
-                s = index->keyValue;
-                socket_clean_queues(s);
-                pico_tree_delete(&S->sp_udp->socks, s);
-                pico_socket_check_empty_sockport(s, S->sp_udp);
+#ifdef PICO_SUPPORT_UDP
+    while (!pico_tree_empty(&S->UDPTable)) {
+        sp = pico_tree_first(&S->UDPTable);
+        s = pico_tree_first(&sp->socks);
+        pico_tree_delete(&sp->socks, s);
+        pico_socket_check_empty_sockport(s, sp);
 #ifdef PICO_SUPPORT_MCAST
-                pico_multicast_delete(s);
+        pico_multicast_delete(s);
 #endif
-                socket_clean_queues(s);
-                PICO_FREE(s);
-            }
-        }
+        pico_socket_active_del(s);
+        socket_clean_queues(s);
+        PICO_FREE(s);
     }
-    if (S->sp_tcp) {
-        pico_tree_foreach_safe(sp_node, &S->sp_tcp->socks, sp_safe) {
-            start = sp_node->keyValue;
-            pico_tree_foreach_safe(index, &start->socks, safe){
-                s = index->keyValue;
-                socket_clean_queues(s);
-                pico_tree_delete(&S->sp_tcp->socks, s);
-                pico_socket_check_empty_sockport(s, S->sp_tcp);
-                pico_socket_tcp_delete(s);
-                socket_clean_queues(s);
-                PICO_FREE(s);
-            }
-        }
+#endif
+#ifdef PICO_SUPPORT_TCP
+    while (!pico_tree_empty(&S->TCPTable)) {
+        sp = pico_tree_first(&S->TCPTable);
+        s = pico_tree_first(&sp->socks);
+        pico_tree_delete(&sp->socks, s);
+        pico_socket_check_empty_sockport(s, sp);
+        pico_socket_tcp_delete(s);
+        pico_socket_active_del(s);
+        socket_clean_queues(s);
+        PICO_FREE(s);
     }
+#endif
 #ifdef PICO_SUPPORT_ICMP4
     pico_tree_foreach_safe(index, &S->ICMP4Sockets, safe){
         s = index->keyValue;
@@ -2171,6 +2418,11 @@ void pico_socket_destroy_all(struct pico_stack *S)
         socket_clean_queues(s);
         PICO_FREE(s);
     }
+#endif
+#ifdef PICO_SUPPORT_TCP
+    pico_socket_tcp_hash_destroy(S);
+    pico_tcp_synq_destroy(S);
+    pico_tcp_timewait_destroy(S);
 #endif
     PICOTCP_MUTEX_UNLOCK(S->SockMutex);
 }
@@ -2186,6 +2438,9 @@ static inline int pico_transport_crc_check(struct pico_frame *f)
     {
 #ifdef PICO_SUPPORT_TCP
     case PICO_PROTO_TCP:
+        if (f->flags & PICO_FRAME_FLAG_CSUM_VALID)
+            break;
+
         checksum_invalid = short_be(pico_tcp_checksum(f));
         /* dbg("TCP CRC validation == %u\n", checksum_invalid); */
         if (checksum_invalid) {
@@ -2283,119 +2538,133 @@ int pico_socket_sanity_check(struct pico_socket *s)
 #endif
 
 
-static int pico_sockets_loop_udp(struct pico_stack *S, int loop_score)
+static void pico_socket_active_del(struct pico_socket *s)
 {
+    struct pico_stack *S = s->stack;
+    if (!s->active)
+        return;
 
-#ifdef PICO_SUPPORT_UDP
-    struct pico_sockport *start;
-    struct pico_socket *s;
-    struct pico_frame *f;
+    if (s->active_prev)
+        s->active_prev->active_next = s->active_next;
+    else
+        S->sock_active = s->active_next;
 
-    if (S->sp_udp == NULL)
-    {
-        S->udp_loop_index = pico_tree_firstNode(S->UDPTable.root);
-        S->sp_udp = S->udp_loop_index->keyValue;
-    }
+    if (s->active_next)
+        s->active_next->active_prev = s->active_prev;
+    else
+        S->sock_active_tail = s->active_prev;
 
-    /* init start node */
-    start = S->sp_udp;
+    s->active_prev = NULL;
+    s->active_next = NULL;
+    s->active = 0;
+    S->sock_active_count--;
+}
 
-    /* round-robin all transport protocols, break if traversed all protocols */
-    while (loop_score > SL_LOOP_MIN && S->sp_udp != NULL) {
-        struct pico_tree_node *index;
+static int pico_socket_needs_service(struct pico_socket *s)
+{
+    if (s->state & PICO_SOCKET_STATE_CLOSED)
+        return 0;
 
-        pico_tree_foreach(index, &S->sp_udp->socks){
-            s = index->keyValue;
-            f = pico_dequeue(&s->q_out);
-            while (f && (loop_score > 0)) {
-                pico_proto_udp.push(S, &pico_proto_udp, f);
-                loop_score -= 1;
-                if (loop_score > 0) /* only dequeue if there is still loop_score, otherwise f might get lost */
-                    f = pico_dequeue(&s->q_out);
-            }
-        }
+    if ((s->ev_pending) && s->wakeup)
+        return 1;
 
-        S->udp_loop_index = pico_tree_next(S->udp_loop_index);
-        S->sp_udp = S->udp_loop_index->keyValue;
+#ifdef PICO_SUPPORT_UDP
+    if (PROTO(s) == PICO_PROTO_UDP)
+        return (s->q_out.frames > 0);
 
-        if (S->sp_udp == NULL)
-        {
-            S->udp_loop_index = pico_tree_firstNode(S->UDPTable.root);
-            S->sp_udp = S->udp_loop_index->keyValue;
-        }
+#endif
+#ifdef PICO_SUPPORT_TCP
+    if (PROTO(s) == PICO_PROTO_TCP)
+        return pico_tcp_output_pending(s);
 
-        if (S->sp_udp == start)
-            break;
-    }
 #endif
-    return loop_score;
+    return 0;
 }
 
-static int pico_sockets_loop_tcp(struct pico_stack *S, int loop_score)
+/* Put the socket on the stack work list if pico_sockets_loop() has
+ * something to do for it. Must be called whenever output is queued
+ * or an event is left pending outside of the input path.
+ */
+void pico_socket_schedule(struct pico_socket *s)
 {
-#ifdef PICO_SUPPORT_TCP
-    struct pico_sockport *start;
-    struct pico_socket *s;
-    if (S->sp_tcp == NULL)
-    {
-        S->tcp_loop_index = pico_tree_firstNode(S->TCPTable.root);
-        S->sp_tcp = S->tcp_loop_index->keyValue;
-    }
-
-    /* init start node */
-    start = S->sp_tcp;
+    struct pico_stack *S = s->stack;
+    if (s->active || !pico_socket_needs_service(s))
+        return;
 
-    while (loop_score > SL_LOOP_MIN && S->sp_tcp != NULL) {
-        struct pico_tree_node *index = NULL, *safe_index = NULL;
-        pico_tree_foreach_safe(index, &S->sp_tcp->socks, safe_index){
-            s = index->keyValue;
-            loop_score = pico_tcp_output(s, loop_score);
-            if ((s->ev_pending) && s->wakeup) {
-                s->wakeup(s->ev_pending, s);
-                if(!s->parent)
-                    s->ev_pending = 0;
-            }
-
-            if (loop_score <= 0) {
-                loop_score = 0;
-                break;
-            }
+    s->active = 1;
+    s->active_next = NULL;
+    s->active_prev = S->sock_active_tail;
+    if (S->sock_active_tail)
+        S->sock_active_tail->active_next = s;
+    else
+        S->sock_active = s;
 
-            if(pico_socket_sanity_check(s) < 0)
-            {
-                pico_socket_del(s);
-                S->tcp_loop_index = NULL; /* forcing the restart of loop */
-                S->sp_tcp = NULL;
-                break;
-            }
-        }
+    S->sock_active_tail = s;
+    S->sock_active_count++;
+}
 
-        /* check if RB_FOREACH ended, if not, break to keep the cur S->sp_tcp */
-        if (!S->tcp_loop_index || (index && index->keyValue))
+static int pico_sockets_loop_udp(struct pico_socket *s, int loop_score)
+{
+#ifdef PICO_SUPPORT_UDP
+    struct pico_frame *f;
+    while (loop_score > 0) {
+        f = pico_dequeue(&s->q_out);
+        if (!f)
             break;
 
-        S->tcp_loop_index = pico_tree_next(S->tcp_loop_index);
-        S->sp_tcp = S->tcp_loop_index->keyValue;
-
-        if (S->sp_tcp == NULL)
-        {
-            S->tcp_loop_index = pico_tree_firstNode(S->TCPTable.root);
-            S->sp_tcp = S->tcp_loop_index->keyValue;
-        }
-
-        if (S->sp_tcp == start)
-            break;
+        pico_proto_udp.push(s->stack, &pico_proto_udp, f);
+        loop_score -= 1;
     }
+#else
+    IGNORE_PARAMETER(s);
 #endif
     return loop_score;
+}
+
+static int pico_sockets_loop_tcp(struct pico_socket *s, int loop_score)
+{
+#ifdef PICO_SUPPORT_TCP
+    loop_score = pico_tcp_output(s, loop_score);
+    if ((s->ev_pending) && s->wakeup) {
+        s->wakeup(s->ev_pending, s);
+        if(!s->parent)
+            s->ev_pending = 0;
+    }
+
+    if (loop_score < 0)
+        loop_score = 0;
 
+    if(pico_socket_sanity_check(s) < 0)
+        pico_socket_del(s);
 
+#else
+    IGNORE_PARAMETER(s);
+#endif
+    return loop_score;
 }
 
+/* Only the sockets on the work list are visited: each one is taken off
+ * the head, serviced, and put back at the tail if it still has work.
+ */
 int pico_sockets_loop(struct pico_stack *S, int loop_score)
 {
-    loop_score = pico_sockets_loop_udp(S, loop_score);
-    loop_score = pico_sockets_loop_tcp(S, loop_score);
+    uint32_t n = S->sock_active_count;
+    struct pico_socket *s;
+
+    while ((n-- > 0) && (loop_score > SL_LOOP_MIN) && S->sock_active) {
+        s = S->sock_active;
+        pico_socket_active_del(s);
+        if (PROTO(s) == PICO_PROTO_UDP) {
+            loop_score = pico_sockets_loop_udp(s, loop_score);
+        } else if (PROTO(s) == PICO_PROTO_TCP) {
+            loop_score = pico_sockets_loop_tcp(s, loop_score);
+        } else if ((s->ev_pending) && s->wakeup) {
+            s->wakeup(s->ev_pending, s);
+            s->ev_pending = 0;
+        }
+
+        pico_socket_schedule(s);
+    }
     return loop_score;
 }
 
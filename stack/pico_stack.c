@@ -38,6 +38,7 @@
 
 #include "pico_6lowpan_ll.h"
 #include "pico_ethernet.h"
+#include "pico_gro.h"
 #include "pico_6lowpan.h"
 #include "pico_olsr.h"
 #include "pico_aodv.h"
@@ -435,6 +436,68 @@ int pico_datalink_receive(struct pico_frame *f)
     return 0;
 }
 
+/* Vector version of pico_datalink_receive, for a chain of frames received
+ * on the same device: the whole chain is handed to the datalink layer
+ * with a single enqueue. Returns the number of frames processed.
+ */
+int pico_datalink_receive_burst(struct pico_frame *list)
+{
+    struct pico_frame *f, *next;
+    struct pico_queue *q = NULL;
+    int n = 0;
+
+    if (!list)
+        return 0;
+
+    for (f = list; f; f = f->next) {
+#ifdef PICO_SUPPORT_PACKET_SOCKETS
+        pico_socket_ll_process_in(f->dev->stack, &pico_proto_ll, f);
+#endif
+        if (f->dev->eth)
+            f->datalink_hdr = f->buffer;
+
+        n++;
+    }
+
+#ifdef PICO_SUPPORT_GRO
+    if ((list->dev->offload & PICO_DEV_OFFLOAD_GRO) && (list->dev->mode == LL_MODE_ETHERNET))
+        list = pico_gro_receive(list);
+#endif
+
+    if (list->dev->eth) {
+        switch (list->dev->mode) {
+            #ifdef PICO_SUPPORT_802154
+            case LL_MODE_IEEE802154:
+                q = pico_proto_6lowpan_ll.q_in;
+                break;
+            #endif
+            default:
+                #ifdef PICO_SUPPORT_ETH
+                q = pico_proto_ethernet.q_in;
+                #endif
+                break;
+        }
+    }
+
+    if (q) {
+        pico_enqueue_list(q, &list);
+        /* Whatever is left did not fit in the queue */
+    }
+
+    while (list) {
+        next = list->next;
+        list->next = NULL;
+        if (q || list->dev->eth) {
+            pico_frame_discard(list);
+        } else {
+            list->net_hdr = list->buffer;
+            pico_network_receive(list);
+        }
+        list = next;
+    }
+    return n;
+}
+
 MOCKABLE int pico_datalink_send(struct pico_frame *f)
 {
     if (f->dev->eth) {
@@ -466,7 +529,7 @@ struct pico_frame *pico_stack_recv_new_frame(struct pico_device *dev, uint8_t *b
     if (len == 0)
         return NULL;
 
-    f = pico_frame_alloc(len);
+    f = pico_frame_alloc_pool(PICO_STACK_FRAME_POOL(dev->stack), len);
     if (!f)
     {
         dbg("Cannot alloc incoming frame!\n");
@@ -516,7 +579,7 @@ static int32_t _pico_stack_recv_zerocopy(struct pico_device *dev, uint8_t *buffe
     if (len == 0)
         return -1;
 
-    f = pico_frame_alloc_skeleton(len, ext_buffer);
+    f = pico_frame_alloc_skeleton_pool(PICO_STACK_FRAME_POOL(dev->stack), len, ext_buffer);
     if (!f)
     {
         dbg("Cannot alloc incoming frame!\n");
@@ -526,8 +589,7 @@ static int32_t _pico_stack_recv_zerocopy(struct pico_device *dev, uint8_t *buffe
     if (pico_frame_skeleton_set_buffer(f, buffer) < 0)
     {
         dbg("Invalid zero-copy buffer!\n");
-        PICO_FREE(f->usage_count);
-        PICO_FREE(f);
+        pico_frame_discard(f);
         return -1;
     }
 
@@ -559,6 +621,69 @@ int32_t pico_stack_recv_zerocopy_ext_buffer_notify(struct pico_device *dev, uint
     return _pico_stack_recv_zerocopy(dev, buffer, len, 1, notify_free);
 }
 
+/* Burst version of pico_stack_recv for drivers that collect several packets
+ * per poll. With notify_free == NULL the buffers are copied, otherwise the
+ * frames are built around them (zero-copy) and notify_free() releases each
+ * buffer once the stack is done with it.
+ * Frames are accepted in order: the return value is the number of buffers
+ * taken by the stack, the remaining ones (and, in zero-copy mode, their
+ * ownership) stay with the caller. Returns -1 if nothing could be queued
+ * because of an invalid argument or lack of memory.
+ */
+int32_t pico_stack_recv_burst(struct pico_device *dev, uint8_t **buffers, const uint32_t *len, int count,
+                              void (*notify_free)(uint8_t *buffer))
+{
+    struct pico_frame *head = NULL, *tail = NULL, *f;
+    int i, n;
+
+    if (!dev || !buffers || !len || (count <= 0))
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        if (!notify_free) {
+            f = pico_stack_recv_new_frame(dev, buffers[i], len[i]);
+        } else if (len[i] == 0) {
+            f = NULL;
+        } else {
+            f = pico_frame_alloc_skeleton_pool(PICO_STACK_FRAME_POOL(dev->stack), len[i], 1);
+            if (f && (pico_frame_skeleton_set_buffer(f, buffers[i]) < 0)) {
+                pico_frame_discard(f);
+                f = NULL;
+            }
+
+            if (f) {
+                f->notify_free = notify_free;
+                f->dev = dev;
+            }
+        }
+
+        if (!f)
+            break;
+
+        f->next = NULL;
+        if (tail)
+            tail->next = f;
+        else
+            head = f;
+
+        tail = f;
+    }
+
+    n = pico_enqueue_list(dev->q_in, &head);
+    while (head) {
+        /* Not queued: the caller still owns zero-copy buffers */
+        f = head;
+        head = f->next;
+        f->notify_free = NULL;
+        pico_frame_discard(f);
+    }
+
+    if ((n == 0) && (i < count))
+        return -1;
+
+    return n;
+}
+
 int32_t pico_sendto_dev(struct pico_frame *f)
 {
     if (!f->dev) {
@@ -604,10 +729,12 @@ int32_t pico_seq_compare(uint32_t a, uint32_t b)
 static void pico_check_timers(struct pico_stack *S)
 {
     struct pico_timer *t;
-    struct pico_timer_ref tref_unused, *tref = heap_first(S->Timers);
+    struct pico_timer_ref expired, *tref = heap_first(S->Timers);
     pico_tick = PICO_TIME_MS();
     while((tref) && (tref->expire <= pico_tick)) {
-        t = tref->tmr;
+        /* Pop before running: the callback may add or cancel timers */
+        heap_peek(S->Timers, &expired);
+        t = expired.tmr;
         if (t && t->timer)
             t->timer(pico_tick, t->arg);
 
@@ -616,7 +743,6 @@ static void pico_check_timers(struct pico_stack *S)
             PICO_FREE(t);
         }
 
-        heap_peek(S->Timers, &tref_unused);
         tref = heap_first(S->Timers);
     }
 }
@@ -638,22 +764,13 @@ long long int pico_stack_go(struct pico_stack *S)
 
 void MOCKABLE pico_timer_cancel(struct pico_stack *S, uint32_t id)
 {
-    uint32_t i;
-    struct pico_timer_ref *tref;
+    struct pico_timer_ref tref;
     if (id == 0u)
         return;
 
-    for (i = 1; i <= S->Timers->n; i++) {
-        tref = heap_get_element(S->Timers, i);
-        if (tref->id == id) {
-            if (tref->tmr)
-            {
-                PICO_FREE(tref->tmr);
-                tref->tmr = NULL;
-                tref->id = 0;
-            }
-            break;
-        }
+    if (heap_remove_id(S->Timers, id, &tref) == 0) {
+        if (tref.tmr)
+            PICO_FREE(tref.tmr);
     }
 }
 
@@ -664,6 +781,10 @@ void pico_timer_cancel_hashed(struct pico_stack *S, uint32_t hash)
     if (hash == 0u)
         return;
 
+    /* The heap index is keyed by timer id, so matching hashes means a scan.
+     * Matches are killed in place (dropped from the id index, left as dead
+     * entries) and reclaimed once enough of them pile up.
+     */
     for (i = 1; i <= S->Timers->n; i++) {
         tref = heap_get_element(S->Timers, i);
         if (tref->hash == hash) {
@@ -671,10 +792,13 @@ void pico_timer_cancel_hashed(struct pico_stack *S, uint32_t hash)
             {
                 PICO_FREE(tref->tmr);
                 tref->tmr = NULL;
-                tref[i].id = 0;
+                heap_kill(S->Timers, i);
             }
         }
     }
+
+    if (heap_compact_needed(S->Timers))
+        heap_compact(S->Timers);
 }
 
 #ifndef PICO_SUPPORT_TICKLESS
@@ -879,15 +1003,13 @@ int MOCKABLE pico_stack_init(struct pico_stack **S)
     /* Initialize "link" tree */
     EMPTY_TREE((*S)->Tree_dev_link, ipv4_link_compare);
     EMPTY_TREE((*S)->Routes, ipv4_route_compare);
+    pico_lpm_init(&(*S)->RoutesLPM, PICO_SIZE_IP4);
     /* Set default broadcast route */
     (*S)->default_bcast_route = &initial_default_bcast_route;
+    (*S)->ipv4_flows_size = PICO_IPV4_FLOW_CACHE_SIZE;
 #   ifdef PICO_SUPPORT_RAWSOCKETS
     EMPTY_TREE((*S)->IP4Sockets, pico_ipv4_rawsocket_cmp);
 #   endif
-#   ifdef PICO_SUPPORT_NAT
-    EMPTY_TREE((*S)->NATOutbound, nat_cmp_outbound);
-    EMPTY_TREE((*S)->NATInbound, nat_cmp_inbound);
-#   endif
 #   ifdef PICO_SUPPORT_IPV4FRAG
     EMPTY_TREE((*S)->ipv4_fragments, pico_ipv4_frag_compare);
 #   endif
@@ -901,6 +1023,7 @@ int MOCKABLE pico_stack_init(struct pico_stack **S)
     ATTACH_QUEUES(*S, ipv6, pico_proto_ipv6);
 	EMPTY_TREE((*S)->Tree_dev_ip6_link, ipv6_link_compare);
 	EMPTY_TREE((*S)->IPV6Routes, ipv6_route_compare);
+    pico_lpm_init(&(*S)->IPV6RoutesLPM, PICO_SIZE_IP6);
 	EMPTY_TREE((*S)->IPV6Links, ipv6_link_compare);
 	EMPTY_TREE((*S)->IPV6NQueue, pico_ipv6_nd_qcompare);
 	EMPTY_TREE((*S)->IPV6NCache, pico_ipv6_neighbor_compare);
@@ -910,10 +1033,6 @@ int MOCKABLE pico_stack_init(struct pico_stack **S)
 #   endif
 #endif
 
-#ifdef PICO_SUPPORT_IPFILTER
-    EMPTY_TREE((*S)->ipfilter_tree, filter_compare);
-#endif
-
 #ifdef PICO_SUPPORT_ICMP4
     pico_protocol_init(*S, &pico_proto_icmp4);
     ATTACH_QUEUES(*S, icmp4, pico_proto_icmp4);
@@ -949,6 +1068,8 @@ int MOCKABLE pico_stack_init(struct pico_stack **S)
     pico_protocol_init(*S, &pico_proto_tcp);
     ATTACH_QUEUES(*S, tcp, pico_proto_tcp);
     EMPTY_TREE((*S)->TCPTable, pico_socket_table_compare);
+    (*S)->TCPRcvBufLimit = PICO_TCP_RCVBUF_LIMIT;
+    (*S)->TCPSynCookies = PICO_TCP_SYNCOOKIES;
 #endif
 
 #ifdef PICO_SUPPORT_DHCPC
@@ -976,15 +1097,22 @@ int MOCKABLE pico_stack_init(struct pico_stack **S)
 #endif
     pico_rand_feed(123456);
 
+#ifdef PICO_SUPPORT_FRAME_POOL
+    pico_frame_pool_init(&(*S)->frame_pool, PICO_FRAME_POOL_MAX_CACHED);
+#endif
+
     /* Initialize timer heap */
     (*S)->Timers = heap_init();
     if (!(*S)->Timers)
         return -1;
 
+    heap_set_max((*S)->Timers, PICO_TIMERS_LIMIT);
+
 #if ((defined PICO_SUPPORT_IPV4) && (defined PICO_SUPPORT_ETH))
     /* Initialize ARP module */
     pico_arp_init(*S);
     EMPTY_TREE((*S)->arp_tree, arp_compare);
+    EMPTY_TREE((*S)->arp_pending, arp_pending_compare);
 #endif
 
 #ifdef PICO_SUPPORT_IPV6
@@ -1135,6 +1263,22 @@ void pico_stack_deinit(struct pico_stack *S)
     }
     /* Cleanup: sockets */
     pico_socket_destroy_all(S);
+#if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_NAT)
+    pico_ipv4_nat_destroy(S);
+#endif
+#if defined(PICO_SUPPORT_IPV4) && defined(PICO_SUPPORT_ETH)
+    pico_arp_destroy(S);
+#endif
+#ifdef PICO_SUPPORT_IPV4
+    pico_ipv4_flow_cache_destroy(S);
+    pico_lpm_destroy(&S->RoutesLPM);
+#endif
+#ifdef PICO_SUPPORT_IPV6
+    pico_lpm_destroy(&S->IPV6RoutesLPM);
+#endif
+#ifdef PICO_SUPPORT_IPFILTER
+    pico_ipfilter_destroy(S);
+#endif
 
     /* Cleanup: queues */
     
@@ -1175,4 +1319,11 @@ void pico_stack_deinit(struct pico_stack *S)
     DETACH_QUEUES(S, tcp);
 #endif
 
+    /* Cleanup: timers armed during teardown, then the heap itself */
+    pico_terminate_timers(S);
+    heap_destroy(S->Timers);
+    S->Timers = NULL;
+#ifdef PICO_SUPPORT_FRAME_POOL
+    pico_frame_pool_destroy(&S->frame_pool);
+#endif
 }
@@ -0,0 +1,243 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_device.h"
+#include "pico_arp.h"
+#include "check.h"
+#include <unistd.h>
+
+Suite *pico_suite(void);
+
+#define LOCAL4    0x0A320001u   /* 10.50.0.1/24 */
+#define PEER_A    0x0A320002u
+#define PEER_B    0x0A320003u
+#define GW4       0x0A3200FEu
+#define FAR4      0x08080808u
+#define CAP_MAX   64
+
+static const uint8_t mac_local[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+static const uint8_t mac_a[6] = { 0x02, 0, 0, 0, 0, 0x0A };
+static const uint8_t mac_gw[6] = { 0x02, 0, 0, 0, 0, 0xFE };
+
+/* Device counting ARP requests and recording IPv4 frames */
+struct arp_dev {
+    struct pico_device dev;
+    int requests;
+    uint32_t req_dst[CAP_MAX];
+    int n;
+    uint32_t dst[CAP_MAX];      /* IPv4 destination, host order */
+    uint8_t mac[CAP_MAX][6];
+    uint8_t mark[CAP_MAX];
+};
+
+static int arp_dev_send(struct pico_device *dev, void *buf, int len)
+{
+    struct arp_dev *d = (struct arp_dev *)dev;
+    struct pico_eth_hdr *eh = (struct pico_eth_hdr *)buf;
+    uint8_t *net = (uint8_t *)buf + PICO_SIZE_ETHHDR;
+
+    if (eh->proto == PICO_IDETH_ARP) {
+        fail_if(d->requests >= CAP_MAX);
+        /* target protocol address, last field of the header */
+        memcpy(&d->req_dst[d->requests], net + 24, 4);
+        d->req_dst[d->requests] = long_be(d->req_dst[d->requests]);
+        d->requests++;
+    } else if (eh->proto == PICO_IDETH_IPV4) {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)net;
+        fail_if(d->n >= CAP_MAX);
+        d->dst[d->n] = long_be(hdr->dst.addr);
+        memcpy(d->mac[d->n], eh->daddr, 6);
+        d->mark[d->n] = net[PICO_SIZE_IP4HDR];
+        d->n++;
+    }
+
+    return len;
+}
+
+static struct pico_stack *arp_setup(struct arp_dev *d, const char *name)
+{
+    struct pico_stack *S;
+    struct pico_ip4 addr, nm, any, gw;
+
+    memset(d, 0, sizeof(*d));
+    fail_if(pico_stack_init(&S) != 0);
+    fail_if(pico_device_init(S, &d->dev, name, mac_local) != 0);
+    d->dev.send = arp_dev_send;
+    addr.addr = long_be(LOCAL4);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &d->dev, addr, nm) != 0);
+    any.addr = 0;
+    gw.addr = long_be(GW4);
+    fail_if(pico_ipv4_route_add(S, any, any, gw, 1, NULL) != 0);
+    return S;
+}
+
+/* An IPv4 frame on its way out, one payload byte to tell it apart */
+static struct pico_frame *arp_frame(struct arp_dev *d, uint32_t dst, uint8_t mark)
+{
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_ETHHDR + PICO_SIZE_IP4HDR + 1);
+    struct pico_ipv4_hdr *hdr;
+
+    fail_if(!f);
+    memset(f->buffer, 0, f->buffer_len);
+    f->datalink_hdr = f->buffer;
+    f->net_hdr = f->buffer + PICO_SIZE_ETHHDR;
+    f->start = f->net_hdr;
+    f->len = PICO_SIZE_IP4HDR + 1;
+    f->dev = &d->dev;
+    hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+    hdr->vhl = 0x45;
+    hdr->len = short_be(PICO_SIZE_IP4HDR + 1);
+    hdr->ttl = 64;
+    hdr->proto = PICO_PROTO_UDP;
+    hdr->src.addr = long_be(LOCAL4);
+    hdr->dst.addr = long_be(dst);
+    f->net_hdr[PICO_SIZE_IP4HDR] = mark;
+    return f;
+}
+
+static void arp_send(struct pico_stack *S, struct arp_dev *d, uint32_t dst, uint8_t mark)
+{
+    fail_if(pico_enqueue(&S->q_ethernet.out, arp_frame(d, dst, mark)) <= 0);
+}
+
+static void arp_ticks(struct pico_stack *S, int n)
+{
+    while (n-- > 0)
+        pico_stack_tick(S);
+}
+
+static void arp_resolve(struct pico_stack *S, struct arp_dev *d, uint32_t ip, const uint8_t *mac)
+{
+    struct pico_ip4 a;
+    a.addr = long_be(ip);
+    fail_if(pico_arp_create_entry((uint8_t *)mac, a, &d->dev) != 0);
+}
+
+START_TEST(tc_arp_pending_queue)
+{
+    struct arp_dev d;
+    struct pico_stack *S = arp_setup(&d, "arp0");
+    int i;
+
+    fail_unless(S->arp_pending_max == PICO_ARP_MAX_PENDING);
+    fail_if(pico_arp_set_pending_max(S, 0) == 0);
+    fail_if(pico_arp_set_pending_max(S, 4) != 0);
+
+    /* A burst to a fresh neighbour: one request, the newest 4 frames kept */
+    for (i = 0; i < 6; i++)
+        arp_send(S, &d, PEER_A, (uint8_t)i);
+    arp_send(S, &d, PEER_B, 100);
+    arp_send(S, &d, FAR4, 200);
+    arp_ticks(S, 4);
+    fail_unless(d.n == 0);
+    fail_unless(d.requests == 3);
+    fail_unless(d.req_dst[0] == PEER_A);
+    fail_unless(d.req_dst[1] == PEER_B);
+    fail_unless(d.req_dst[2] == GW4);
+    fail_unless(S->arp_stats.queued == 8);
+    fail_unless(S->arp_stats.overflow == 2);
+    fail_unless(pico_tree_count(&S->arp_pending) == 3);
+
+    /* Resolving A releases A's frames only, in order */
+    arp_resolve(S, &d, PEER_A, mac_a);
+    arp_ticks(S, 4);
+    fail_unless(d.n == 4);
+    for (i = 0; i < 4; i++) {
+        fail_unless(d.dst[i] == PEER_A);
+        fail_unless(memcmp(d.mac[i], mac_a, 6) == 0);
+        fail_unless(d.mark[i] == (uint8_t)(i + 2));
+    }
+    fail_unless(S->arp_stats.sent == 4);
+    fail_unless(pico_tree_count(&S->arp_pending) == 2);
+
+    /* Off-link traffic waits on the gateway */
+    arp_resolve(S, &d, GW4, mac_gw);
+    arp_ticks(S, 4);
+    fail_unless(d.n == 5);
+    fail_unless(d.dst[4] == FAR4);
+    fail_unless(memcmp(d.mac[4], mac_gw, 6) == 0);
+
+    /* Resolved neighbours go straight out */
+    arp_send(S, &d, PEER_A, 7);
+    arp_ticks(S, 4);
+    fail_unless(d.n == 6);
+    fail_unless(S->arp_stats.queued == 8);
+    fail_unless(pico_tree_count(&S->arp_pending) == 1);
+
+    /* Frames still waiting are released on teardown */
+    pico_arp_destroy(S);
+    fail_unless(pico_tree_count(&S->arp_pending) == 0);
+}
+END_TEST
+
+START_TEST(tc_arp_pending_unresolved)
+{
+    struct arp_dev d;
+    struct pico_stack *S = arp_setup(&d, "arp1");
+    int i;
+
+    arp_send(S, &d, PEER_B, 1);
+    arp_send(S, &d, PEER_B, 2);
+    for (i = 0; (i < 300) && (S->arp_stats.unresolved == 0); i++) {
+        pico_stack_tick(S);
+        usleep(10000);
+    }
+    fail_unless(S->arp_stats.unresolved == 2);
+    fail_unless(d.requests == 3);
+    fail_unless(d.n == 0);
+    fail_unless(pico_tree_count(&S->arp_pending) == 0);
+}
+END_TEST
+
+START_TEST(tc_arp_pending_stacks)
+{
+    struct arp_dev d1, d2;
+    struct pico_stack *S1 = arp_setup(&d1, "arp2");
+    struct pico_stack *S2 = arp_setup(&d2, "arp3");
+
+    /* Queues and counters belong to one stack */
+    pico_arp_postpone(arp_frame(&d1, PEER_A, 1));
+    pico_arp_postpone(arp_frame(&d2, PEER_A, 2));
+    pico_arp_postpone(arp_frame(&d2, PEER_A, 3));
+    fail_unless(S1->arp_stats.queued == 1);
+    fail_unless(S2->arp_stats.queued == 2);
+    fail_unless(d1.requests == 1);
+    fail_unless(d2.requests == 1);
+
+    arp_resolve(S2, &d2, PEER_A, mac_a);
+    fail_unless(S2->arp_stats.sent == 2);
+    fail_unless(pico_tree_count(&S2->arp_pending) == 0);
+    fail_unless(S1->arp_stats.sent == 0);
+    fail_unless(pico_tree_count(&S1->arp_pending) == 1);
+    pico_arp_destroy(S1);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_arp_pending_queue = tcase_create("Unit test for ARP pending queues");
+    TCase *TCase_arp_pending_unresolved = tcase_create("Unit test for unresolved ARP neighbours");
+    TCase *TCase_arp_pending_stacks = tcase_create("Unit test for ARP queues across stacks");
+
+    tcase_add_test(TCase_arp_pending_queue, tc_arp_pending_queue);
+    suite_add_tcase(s, TCase_arp_pending_queue);
+    tcase_add_test(TCase_arp_pending_unresolved, tc_arp_pending_unresolved);
+    suite_add_tcase(s, TCase_arp_pending_unresolved);
+    tcase_add_test(TCase_arp_pending_stacks, tc_arp_pending_stacks);
+    suite_add_tcase(s, TCase_arp_pending_stacks);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
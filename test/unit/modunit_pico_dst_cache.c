@@ -0,0 +1,273 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_device.h"
+#include "pico_socket.h"
+#include "pico_arp.h"
+#include "check.h"
+#include <sys/time.h>
+
+Suite *pico_suite(void);
+
+#define LOCAL4    0x0A3C0001u   /* 10.60.0.1/24 */
+#define PEER4     0x0A3C0002u
+#define GW4       0x0A3C00FEu
+#define GW4_2     0x0A3C00FDu
+#define FAR4      0x08080808u
+
+static const uint8_t mac_local[6] = { 0x02, 0, 0, 0, 0, 0x01 };
+static const uint8_t mac_peer[6] = { 0x02, 0, 0, 0, 0, 0x02 };
+static const uint8_t mac_peer2[6] = { 0x02, 0, 0, 0, 0, 0x22 };
+static const uint8_t mac_gw[6] = { 0x02, 0, 0, 0, 0, 0xFE };
+static const uint8_t mac_gw2[6] = { 0x02, 0, 0, 0, 0, 0xFD };
+
+/* Device keeping the destination of the last IPv4 frame */
+struct dc_dev {
+    struct pico_device dev;
+    int n;
+    uint8_t mac[6];
+    uint32_t dst;
+};
+
+static struct pico_stack *S;
+static struct dc_dev dev;
+
+static int dc_dev_send(struct pico_device *d, void *buf, int len)
+{
+    struct dc_dev *c = (struct dc_dev *)d;
+    struct pico_eth_hdr *eh = (struct pico_eth_hdr *)buf;
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)((uint8_t *)buf + PICO_SIZE_ETHHDR);
+
+    if (eh->proto == PICO_IDETH_IPV4) {
+        memcpy(c->mac, eh->daddr, 6);
+        c->dst = long_be(hdr->dst.addr);
+        c->n++;
+    }
+
+    return len;
+}
+
+static void dc_setup(void)
+{
+    struct pico_ip4 addr, nm, any, gw;
+
+    if (S)
+        return;
+
+    fail_if(pico_stack_init(&S) != 0);
+    fail_if(pico_device_init(S, &dev.dev, "dc0", mac_local) != 0);
+    dev.dev.send = dc_dev_send;
+    addr.addr = long_be(LOCAL4);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &dev.dev, addr, nm) != 0);
+    any.addr = 0;
+    gw.addr = long_be(GW4);
+    fail_if(pico_ipv4_route_add(S, any, any, gw, 1, NULL) != 0);
+}
+
+static void dc_resolve(uint32_t ip, const uint8_t *mac)
+{
+    struct pico_ip4 a;
+    a.addr = long_be(ip);
+    fail_if(pico_arp_create_entry((uint8_t *)mac, a, &dev.dev) != 0);
+}
+
+/* An ARP reply announcing a new MAC for 'ip' */
+static void dc_arp_reply(uint32_t ip, const uint8_t *mac)
+{
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_ETHHDR + 28);
+    uint8_t *a;
+    uint32_t src = long_be(ip), dst = long_be(LOCAL4);
+
+    fail_if(!f);
+    f->datalink_hdr = f->buffer;
+    f->net_hdr = f->buffer + PICO_SIZE_ETHHDR;
+    f->dev = &dev.dev;
+    a = f->net_hdr;
+    a[0] = 0; a[1] = 1;             /* ethernet */
+    a[2] = 0x08; a[3] = 0;          /* IPv4 */
+    a[4] = 6; a[5] = 4;
+    a[6] = 0; a[7] = 2;             /* reply */
+    memcpy(a + 8, mac, 6);
+    memcpy(a + 14, &src, 4);
+    memcpy(a + 18, mac_local, 6);
+    memcpy(a + 24, &dst, 4);
+    fail_if(pico_arp_receive(f) != 0);
+}
+
+static void dc_ticks(int n)
+{
+    while (n-- > 0)
+        pico_stack_tick(S);
+}
+
+static void dc_send(struct pico_socket *s)
+{
+    static const uint8_t payload[32];
+    int sent = dev.n;
+
+    fail_if(pico_socket_send(s, payload, sizeof(payload)) != (int)sizeof(payload));
+    dc_ticks(4);
+    fail_unless(dev.n == sent + 1);
+}
+
+static struct pico_socket *dc_socket(uint32_t dst)
+{
+    struct pico_socket *s = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_UDP, NULL);
+    struct pico_ip4 a;
+
+    fail_if(!s);
+    a.addr = long_be(dst);
+    fail_if(pico_socket_connect(s, &a, short_be(9)) != 0);
+    return s;
+}
+
+START_TEST(tc_dst_cache)
+{
+    struct pico_socket *s, *far;
+    struct pico_ip4 a, nm, gw;
+    uint32_t gen;
+
+    dc_setup();
+    s = dc_socket(PEER4);
+
+    /* Unresolved: the frame waits for ARP, the entry has no MAC yet */
+    fail_if(pico_socket_send(s, "x", 1) != 1);
+    dc_ticks(4);
+    fail_unless(dev.n == 0);
+    fail_unless(s->dst_cache.link != NULL);
+    fail_unless(s->dst_cache.mac_valid == 0);
+
+    /* Resolution invalidates; the next send fills the MAC in */
+    gen = S->DstCacheGen;
+    dc_resolve(PEER4, mac_peer);
+    fail_if(S->DstCacheGen == gen);
+    dc_ticks(4);
+    fail_unless(dev.n == 1);
+    dc_send(s);
+    fail_unless(s->dst_cache.mac_valid == 1);
+    fail_unless(s->dst_cache.gen == S->DstCacheGen);
+    fail_unless(s->dst_cache.nexthop.addr == long_be(PEER4));
+    fail_unless(memcmp(dev.mac, mac_peer, 6) == 0);
+
+    /* Steady state: nothing changes, nothing is looked up again */
+    gen = S->DstCacheGen;
+    dc_send(s);
+    dc_send(s);
+    fail_unless(S->DstCacheGen == gen);
+    fail_unless(memcmp(dev.mac, mac_peer, 6) == 0);
+
+    /* The neighbour moves */
+    dc_arp_reply(PEER4, mac_peer2);
+    fail_if(S->DstCacheGen == gen);
+    dc_send(s);
+    fail_unless(memcmp(dev.mac, mac_peer2, 6) == 0);
+
+    /* Off-link: the next hop is the gateway, until a better route shows up */
+    dc_resolve(GW4, mac_gw);
+    dc_resolve(GW4_2, mac_gw2);
+    far = dc_socket(FAR4);
+    dc_send(far);
+    fail_unless(far->dst_cache.nexthop.addr == long_be(GW4));
+    fail_unless(dev.dst == FAR4);
+    fail_unless(memcmp(dev.mac, mac_gw, 6) == 0);
+
+    a.addr = long_be(FAR4);
+    nm.addr = 0xFFFFFFFF;
+    gw.addr = long_be(GW4_2);
+    fail_if(pico_ipv4_route_add(S, a, nm, gw, 1, NULL) != 0);
+    dc_send(far);
+    fail_unless(far->dst_cache.nexthop.addr == long_be(GW4_2));
+    fail_unless(memcmp(dev.mac, mac_gw2, 6) == 0);
+
+    fail_if(pico_ipv4_route_del(S, a, nm, 1) != 0);
+    dc_send(far);
+    fail_unless(memcmp(dev.mac, mac_gw, 6) == 0);
+
+    pico_socket_close(s);
+    pico_socket_close(far);
+    dc_ticks(4);
+}
+END_TEST
+
+static double now_s(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + ((double)tv.tv_usec / 1e6);
+}
+
+/* Datagrams/s through a connected socket, with the cache kept or
+ * dropped before every send.
+ */
+static double dc_rate(struct pico_socket *s, int flush)
+{
+    static const uint8_t payload[64];
+    const int rounds = 200000;
+    int i, sent = dev.n;
+    double t = now_s();
+
+    for (i = 0; i < rounds; i++) {
+        if (flush)
+            pico_ipv4_dst_cache_invalidate(S);
+
+        pico_socket_send(s, payload, sizeof(payload));
+        if ((i & 15) == 15)
+            dc_ticks(2);
+    }
+    dc_ticks(4);
+    t = now_s() - t;
+    fail_unless(dev.n - sent >= rounds - 16);
+    return rounds / t;
+}
+
+START_TEST(tc_dst_cache_bench)
+{
+    struct pico_socket *s;
+    struct pico_ip4 a, nm, gw;
+    double hit, miss;
+    uint32_t i;
+
+    dc_setup();
+    gw.addr = long_be(GW4);
+    nm.addr = long_be(0xFFFFFF00);
+    for (i = 0; i < 256; i++) {
+        a.addr = long_be(0x0B000000u | (i << 8));
+        fail_if(pico_ipv4_route_add(S, a, nm, gw, 1, NULL) != 0);
+    }
+
+    s = dc_socket(FAR4);
+    dc_send(s);
+    miss = dc_rate(s, 1);
+    hit = dc_rate(s, 0);
+    printf("Destination cache: %.0f k sends/s cached, %.0f k sends/s uncached\n", hit / 1e3, miss / 1e3);
+    pico_socket_close(s);
+    dc_ticks(4);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_dst_cache = tcase_create("Unit test for the IPv4 destination cache");
+    TCase *TCase_dst_cache_bench = tcase_create("Destination cache benchmark");
+
+    tcase_add_test(TCase_dst_cache, tc_dst_cache);
+    suite_add_tcase(s, TCase_dst_cache);
+    tcase_add_test(TCase_dst_cache_bench, tc_dst_cache_bench);
+    tcase_set_timeout(TCase_dst_cache_bench, 60);
+    suite_add_tcase(s, TCase_dst_cache_bench);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
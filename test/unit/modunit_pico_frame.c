@@ -3,6 +3,7 @@
 #include "pico_frame.h"
 #include "stack/pico_frame.c"
 #include "check.h"
+#include <time.h>
 
 volatile pico_err_t pico_err;
 
@@ -40,11 +41,11 @@ START_TEST(tc_pico_frame_alloc_discard)
 
     printf("Testing with faulty memory in frame_do_alloc, with external buffer, failing to allocate usage_count \n");
     pico_set_mm_failure(2);
-    f = pico_frame_do_alloc(FRAME_SIZE, 1, 1);
+    f = pico_frame_do_alloc(NULL, FRAME_SIZE, 1, 1);
     fail_if(f);
 #endif
     printf("Testing frame_do_alloc, with invalid flags combination\n");
-    f = pico_frame_do_alloc(FRAME_SIZE, 0, 1);
+    f = pico_frame_do_alloc(NULL, FRAME_SIZE, 0, 1);
     fail_if(f);
 
 }
@@ -237,6 +238,158 @@ START_TEST(tc_pico_is_hex)
 }
 END_TEST
 
+/* 16 bits at a time, the way the checksum used to be computed */
+static uint16_t checksum_ref(const uint8_t *buf, uint32_t len)
+{
+    uint32_t sum = 0;
+    uint32_t i;
+    for (i = 0; i + 1 < len; i += 2)
+        sum += (uint32_t)((buf[i] << 8) | buf[i + 1]);
+    if (len & 1)
+        sum += (uint32_t)(buf[len - 1] << 8);
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+START_TEST(tc_pico_checksum)
+{
+    uint8_t buf[4096 + 8];
+    uint32_t i, off, len;
+
+    for (i = 0; i < sizeof(buf); i++)
+        buf[i] = (uint8_t)(i * 7 + (i >> 5));
+
+    /* All alignments and tail lengths */
+    for (off = 0; off < 8; off++) {
+        for (len = 0; len < 300; len++)
+            fail_unless((pico_checksum(buf + off, len)) == checksum_ref(buf + off, len));
+        fail_unless((pico_checksum(buf + off, 4096)) == checksum_ref(buf + off, 4096));
+    }
+
+    /* Carries: all ones */
+    memset(buf, 0xFF, sizeof(buf));
+    fail_unless((pico_checksum(buf, 4096)) == checksum_ref(buf, 4096));
+    fail_unless((pico_checksum(buf, 4095)) == checksum_ref(buf, 4095));
+
+    /* Split buffers */
+    for (i = 0; i < 64; i++)
+        buf[i] = (uint8_t)(i * 13);
+    fail_unless(pico_dualbuffer_checksum(buf, 12, buf + 12, 41) == pico_checksum(buf, 53));
+}
+END_TEST
+
+START_TEST(tc_pico_checksum_adjust)
+{
+    uint8_t buf[64];
+    uint16_t w16, n16, crc;
+    uint32_t w32, n32;
+    int i;
+
+    for (i = 0; i < 64; i++)
+        buf[i] = (uint8_t)(i * 29 + 3);
+
+    for (i = 0; i < 1000; i++) {
+        crc = short_be(pico_checksum(buf, 64));
+        memcpy(&w16, buf + 8, 2);
+        buf[8] = (uint8_t)(buf[8] - 1); /* TTL-style decrement */
+        buf[9] = (uint8_t)(buf[9] ^ (uint8_t)i);
+        memcpy(&n16, buf + 8, 2);
+        crc = pico_checksum_adjust16(crc, w16, n16);
+        fail_unless(crc == short_be(pico_checksum(buf, 64)));
+
+        memcpy(&w32, buf + 12, 4);
+        buf[12] = (uint8_t)(buf[12] + i);
+        buf[15] = (uint8_t)(buf[15] ^ 0xFF);
+        memcpy(&n32, buf + 12, 4);
+        crc = pico_checksum_adjust32(crc, w32, n32);
+        fail_unless(crc == short_be(pico_checksum(buf, 64)));
+    }
+
+    /* Data that sums to zero must not yield a negative zero */
+    memset(buf, 0, sizeof(buf));
+    crc = short_be(pico_checksum(buf, 64));
+    buf[0] = 0xFF;
+    buf[1] = 0xFF;
+    crc = pico_checksum_adjust16(crc, 0, 0xFFFF);
+    fail_unless(crc == short_be(pico_checksum(buf, 64)));
+}
+END_TEST
+
+/* Report checksum throughput for 64B..64KB buffers */
+START_TEST(tc_pico_checksum_bench)
+{
+    uint8_t *buf = PICO_ZALLOC(65536);
+    volatile uint16_t sink = 0;
+    struct timespec t0, t1;
+    uint32_t len, i, rounds;
+    double secs;
+
+    fail_if(!buf);
+    for (i = 0; i < 65536; i++)
+        buf[i] = (uint8_t)i;
+
+    for (len = 64; len <= 65536; len <<= 2) {
+        rounds = (64u << 20) / len;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < rounds; i++)
+            sink = (uint16_t)(sink + pico_checksum(buf, len));
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("Checksum %6u bytes: %8.1f MB/s\n", len, (double)len * rounds / (secs > 0 ? secs : 1e-9) / 1e6);
+    }
+    (void)sink;
+    PICO_FREE(buf);
+}
+END_TEST
+static int ext_freed;
+static void ext_notify_free(uint8_t *buf)
+{
+    IGNORE_PARAMETER(buf);
+    ext_freed++;
+}
+
+START_TEST(tc_pico_frame_set_ext_buffer)
+{
+    struct pico_frame *f = pico_frame_alloc(64);
+    struct pico_frame *c;
+    uint8_t ext[256];
+    fail_if(!f);
+    f->net_hdr = f->buffer + 14;
+    f->transport_hdr = f->buffer + 34;
+    f->payload = f->buffer + 54;
+    f->buffer[20] = 0xAB;
+    memset(ext, 0x55, sizeof(ext));
+
+    /* Shared frames and short buffers are refused */
+    c = pico_frame_copy(f);
+    fail_if(pico_frame_set_ext_buffer(f, ext, sizeof(ext), ext_notify_free) == 0);
+    pico_frame_discard(c);
+    fail_if(pico_frame_set_ext_buffer(f, ext, 32, ext_notify_free) == 0);
+
+    fail_if(pico_frame_set_ext_buffer(f, ext, sizeof(ext), ext_notify_free) != 0);
+    fail_if(f->buffer != ext);
+    fail_if(f->buffer_len != sizeof(ext));
+    fail_if(f->net_hdr != ext + 14);
+    fail_if(f->transport_hdr != ext + 34);
+    fail_if(f->payload != ext + 54);
+    fail_if(!(f->flags & PICO_FRAME_FLAG_EXT_BUFFER));
+    /* Old contents moved along, the rest of the buffer is left alone */
+    fail_if(ext[20] != 0xAB);
+    fail_if(ext[64] != 0x55);
+
+    /* Already external: refused */
+    fail_if(pico_frame_set_ext_buffer(f, ext, sizeof(ext), ext_notify_free) == 0);
+
+    ext_freed = 0;
+    c = pico_frame_copy(f);
+    pico_frame_discard(f);
+    fail_if(ext_freed != 0);
+    pico_frame_discard(c);
+    fail_if(ext_freed != 1);
+}
+END_TEST
+
 Suite *pico_suite(void)
 {
     Suite *s = suite_create("pico_frame.c");
@@ -245,20 +398,32 @@ Suite *pico_suite(void)
     TCase *TCase_pico_frame_grow = tcase_create("Unit test for pico_frame_grow");
     TCase *TCase_pico_frame_grow_head = tcase_create("Unit test for pico_frame_grow_head");
     TCase *TCase_pico_frame_deepcopy = tcase_create("Unit test for pico_frame_deepcopy");
+    TCase *TCase_pico_frame_set_ext_buffer = tcase_create("Unit test for pico_frame_set_ext_buffer");
     TCase *TCase_pico_is_digit = tcase_create("Unit test for pico_is_digit");
     TCase *TCase_pico_is_hex = tcase_create("Unit test for pico_is_hex");
+    TCase *TCase_pico_checksum = tcase_create("Unit test for pico_checksum");
+    TCase *TCase_pico_checksum_adjust = tcase_create("Unit test for pico_checksum_adjust16/32");
+    TCase *TCase_pico_checksum_bench = tcase_create("Benchmark pico_checksum throughput");
     tcase_add_test(TCase_pico_frame_alloc_discard, tc_pico_frame_alloc_discard);
     tcase_add_test(TCase_pico_frame_copy, tc_pico_frame_copy);
     tcase_add_test(TCase_pico_frame_grow, tc_pico_frame_grow);
     tcase_add_test(TCase_pico_frame_grow_head, tc_pico_frame_grow_head);
     tcase_add_test(TCase_pico_frame_deepcopy, tc_pico_frame_deepcopy);
+    tcase_add_test(TCase_pico_frame_set_ext_buffer, tc_pico_frame_set_ext_buffer);
     tcase_add_test(TCase_pico_is_digit, tc_pico_is_digit);
     tcase_add_test(TCase_pico_is_hex, tc_pico_is_hex);
+    tcase_add_test(TCase_pico_checksum, tc_pico_checksum);
+    tcase_add_test(TCase_pico_checksum_adjust, tc_pico_checksum_adjust);
+    tcase_add_test(TCase_pico_checksum_bench, tc_pico_checksum_bench);
     suite_add_tcase(s, TCase_pico_frame_alloc_discard);
     suite_add_tcase(s, TCase_pico_frame_copy);
     suite_add_tcase(s, TCase_pico_frame_grow);
     suite_add_tcase(s, TCase_pico_frame_grow_head);
     suite_add_tcase(s, TCase_pico_frame_deepcopy);
+    suite_add_tcase(s, TCase_pico_frame_set_ext_buffer);
+    suite_add_tcase(s, TCase_pico_checksum);
+    suite_add_tcase(s, TCase_pico_checksum_adjust);
+    suite_add_tcase(s, TCase_pico_checksum_bench);
     return s;
 }
 
@@ -0,0 +1,315 @@
+#include "pico_config.h"
+#include "pico_frame.h"
+#include "pico_device.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_udp.h"
+#include "check.h"
+#include <time.h>
+
+Suite *pico_suite(void);
+
+#define FWD_WARMUP  100
+#define FWD_PACKETS 100000
+#define FWD_PAYLOAD 1000
+#define FWD_LEN (PICO_SIZE_IP4HDR + PICO_UDPHDR_SIZE + FWD_PAYLOAD)
+
+static uint32_t fwd_sent;
+static uint32_t fwd_bad_crc;
+
+static int fwd_send(struct pico_device *dev, void *buf, int len)
+{
+    IGNORE_PARAMETER(dev);
+    /* Only count forwarded datagrams, not the stack's own traffic */
+    if (len == FWD_LEN) {
+        fwd_sent++;
+        /* TTL was decremented: the patched header checksum must still verify */
+        if (pico_checksum(buf, PICO_SIZE_IP4HDR) != 0)
+            fwd_bad_crc++;
+    }
+
+    return len;
+}
+
+static struct pico_device *fwd_dev(struct pico_stack *S, const char *name, uint32_t addr)
+{
+    struct pico_device *dev = PICO_ZALLOC(sizeof(struct pico_device));
+    struct pico_ip4 ip, nm;
+    fail_if(!dev);
+    fail_if(pico_device_init(S, dev, name, NULL) != 0);
+    dev->send = fwd_send;
+    ip.addr = long_be(addr);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, dev, ip, nm) != 0);
+    return dev;
+}
+
+/* Minimal IPv4/UDP datagram from 10.40.0.2 to 10.40.1.2.
+ * The forwarder drops back-to-back duplicates, so each packet gets its own id.
+ */
+static void fwd_packet_id(uint8_t *buf, uint16_t id)
+{
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)buf;
+    hdr->id = short_be(id);
+    hdr->crc = 0;
+    hdr->crc = short_be(pico_checksum(hdr, PICO_SIZE_IP4HDR));
+}
+
+static uint32_t fwd_packet(uint8_t *buf)
+{
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)buf;
+    struct pico_udp_hdr *udp = (struct pico_udp_hdr *)(buf + PICO_SIZE_IP4HDR);
+    uint32_t len = FWD_LEN;
+
+    memset(buf, 0, len);
+    hdr->vhl = 0x45;
+    hdr->len = short_be((uint16_t)len);
+    hdr->ttl = 64;
+    hdr->proto = PICO_PROTO_UDP;
+    hdr->src.addr = long_be(0x0A280002);
+    hdr->dst.addr = long_be(0x0A280102);
+    udp->trans.sport = short_be(1000);
+    udp->trans.dport = short_be(2000);
+    udp->len = short_be((uint16_t)(PICO_UDPHDR_SIZE + FWD_PAYLOAD));
+    return len;
+}
+
+static uint32_t pool_misses(struct pico_stack *S)
+{
+    struct pico_frame_pool *pool = PICO_STACK_FRAME_POOL(S);
+    uint32_t misses = pool->frame_stats.misses + pool->counter_stats.misses;
+    int i;
+    for (i = 0; i < PICO_FRAME_POOL_CLASSES; i++)
+        misses += pool->buffer_stats[i].misses;
+    return misses;
+}
+
+START_TEST(tc_frame_pool_classes)
+{
+    struct pico_frame_pool pool;
+    struct pico_frame *f, *cp;
+    uint8_t *buf;
+
+    pico_frame_pool_init(&pool, 2);
+    f = pico_frame_alloc_pool(&pool, 100);
+    fail_if(!f);
+    fail_unless(f->pool == &pool);
+    fail_unless(f->pool_class == 1);
+    fail_unless(*f->usage_count == 1);
+    cp = pico_frame_copy(f);
+    fail_unless(*f->usage_count == 2);
+    fail_unless(pool.frame_stats.in_use == 2);
+    buf = f->buffer;
+    pico_frame_discard(f);
+    fail_unless(pool.buffer_stats[0].cached == 0);
+    pico_frame_discard(cp);
+    fail_unless(pool.buffer_stats[0].cached == 1);
+    fail_unless(pool.frame_stats.cached == 2);
+
+    /* Recycled buffer comes back zeroed */
+    f = pico_frame_alloc_pool(&pool, 64);
+    fail_unless(f->buffer == buf);
+    fail_unless(pool.buffer_stats[0].hits == 1);
+    memset(f->buffer, 0xAA, 64);
+    pico_frame_discard(f);
+    f = pico_frame_alloc_pool(&pool, 64);
+    fail_unless(f->buffer[0] == 0 && f->buffer[63] == 0);
+    pico_frame_discard(f);
+
+    f = pico_frame_alloc_pool(&pool, 1500);
+    fail_unless(f->pool_class == 2);
+    fail_if(pico_frame_grow(f, 9000) != 0);
+    fail_unless(f->pool_class == 3);
+    fail_unless(pool.buffer_stats[1].cached == 1);
+    pico_frame_discard(f);
+
+    /* Larger than the biggest class: plain heap buffer */
+    f = pico_frame_alloc_pool(&pool, 20000);
+    fail_unless(f->pool_class == 0);
+    pico_frame_discard(f);
+
+    f = pico_frame_alloc_skeleton_pool(&pool, 100, 0);
+    fail_unless(pool.counter_stats.in_use == 1);
+    pico_frame_discard(f);
+    fail_unless(pool.counter_stats.cached == 1);
+
+    /* Free lists are capped at max_cached */
+    fail_unless(pool.frame_stats.cached == 2);
+    pico_frame_pool_destroy(&pool);
+    fail_unless(pool.frame_stats.cached == 0);
+}
+END_TEST
+
+/* Forward UDP datagrams between two interfaces and count heap allocations
+ * made by the frame code once the pool has warmed up.
+ */
+START_TEST(tc_frame_pool_forward)
+{
+    struct pico_stack *S;
+    struct pico_device *in;
+    uint8_t pkt[FWD_LEN];
+    uint32_t len = fwd_packet(pkt);
+    uint32_t i, misses;
+    struct timespec t0, t1;
+    double secs;
+
+    fail_if(pico_stack_init(&S) != 0);
+    in = fwd_dev(S, "fwd0", 0x0A280001);
+    fwd_dev(S, "fwd1", 0x0A280101);
+
+    fwd_sent = 0;
+    for (i = 0; i < FWD_WARMUP; i++) {
+        fwd_packet_id(pkt, (uint16_t)i);
+        fail_if(pico_stack_recv(in, pkt, len) <= 0);
+        pico_stack_tick(S);
+    }
+    fail_unless(fwd_sent == FWD_WARMUP);
+
+    misses = pool_misses(S);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < FWD_PACKETS; i++) {
+        fwd_packet_id(pkt, (uint16_t)(FWD_WARMUP + i));
+        pico_stack_recv(in, pkt, len);
+        pico_stack_tick(S);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+    misses = pool_misses(S) - misses;
+
+    printf("Forwarded %u packets in %.3f s, %.4f frame allocations/packet (pool hits: %u frames, %u buffers)\n",
+           FWD_PACKETS, secs, (double)misses / FWD_PACKETS,
+           PICO_STACK_FRAME_POOL(S)->frame_stats.hits, PICO_STACK_FRAME_POOL(S)->buffer_stats[1].hits);
+    fail_unless(fwd_sent == FWD_WARMUP + FWD_PACKETS);
+    fail_unless(fwd_bad_crc == 0);
+    /* Forwarding itself never misses; allow for a few locally generated
+     * frames (e.g. IGMP reports) that may be in flight at the same time.
+     */
+    fail_unless(misses < 16);
+}
+END_TEST
+
+#define FWD_BURST 32
+static uint32_t burst_freed;
+static uint32_t burst_calls;
+
+static int fwd_send_burst(struct pico_device *dev, struct pico_frame **f, int count)
+{
+    int i;
+    burst_calls++;
+    for (i = 0; i < count; i++)
+        fwd_send(dev, f[i]->start, (int)f[i]->len);
+    return count;
+}
+
+static void burst_notify_free(uint8_t *buf)
+{
+    IGNORE_PARAMETER(buf);
+    burst_freed++;
+}
+
+/* Same forwarding path, with the driver side handing packets over in
+ * bursts, both copied and zero-copy.
+ */
+START_TEST(tc_frame_pool_forward_burst)
+{
+    struct pico_stack *S;
+    struct pico_device *in, *out;
+    static uint8_t pkt[FWD_BURST][FWD_LEN];
+    uint8_t *buf[FWD_BURST];
+    uint32_t len[FWD_BURST];
+    uint32_t i, j, base = 0;
+    int32_t ret;
+    struct timespec t0, t1;
+    double secs;
+    int zc;
+
+    fail_if(pico_stack_init(&S) != 0);
+    in = fwd_dev(S, "fwd0", 0x0A280001);
+    out = fwd_dev(S, "fwd1", 0x0A280101);
+
+    for (j = 0; j < FWD_BURST; j++) {
+        len[j] = fwd_packet(pkt[j]);
+        buf[j] = pkt[j];
+    }
+
+    fail_if(pico_stack_recv_burst(in, buf, len, 0, NULL) != -1);
+    for (zc = 0; zc < 2; zc++) {
+        fwd_sent = 0;
+        burst_freed = 0;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        for (i = 0; i < FWD_PACKETS / FWD_BURST; i++) {
+            for (j = 0; j < FWD_BURST; j++) {
+                /* Forwarding rewrites the TTL in place in zero-copy buffers */
+                fwd_packet(pkt[j]);
+                fwd_packet_id(pkt[j], (uint16_t)(base++));
+            }
+            ret = pico_stack_recv_burst(in, buf, len, FWD_BURST, zc ? burst_notify_free : NULL);
+            fail_unless(ret == FWD_BURST);
+            pico_stack_tick(S);
+            /* Zero-copy buffers are reused for the next burst */
+            if (zc)
+                fail_unless(burst_freed == (i + 1) * FWD_BURST);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        secs = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+        printf("Forwarded %u packets in bursts of %d (%s) in %.3f s\n", fwd_sent, FWD_BURST,
+               zc ? "zero-copy" : "copy", secs);
+        fail_unless(fwd_sent == (FWD_PACKETS / FWD_BURST) * FWD_BURST);
+        fail_unless(fwd_bad_crc == 0);
+    }
+
+    /* A full device queue takes what fits, the rest stays with the caller */
+    in->q_in->max_frames = 4;
+    burst_freed = 0;
+    for (j = 0; j < FWD_BURST; j++)
+        fwd_packet_id(pkt[j], (uint16_t)(base++));
+    fail_unless(pico_stack_recv_burst(in, buf, len, FWD_BURST, burst_notify_free) == 4);
+    fail_unless(burst_freed == 0);
+    pico_stack_tick(S);
+    fail_unless(burst_freed == 4);
+    in->q_in->max_frames = 0;
+
+    /* Transmit side: the whole burst reaches the driver in one call */
+    out->send_burst = fwd_send_burst;
+    fwd_sent = 0;
+    burst_calls = 0;
+    for (j = 0; j < FWD_BURST; j++) {
+        fwd_packet(pkt[j]);
+        fwd_packet_id(pkt[j], (uint16_t)(base++));
+    }
+    fail_unless(pico_stack_recv_burst(in, buf, len, FWD_BURST, NULL) == FWD_BURST);
+    pico_stack_tick(S);
+    fail_unless(fwd_sent == FWD_BURST);
+    fail_unless(burst_calls == 1);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_frame_pool_classes = tcase_create("Unit test for frame pool size classes");
+    TCase *TCase_frame_pool_forward = tcase_create("Benchmark frame pool on the forwarding path");
+    TCase *TCase_frame_pool_forward_burst = tcase_create("Benchmark burst receive on the forwarding path");
+
+    tcase_add_test(TCase_frame_pool_classes, tc_frame_pool_classes);
+    suite_add_tcase(s, TCase_frame_pool_classes);
+    tcase_add_test(TCase_frame_pool_forward, tc_frame_pool_forward);
+    tcase_set_timeout(TCase_frame_pool_forward, 60);
+    suite_add_tcase(s, TCase_frame_pool_forward);
+    tcase_add_test(TCase_frame_pool_forward_burst, tc_frame_pool_forward_burst);
+    tcase_set_timeout(TCase_frame_pool_forward_burst, 60);
+    suite_add_tcase(s, TCase_frame_pool_forward_burst);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,472 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_ipv6.h"
+#include "pico_socket.h"
+#include "pico_device.h"
+#include "pico_tcp.h"
+#include "pico_udp.h"
+#include "pico_gro.h"
+#include "modules/pico_gro.c"
+#include "check.h"
+#include <time.h>
+
+Suite *pico_suite(void);
+
+#define SEG      1000u
+#define SEQ      0xFFFFF000u /* exercise sequence wrap-around */
+#define LOCAL4   0x0A280001u
+#define PEER4    0x0A280002u
+
+static struct pico_stack *S;
+static struct pico_device dev;
+static struct pico_ip6 local6, peer6;
+
+static int dev_send(struct pico_device *d, void *buf, int len)
+{
+    IGNORE_PARAMETER(d);
+    IGNORE_PARAMETER(buf);
+    return len;
+}
+
+static void gro_setup(void)
+{
+    struct pico_ip4 addr, nm;
+    struct pico_ip6 nm6;
+    struct pico_ipv6_link *link;
+
+    if (S)
+        return;
+
+    fail_if(pico_stack_init(&S) != 0);
+    dev.send = dev_send;
+    fail_if(pico_device_init(S, &dev, "gro", NULL) != 0);
+    fail_unless(dev.offload & PICO_DEV_OFFLOAD_GRO);
+    addr.addr = long_be(LOCAL4);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &dev, addr, nm) != 0);
+
+    pico_string_to_ipv6("fd00::1", local6.addr);
+    pico_string_to_ipv6("fd00::2", peer6.addr);
+    pico_string_to_ipv6("ffff:ffff:ffff:ffff::", nm6.addr);
+    link = pico_ipv6_link_add_no_dad(&dev, local6, nm6);
+    fail_if(!link);
+    fail_unless(pico_ipv6_link_find(S, &local6) == &dev);
+}
+
+/* A received raw IP packet from the peer: TCP with 12 bytes of
+ * options and payload bytes following the sequence number.
+ */
+static struct pico_frame *gro_seg(int ipv6, uint16_t sport, uint32_t seq, uint16_t len, uint8_t flags)
+{
+    uint32_t nhlen = ipv6 ? PICO_SIZE_IP6HDR : PICO_SIZE_IP4HDR;
+    uint32_t thlen = PICO_SIZE_TCPHDR + 12u;
+    struct pico_frame *f = pico_frame_alloc(nhlen + thlen + len);
+    struct pico_tcp_hdr *tcp;
+    uint32_t i;
+
+    fail_if(!f);
+    memset(f->buffer, 0, f->buffer_len);
+    f->dev = &dev;
+    f->start = f->buffer;
+    f->len = f->buffer_len;
+    f->net_hdr = f->buffer;
+    f->transport_hdr = f->net_hdr + nhlen;
+    f->transport_len = (uint16_t)(thlen + len);
+    if (ipv6) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        hdr->vtf = long_be(0x60000000);
+        hdr->len = short_be((uint16_t)f->transport_len);
+        hdr->nxthdr = PICO_PROTO_TCP;
+        hdr->hop = 64;
+        hdr->src = peer6;
+        hdr->dst = local6;
+    } else {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        hdr->vhl = 0x45;
+        hdr->len = short_be((uint16_t)(nhlen + f->transport_len));
+        hdr->frag = short_be(PICO_IPV4_DONTFRAG);
+        hdr->ttl = 64;
+        hdr->proto = PICO_PROTO_TCP;
+        hdr->src.addr = long_be(PEER4);
+        hdr->dst.addr = long_be(LOCAL4);
+        hdr->crc = short_be(pico_checksum(hdr, nhlen));
+    }
+
+    tcp = (struct pico_tcp_hdr *)f->transport_hdr;
+    tcp->trans.sport = short_be(sport);
+    tcp->trans.dport = short_be(80);
+    tcp->seq = long_be(seq);
+    tcp->ack = long_be(42);
+    tcp->len = (uint8_t)((thlen >> 2) << 4);
+    tcp->flags = flags;
+    tcp->rwnd = short_be((uint16_t)(seq & 0xFFFF));
+    memset(f->transport_hdr + PICO_SIZE_TCPHDR, PICO_TCP_OPTION_NOOP, 12);
+    for (i = 0; i < len; i++)
+        f->transport_hdr[thlen + i] = (uint8_t)(seq + i);
+    tcp->crc = short_be(pico_tcp_checksum(f));
+    f->net_hdr = NULL;
+    f->transport_hdr = NULL;
+    return f;
+}
+
+static struct pico_frame *gro_udp(void)
+{
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_IP4HDR + PICO_UDPHDR_SIZE);
+    struct pico_ipv4_hdr *hdr;
+
+    fail_if(!f);
+    memset(f->buffer, 0, f->buffer_len);
+    f->dev = &dev;
+    f->start = f->buffer;
+    f->len = f->buffer_len;
+    hdr = (struct pico_ipv4_hdr *)f->buffer;
+    hdr->vhl = 0x45;
+    hdr->len = short_be((uint16_t)f->len);
+    hdr->ttl = 64;
+    hdr->proto = PICO_PROTO_UDP;
+    hdr->src.addr = long_be(PEER4);
+    hdr->dst.addr = long_be(LOCAL4);
+    hdr->crc = short_be(pico_checksum(hdr, PICO_SIZE_IP4HDR));
+    return f;
+}
+
+/* f must be a valid packet carrying [seq, seq + len) */
+static void gro_check(struct pico_frame *f, uint16_t sport, uint32_t seq, uint32_t len, uint8_t flags, int merged)
+{
+    uint8_t *net = f->start;
+    int ipv6 = ((net[0] >> 4) == 6);
+    uint32_t nhlen = ipv6 ? PICO_SIZE_IP6HDR : PICO_SIZE_IP4HDR;
+    uint32_t thlen = PICO_SIZE_TCPHDR + 12u;
+    struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)(net + nhlen);
+    uint32_t i;
+
+    fail_unless(f->len == nhlen + thlen + len);
+    if (ipv6) {
+        fail_unless(short_be(((struct pico_ipv6_hdr *)net)->len) == thlen + len);
+    } else {
+        fail_unless(short_be(((struct pico_ipv4_hdr *)net)->len) == nhlen + thlen + len);
+        fail_unless(pico_checksum(net, nhlen) == 0);
+    }
+
+    fail_unless(short_be(tcp->trans.sport) == sport);
+    fail_unless(long_be(tcp->seq) == seq);
+    fail_unless(tcp->flags == flags);
+    fail_unless(!merged == !(f->flags & PICO_FRAME_FLAG_CSUM_VALID));
+    if (merged)
+        fail_unless(short_be(tcp->rwnd) == (uint16_t)(seq + len - ((len % SEG) ? (len % SEG) : SEG)));
+
+    for (i = 0; i < len; i++)
+        fail_unless(((uint8_t *)tcp)[thlen + i] == (uint8_t)(seq + i));
+}
+
+static struct pico_frame *gro_chain(struct pico_frame **v, int n)
+{
+    int i;
+    for (i = 0; i < n - 1; i++)
+        v[i]->next = v[i + 1];
+    v[n - 1]->next = NULL;
+    return v[0];
+}
+
+static int gro_count(struct pico_frame *f)
+{
+    int n = 0;
+    for (; f; f = f->next)
+        n++;
+    return n;
+}
+
+static void gro_free(struct pico_frame *f)
+{
+    struct pico_frame *next;
+    for (; f; f = next) {
+        next = f->next;
+        pico_frame_discard(f);
+    }
+}
+
+START_TEST(tc_gro_receive)
+{
+    struct pico_frame *v[16], *out, *f;
+    struct pico_ipv4_hdr *hdr;
+    int ipv6;
+
+    gro_setup();
+    for (ipv6 = 0; ipv6 < 2; ipv6++) {
+        /* Three full segments and a short one, then more of the same
+         * flow after a UDP packet. Only the short segment ends a merge.
+         */
+        v[0] = gro_seg(ipv6, 1000, SEQ, SEG, PICO_TCP_ACK);
+        v[1] = gro_seg(ipv6, 1000, SEQ + SEG, SEG, PICO_TCP_PSHACK);
+        v[2] = gro_seg(ipv6, 1000, SEQ + 2 * SEG, SEG, PICO_TCP_ACK);
+        v[3] = gro_seg(ipv6, 1000, SEQ + 3 * SEG, 500, PICO_TCP_PSHACK);
+        v[4] = gro_udp();
+        v[5] = gro_seg(ipv6, 1000, SEQ + 3 * SEG + 500, SEG, PICO_TCP_ACK);
+        v[6] = gro_seg(ipv6, 1000, SEQ + 4 * SEG + 500, SEG, PICO_TCP_ACK);
+        out = pico_gro_receive(gro_chain(v, 7));
+        fail_unless(gro_count(out) == 3);
+        gro_check(out, 1000, SEQ, 3 * SEG + 500, PICO_TCP_PSHACK, 1);
+        fail_unless(out->next == v[4]);
+        gro_check(v[4]->next, 1000, SEQ + 3 * SEG + 500, 2 * SEG, PICO_TCP_ACK, 1);
+        gro_free(out);
+
+        /* Interleaved flows are merged separately, a hole or a FIN
+         * ends a merge, and the FIN stays behind its flow's data.
+         */
+        v[0] = gro_seg(ipv6, 2000, SEQ, SEG, PICO_TCP_ACK);
+        v[1] = gro_seg(ipv6, 3000, 0, SEG, PICO_TCP_ACK);
+        v[2] = gro_seg(ipv6, 2000, SEQ + SEG, SEG, PICO_TCP_ACK);
+        v[3] = gro_seg(ipv6, 3000, SEG, SEG, PICO_TCP_ACK);
+        v[4] = gro_seg(ipv6, 2000, SEQ + 3 * SEG, SEG, PICO_TCP_ACK);
+        v[5] = gro_seg(ipv6, 3000, 2 * SEG, SEG, PICO_TCP_FINACK);
+        out = pico_gro_receive(gro_chain(v, 6));
+        fail_unless(gro_count(out) == 4);
+        f = out;
+        gro_check(f, 2000, SEQ, 2 * SEG, PICO_TCP_ACK, 1);
+        f = f->next;
+        gro_check(f, 3000, 0, 2 * SEG, PICO_TCP_ACK, 1);
+        fail_unless(f->next == v[5]);
+        f = v[5]->next;
+        fail_unless(f == v[4]);
+        gro_check(f, 2000, SEQ + 3 * SEG, SEG, PICO_TCP_ACK, 0);
+        gro_free(out);
+    }
+
+    /* Bad checksums and foreign destinations are left alone */
+    v[0] = gro_seg(0, 4000, 0, SEG, PICO_TCP_ACK);
+    v[1] = gro_seg(0, 4000, SEG, SEG, PICO_TCP_ACK);
+    v[1]->start[PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR + 12u] ^= 0xFF;
+    v[2] = gro_seg(0, 5000, 0, SEG, PICO_TCP_ACK);
+    v[3] = gro_seg(0, 5000, SEG, SEG, PICO_TCP_ACK);
+    hdr = (struct pico_ipv4_hdr *)v[2]->start;
+    hdr->dst.addr = long_be(PEER4 + 1u);
+    hdr->crc = 0;
+    hdr->crc = short_be(pico_checksum(hdr, PICO_SIZE_IP4HDR));
+    hdr = (struct pico_ipv4_hdr *)v[3]->start;
+    hdr->dst.addr = long_be(PEER4 + 1u);
+    hdr->crc = 0;
+    hdr->crc = short_be(pico_checksum(hdr, PICO_SIZE_IP4HDR));
+    out = pico_gro_receive(gro_chain(v, 4));
+    fail_unless(gro_count(out) == 4);
+    fail_unless((out == v[0]) && (v[0]->next == v[1]) && (v[1]->next == v[2]) && (v[2]->next == v[3]));
+    gro_free(out);
+}
+END_TEST
+
+/* Buffers of a zero-copy driver, released through notify_free */
+static uint32_t gro_freed;
+
+static void gro_notify_free(uint8_t *buffer)
+{
+    gro_freed++;
+    PICO_FREE(buffer);
+}
+
+START_TEST(tc_gro_ext_buffer)
+{
+    struct pico_frame *f, *out;
+    uint8_t *bufs[3];
+    uint32_t len[3];
+    int i;
+
+    gro_setup();
+    for (i = 0; i < 3; i++) {
+        f = gro_seg(0, 6000, SEQ + (uint32_t)i * SEG, SEG, PICO_TCP_ACK);
+        len[i] = f->len;
+        bufs[i] = PICO_ZALLOC(len[i]);
+        fail_if(!bufs[i]);
+        memcpy(bufs[i], f->start, len[i]);
+        pico_frame_discard(f);
+    }
+
+    gro_freed = 0;
+    fail_unless(pico_stack_recv_burst(&dev, bufs, len, 3, gro_notify_free) == 3);
+    out = pico_dequeue_list(dev.q_in, 3);
+    fail_unless(gro_count(out) == 3);
+    fail_unless(out->flags & PICO_FRAME_FLAG_EXT_BUFFER);
+
+    /* The merged frame owns its buffer; the driver gets its own back */
+    out = pico_gro_receive(out);
+    fail_unless(gro_count(out) == 1);
+    gro_check(out, 6000, SEQ, 3 * SEG, PICO_TCP_ACK, 1);
+    fail_if(out->flags & (PICO_FRAME_FLAG_EXT_BUFFER | PICO_FRAME_FLAG_EXT_USAGE_COUNTER));
+    fail_unless(gro_freed == 3);
+    gro_free(out);
+    fail_unless(gro_freed == 3);
+}
+END_TEST
+
+/* Reflecting link: every IPv4 packet comes back with source and
+ * destination swapped, so that a connection to a neighbour ends up on
+ * a local listener and both directions cross the device.
+ */
+#define LINK_RING  512
+#define LINK_MTU   1500
+#define LINK_BYTES (4 * 1024 * 1024)
+
+struct link_dev {
+    struct pico_device dev;
+    uint8_t ring[LINK_RING][LINK_MTU];
+    int len[LINK_RING];
+    int head, tail;
+    uint32_t acks; /* TCP packets without payload */
+};
+
+static int link_send(struct pico_device *d, void *buf, int len)
+{
+    struct link_dev *l = (struct link_dev *)d;
+    uint8_t *p = (uint8_t *)buf;
+    int next = (l->head + 1) % LINK_RING;
+
+    fail_if(len > LINK_MTU);
+    if (next == l->tail)
+        return 0;
+
+    /* IPv4 only: looping IPv6 DAD probes back would look like a conflict */
+    if ((p[0] >> 4) != 4)
+        return len;
+
+    if ((p[9] == PICO_PROTO_TCP) && (len == (int)(PICO_SIZE_IP4HDR + ((p[PICO_SIZE_IP4HDR + 12] & 0xf0u) >> 2))))
+        l->acks++;
+
+    memcpy(l->ring[l->head], buf, (size_t)len);
+    memcpy(l->ring[l->head] + 12, p + 16, 4);
+    memcpy(l->ring[l->head] + 16, p + 12, 4);
+    l->len[l->head] = len;
+    l->head = next;
+    return len;
+}
+
+static int link_poll(struct pico_device *d, int loop_score)
+{
+    struct link_dev *l = (struct link_dev *)d;
+    while ((loop_score > 0) && (l->tail != l->head)) {
+        pico_stack_recv(d, l->ring[l->tail], (uint32_t)l->len[l->tail]);
+        l->tail = (l->tail + 1) % LINK_RING;
+        loop_score--;
+    }
+    return loop_score;
+}
+
+static void link_cb(uint16_t ev, struct pico_socket *s)
+{
+    IGNORE_PARAMETER(ev);
+    IGNORE_PARAMETER(s);
+}
+
+/* Returns the transfer time in ms */
+static double link_transfer(struct link_dev *l, int gro, uint16_t port)
+{
+    struct pico_stack *LS;
+    struct pico_socket *srv, *cli, *acc = NULL;
+    struct pico_ip4 addr, peer, nm, any = { 0 }, orig;
+    struct timespec t0, t1;
+    static uint8_t buf[16384];
+    uint16_t rport;
+    int sent = 0, rcvd = 0, r, i, val = 1 << 20;
+    long ticks = 0;
+
+    memset(l, 0, sizeof(*l));
+    fail_if(pico_stack_init(&LS) != 0);
+    fail_if(pico_device_init(LS, &l->dev, "link", NULL) != 0);
+    l->dev.send = link_send;
+    l->dev.poll = link_poll;
+    if (!gro)
+        l->dev.offload &= (uint8_t)~PICO_DEV_OFFLOAD_GRO;
+
+    addr.addr = long_be(LOCAL4);
+    peer.addr = long_be(PEER4);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(LS, &l->dev, addr, nm) != 0);
+
+    srv = pico_socket_open(LS, PICO_PROTO_IPV4, PICO_PROTO_TCP, link_cb);
+    fail_if(!srv);
+    fail_if(pico_socket_bind(srv, &any, &port) != 0);
+    fail_if(pico_socket_listen(srv, 1) != 0);
+    cli = pico_socket_open(LS, PICO_PROTO_IPV4, PICO_PROTO_TCP, link_cb);
+    fail_if(!cli);
+    fail_if(pico_socket_setoption(cli, PICO_SOCKET_OPT_SNDBUF, &val) != 0);
+    fail_if(pico_socket_connect(cli, &peer, port) != 0);
+    while (!acc && (ticks++ < 100000)) {
+        pico_stack_tick(LS);
+        acc = pico_socket_accept(srv, &orig, &rport);
+    }
+    fail_if(!acc);
+
+    l->acks = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ((rcvd < LINK_BYTES) && (ticks++ < 50000000)) {
+        while (sent < LINK_BYTES) {
+            int len = LINK_BYTES - sent;
+            if (len > (int)sizeof(buf))
+                len = (int)sizeof(buf);
+
+            for (i = 0; i < len; i++)
+                buf[i] = (uint8_t)(sent + i);
+            r = pico_socket_write(cli, buf, len);
+            if (r <= 0)
+                break;
+
+            sent += r;
+        }
+        pico_stack_tick(LS);
+        while ((r = pico_socket_read(acc, buf, sizeof(buf))) > 0) {
+            for (i = 0; i < r; i++)
+                fail_if(buf[i] != (uint8_t)(rcvd + i));
+            rcvd += r;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fail_unless(rcvd == LINK_BYTES);
+    pico_socket_close(cli);
+    pico_socket_close(acc);
+    pico_socket_close(srv);
+    return ((double)(t1.tv_sec - t0.tv_sec) * 1e3) + ((double)(t1.tv_nsec - t0.tv_nsec) / 1e6);
+}
+
+START_TEST(tc_gro_tcp)
+{
+    static struct link_dev l;
+    double ms_plain, ms_gro;
+    uint32_t acks_plain;
+
+    ms_plain = link_transfer(&l, 0, short_be(7300));
+    acks_plain = l.acks;
+    ms_gro = link_transfer(&l, 1, short_be(7301));
+    /* One TCP input, hence at most one ACK, per merged frame */
+    fail_unless((l.acks * 2u) < acks_plain);
+    printf("%u KiB over a reflecting link:\n", LINK_BYTES / 1024);
+    printf("  one by one:  %7.1f ms, %u ACKs\n", ms_plain, acks_plain);
+    printf("  GRO:         %7.1f ms, %u ACKs\n", ms_gro, l.acks);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_gro_receive = tcase_create("Unit test for receive coalescing");
+    TCase *TCase_gro_ext_buffer = tcase_create("Unit test for coalescing zero-copy receive buffers");
+    TCase *TCase_gro_tcp = tcase_create("TCP bulk transfer with receive coalescing");
+
+    tcase_add_test(TCase_gro_receive, tc_gro_receive);
+    suite_add_tcase(s, TCase_gro_receive);
+    tcase_add_test(TCase_gro_ext_buffer, tc_gro_ext_buffer);
+    suite_add_tcase(s, TCase_gro_ext_buffer);
+    tcase_add_test(TCase_gro_tcp, tc_gro_tcp);
+    tcase_set_timeout(TCase_gro_tcp, 60);
+    suite_add_tcase(s, TCase_gro_tcp);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,415 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_ipv6.h"
+#include "pico_socket.h"
+#include "pico_device.h"
+#include "pico_tcp.h"
+#include "pico_gso.h"
+#include "modules/pico_gso.c"
+#include "check.h"
+#include <time.h>
+
+Suite *pico_suite(void);
+
+#define SEG      1000u
+#define SEQ      0xFFFFF000u /* exercise sequence wrap-around */
+#define IP_ID    0xFFFEu
+#define CAP_MAX  8
+#define CAP_LEN  2048
+#define EXT_LEN  8u /* IPv6 destination options header, padding only */
+
+/* Device recording what reaches send(), busy once when asked to */
+struct cap_dev {
+    struct pico_device dev;
+    uint8_t buf[CAP_MAX][CAP_LEN];
+    int len[CAP_MAX];
+    int n;
+    int busy_at;
+};
+
+static int cap_send(struct pico_device *dev, void *buf, int len)
+{
+    struct cap_dev *c = (struct cap_dev *)dev;
+    if (c->n == c->busy_at) {
+        c->busy_at = -1;
+        return 0;
+    }
+
+    fail_if((c->n >= CAP_MAX) || (len > CAP_LEN));
+    memcpy(c->buf[c->n], buf, (size_t)len);
+    c->len[c->n++] = len;
+    return len;
+}
+
+/* Network header length: IPv4, IPv6, or IPv6 with EXT_LEN bytes of
+ * extension header when ipv6 is 2.
+ */
+static uint32_t gso_nhlen(int ipv6)
+{
+    if (!ipv6)
+        return PICO_SIZE_IP4HDR;
+
+    return (ipv6 > 1) ? (PICO_SIZE_IP6HDR + EXT_LEN) : PICO_SIZE_IP6HDR;
+}
+
+/* Ethernet + network + TCP header with 12 bytes of options, then
+ * 'payload' bytes of pattern, as the stack hands it to the device.
+ */
+static struct pico_frame *gso_super_frame(int ipv6, uint32_t payload)
+{
+    uint32_t nhlen = gso_nhlen(ipv6);
+    uint32_t thlen = PICO_SIZE_TCPHDR + 12u;
+    struct pico_frame *f = pico_frame_alloc(PICO_SIZE_ETHHDR + nhlen + thlen + payload);
+    struct pico_tcp_hdr *tcp;
+    uint32_t i;
+
+    fail_if(!f);
+    memset(f->buffer, 0, f->buffer_len);
+    f->start = f->buffer;
+    f->len = f->buffer_len;
+    f->datalink_hdr = f->buffer;
+    f->net_hdr = f->datalink_hdr + PICO_SIZE_ETHHDR;
+    f->net_len = (uint16_t)nhlen;
+    f->transport_hdr = f->net_hdr + nhlen;
+    f->transport_len = (uint16_t)(thlen + payload);
+    f->payload = f->transport_hdr + thlen;
+    f->payload_len = (uint16_t)payload;
+    f->gso_size = SEG;
+
+    memset(f->datalink_hdr, 0xAA, PICO_SIZE_ETHHDR);
+    if (ipv6) {
+        struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)f->net_hdr;
+        hdr->vtf = long_be(0x60000000);
+        hdr->len = short_be((uint16_t)(nhlen - PICO_SIZE_IP6HDR + f->transport_len));
+        hdr->nxthdr = PICO_PROTO_TCP;
+        if (ipv6 > 1) {
+            /* Next header TCP, then a PadN option filling the rest */
+            hdr->nxthdr = PICO_IPV6_EXTHDR_DESTOPT;
+            f->net_hdr[PICO_SIZE_IP6HDR] = PICO_PROTO_TCP;
+            f->net_hdr[PICO_SIZE_IP6HDR + 2] = 1;
+            f->net_hdr[PICO_SIZE_IP6HDR + 3] = (uint8_t)(EXT_LEN - 4u);
+        }
+
+        hdr->hop = 64;
+        hdr->src.addr[0] = 0xfd;
+        hdr->src.addr[15] = 1;
+        hdr->dst.addr[0] = 0xfd;
+        hdr->dst.addr[15] = 2;
+    } else {
+        struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)f->net_hdr;
+        hdr->vhl = 0x45;
+        hdr->len = short_be((uint16_t)(nhlen + f->transport_len));
+        hdr->id = short_be(IP_ID);
+        hdr->frag = short_be(PICO_IPV4_DONTFRAG);
+        hdr->ttl = 64;
+        hdr->proto = PICO_PROTO_TCP;
+        hdr->src.addr = long_be(0x0A280001);
+        hdr->dst.addr = long_be(0x0A280002);
+    }
+
+    tcp = (struct pico_tcp_hdr *)f->transport_hdr;
+    tcp->trans.sport = short_be(1234);
+    tcp->trans.dport = short_be(80);
+    tcp->seq = long_be(SEQ);
+    tcp->ack = long_be(42);
+    tcp->len = (uint8_t)((thlen >> 2) << 4);
+    tcp->flags = PICO_TCP_PSH | PICO_TCP_ACK;
+    tcp->rwnd = short_be(1000);
+    memset(f->transport_hdr + PICO_SIZE_TCPHDR, PICO_TCP_OPTION_NOOP, 12);
+    for (i = 0; i < payload; i++)
+        f->payload[i] = (uint8_t)(i * 7u);
+
+    return f;
+}
+
+/* Each captured segment must be a valid packet of its own */
+static void gso_check_segments(struct cap_dev *c, int ipv6, uint32_t payload)
+{
+    uint32_t nhlen = gso_nhlen(ipv6);
+    uint32_t thlen = PICO_SIZE_TCPHDR + 12u;
+    uint32_t off = 0, seg, i;
+    int k;
+
+    fail_unless(c->n == (int)((payload + SEG - 1u) / SEG));
+    for (k = 0; k < c->n; k++) {
+        uint8_t *net = c->buf[k] + PICO_SIZE_ETHHDR;
+        struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)(net + nhlen);
+        uint16_t tlen;
+
+        seg = ((payload - off) > SEG) ? SEG : (payload - off);
+        tlen = (uint16_t)(thlen + seg);
+        fail_unless(c->len[k] == (int)(PICO_SIZE_ETHHDR + nhlen + tlen));
+        fail_unless(c->buf[k][0] == 0xAA);
+        fail_unless(long_be(tcp->seq) == SEQ + off);
+        fail_unless(long_be(tcp->ack) == 42);
+        fail_unless(tcp->flags == (PICO_TCP_PSH | PICO_TCP_ACK));
+        fail_unless(((uint8_t *)tcp)[PICO_SIZE_TCPHDR + 11] == PICO_TCP_OPTION_NOOP);
+        if (ipv6) {
+            struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)net;
+            struct pico_ipv6_pseudo_hdr pseudo;
+            fail_unless(short_be(hdr->len) == nhlen - PICO_SIZE_IP6HDR + tlen);
+            memset(&pseudo, 0, sizeof(pseudo));
+            pseudo.src = hdr->src;
+            pseudo.dst = hdr->dst;
+            pseudo.len = long_be(tlen);
+            pseudo.nxthdr = PICO_PROTO_TCP;
+            fail_unless(pico_dualbuffer_checksum(&pseudo, sizeof(pseudo), tcp, tlen) == 0);
+        } else {
+            struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)net;
+            struct pico_ipv4_pseudo_hdr pseudo;
+            fail_unless(short_be(hdr->len) == nhlen + tlen);
+            fail_unless(short_be(hdr->id) == (uint16_t)(IP_ID + k));
+            fail_unless(pico_checksum(hdr, nhlen) == 0);
+            pseudo.src.addr = hdr->src.addr;
+            pseudo.dst.addr = hdr->dst.addr;
+            pseudo.zeros = 0;
+            pseudo.proto = PICO_PROTO_TCP;
+            pseudo.len = short_be(tlen);
+            fail_unless(pico_dualbuffer_checksum(&pseudo, sizeof(pseudo), tcp, tlen) == 0);
+        }
+
+        for (i = 0; i < seg; i++)
+            fail_unless(((uint8_t *)tcp)[thlen + i] == (uint8_t)((off + i) * 7u));
+        off += seg;
+    }
+}
+
+START_TEST(tc_gso_xmit)
+{
+    static struct cap_dev c;
+    struct pico_frame *f;
+    int ipv6;
+
+    c.dev.send = cap_send;
+    for (ipv6 = 0; ipv6 < 3; ipv6++) {
+        /* Three full segments and a short one; the device is busy once */
+        c.n = 0;
+        c.busy_at = 2;
+        f = gso_super_frame(ipv6, 3u * SEG + 500u);
+        fail_unless(pico_gso_xmit(&c.dev, f) == 0);
+        fail_unless(c.n == 2);
+        fail_unless(pico_gso_xmit(&c.dev, f) > 0);
+        gso_check_segments(&c, ipv6, 3u * SEG + 500u);
+        pico_frame_discard(f);
+
+        /* Exact multiple of the segment size */
+        c.n = 0;
+        f = gso_super_frame(ipv6, 2u * SEG);
+        fail_unless(pico_gso_xmit(&c.dev, f) > 0);
+        gso_check_segments(&c, ipv6, 2u * SEG);
+        pico_frame_discard(f);
+
+        /* Nothing to split */
+        c.n = 0;
+        f = gso_super_frame(ipv6, 100u);
+        fail_unless(pico_gso_xmit(&c.dev, f) > 0);
+        gso_check_segments(&c, ipv6, 100u);
+        pico_frame_discard(f);
+    }
+}
+END_TEST
+
+/* Reflecting link: every IPv4 packet comes back with source and
+ * destination swapped, so that a connection to a neighbour ends up on
+ * a local listener and both directions cross the device. With
+ * 'tso' set the driver takes super-frames through send_burst() and
+ * segments them itself, counting how many frames came down the stack.
+ */
+#define LINK_RING  512
+#define LINK_MTU   1500
+#define LINK_BYTES (4 * 1024 * 1024)
+
+struct link_dev {
+    struct pico_device dev;
+    uint8_t ring[LINK_RING][LINK_MTU];
+    int len[LINK_RING];
+    int head, tail;
+    uint32_t frames;   /* frames handed over by the stack */
+    uint32_t supers;   /* ...of which super-frames */
+    uint32_t segments; /* packets on the wire */
+};
+
+static int link_send(struct pico_device *dev, void *buf, int len)
+{
+    struct link_dev *l = (struct link_dev *)dev;
+    int next = (l->head + 1) % LINK_RING;
+
+    fail_if(len > LINK_MTU);
+    if (next == l->tail)
+        return 0;
+
+    /* IPv4 only: looping IPv6 DAD probes back would look like a conflict */
+    if ((((uint8_t *)buf)[0] >> 4) != 4)
+        return len;
+
+    memcpy(l->ring[l->head], buf, (size_t)len);
+    memcpy(l->ring[l->head] + 12, (uint8_t *)buf + 16, 4);
+    memcpy(l->ring[l->head] + 16, (uint8_t *)buf + 12, 4);
+    l->len[l->head] = len;
+    l->head = next;
+    l->segments++;
+    return len;
+}
+
+static int link_send_burst(struct pico_device *dev, struct pico_frame **f, int count)
+{
+    struct link_dev *l = (struct link_dev *)dev;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (f[i]->gso_size) {
+            if (pico_gso_xmit(dev, f[i]) <= 0)
+                break;
+
+            l->supers++;
+        } else if (link_send(dev, f[i]->start, (int)f[i]->len) <= 0) {
+            break;
+        }
+
+        l->frames++;
+    }
+    return i;
+}
+
+static int link_poll(struct pico_device *dev, int loop_score)
+{
+    struct link_dev *l = (struct link_dev *)dev;
+    while ((loop_score > 0) && (l->tail != l->head)) {
+        pico_stack_recv(dev, l->ring[l->tail], (uint32_t)l->len[l->tail]);
+        l->tail = (l->tail + 1) % LINK_RING;
+        loop_score--;
+    }
+    return loop_score;
+}
+
+static void link_cb(uint16_t ev, struct pico_socket *s)
+{
+    IGNORE_PARAMETER(ev);
+    IGNORE_PARAMETER(s);
+}
+
+/* Returns the transfer time in ms */
+static double link_transfer(struct link_dev *l, int gso, int tso, uint16_t port)
+{
+    struct pico_stack *S;
+    struct pico_socket *srv, *cli, *acc = NULL;
+    struct pico_ip4 addr, peer, nm, any = { 0 }, orig;
+    struct timespec t0, t1;
+    static uint8_t buf[16384];
+    uint16_t rport;
+    int sent = 0, rcvd = 0, r, i, val = 1 << 20;
+    long ticks = 0;
+
+    memset(l, 0, sizeof(*l));
+    fail_if(pico_stack_init(&S) != 0);
+    fail_if(pico_device_init(S, &l->dev, "link", NULL) != 0);
+    fail_unless(l->dev.gso_max_size == PICO_GSO_MAX_SIZE);
+    l->dev.send = link_send;
+    l->dev.poll = link_poll;
+    if (!gso)
+        l->dev.gso_max_size = 0;
+
+    if (tso) {
+        l->dev.send_burst = link_send_burst;
+        l->dev.offload |= PICO_DEV_OFFLOAD_TSO;
+    }
+
+    addr.addr = long_be(0x0A280001);
+    peer.addr = long_be(0x0A280002);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &l->dev, addr, nm) != 0);
+
+    srv = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, link_cb);
+    fail_if(!srv);
+    fail_if(pico_socket_bind(srv, &any, &port) != 0);
+    fail_if(pico_socket_listen(srv, 1) != 0);
+    cli = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, link_cb);
+    fail_if(!cli);
+    fail_if(pico_socket_setoption(cli, PICO_SOCKET_OPT_SNDBUF, &val) != 0);
+    fail_if(pico_socket_connect(cli, &peer, port) != 0);
+    while (!acc && (ticks++ < 100000)) {
+        pico_stack_tick(S);
+        acc = pico_socket_accept(srv, &orig, &rport);
+    }
+    fail_if(!acc);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ((rcvd < LINK_BYTES) && (ticks++ < 50000000)) {
+        while (sent < LINK_BYTES) {
+            int len = LINK_BYTES - sent;
+            if (len > (int)sizeof(buf))
+                len = (int)sizeof(buf);
+
+            for (i = 0; i < len; i++)
+                buf[i] = (uint8_t)(sent + i);
+            r = pico_socket_write(cli, buf, len);
+            if (r <= 0)
+                break;
+
+            sent += r;
+        }
+        pico_stack_tick(S);
+        while ((r = pico_socket_read(acc, buf, sizeof(buf))) > 0) {
+            for (i = 0; i < r; i++)
+                fail_if(buf[i] != (uint8_t)(rcvd + i));
+            rcvd += r;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fail_unless(rcvd == LINK_BYTES);
+    pico_socket_close(cli);
+    pico_socket_close(acc);
+    pico_socket_close(srv);
+    return ((double)(t1.tv_sec - t0.tv_sec) * 1e3) + ((double)(t1.tv_nsec - t0.tv_nsec) / 1e6);
+}
+
+START_TEST(tc_gso_tcp)
+{
+    static struct link_dev l;
+    double ms_plain, ms_gso, ms_tso;
+    uint32_t frames_plain;
+
+    ms_plain = link_transfer(&l, 0, 1, short_be(7200));
+    fail_unless(l.supers == 0);
+    frames_plain = l.frames;
+
+    ms_tso = link_transfer(&l, 1, 1, short_be(7201));
+    fail_unless(l.supers > 0);
+    fail_unless(l.segments >= (LINK_BYTES / LINK_MTU));
+    /* Data goes down the stack in super-frames */
+    fail_unless((l.frames * 2u) < l.segments);
+    printf("%u KiB over a reflecting link: %u segments\n", LINK_BYTES / 1024, l.segments);
+    printf("  one by one:       %7.1f ms, %u frames down the stack\n", ms_plain, frames_plain);
+    printf("  TSO driver:       %7.1f ms, %u frames (%u super-frames)\n", ms_tso, l.frames, l.supers);
+
+    ms_gso = link_transfer(&l, 1, 0, short_be(7202));
+    printf("  software GSO:     %7.1f ms\n", ms_gso);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_gso_xmit = tcase_create("Unit test for super-frame segmentation");
+    TCase *TCase_gso_tcp = tcase_create("TCP bulk transfer with segmentation offload");
+
+    tcase_add_test(TCase_gso_xmit, tc_gso_xmit);
+    suite_add_tcase(s, TCase_gso_xmit);
+    tcase_add_test(TCase_gso_tcp, tc_gso_tcp);
+    tcase_set_timeout(TCase_gso_tcp, 60);
+    suite_add_tcase(s, TCase_gso_tcp);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
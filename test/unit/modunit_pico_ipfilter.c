@@ -8,266 +8,137 @@
 #include "pico_ipfilter.h"
 #include "pico_tcp.h"
 #include "pico_udp.h"
-#include "pico_tree.h"
 #include "modules/pico_ipfilter.c"
 #include "check.h"
+#include <sys/time.h>
 
 Suite *pico_suite(void);
-int pico_icmp4_packet_filtered(struct pico_frame *f)
+
+static int discarded, rejected;
+
+int pico_icmp4_packet_filtered(struct pico_stack *S, struct pico_frame *f)
 {
+    (void)S;
     (void)f;
+    rejected++;
     return 0;
 }
 
-void pico_frame_discard(struct pico_frame *f)
+#ifdef PICO_SUPPORT_IPV6
+int pico_icmp6_packet_filtered(struct pico_stack *S, struct pico_frame *f)
 {
+    (void)S;
     (void)f;
+    rejected++;
+    return 0;
 }
+#endif
 
-volatile pico_err_t pico_err;
-
-
-
-START_TEST(tc_ipfilter)
+void pico_ipv4_flow_cache_invalidate(struct pico_stack *S)
 {
-    uint32_t r;
-    struct filter_node a = {
-        0
-    }, b = {
-        0
-    };
-    fail_if(filter_compare(&a, &b) != 0);
-
-
-    /* a is rule, matching packet b */
-    a.filter_id = 1;
-
-    /* check that rule is matched properly */
-    fail_if(filter_match_packet_find_rule(&a, &b) != &a);
-
-    /* a has a out port that does not match packet */
-    b.out_port = 8;
-    a.out_port = 7;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches all ports */
-    a.out_port = 0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-
-    /* a has a in port that does not match packet */
-    b.in_port = 8;
-    a.in_port = 7;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches all ports */
-    a.in_port = 0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a matches port exactly */
-    a.in_port = 0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all out addresses */
-    b.out_addr = 0x010000a0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a does not match b via 8-bit netmask */
-    a.out_addr = 0x000000c0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a does not match b at all*/
-    a.out_addr = 0x020000b0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.out_addr = 0x000000a0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a matches b exactly */
-    a.out_addr = 0x010000a0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all in addresses */
-    b.in_addr = 0x010000a0;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a does not match b via 8-bit netmask */
-    a.in_addr = 0x000000c0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a does not match b at all*/
-    a.in_addr = 0x020000b0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.in_addr = 0x000000a0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a matches b exactly */
-    a.in_addr = 0x010000a0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all protocols */
-    b.proto = 4u;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a does not match protocol */
-    a.proto = 5u;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches b's protocol */
-    a.proto = b.proto;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all devices */
-    b.fdev = (struct pico_device *) &b;
-    fail_if(filter_compare(&a, &b) != 0);
-
-    /* a does not match device */
-    a.fdev = (struct pico_device *)&a;
-    fail_if(filter_compare(&a, &b) == 0);
-
-    /* a matches b's device */
-    a.fdev = b.fdev;
-    fail_if(filter_compare(&a, &b) != 0);
-
-
-    /*** SAME TEST DUPLICATED WITH INVERTED ORDER OF PARAMETERS ***/
-
-    memset(&a, 0, sizeof(struct filter_node));
-    memset(&b, 0, sizeof(struct filter_node));
-
-    a.filter_id = 2;
-
-
-    /* check that rule is matched properly */
-    fail_if(filter_match_packet_find_rule(&b, &a) != &a);
-
-    /* a has a out port that does not match packet */
-    b.out_port = 8;
-    a.out_port = 7;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches all ports */
-    a.out_port = 0;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /*** NEXT TEST ***/
-
-
-    /* a has a in port that does not match packet */
-    b.in_port = 8;
-    a.in_port = 7;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches all ports */
-    a.in_port = 0;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /* a matches port exactly */
-    a.in_port = 0;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all out addresses */
-    b.out_addr = 0x010000a0;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /* a does not match b via 8-bit netmask */
-    a.out_addr = 0x000000c0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a does not match b at all*/
-    a.out_addr = 0x020000b0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.out_addr = 0x000000a0;
-    a.out_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /* a matches b exactly */
-    a.out_addr = 0x010000a0;
-    a.out_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /*** NEXT TEST ***/
-
-    /* a matches all in addresses */
-    b.in_addr = 0x010000a0;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /* a does not match b via 8-bit netmask */
-    a.in_addr = 0x000000c0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a does not match b at all*/
-    a.in_addr = 0x020000b0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) == 0);
-
-    /* a matches b via 8-bit netmask */
-    a.in_addr = 0x000000a0;
-    a.in_addr_netmask = 0x000000ff;
-    fail_if(filter_compare(&b, &a) != 0);
-
-    /* a matches b exactly */
-    a.in_addr = 0x010000a0;
-    a.in_addr_netmask = 0xffffffff;
-    fail_if(filter_compare(&b, &a) != 0);
+    (void)S;
+}
 
-    /*** NEXT TEST ***/
+void pico_frame_discard(struct pico_frame *f)
+{
+    (void)f;
+    discarded++;
+}
 
-    /* a matches all protocols */
-    b.proto = 4u;
-    fail_if(filter_compare(&b, &a) != 0);
+volatile pico_err_t pico_err;
 
-    /* a does not match protocol */
-    a.proto = 5u;
-    fail_if(filter_compare(&b, &a) == 0);
+static struct pico_stack stack;
+static struct pico_device dev, dev2;
+static uint8_t buf[128];
+static struct pico_frame frame;
 
-    /* a matches b's protocol */
-    a.proto = b.proto;
-    fail_if(filter_compare(&b, &a) != 0);
+static struct pico_frame *ipf_frame4(struct pico_device *d, uint8_t proto, uint32_t src, uint32_t dst,
+                                     uint16_t sport, uint16_t dport)
+{
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)buf;
+    struct pico_trans *tr = (struct pico_trans *)(buf + PICO_SIZE_IP4HDR);
+
+    memset(buf, 0, sizeof(buf));
+    memset(&frame, 0, sizeof(frame));
+    hdr->vhl = 0x45;
+    hdr->len = short_be(60);
+    hdr->proto = proto;
+    hdr->src.addr = long_be(src);
+    hdr->dst.addr = long_be(dst);
+    tr->sport = short_be(sport);
+    tr->dport = short_be(dport);
+    frame.buffer = buf;
+    frame.buffer_len = sizeof(buf);
+    frame.net_hdr = buf;
+    frame.transport_hdr = buf + PICO_SIZE_IP4HDR;
+    frame.dev = d;
+    return &frame;
+}
 
-    /*** NEXT TEST ***/
+/* a:b:c::d */
+static void ipf_ip6(uint8_t *addr, uint16_t a, uint16_t b, uint16_t c, uint16_t d)
+{
+    memset(addr, 0, PICO_SIZE_IP6);
+    addr[0] = (uint8_t)(a >> 8);
+    addr[1] = (uint8_t)a;
+    addr[2] = (uint8_t)(b >> 8);
+    addr[3] = (uint8_t)b;
+    addr[4] = (uint8_t)(c >> 8);
+    addr[5] = (uint8_t)c;
+    addr[14] = (uint8_t)(d >> 8);
+    addr[15] = (uint8_t)d;
+}
 
-    /* a matches all devices */
-    b.fdev = (struct pico_device *)&b;
-    fail_if(filter_compare(&b, &a) != 0);
+static struct pico_frame *ipf_frame6(uint8_t proto, uint16_t net, uint16_t subnet, uint16_t dport)
+{
+    struct pico_ipv6_hdr *hdr = (struct pico_ipv6_hdr *)buf;
+    struct pico_trans *tr = (struct pico_trans *)(buf + PICO_SIZE_IP6HDR);
+
+    memset(buf, 0, sizeof(buf));
+    memset(&frame, 0, sizeof(frame));
+    hdr->vtf = long_be(0x60000000);
+    hdr->len = short_be(20);
+    hdr->nxthdr = proto;
+    ipf_ip6(hdr->src.addr, 0x2001, 0x0db8, 1, 1);
+    ipf_ip6(hdr->dst.addr, 0x2001, net, subnet, 1);
+    tr->sport = short_be(1234);
+    tr->dport = short_be(dport);
+    frame.buffer = buf;
+    frame.buffer_len = sizeof(buf);
+    frame.net_hdr = buf;
+    frame.transport_hdr = buf + PICO_SIZE_IP6HDR;
+    frame.dev = &dev;
+    return &frame;
+}
 
-    /* a does not match device */
-    a.fdev = (struct pico_device *)&a;
-    fail_if(filter_compare(&b, &a) == 0);
+static void ipf_rule4(struct pico_ipfilter_rule *r, uint8_t proto, uint32_t src, uint8_t src_prefix,
+                      uint32_t dst, uint8_t dst_prefix, int8_t priority, enum filter_action action)
+{
+    memset(r, 0, sizeof(*r));
+    r->family = PICO_PROTO_IPV4;
+    r->proto = proto;
+    r->src.ip4.addr = long_be(src);
+    r->src_prefix = src_prefix;
+    r->dst.ip4.addr = long_be(dst);
+    r->dst_prefix = dst_prefix;
+    r->priority = priority;
+    r->action = action;
+}
 
-    /* a matches b's device */
-    a.fdev = b.fdev;
-    fail_if(filter_compare(&b, &a) != 0);
+static uint32_t ipf_hits(uint32_t id)
+{
+    uint32_t hits = 0;
+    fail_if(pico_ipfilter_stats(&stack, id, &hits, NULL) != 0);
+    return hits;
+}
 
+START_TEST(tc_ipfilter)
+{
+    struct pico_ipfilter_set *set;
+    struct pico_ipfilter_rule rule;
+    uint32_t r;
 
+    dev.stack = &stack;
 
     /*********** TEST ADD FILTER **************/
 
@@ -280,32 +151,360 @@ START_TEST(tc_ipfilter)
      */
 
 
-    r = pico_ipv4_filter_add(NULL, 0, NULL, NULL, NULL, NULL, 0, 0, MAX_PRIORITY + 1, 0, FILTER_DROP);
+    r = pico_ipv4_filter_add(&dev, 0, NULL, NULL, NULL, NULL, 0, 0, MAX_PRIORITY + 1, 0, FILTER_DROP);
     fail_if(r > 0);
 
-    r = pico_ipv4_filter_add(NULL, 0, NULL, NULL, NULL, NULL, 0, 0, MIN_PRIORITY - 1, 0, FILTER_PRIORITY);
+    r = pico_ipv4_filter_add(&dev, 0, NULL, NULL, NULL, NULL, 0, 0, MIN_PRIORITY - 1, 0, FILTER_PRIORITY);
     fail_if(r > 0);
 
-    r = pico_ipv4_filter_add(NULL, 0, NULL, NULL, NULL, NULL, 0, 0, 0, 0, FILTER_COUNT);
+    r = pico_ipv4_filter_add(&dev, 0, NULL, NULL, NULL, NULL, 0, 0, 0, 0, FILTER_COUNT);
     fail_if(r > 0);
 
+    r = pico_ipv4_filter_add(NULL, 0, NULL, NULL, NULL, NULL, 0, 0, 0, 0, FILTER_DROP);
+    fail_if(r > 0);
+
+    set = pico_ipfilter_set_new();
+    fail_if(!set);
+    ipf_rule4(&rule, 0, 0, 0, 0, 33, 0, FILTER_DROP);
+    fail_if(pico_ipfilter_set_add(set, &rule) > 0);
+    ipf_rule4(&rule, 0, 0, 0, 0, 0, 0, FILTER_DROP);
+    rule.family = 7;
+    fail_if(pico_ipfilter_set_add(set, &rule) > 0);
+    ipf_rule4(&rule, 0, 0, 0, 0, 0, 0, FILTER_DROP);
+    rule.dport_min = 100;
+    rule.dport_max = 99;
+    fail_if(pico_ipfilter_set_add(set, &rule) > 0);
+    pico_ipfilter_set_free(set);
+
 #ifdef FAULTY
     pico_set_mm_failure(1);
-    r = pico_ipv4_filter_add(NULL, 0, NULL, NULL, NULL, NULL, 0, 0, 0, 0, FILTER_DROP);
+    r = pico_ipv4_filter_add(&dev, 0, NULL, NULL, NULL, NULL, 0, 0, 0, 0, FILTER_DROP);
     fail_if(r > 0);
     fail_if(pico_err != PICO_ERR_ENOMEM);
 #endif
 }
 END_TEST
 
+START_TEST(tc_ipfilter_first_match)
+{
+    struct pico_ipfilter_set *set;
+    struct pico_ipfilter_rule rule;
+    struct pico_ip4 a, nm;
+    uint32_t web, low, lan, dns, v6udp, v6any, all, legacy;
+    uint64_t bytes;
+    struct pico_icmp4_hdr *icmp;
+
+    dev.stack = &stack;
+    dev2.stack = &stack;
+    dev2.hash = 2;
+    discarded = 0;
+    rejected = 0;
+
+    set = pico_ipfilter_set_new();
+    ipf_rule4(&rule, PICO_PROTO_TCP, 0, 0, 0x0A000000u, 8, 0, FILTER_DROP);
+    rule.dport_min = rule.dport_max = 80;
+    web = pico_ipfilter_set_add(set, &rule);
+    ipf_rule4(&rule, PICO_PROTO_TCP, 0, 0, 0, 0, 5, FILTER_PRIORITY);
+    rule.dport_min = 1;
+    rule.dport_max = 1024;
+    low = pico_ipfilter_set_add(set, &rule);
+    ipf_rule4(&rule, 0, 0xC0A80100u, 24, 0, 0, 0, FILTER_REJECT);
+    lan = pico_ipfilter_set_add(set, &rule);
+    ipf_rule4(&rule, PICO_PROTO_UDP, 0xC0A80107u, 32, 0, 0, 0, FILTER_DROP);
+    rule.sport_min = rule.sport_max = 53;
+    dns = pico_ipfilter_set_add(set, &rule);
+    memset(&rule, 0, sizeof(rule));
+    rule.family = PICO_PROTO_IPV6;
+    rule.proto = PICO_PROTO_UDP;
+    ipf_ip6(rule.dst.ip6.addr, 0x2001, 0x0db8, 0, 0);
+    rule.dst_prefix = 32;
+    rule.dport_min = 5000;
+    rule.dport_max = 6000;
+    rule.action = FILTER_DROP;
+    v6udp = pico_ipfilter_set_add(set, &rule);
+    memset(&rule, 0, sizeof(rule));
+    rule.family = PICO_PROTO_IPV6;
+    rule.priority = MIN_PRIORITY;
+    rule.action = FILTER_PRIORITY;
+    v6any = pico_ipfilter_set_add(set, &rule);
+    fail_if(!web || !low || !lan || !dns || !v6udp || !v6any);
+    fail_if(pico_ipfilter_set_commit(&stack, set) != 0);
+    fail_unless(pico_ipfilter_has_pass_rules(&stack));
+
+    /* Higher priority first, whatever the insertion order */
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_TCP, 0x01020304u, 0x0A010101u, 4000, 80)) != 0);
+    fail_unless(ipf_hits(low) == 1);
+    fail_unless(ipf_hits(web) == 0);
+    fail_if(pico_ipfilter_stats(&stack, low, NULL, &bytes) != 0);
+    fail_unless(bytes == 60);
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_TCP, 0x01020304u, 0x0A010101u, 4000, 8080)) != 0);
+    fail_unless(ipf_hits(low) == 1);
+
+    fail_if(pico_ipv4_filter_del(&stack, low) != 0);
+    fail_if(pico_ipv4_filter_del(&stack, low) == 0);
+    fail_if(pico_ipfilter_stats(&stack, low, NULL, NULL) == 0);
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_TCP, 0x01020304u, 0x0A010101u, 4000, 80)) != 1);
+    fail_unless(ipf_hits(web) == 1);
+    fail_unless(discarded == 1);
+
+    /* Same priority: the rule added first wins */
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_UDP, 0xC0A80107u, 0x08080808u, 53, 53)) != 1);
+    fail_unless(ipf_hits(lan) == 1);
+    fail_unless(ipf_hits(dns) == 0);
+    fail_unless(rejected == 1);
+
+    /* No ports on ICMP; our own "filtered" errors are never filtered */
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_ICMP4, 0xC0A80107u, 0x08080808u, 0, 0)) != 1);
+    fail_unless(ipf_hits(lan) == 2);
+    ipf_frame4(&dev, PICO_PROTO_ICMP4, 0xC0A80107u, 0x08080808u, 0, 0);
+    icmp = (struct pico_icmp4_hdr *)frame.transport_hdr;
+    icmp->type = PICO_ICMP_UNREACH;
+    icmp->code = PICO_ICMP_UNREACH_FILTER_PROHIB;
+    fail_if(ipfilter(&frame) != 0);
+    fail_unless(ipf_hits(lan) == 2);
+
+    /* IPv6 prefixes and port ranges */
+    fail_if(ipfilter(ipf_frame6(PICO_PROTO_UDP, 0x0db8, 0xff, 5500)) != 1);
+    fail_unless(ipf_hits(v6udp) == 1);
+    fail_if(ipfilter(ipf_frame6(PICO_PROTO_UDP, 0x0db8, 0xff, 7000)) != 0);
+    fail_if(ipfilter(ipf_frame6(PICO_PROTO_UDP, 0x0db9, 0, 5500)) != 0);
+    fail_if(ipfilter(ipf_frame6(PICO_PROTO_TCP, 0x0db8, 0, 5500)) != 0);
+    fail_unless(ipf_hits(v6any) == 3);
+    fail_if(pico_ipfilter_stats(&stack, v6any, NULL, &bytes) != 0);
+    fail_unless(bytes == 3 * (20 + PICO_SIZE_IP6HDR));
+
+    /* A new set replaces the whole rule base at once */
+    set = pico_ipfilter_set_new();
+    ipf_rule4(&rule, 0, 0, 0, 0, 0, 0, FILTER_DROP);
+    all = pico_ipfilter_set_add(set, &rule);
+    fail_if(pico_ipfilter_set_commit(&stack, set) != 0);
+    fail_unless(pico_ipfilter_stats(&stack, web, NULL, NULL) < 0);
+    fail_unless(pico_ipfilter_stats(&stack, v6any, NULL, NULL) < 0);
+    fail_unless(!pico_ipfilter_has_pass_rules(&stack));
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_TCP, 0x01020304u, 0x0A010101u, 4000, 80)) != 1);
+    fail_if(ipfilter(ipf_frame6(PICO_PROTO_UDP, 0x0db8, 0xff, 5500)) != 0);
+    fail_unless(ipf_hits(all) == 1);
+
+    /* Rules bound to a device; counters survive later changes */
+    a.addr = long_be(0x0A000000u);
+    nm.addr = long_be(0xFF000000u);
+    legacy = pico_ipv4_filter_add(&dev2, PICO_PROTO_UDP, &a, &nm, NULL, NULL, 53, 0, 1, 0, FILTER_PRIORITY);
+    fail_if(!legacy);
+    fail_unless(ipf_hits(all) == 1);
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_UDP, 0x01020304u, 0x0A010101u, 4000, 53)) != 1);
+    fail_if(ipfilter(ipf_frame4(&dev2, PICO_PROTO_UDP, 0x01020304u, 0x0A010101u, 4000, 53)) != 0);
+    fail_if(ipfilter(ipf_frame4(&dev2, PICO_PROTO_UDP, 0x01020304u, 0x0B010101u, 4000, 53)) != 1);
+    fail_unless(ipf_hits(legacy) == 1);
+    fail_unless(ipf_hits(all) == 3);
+
+    pico_ipfilter_destroy(&stack);
+    fail_if(ipfilter(ipf_frame4(&dev, PICO_PROTO_TCP, 0x01020304u, 0x0A010101u, 4000, 80)) != 0);
+}
+END_TEST
+
+/* Random rule bases, classified both ways */
+static uint32_t ipf_seed = 12345u;
+
+static uint32_t ipf_rand(void)
+{
+    ipf_seed = ipf_seed * 1103515245u + 12345u;
+    return (ipf_seed >> 8) ^ (ipf_seed << 20);
+}
+
+static void ipf_random_rule(struct pico_ipfilter_rule *r)
+{
+    static const uint8_t plen4[] = { 0, 8, 16, 24, 32 };
+    static const uint8_t plen6[] = { 0, 32, 48, 64, 128 };
+    static const uint8_t proto[] = { 0, PICO_PROTO_TCP, PICO_PROTO_UDP };
+    uint32_t i, v;
+
+    memset(r, 0, sizeof(*r));
+    r->family = ((ipf_rand() % 10) == 0) ? PICO_PROTO_IPV6 : PICO_PROTO_IPV4;
+    if (r->family == PICO_PROTO_IPV4) {
+        r->src.ip4.addr = long_be(0x0A000000u | (ipf_rand() & 0x00FF0F0Fu));
+        r->dst.ip4.addr = long_be(0xAC100000u | (ipf_rand() & 0x000F0F3Fu));
+        r->src_prefix = plen4[ipf_rand() % 5];
+        r->dst_prefix = plen4[ipf_rand() % 5];
+    } else {
+        for (i = 0; i < 16; i += 4) {
+            v = long_be(0x20010DB8u ^ ((i ? ipf_rand() : 0) & 0x0303u));
+            memcpy(r->src.ip6.addr + i, &v, 4);
+            v = long_be(0x20010DB8u ^ ((i ? ipf_rand() : 0) & 0x0F03u));
+            memcpy(r->dst.ip6.addr + i, &v, 4);
+        }
+        r->src_prefix = plen6[ipf_rand() % 5];
+        r->dst_prefix = plen6[ipf_rand() % 5];
+    }
+
+    r->proto = proto[ipf_rand() % 3];
+    switch (ipf_rand() % 4) {
+    case 0:
+        r->dport_min = r->dport_max = (uint16_t)(1 + (ipf_rand() % 2000));
+        break;
+    case 1:
+        r->dport_min = (uint16_t)(ipf_rand() % 2000);
+        r->dport_max = (uint16_t)(r->dport_min + 1 + (ipf_rand() % 500));
+        break;
+    default:
+        break;
+    }
+    if ((ipf_rand() % 8) == 0)
+        r->sport_min = r->sport_max = (uint16_t)(1 + (ipf_rand() % 2000));
+
+    r->priority = (int8_t)((ipf_rand() % 5) - 2);
+    r->action = ((ipf_rand() % 2) == 0) ? FILTER_DROP : FILTER_PRIORITY;
+}
+
+/* A key close to some rule, so that lookups do match now and then */
+static void ipf_random_key(const struct pico_ipfilter_set *set, struct filter_key *k)
+{
+    const struct filter_node *n = &set->rules[ipf_rand() % set->count];
+    static const uint8_t proto[] = { PICO_PROTO_TCP, PICO_PROTO_UDP, PICO_PROTO_ICMP4 };
+    uint32_t i;
+
+    memset(k, 0, sizeof(*k));
+    k->dev = &dev;
+    k->family = n->family;
+    k->words = (uint8_t)ipfilter_words(n->family);
+    for (i = 0; i < k->words; i++) {
+        k->src[i] = n->src[i] | (ipf_rand() & ~n->src_mask[i] & long_be(0x00000303u));
+        k->dst[i] = n->dst[i] | (ipf_rand() & ~n->dst_mask[i] & long_be(0x00000F03u));
+    }
+    k->proto = proto[ipf_rand() % 3];
+    if (k->proto == PICO_PROTO_ICMP4) {
+        k->sport = k->dport = IPF_NO_PORT;
+    } else {
+        k->sport = (ipf_rand() % 4) ? n->sport_min : (ipf_rand() % 2000);
+        k->dport = (ipf_rand() % 4) ? n->dport_min + (ipf_rand() % 4) : (ipf_rand() % 2000);
+        if (k->sport > 0xFFFF)
+            k->sport = ipf_rand() & 0xFFFF;
+        if (k->dport > 0xFFFF)
+            k->dport = ipf_rand() & 0xFFFF;
+    }
+    k->len = 64;
+}
+
+/* Reference: every rule, best priority then lowest id */
+static struct filter_node *ipf_linear(const struct pico_ipfilter_set *set, const struct filter_key *k)
+{
+    struct filter_node *best = NULL;
+    uint32_t i;
+
+    for (i = 0; i < set->count; i++) {
+        struct filter_node *n = &set->rules[i];
+        if ((!best || (n->priority > best->priority)) && ipfilter_node_match(n, k))
+            best = n;
+    }
+    return best;
+}
+
+static struct pico_ipfilter_set *ipf_random_set(uint32_t rules)
+{
+    struct pico_ipfilter_set *set = pico_ipfilter_set_new();
+    struct pico_ipfilter_rule r;
+    uint32_t i;
+
+    fail_if(!set);
+    for (i = 0; i < rules; i++) {
+        ipf_random_rule(&r);
+        fail_if(pico_ipfilter_set_add(set, &r) == 0);
+    }
+    fail_if(pico_ipfilter_set_commit(&stack, set) != 0);
+    return set;
+}
+
+START_TEST(tc_ipfilter_random)
+{
+    static const uint32_t sizes[] = { 10, 3000 };
+    struct pico_ipfilter_set *set;
+    struct filter_key k;
+    uint32_t i, j, matched;
+
+    /* Both the short walk and the tuple search */
+    for (j = 0; j < sizeof(sizes) / sizeof(sizes[0]); j++) {
+        set = ipf_random_set(sizes[j]);
+        matched = 0;
+        for (i = 0; i < 50000; i++) {
+            struct filter_node *n;
+            ipf_random_key(set, &k);
+            n = ipfilter_classify(set, &k);
+            fail_unless(n == ipf_linear(set, &k));
+            if (n)
+                matched++;
+        }
+        fail_unless(matched > 5000);
+        pico_ipfilter_destroy(&stack);
+    }
+}
+END_TEST
+
+static double now_s(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + ((double)tv.tv_usec / 1e6);
+}
+
+#define IPF_BENCH_KEYS 4096
+
+static double ipf_rate(const struct pico_ipfilter_set *set, const struct filter_key *keys, uint32_t rounds, int linear)
+{
+    volatile uintptr_t sink = 0;
+    double t = now_s();
+    uint32_t i;
+
+    for (i = 0; i < rounds; i++) {
+        const struct filter_key *k = &keys[i % IPF_BENCH_KEYS];
+        sink += (uintptr_t)(linear ? ipf_linear(set, k) : ipfilter_classify(set, k));
+    }
+    t = now_s() - t;
+    (void)sink;
+    return rounds / t;
+}
+
+START_TEST(tc_ipfilter_bench)
+{
+    static const uint32_t sizes[] = { 10, 1000, 10000 };
+    static struct filter_key keys[IPF_BENCH_KEYS];
+    struct pico_ipfilter_set *set;
+    double compiled, linear, t;
+    uint32_t i, j;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        ipf_seed = 12345u + sizes[i];
+        t = now_s();
+        set = ipf_random_set(sizes[i]);
+        t = now_s() - t;
+        for (j = 0; j < IPF_BENCH_KEYS; j++)
+            ipf_random_key(set, &keys[j]);
+        compiled = ipf_rate(set, keys, 1000000, 0);
+        linear = ipf_rate(set, keys, 20000000 / sizes[i], 1);
+        printf("Classifier, %5u rules, %u tuples: %.0f k lookups/s compiled, %.0f k lookups/s linear (built in %.1f ms)\n",
+               sizes[i], set->ntuples, compiled / 1e3, linear / 1e3, t * 1e3);
+        pico_ipfilter_destroy(&stack);
+    }
+}
+END_TEST
 
 Suite *pico_suite(void)
 {
     Suite *s = suite_create("IPfilter module");
 
     TCase *TCase_ipfilter = tcase_create("Unit test for ipfilter");
+    TCase *TCase_ipfilter_first_match = tcase_create("Unit test for ipfilter first-match order and counters");
+    TCase *TCase_ipfilter_random = tcase_create("Unit test for the compiled classifier against a linear scan");
+    TCase *TCase_ipfilter_bench = tcase_create("Classifier benchmark");
+
     tcase_add_test(TCase_ipfilter, tc_ipfilter);
     suite_add_tcase(s, TCase_ipfilter);
+    tcase_add_test(TCase_ipfilter_first_match, tc_ipfilter_first_match);
+    suite_add_tcase(s, TCase_ipfilter_first_match);
+    tcase_add_test(TCase_ipfilter_random, tc_ipfilter_random);
+    tcase_set_timeout(TCase_ipfilter_random, 60);
+    suite_add_tcase(s, TCase_ipfilter_random);
+    tcase_add_test(TCase_ipfilter_bench, tc_ipfilter_bench);
+    tcase_set_timeout(TCase_ipfilter_bench, 120);
+    suite_add_tcase(s, TCase_ipfilter_bench);
     return s;
 }
 
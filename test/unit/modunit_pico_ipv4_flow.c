@@ -0,0 +1,406 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_device.h"
+#include "pico_arp.h"
+#include "pico_nat.h"
+#include "pico_ipfilter.h"
+#include "check.h"
+#include <sys/time.h>
+
+Suite *pico_suite(void);
+
+#define LAN4      0x0A460001u   /* 10.70.0.1/24 */
+#define HOST4     0x0A460002u
+#define WAN4      0xC6336401u   /* 198.51.100.1/24 */
+#define GW4       0xC63364FEu
+#define GW4_2     0xC63364FDu
+#define REMOTE4   0xCB007109u   /* 203.0.113.9 */
+#define FRAME_LEN (PICO_SIZE_ETHHDR + 20 + 8 + 4)
+
+static const uint8_t mac_lan[6] = { 0x02, 0, 0, 0, 0x70, 0x01 };
+static const uint8_t mac_wan[6] = { 0x02, 0, 0, 0, 0x71, 0x01 };
+static const uint8_t mac_host[6] = { 0x02, 0, 0, 0, 0x70, 0x02 };
+static const uint8_t mac_gw[6] = { 0x02, 0, 0, 0, 0x71, 0xFE };
+static const uint8_t mac_gw2[6] = { 0x02, 0, 0, 0, 0x71, 0xFD };
+
+/* Device keeping a copy of the last IPv4 frame it sent */
+struct fc_dev {
+    struct pico_device dev;
+    int n;
+    uint8_t last[FRAME_LEN];
+};
+
+static struct pico_stack *S;
+static struct fc_dev lan, wan;
+static uint16_t ip_id;
+
+static int fc_dev_send(struct pico_device *d, void *buf, int len)
+{
+    struct fc_dev *c = (struct fc_dev *)d;
+    struct pico_eth_hdr *eh = (struct pico_eth_hdr *)buf;
+
+    if (eh->proto == PICO_IDETH_IPV4) {
+        memcpy(c->last, buf, (len < FRAME_LEN) ? (size_t)len : FRAME_LEN);
+        c->n++;
+    }
+
+    return len;
+}
+
+static void fc_dev_init(struct fc_dev *d, const char *name, const uint8_t *mac, uint32_t addr)
+{
+    struct pico_ip4 a, nm;
+
+    fail_if(pico_device_init(S, &d->dev, name, mac) != 0);
+    d->dev.send = fc_dev_send;
+    a.addr = long_be(addr);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &d->dev, a, nm) != 0);
+}
+
+static void fc_resolve(struct fc_dev *d, uint32_t ip, const uint8_t *mac)
+{
+    struct pico_ip4 a;
+    a.addr = long_be(ip);
+    fail_if(pico_arp_create_entry((uint8_t *)mac, a, &d->dev) != 0);
+}
+
+static void fc_setup(void)
+{
+    struct pico_ip4 any, gw;
+
+    if (S)
+        return;
+
+    fail_if(pico_stack_init(&S) != 0);
+    fc_dev_init(&lan, "fc0", mac_lan, LAN4);
+    fc_dev_init(&wan, "fc1", mac_wan, WAN4);
+    any.addr = 0;
+    gw.addr = long_be(GW4);
+    fail_if(pico_ipv4_route_add(S, any, any, gw, 1, NULL) != 0);
+    fc_resolve(&lan, HOST4, mac_host);
+    fc_resolve(&wan, GW4, mac_gw);
+    fc_resolve(&wan, GW4_2, mac_gw2);
+}
+
+/* Ones' complement sum over the UDP pseudo-header and datagram */
+static uint16_t fc_udp_sum(const uint8_t *ip)
+{
+    uint8_t buf[12 + 8 + 4];
+    uint16_t crc;
+
+    memcpy(buf, ip + 12, 8);
+    buf[8] = 0;
+    buf[9] = PICO_PROTO_UDP;
+    buf[10] = 0;
+    buf[11] = 12;
+    memcpy(buf + 12, ip + 20, 12);
+    crc = pico_checksum(buf, sizeof(buf));
+    return crc;
+}
+
+/* A UDP datagram as it arrives on 'd' */
+static void fc_frame(uint8_t *buf, struct fc_dev *d, const uint8_t *from, uint32_t src, uint16_t sport,
+                     uint32_t dst, uint16_t dport, uint8_t ttl)
+{
+    struct pico_eth_hdr *eh = (struct pico_eth_hdr *)buf;
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)(buf + PICO_SIZE_ETHHDR);
+    uint8_t *udp = buf + PICO_SIZE_ETHHDR + 20;
+    uint16_t v;
+
+    memcpy(eh->daddr, d->dev.eth->mac.addr, 6);
+    memcpy(eh->saddr, from, 6);
+    eh->proto = PICO_IDETH_IPV4;
+    memset(hdr, 0, 20);
+    hdr->vhl = 0x45;
+    hdr->len = short_be(20 + 8 + 4);
+    hdr->id = short_be(++ip_id);
+    hdr->ttl = ttl;
+    hdr->proto = PICO_PROTO_UDP;
+    hdr->src.addr = long_be(src);
+    hdr->dst.addr = long_be(dst);
+    hdr->crc = short_be(pico_checksum(hdr, 20));
+    v = short_be(sport);
+    memcpy(udp, &v, 2);
+    v = short_be(dport);
+    memcpy(udp + 2, &v, 2);
+    v = short_be(12);
+    memcpy(udp + 4, &v, 2);
+    memset(udp + 6, 0, 6);
+    udp[8] = 0xAB;
+    v = short_be(fc_udp_sum((uint8_t *)hdr));
+    memcpy(udp + 6, &v, 2);
+}
+
+static void fc_ticks(int n)
+{
+    while (n-- > 0)
+        pico_stack_tick(S);
+}
+
+/* Inject one datagram; returns the number of frames 'out' sent for it */
+static int fc_send(struct fc_dev *in, struct fc_dev *out, const uint8_t *from, uint32_t src, uint16_t sport,
+                   uint32_t dst, uint16_t dport, uint8_t ttl)
+{
+    uint8_t buf[FRAME_LEN];
+    int n = out->n;
+
+    fc_frame(buf, in, from, src, sport, dst, dport, ttl);
+    fail_if(pico_stack_recv(&in->dev, buf, FRAME_LEN) <= 0);
+    fc_ticks(6);
+    return out->n - n;
+}
+
+/* What left 'd' last: next hop, addresses, ports, TTL and checksums */
+static void fc_check(struct fc_dev *d, const uint8_t *mac, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport)
+{
+    struct pico_eth_hdr *eh = (struct pico_eth_hdr *)d->last;
+    struct pico_ipv4_hdr *hdr = (struct pico_ipv4_hdr *)(d->last + PICO_SIZE_ETHHDR);
+    uint8_t *udp = d->last + PICO_SIZE_ETHHDR + 20;
+    uint16_t v;
+
+    fail_unless(memcmp(eh->daddr, mac, 6) == 0);
+    fail_unless(memcmp(eh->saddr, d->dev.eth->mac.addr, 6) == 0);
+    fail_unless(hdr->src.addr == long_be(src));
+    fail_unless(hdr->dst.addr == long_be(dst));
+    fail_unless(hdr->ttl == 63);
+    fail_unless(pico_checksum(hdr, 20) == 0);
+    memcpy(&v, udp, 2);
+    if (sport)
+        fail_unless(v == short_be(sport));
+
+    memcpy(&v, udp + 2, 2);
+    fail_unless(v == short_be(dport));
+    fail_unless(fc_udp_sum((uint8_t *)hdr) == 0);
+}
+
+static uint16_t fc_sport(struct fc_dev *d)
+{
+    uint16_t v;
+    memcpy(&v, d->last + PICO_SIZE_ETHHDR + 20, 2);
+    return short_be(v);
+}
+
+START_TEST(tc_ipv4_flow)
+{
+    struct pico_ipv4_flow_stats st;
+    struct pico_ip4 a, nm, gw;
+    uint32_t gen, filter;
+    uint16_t nport, nport2;
+
+    fc_setup();
+
+    /* First packet caches the flow, the next ones hit it */
+    st = S->ipv4_flow_stats;
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fc_check(&wan, mac_gw, HOST4, 4000, REMOTE4, 53);
+    fail_unless(S->ipv4_flow_stats.added == st.added + 1);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fc_check(&wan, mac_gw, HOST4, 4000, REMOTE4, 53);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 2);
+
+    /* Expiring frames still get the slow path and go nowhere */
+    st = S->ipv4_flow_stats;
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 1) == 0);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits);
+
+    /* A better route */
+    gen = S->FlowCacheGen;
+    a.addr = long_be(REMOTE4);
+    nm.addr = 0xFFFFFFFF;
+    gw.addr = long_be(GW4_2);
+    fail_if(pico_ipv4_route_add(S, a, nm, gw, 1, NULL) != 0);
+    fail_if(S->FlowCacheGen == gen);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fc_check(&wan, mac_gw2, HOST4, 4000, REMOTE4, 53);
+    st = S->ipv4_flow_stats;
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fc_check(&wan, mac_gw2, HOST4, 4000, REMOTE4, 53);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 1);
+    fail_if(pico_ipv4_route_del(S, a, nm, 1) != 0);
+
+    /* Neighbour changes */
+    gen = S->FlowCacheGen;
+    fc_resolve(&lan, HOST4 + 1, mac_host);
+    fail_if(S->FlowCacheGen == gen);
+
+    /* A filter dropping the flow on its way out, then removed */
+    a.addr = long_be(REMOTE4);
+    filter = pico_ipv4_filter_add(&wan.dev, PICO_PROTO_UDP, &a, &nm, NULL, NULL, 53, 0, 0, 0, FILTER_DROP);
+    fail_if(filter == 0);
+    st = S->ipv4_flow_stats;
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 0);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 0);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits);
+    fail_if(pico_ipv4_filter_del(S, filter) != 0);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 1);
+
+#ifdef PICO_SUPPORT_NAT
+    /* Masquerading on the WAN link: both directions cached */
+    gen = S->FlowCacheGen;
+    fail_if(pico_ipv4_nat_enable(pico_ipv4_link_by_dev(S, &wan.dev)) != 0);
+    fail_if(S->FlowCacheGen == gen);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fc_check(&wan, mac_gw, WAN4, 0, REMOTE4, 53);
+    nport = fc_sport(&wan);
+    fail_if(nport == 4000);
+    st = S->ipv4_flow_stats;
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fc_check(&wan, mac_gw, WAN4, nport, REMOTE4, 53);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 1);
+
+    fail_unless(fc_send(&wan, &lan, mac_gw, REMOTE4, 53, WAN4, nport, 64) == 1);
+    fc_check(&lan, mac_host, REMOTE4, 53, HOST4, 4000);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 1);
+    fail_unless(fc_send(&wan, &lan, mac_gw, REMOTE4, 53, WAN4, nport, 64) == 1);
+    fc_check(&lan, mac_host, REMOTE4, 53, HOST4, 4000);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 2);
+
+    /* Another translation going away leaves the cache alone */
+    gen = S->FlowCacheGen;
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4001, REMOTE4, 53, 64) == 1);
+    nport2 = fc_sport(&wan);
+    fail_if(pico_ipv4_port_forward(S, a, short_be(nport2), a, 0, PICO_PROTO_UDP, PICO_NAT_PORT_FORWARD_DEL) != 0);
+    fail_unless(S->FlowCacheGen == gen);
+    fail_unless(fc_send(&wan, &lan, mac_gw, REMOTE4, 53, WAN4, nport, 64) == 1);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 3);
+    fail_unless(fc_send(&wan, &lan, mac_gw, REMOTE4, 53, WAN4, nport2, 64) == 0);
+
+    /* Its own going away sends the flows that used it the long way */
+    fail_if(pico_ipv4_port_forward(S, a, short_be(nport), a, 0, PICO_PROTO_UDP, PICO_NAT_PORT_FORWARD_DEL) != 0);
+    fail_unless(S->FlowCacheGen == gen);
+    fail_unless(fc_send(&wan, &lan, mac_gw, REMOTE4, 53, WAN4, nport, 64) == 0);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 3);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fail_if(fc_sport(&wan) == nport);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits + 3);
+
+    pico_ipv4_nat_disable();
+#else
+    (void)nport;
+    (void)nport2;
+    (void)fc_sport;
+#endif
+
+    /* Turned off */
+    fail_if(pico_ipv4_flow_cache_set_size(S, 3) == 0);
+    fail_if(pico_ipv4_flow_cache_set_size(S, 0) != 0);
+    st = S->ipv4_flow_stats;
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fail_unless(fc_send(&lan, &wan, mac_host, HOST4, 4000, REMOTE4, 53, 64) == 1);
+    fail_unless(S->ipv4_flow_stats.added == st.added);
+    fail_unless(S->ipv4_flow_stats.hits == st.hits);
+    fail_if(pico_ipv4_flow_cache_set_size(S, PICO_IPV4_FLOW_CACHE_SIZE) != 0);
+}
+END_TEST
+
+static double now_s(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + ((double)tv.tv_usec / 1e6);
+}
+
+/* Flow k: one of 200 LAN hosts, source port by host */
+static void fc_flow(uint32_t k, uint32_t *src, uint16_t *sport)
+{
+    *src = HOST4 + (k % 200u);
+    *sport = (uint16_t)(1024u + (k / 200u));
+}
+
+static void fc_burst(uint32_t flows, uint32_t *k)
+{
+    uint8_t buf[FRAME_LEN];
+    uint32_t src;
+    uint16_t sport;
+    int j;
+
+    for (j = 0; j < 32; j++, (*k)++) {
+        fc_flow(*k % flows, &src, &sport);
+        fc_frame(buf, &lan, mac_host, src, sport, REMOTE4, 53, 64);
+        pico_stack_recv(&lan.dev, buf, FRAME_LEN);
+    }
+    fc_ticks(4);
+}
+
+/* Forwarded datagrams/s, round robin over 'flows' */
+static double fc_rate(uint32_t flows, uint32_t rounds)
+{
+    uint32_t i, k = 0;
+    int sent;
+    double t;
+
+    /* One pass so that every flow has been seen */
+    for (i = 0; i < flows; i += 32)
+        fc_burst(flows, &k);
+
+    sent = wan.n;
+    t = now_s();
+    for (i = 0; i < rounds; i += 32)
+        fc_burst(flows, &k);
+    t = now_s() - t;
+    fail_unless((uint32_t)(wan.n - sent) >= rounds - 64);
+    return rounds / t;
+}
+
+START_TEST(tc_ipv4_flow_bench)
+{
+    static const uint32_t flows[] = { 1, 1000, 100000 };
+    double hit, miss;
+    uint32_t i;
+
+    fc_setup();
+    for (i = 0; i < sizeof(flows) / sizeof(flows[0]); i++) {
+        fail_if(pico_ipv4_flow_cache_set_size(S, 0) != 0);
+        miss = fc_rate(flows[i], 300000);
+        fail_if(pico_ipv4_flow_cache_set_size(S, 262144) != 0);
+        hit = fc_rate(flows[i], 300000);
+        printf("Forwarding %6u flows: %.0f k pkts/s cached, %.0f k pkts/s uncached\n", flows[i], hit / 1e3, miss / 1e3);
+    }
+
+#ifdef PICO_SUPPORT_NAT
+    /* Each flow takes a NAT port, so not the largest count */
+    fail_if(pico_ipv4_nat_enable(pico_ipv4_link_by_dev(S, &wan.dev)) != 0);
+    for (i = 0; i < 2; i++) {
+        fail_if(pico_ipv4_flow_cache_set_size(S, 0) != 0);
+        miss = fc_rate(flows[i], 300000);
+        fail_if(pico_ipv4_flow_cache_set_size(S, 262144) != 0);
+        hit = fc_rate(flows[i], 300000);
+        printf("NAT        %6u flows: %.0f k pkts/s cached, %.0f k pkts/s uncached\n", flows[i], hit / 1e3, miss / 1e3);
+    }
+    pico_ipv4_nat_disable();
+#endif
+    fail_if(pico_ipv4_flow_cache_set_size(S, PICO_IPV4_FLOW_CACHE_SIZE) != 0);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_ipv4_flow = tcase_create("Unit test for the IPv4 forwarding flow cache");
+    TCase *TCase_ipv4_flow_bench = tcase_create("Forwarding flow cache benchmark");
+
+    tcase_add_test(TCase_ipv4_flow, tc_ipv4_flow);
+    suite_add_tcase(s, TCase_ipv4_flow);
+    tcase_add_test(TCase_ipv4_flow_bench, tc_ipv4_flow_bench);
+    tcase_set_timeout(TCase_ipv4_flow_bench, 120);
+    suite_add_tcase(s, TCase_ipv4_flow_bench);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,255 @@
+#include "pico_config.h"
+#include "pico_lpm.h"
+#include "stack/pico_lpm.c"
+#include "check.h"
+#include <time.h>
+
+Suite *pico_suite(void);
+
+#define LPM_BENCH_LOOKUPS 20000
+
+struct lpm_ref {
+    uint32_t addr; /* host order */
+    uint32_t mask;
+    uint8_t key[4];
+    uint8_t plen;
+};
+
+static uint32_t lpm_rand_state = 0x12345678u;
+static uint32_t lpm_rand(void)
+{
+    lpm_rand_state ^= lpm_rand_state << 13;
+    lpm_rand_state ^= lpm_rand_state >> 17;
+    lpm_rand_state ^= lpm_rand_state << 5;
+    return lpm_rand_state;
+}
+
+static void lpm_key4(uint8_t *key, uint32_t addr)
+{
+    key[0] = (uint8_t)(addr >> 24);
+    key[1] = (uint8_t)(addr >> 16);
+    key[2] = (uint8_t)(addr >> 8);
+    key[3] = (uint8_t)addr;
+}
+
+static double lpm_elapsed(struct timespec *a, struct timespec *b)
+{
+    return (double)(b->tv_sec - a->tv_sec) + (double)(b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+/* Reference lookup: reverse linear scan, the way the route tree is walked */
+static struct lpm_ref *lpm_ref_lookup(struct lpm_ref *r, int n, uint32_t addr)
+{
+    struct lpm_ref *best = NULL;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (((addr & r[i].mask) == r[i].addr) && (!best || (r[i].plen > best->plen)))
+            best = &r[i];
+    }
+    return best;
+}
+
+START_TEST(tc_lpm_basic)
+{
+    struct pico_lpm t;
+    uint8_t k[4], any[4] = {
+        0
+    };
+    int a = 1, b = 2, c = 3, d = 4;
+
+    pico_lpm_init(&t, 4);
+    fail_if(pico_lpm_lookup(&t, any) != NULL);
+
+    lpm_key4(k, 0x0A000000u);
+    fail_if(pico_lpm_insert(&t, k, 8, &a) != 0);
+    lpm_key4(k, 0x0A010000u);
+    fail_if(pico_lpm_insert(&t, k, 16, &b) != 0);
+    lpm_key4(k, 0x0A010200u);
+    fail_if(pico_lpm_insert(&t, k, 24, &c) != 0);
+    fail_if(pico_lpm_insert(&t, any, 0, &d) != 0);
+    fail_if(t.count != 4);
+
+    lpm_key4(k, 0x0A010203u);
+    fail_if(pico_lpm_lookup(&t, k) != &c);
+    lpm_key4(k, 0x0A010303u);
+    fail_if(pico_lpm_lookup(&t, k) != &b);
+    lpm_key4(k, 0x0A020303u);
+    fail_if(pico_lpm_lookup(&t, k) != &a);
+    lpm_key4(k, 0xC0A80001u);
+    fail_if(pico_lpm_lookup(&t, k) != &d);
+
+    /* Host bits in the key are ignored */
+    lpm_key4(k, 0x0A0102FFu);
+    fail_if(pico_lpm_get(&t, k, 24) != &c);
+    fail_if(pico_lpm_get(&t, k, 20) != NULL);
+
+    lpm_key4(k, 0x0A010000u);
+    fail_if(pico_lpm_remove(&t, k, 16) != &b);
+    fail_if(pico_lpm_remove(&t, k, 16) != NULL);
+    lpm_key4(k, 0x0A010303u);
+    fail_if(pico_lpm_lookup(&t, k) != &a);
+    lpm_key4(k, 0x0A010203u);
+    fail_if(pico_lpm_lookup(&t, k) != &c);
+
+    fail_if(pico_lpm_remove(&t, any, 0) != &d);
+    lpm_key4(k, 0xC0A80001u);
+    fail_if(pico_lpm_lookup(&t, k) != NULL);
+    fail_if(t.count != 2);
+    pico_lpm_destroy(&t);
+    fail_if(t.root != NULL);
+
+    /* IPv6: /64 inside a /48 */
+    {
+        uint8_t p48[16] = {
+            0x20, 0x01, 0x0d, 0xb8, 0, 1
+        };
+        uint8_t p64[16] = {
+            0x20, 0x01, 0x0d, 0xb8, 0, 1, 0, 2
+        };
+        uint8_t host[16] = {
+            0x20, 0x01, 0x0d, 0xb8, 0, 1, 0, 2, 0, 0, 0, 0, 0, 0, 0, 1
+        };
+
+        pico_lpm_init(&t, 16);
+        fail_if(pico_lpm_insert(&t, p48, 48, &a) != 0);
+        fail_if(pico_lpm_insert(&t, p64, 64, &b) != 0);
+        fail_if(pico_lpm_insert(&t, host, 128, &c) != 0);
+        fail_if(pico_lpm_lookup(&t, host) != &c);
+        host[15] = 2;
+        fail_if(pico_lpm_lookup(&t, host) != &b);
+        host[7] = 3;
+        fail_if(pico_lpm_lookup(&t, host) != &a);
+        pico_lpm_destroy(&t);
+    }
+}
+END_TEST
+
+START_TEST(tc_lpm_mask_len)
+{
+    uint8_t m4[4] = {
+        0xFF, 0xFF, 0xF0, 0
+    };
+    uint8_t m6[16] = {
+        0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+    };
+    fail_if(pico_lpm_mask_len(m4, 4) != 20);
+    m4[3] = 1;
+    fail_if(pico_lpm_mask_len(m4, 4) != -1);
+    m4[2] = 0xF8;
+    m4[3] = 0;
+    fail_if(pico_lpm_mask_len(m4, 4) != 21);
+    m4[2] = 0x7F;
+    fail_if(pico_lpm_mask_len(m4, 4) != -1);
+    fail_if(pico_lpm_mask_len(m6, 16) != 64);
+}
+END_TEST
+
+/* Build tables of 10, 1k and 100k random prefixes, check every lookup
+ * against the linear reference and report lookups per second for both.
+ */
+static void lpm_bench(int routes)
+{
+    struct pico_lpm t;
+    struct lpm_ref *ref = PICO_ZALLOC(sizeof(struct lpm_ref) * (size_t)routes);
+    uint32_t *probe = PICO_ZALLOC(sizeof(uint32_t) * LPM_BENCH_LOOKUPS);
+    struct lpm_ref *exp;
+    struct timespec t0, t1;
+    volatile uintptr_t sink = 0;
+    double trie_s, lin_s;
+    int n = 0, i, lin_lookups;
+    uint8_t k[4];
+
+    fail_if(!ref || !probe);
+    pico_lpm_init(&t, 4);
+    while (n < routes) {
+        uint8_t plen = (uint8_t)(8 + (lpm_rand() % 25));
+        uint32_t mask = (uint32_t)(0xFFFFFFFFu << (32 - plen));
+        ref[n].addr = lpm_rand() & mask;
+        ref[n].mask = mask;
+        ref[n].plen = plen;
+        lpm_key4(ref[n].key, ref[n].addr);
+        if (pico_lpm_get(&t, ref[n].key, plen))
+            continue;
+
+        fail_if(pico_lpm_insert(&t, ref[n].key, plen, &ref[n]) != 0);
+        n++;
+    }
+    fail_if(t.count != (uint32_t)routes);
+
+    /* Half of the probes fall inside a known prefix */
+    for (i = 0; i < LPM_BENCH_LOOKUPS; i++) {
+        if (i & 1)
+            probe[i] = ref[lpm_rand() % (uint32_t)routes].addr | (lpm_rand() & 0xFFu);
+        else
+            probe[i] = lpm_rand();
+    }
+
+    lin_lookups = (routes > 1000) ? 1000 : LPM_BENCH_LOOKUPS;
+    for (i = 0; i < lin_lookups; i++) {
+        lpm_key4(k, probe[i]);
+        exp = lpm_ref_lookup(ref, routes, probe[i]);
+        fail_if(pico_lpm_lookup(&t, k) != exp);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < LPM_BENCH_LOOKUPS; i++) {
+        lpm_key4(k, probe[i]);
+        sink += (uintptr_t)pico_lpm_lookup(&t, k);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    trie_s = lpm_elapsed(&t0, &t1);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < lin_lookups; i++)
+        sink += (uintptr_t)lpm_ref_lookup(ref, routes, probe[i]);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    lin_s = lpm_elapsed(&t0, &t1);
+
+    printf("LPM %6d routes: trie %10.0f lookups/s, linear %10.0f lookups/s\n", routes,
+           (double)LPM_BENCH_LOOKUPS / (trie_s > 0 ? trie_s : 1e-9),
+           (double)lin_lookups / (lin_s > 0 ? lin_s : 1e-9));
+
+    for (i = 0; i < routes; i++)
+        fail_if(pico_lpm_remove(&t, ref[i].key, ref[i].plen) != &ref[i]);
+    fail_if(t.root != NULL);
+    (void)sink;
+    PICO_FREE(probe);
+    PICO_FREE(ref);
+}
+
+START_TEST(tc_lpm_bench)
+{
+    lpm_bench(10);
+    lpm_bench(1000);
+    lpm_bench(100000);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_lpm_basic = tcase_create("Unit test for pico_lpm insert/lookup/remove");
+    TCase *TCase_lpm_mask_len = tcase_create("Unit test for pico_lpm_mask_len");
+    TCase *TCase_lpm_bench = tcase_create("Benchmark pico_lpm against linear route scan");
+
+    tcase_add_test(TCase_lpm_basic, tc_lpm_basic);
+    suite_add_tcase(s, TCase_lpm_basic);
+    tcase_add_test(TCase_lpm_mask_len, tc_lpm_mask_len);
+    suite_add_tcase(s, TCase_lpm_mask_len);
+    tcase_add_test(TCase_lpm_bench, tc_lpm_bench);
+    tcase_set_timeout(TCase_lpm_bench, 60);
+    suite_add_tcase(s, TCase_lpm_bench);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,302 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_device.h"
+#include "pico_socket.h"
+#include "pico_tcp.h"
+#include "pico_udp.h"
+#include "modules/pico_nat.c"
+#include "check.h"
+#include <sys/time.h>
+
+Suite *pico_suite(void);
+
+#define PUBLIC4   0x0A2B0001u   /* the NAT link */
+#define REMOTE4   0x08080808u
+#define PRIVATE4  0xC0A80000u   /* 192.168.0.0/16, hosts behind the NAT */
+
+static struct pico_stack *S;
+static struct pico_device dev;
+
+/* One IPv4 segment or datagram, rewritten in place */
+static uint8_t buf[PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR + 8];
+static struct pico_frame frame;
+
+static int dev_send(struct pico_device *d, void *b, int len)
+{
+    IGNORE_PARAMETER(d);
+    IGNORE_PARAMETER(b);
+    return len;
+}
+
+static void nat_setup(void)
+{
+    struct pico_ip4 addr, nm;
+
+    if (S)
+        return;
+
+    fail_if(pico_stack_init(&S) != 0);
+    dev.send = dev_send;
+    dev.mtu = 1500;
+    fail_if(pico_device_init(S, &dev, "nat", NULL) != 0);
+    addr.addr = long_be(PUBLIC4);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &dev, addr, nm) != 0);
+    fail_if(pico_ipv4_nat_enable(pico_ipv4_link_get(S, &addr)) != 0);
+    fail_if(!nat_link);
+}
+
+static struct pico_ipv4_hdr *ip(void)
+{
+    return (struct pico_ipv4_hdr *)buf;
+}
+
+static struct pico_trans *trans(void)
+{
+    return (struct pico_trans *)(buf + PICO_SIZE_IP4HDR);
+}
+
+/* A packet with valid checksums, src and dst in host order */
+static struct pico_frame *packet(uint8_t proto, uint32_t src, uint16_t sport, uint32_t dst, uint16_t dport, uint8_t flags)
+{
+    uint16_t tlen = (proto == PICO_PROTO_TCP) ? (uint16_t)(PICO_SIZE_TCPHDR + 8) : (uint16_t)(PICO_UDPHDR_SIZE + 8);
+
+    memset(buf, 0, sizeof(buf));
+    ip()->vhl = 0x45;
+    ip()->len = short_be((uint16_t)(PICO_SIZE_IP4HDR + tlen));
+    ip()->ttl = 64;
+    ip()->proto = proto;
+    ip()->src.addr = long_be(src);
+    ip()->dst.addr = long_be(dst);
+    ip()->crc = short_be(pico_checksum(ip(), PICO_SIZE_IP4HDR));
+    trans()->sport = short_be(sport);
+    trans()->dport = short_be(dport);
+
+    memset(&frame, 0, sizeof(frame));
+    frame.net_hdr = buf;
+    frame.transport_hdr = buf + PICO_SIZE_IP4HDR;
+    frame.transport_len = tlen;
+    memset(frame.transport_hdr + tlen - 8, 0xA5, 8);
+    if (proto == PICO_PROTO_TCP) {
+        struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)frame.transport_hdr;
+        tcp->len = (uint8_t)((PICO_SIZE_TCPHDR >> 2) << 4);
+        tcp->flags = flags;
+        tcp->seq = long_be(0x11223344u);
+        tcp->crc = short_be(pico_tcp_checksum_ipv4(&frame));
+    } else {
+        struct pico_udp_hdr *udp = (struct pico_udp_hdr *)frame.transport_hdr;
+        udp->len = short_be(tlen);
+        udp->crc = short_be(pico_udp_checksum_ipv4(&frame));
+    }
+
+    return &frame;
+}
+
+/* Both checksums of the rewritten packet still verify */
+static int checksums_ok(void)
+{
+    if (pico_checksum(ip(), PICO_SIZE_IP4HDR) != 0)
+        return 0;
+
+    if (ip()->proto == PICO_PROTO_TCP)
+        return pico_tcp_checksum_ipv4(&frame) == 0;
+
+    return pico_udp_checksum_ipv4(&frame) == 0;
+}
+
+static uint16_t out(uint8_t proto, uint32_t src, uint16_t sport, uint8_t flags)
+{
+    fail_if(pico_ipv4_nat_outbound(S, packet(proto, src, sport, REMOTE4, 80, flags), &nat_link->address) != 0);
+    fail_unless(ip()->src.addr == long_be(PUBLIC4));
+    fail_unless(checksums_ok());
+    return trans()->sport;
+}
+
+static void in(uint8_t proto, uint16_t nat_port, uint8_t flags)
+{
+    packet(proto, REMOTE4, 80, PUBLIC4, 0, flags);
+    trans()->dport = nat_port;
+    ip()->crc = 0;
+    ip()->crc = short_be(pico_checksum(ip(), PICO_SIZE_IP4HDR));
+    if (proto == PICO_PROTO_TCP) {
+        ((struct pico_tcp_hdr *)frame.transport_hdr)->crc = 0;
+        ((struct pico_tcp_hdr *)frame.transport_hdr)->crc = short_be(pico_tcp_checksum_ipv4(&frame));
+    } else {
+        ((struct pico_udp_hdr *)frame.transport_hdr)->crc = 0;
+        ((struct pico_udp_hdr *)frame.transport_hdr)->crc = short_be(pico_udp_checksum_ipv4(&frame));
+    }
+
+    fail_if(pico_ipv4_nat_inbound(S, &frame, &nat_link->address) != 0);
+    fail_unless(checksums_ok());
+}
+
+START_TEST(tc_nat_translate)
+{
+    struct pico_ip4 host;
+    uint16_t nport, fport = short_be(8080);
+
+    nat_setup();
+
+    /* A flow keeps its port both ways */
+    nport = out(PICO_PROTO_UDP, PRIVATE4 + 10, 5000, 0);
+    fail_if(nport == short_be(5000));
+    fail_unless(out(PICO_PROTO_UDP, PRIVATE4 + 10, 5000, 0) == nport);
+    in(PICO_PROTO_UDP, nport, 0);
+    fail_unless(ip()->dst.addr == long_be(PRIVATE4 + 10));
+    fail_unless(trans()->dport == short_be(5000));
+
+    /* Same host and port over TCP: another translation */
+    fail_if(out(PICO_PROTO_TCP, PRIVATE4 + 10, 5000, PICO_TCP_SYN) == 0);
+    fail_unless(S->NAT->count == 2);
+
+    /* No translation: nothing is touched */
+    packet(PICO_PROTO_UDP, REMOTE4, 80, PUBLIC4, 4242, 0);
+    fail_if(pico_ipv4_nat_inbound(S, &frame, &nat_link->address) == 0);
+    fail_unless(trans()->dport == short_be(4242));
+
+    /* Port forwards */
+    host.addr = long_be(PRIVATE4 + 20);
+    fail_if(pico_ipv4_port_forward(S, nat_link->address, fport, host, short_be(80), PICO_PROTO_TCP, PICO_NAT_PORT_FORWARD_ADD) != 0);
+    fail_if(pico_ipv4_port_forward(S, nat_link->address, fport, host, short_be(81), PICO_PROTO_TCP, PICO_NAT_PORT_FORWARD_ADD) == 0);
+    fail_unless(pico_ipv4_nat_find(S, fport, NULL, 0, PICO_PROTO_TCP) == 1);
+    in(PICO_PROTO_TCP, fport, PICO_TCP_SYN);
+    fail_unless(ip()->dst.addr == long_be(PRIVATE4 + 20));
+    fail_unless(trans()->dport == short_be(80));
+    fail_if(pico_ipv4_port_forward(S, nat_link->address, fport, host, short_be(80), PICO_PROTO_TCP, PICO_NAT_PORT_FORWARD_DEL) != 0);
+    fail_unless(pico_ipv4_nat_find(S, fport, NULL, 0, PICO_PROTO_TCP) == 0);
+    fail_unless(S->NAT->count == 2);
+}
+END_TEST
+
+START_TEST(tc_nat_expire)
+{
+    struct pico_nat_table *nt;
+    struct pico_nat_tuple *pushed;
+    struct pico_ip4 host;
+    uint16_t udp, closed, open, late;
+    pico_time t0;
+
+    nat_setup();
+    pico_ipv4_nat_destroy(S);
+    t0 = PICO_TIME_MS();
+
+    udp = out(PICO_PROTO_UDP, PRIVATE4 + 30, 6000, 0);
+    closed = out(PICO_PROTO_TCP, PRIVATE4 + 30, 6001, PICO_TCP_SYN);
+    out(PICO_PROTO_TCP, PRIVATE4 + 30, 6001, PICO_TCP_FINACK);
+    in(PICO_PROTO_TCP, closed, PICO_TCP_FINACK);
+    open = out(PICO_PROTO_TCP, PRIVATE4 + 30, 6002, PICO_TCP_SYN);
+    late = out(PICO_PROTO_UDP, PRIVATE4 + 30, 6003, 0);
+    host.addr = long_be(PRIVATE4 + 31);
+    fail_if(pico_ipv4_port_forward(S, nat_link->address, short_be(2222), host, short_be(22), PICO_PROTO_TCP, PICO_NAT_PORT_FORWARD_ADD) != 0);
+    nt = S->NAT;
+    fail_unless(nt->count == 5);
+    fail_unless(nt->wheel_count == 4);
+
+    /* Traffic on a flow only pushes its expiry back */
+    pushed = nat_find_inbound(nt, late, PICO_PROTO_UDP);
+    fail_if(!pushed);
+    pushed->expire += PICO_NAT_TIMEWAIT;
+
+    nat_wheel_advance(S, nt, t0 + PICO_NAT_TIMEWAIT - (2 * PICO_NAT_WHEEL_TICK));
+    fail_unless(nt->count == 5);
+
+    /* Idle UDP and closed TCP go, the others stay */
+    nat_wheel_advance(S, nt, t0 + PICO_NAT_TIMEWAIT + (2 * PICO_NAT_WHEEL_TICK));
+    fail_unless(nt->count == 3);
+    fail_if(nat_find_inbound(nt, udp, PICO_PROTO_UDP));
+    fail_if(nat_find_inbound(nt, closed, PICO_PROTO_TCP));
+    fail_unless(nat_find_inbound(nt, open, PICO_PROTO_TCP) != NULL);
+    fail_unless(nat_find_inbound(nt, late, PICO_PROTO_UDP) == pushed);
+
+    nat_wheel_advance(S, nt, t0 + (2 * PICO_NAT_TIMEWAIT) + (2 * PICO_NAT_WHEEL_TICK));
+    fail_unless(nt->count == 2);
+    fail_unless(nt->wheel_count == 1);
+
+    /* A gap longer than a rotation still visits every entry once */
+    nat_wheel_advance(S, nt, t0 + PICO_NAT_TCP_TIMEOUT + (2 * PICO_NAT_WHEEL_TICK));
+    fail_unless(nt->count == 1);
+    fail_unless(nt->wheel_count == 0);
+    fail_unless(pico_ipv4_nat_find(S, short_be(2222), NULL, 0, PICO_PROTO_TCP) == 1);
+    pico_ipv4_nat_destroy(S);
+}
+END_TEST
+
+static double now_s(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (double)tv.tv_sec + ((double)tv.tv_usec / 1e6);
+}
+
+/* Translations per second, out and back in, against the table size */
+START_TEST(tc_nat_bench)
+{
+    static const uint32_t sizes[] = {
+        1000, 10000, 50000
+    };
+    const uint32_t rounds = 1000000;
+    struct pico_ip4 a;
+    uint16_t p;
+    uint32_t i, n, k;
+    double t;
+
+    nat_setup();
+
+    for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+        pico_ipv4_nat_destroy(S);
+        n = sizes[k];
+        for (i = 0; i < n; i++)
+            out(PICO_PROTO_UDP, PRIVATE4 + 1 + (i >> 8), (uint16_t)(10000 + (i & 0xFF)), 0);
+        fail_unless(S->NAT->count == n);
+
+        t = now_s();
+        for (i = 0; i < rounds; i++) {
+            uint32_t j = (i * 2654435761u) % n;
+            packet(PICO_PROTO_UDP, PRIVATE4 + 1 + (j >> 8), (uint16_t)(10000 + (j & 0xFF)), REMOTE4, 80, 0);
+            pico_ipv4_nat_outbound(S, &frame, &nat_link->address);
+            /* the reply: swapping both ends leaves the checksums valid */
+            a = ip()->src;
+            ip()->src = ip()->dst;
+            ip()->dst = a;
+            p = trans()->sport;
+            trans()->sport = trans()->dport;
+            trans()->dport = p;
+            pico_ipv4_nat_inbound(S, &frame, &nat_link->address);
+        }
+        t = now_s() - t;
+        fail_unless(checksums_ok());
+        printf("NAT: %6u flows: %.2f M translations/s\n", n, (2.0 * rounds) / t / 1e6);
+    }
+    pico_ipv4_nat_destroy(S);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_nat_translate = tcase_create("Unit test for NAT translation");
+    TCase *TCase_nat_expire = tcase_create("Unit test for NAT expiry");
+    TCase *TCase_nat_bench = tcase_create("NAT benchmark");
+
+    tcase_add_test(TCase_nat_translate, tc_nat_translate);
+    suite_add_tcase(s, TCase_nat_translate);
+    tcase_add_test(TCase_nat_expire, tc_nat_expire);
+    suite_add_tcase(s, TCase_nat_expire);
+    tcase_add_test(TCase_nat_bench, tc_nat_bench);
+    tcase_set_timeout(TCase_nat_bench, 60);
+    suite_add_tcase(s, TCase_nat_bench);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
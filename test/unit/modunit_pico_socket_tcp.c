@@ -0,0 +1,853 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_socket.h"
+#include "pico_dev_loop.h"
+#include "pico_tcp.h"
+#include "pico_socket_tcp.h"
+#include "check.h"
+#include <time.h>
+#include <string.h>
+
+Suite *pico_suite(void);
+
+#define ACCEPT_CONNS 2000
+
+static void accept_cb(uint16_t ev, struct pico_socket *s)
+{
+    IGNORE_PARAMETER(ev);
+    IGNORE_PARAMETER(s);
+}
+
+static struct pico_socket *accept_listener(struct pico_stack *S, uint16_t port, int backlog)
+{
+    struct pico_ip4 any = {
+        0
+    };
+    struct pico_socket *l = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, accept_cb);
+    fail_if(!l);
+    fail_if(pico_socket_bind(l, &any, &port) != 0);
+    fail_if(pico_socket_listen(l, backlog) != 0);
+    return l;
+}
+
+static int accept_queued(struct pico_socket *l)
+{
+    struct pico_socket *s;
+    int n = 0;
+    for (s = l->backlog; s; s = s->next)
+        n++;
+    return n;
+}
+
+static void accept_connect(struct pico_stack *S, struct pico_socket *l, struct pico_socket **cli, int n, uint16_t port)
+{
+    struct pico_ip4 lo;
+    int i, tries = 0;
+    int queued = accept_queued(l);
+
+    lo.addr = long_be(0x7F000001);
+    for (i = 0; i < n; i++) {
+        cli[i] = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, accept_cb);
+        fail_if(!cli[i]);
+        fail_if(pico_socket_connect(cli[i], &lo, port) != 0);
+    }
+    while ((accept_queued(l) < queued + n) && (tries++ < 100 * n + 1000))
+        pico_stack_tick(S);
+    fail_unless(accept_queued(l) == queued + n);
+}
+
+START_TEST(tc_accept_queue)
+{
+    struct pico_stack *S;
+    struct pico_device *lo;
+    struct pico_socket *l, *s, *c, **cli;
+    struct pico_ip4 addr, nm, orig;
+    uint16_t port = short_be(7000), rport;
+    struct timespec t0, t1;
+    int i;
+
+    fail_if(pico_stack_init(&S) != 0);
+    lo = pico_loop_create(S);
+    fail_if(!lo);
+    addr.addr = long_be(0x7F000001);
+    nm.addr = long_be(0xFF000000);
+    fail_if(pico_ipv4_link_add(S, lo, addr, nm) != 0);
+    cli = PICO_ZALLOC(sizeof(struct pico_socket *) * ACCEPT_CONNS);
+    fail_if(!cli);
+
+    l = accept_listener(S, port, ACCEPT_CONNS);
+    fail_if(pico_socket_accept(l, &orig, &rport) != NULL);
+    fail_unless(pico_err == PICO_ERR_EAGAIN);
+
+    accept_connect(S, l, cli, ACCEPT_CONNS, port);
+    fail_unless(l->number_of_pending_conn == ACCEPT_CONNS);
+
+    /* Completed connections come out in FIFO order */
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < ACCEPT_CONNS; i++) {
+        c = l->backlog;
+        s = pico_socket_accept(l, &orig, &rport);
+        fail_if(s != c);
+        fail_if(s->parent != NULL);
+        fail_if(rport != s->remote_port);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("Accepted %d connections in %.3f ms\n", ACCEPT_CONNS,
+           ((double)(t1.tv_sec - t0.tv_sec) * 1e3) + ((double)(t1.tv_nsec - t0.tv_nsec) / 1e6));
+    fail_if(pico_socket_accept(l, &orig, &rport) != NULL);
+    fail_unless(l->number_of_pending_conn == 0);
+    fail_unless(l->backlog == NULL && l->backlog_tail == NULL);
+
+    /* A child that goes away before accept() leaves the queue */
+    accept_connect(S, l, cli, 3, port);
+    s = l->backlog->next;
+    pico_socket_del(s);
+    fail_unless(accept_queued(l) == 2);
+    fail_unless(l->number_of_pending_conn == 2);
+    fail_if(pico_socket_accept(l, &orig, &rport) == s);
+    fail_if(pico_socket_accept(l, &orig, &rport) == s);
+    fail_if(pico_socket_accept(l, &orig, &rport) != NULL);
+
+    /* Closing the listener detaches the children still queued */
+    accept_connect(S, l, cli, 1, port);
+    s = l->backlog;
+    pico_socket_del(l);
+    fail_if(s->parent != NULL);
+    fail_if(s->next != NULL);
+
+    PICO_FREE(cli);
+}
+END_TEST
+
+#define HASH_CONNS 100
+
+/* Times s is chained in the connection table */
+static int conn_hashed(struct pico_stack *S, struct pico_socket *s)
+{
+    struct pico_socket *cur;
+    uint32_t i;
+    int n = 0;
+
+    for (i = 0; i < S->TCPConnHashSize; i++) {
+        for (cur = S->TCPConnHash[i]; cur; cur = cur->hash_next) {
+            if (cur == s)
+                n++;
+        }
+    }
+    return n;
+}
+
+START_TEST(tc_conn_hash)
+{
+    struct pico_stack *S;
+    struct pico_device *lo;
+    struct pico_socket *l, *c, **cli, **srv;
+    struct pico_ip4 addr, nm, orig;
+    uint16_t port = short_be(7005), rport;
+    uint8_t buf[8];
+    uint32_t count;
+    int i, tries;
+
+    fail_if(pico_stack_init(&S) != 0);
+    lo = pico_loop_create(S);
+    fail_if(!lo);
+    addr.addr = long_be(0x7F000001);
+    nm.addr = long_be(0xFF000000);
+    fail_if(pico_ipv4_link_add(S, lo, addr, nm) != 0);
+    cli = PICO_ZALLOC(sizeof(struct pico_socket *) * (HASH_CONNS + 1));
+    srv = PICO_ZALLOC(sizeof(struct pico_socket *) * (HASH_CONNS + 1));
+    fail_if(!cli || !srv);
+
+    /* Both ends of every connection are hashed, the listener is not.
+     * The first ones went in before the table grew.
+     */
+    l = accept_listener(S, port, HASH_CONNS + 1);
+    accept_connect(S, l, cli, HASH_CONNS, port);
+    for (i = 0; i < HASH_CONNS; i++) {
+        srv[i] = pico_socket_accept(l, &orig, &rport);
+        fail_if(!srv[i]);
+    }
+    fail_unless(S->TCPConnHashCount == 2 * HASH_CONNS);
+    fail_unless(S->TCPConnHashSize > PICO_TCP_CONN_HASH_INIT);
+    fail_unless(S->TCPConnHashCount <= S->TCPConnHashSize * PICO_TCP_CONN_HASH_LOAD);
+    for (i = 0; i < HASH_CONNS; i++) {
+        fail_unless(conn_hashed(S, cli[i]) == 1);
+        fail_unless(conn_hashed(S, srv[i]) == 1);
+    }
+    fail_unless(conn_hashed(S, l) == 0);
+
+    /* Each segment reaches the end of its own 4-tuple */
+    for (i = 0; i < HASH_CONNS; i++) {
+        buf[0] = (uint8_t)i;
+        fail_unless(pico_socket_write(cli[i], buf, 1) == 1);
+    }
+    for (tries = 0; tries < 100; tries++)
+        pico_stack_tick(S);
+    for (i = 0; i < HASH_CONNS; i++) {
+        fail_unless(pico_socket_read(srv[i], buf, sizeof(buf)) == 1);
+        fail_unless(buf[0] == (uint8_t)i);
+    }
+    fail_unless(S->TCPConnHashCount == 2 * HASH_CONNS);
+
+    /* A SYN misses the table and goes on to the listener */
+    accept_connect(S, l, cli + HASH_CONNS, 1, port);
+    c = pico_socket_accept(l, &orig, &rport);
+    fail_if(!c);
+    fail_unless(conn_hashed(S, c) == 1);
+    fail_unless(S->TCPConnHashCount == 2 * HASH_CONNS + 2);
+
+    /* Closed connections leave the table */
+    count = S->TCPConnHashCount;
+    pico_socket_close(cli[HASH_CONNS]);
+    for (tries = 0; tries < 100; tries++)
+        pico_stack_tick(S);
+    pico_socket_close(c);
+    for (tries = 0; (S->TCPConnHashCount > count - 2) && (tries < 10000); tries++)
+        pico_stack_tick(S);
+    fail_unless(S->TCPConnHashCount == count - 2);
+    fail_unless(conn_hashed(S, cli[HASH_CONNS]) == 0);
+    fail_unless(conn_hashed(S, c) == 0);
+
+    pico_socket_del(srv[0]);
+    fail_unless(S->TCPConnHashCount == count - 3);
+    fail_unless(conn_hashed(S, srv[0]) == 0);
+
+    PICO_FREE(cli);
+    PICO_FREE(srv);
+}
+END_TEST
+
+#define IDLE_CONNS 2000
+
+START_TEST(tc_active_list)
+{
+    struct pico_stack *S;
+    struct pico_device *lo;
+    struct pico_socket *l, *s, **cli, **srv;
+    struct pico_ip4 addr, nm, orig;
+    uint16_t port = short_be(7001), rport;
+    struct timespec t0, t1;
+    uint8_t buf[16];
+    int i, tries;
+
+    fail_if(pico_stack_init(&S) != 0);
+    lo = pico_loop_create(S);
+    fail_if(!lo);
+    addr.addr = long_be(0x7F000001);
+    nm.addr = long_be(0xFF000000);
+    fail_if(pico_ipv4_link_add(S, lo, addr, nm) != 0);
+    cli = PICO_ZALLOC(sizeof(struct pico_socket *) * IDLE_CONNS);
+    srv = PICO_ZALLOC(sizeof(struct pico_socket *) * IDLE_CONNS);
+    fail_if(!cli || !srv);
+
+    l = accept_listener(S, port, IDLE_CONNS);
+    accept_connect(S, l, cli, IDLE_CONNS, port);
+    for (i = 0; i < IDLE_CONNS; i++) {
+        srv[i] = pico_socket_accept(l, &orig, &rport);
+        fail_if(!srv[i]);
+    }
+
+    /* Once every connection is idle, nothing is left on the work list */
+    for (tries = 0; (S->sock_active_count > 0) && (tries < 1000); tries++)
+        pico_stack_tick(S);
+    fail_unless(S->sock_active_count == 0);
+    fail_unless(S->sock_active == NULL && S->sock_active_tail == NULL);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (i = 0; i < 1000; i++)
+        pico_stack_tick(S);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("1000 ticks with %d idle connections in %.3f ms\n", 2 * IDLE_CONNS,
+           ((double)(t1.tv_sec - t0.tv_sec) * 1e3) + ((double)(t1.tv_nsec - t0.tv_nsec) / 1e6));
+
+    /* Pending events are delivered from the list */
+    s = srv[IDLE_CONNS / 2];
+    s->ev_pending |= PICO_SOCK_EV_WR;
+    pico_socket_schedule(s);
+    fail_unless(S->sock_active == s && S->sock_active_count == 1);
+    pico_stack_tick(S);
+    fail_unless(s->ev_pending == 0);
+    fail_unless(S->sock_active_count == 0);
+
+    /* Data still flows, and a FIN waiting on shutdown gets sent */
+    fail_unless(pico_socket_write(cli[7], "hello", 5) == 5);
+    fail_unless(cli[7]->active);
+    fail_unless(pico_socket_shutdown(cli[7], PICO_SHUT_WR) == 0);
+    for (tries = 0; tries < 1000; tries++)
+        pico_stack_tick(S);
+    fail_unless(pico_socket_read(srv[7], buf, sizeof(buf)) == 5);
+    fail_if(memcmp(buf, "hello", 5) != 0);
+    fail_unless((srv[7]->state & PICO_SOCKET_STATE_TCP) == PICO_SOCKET_STATE_TCP_CLOSE_WAIT);
+    pico_stack_tick(S);
+    fail_unless(S->sock_active_count == 0);
+
+    /* Deleted sockets are taken off the list */
+    s = srv[3];
+    s->ev_pending |= PICO_SOCK_EV_WR;
+    pico_socket_schedule(s);
+    fail_unless(S->sock_active_count == 1);
+    pico_socket_del(s);
+    fail_unless(S->sock_active_count == 0);
+    fail_unless(S->sock_active == NULL);
+
+    PICO_FREE(cli);
+    PICO_FREE(srv);
+}
+END_TEST
+
+static int (*tcp_process_out)(struct pico_stack *S, struct pico_protocol *self, struct pico_frame *f);
+static struct pico_socket *acks_sock;
+static int acks_sent;
+
+/* Count the segments without payload sent by acks_sock */
+static int ack_count_out(struct pico_stack *S, struct pico_protocol *self, struct pico_frame *f)
+{
+    if (acks_sock && (f->sock == acks_sock) && (f->payload_len == 0))
+        acks_sent++;
+
+    return tcp_process_out(S, self, f);
+}
+
+/* Bulk transfer over the loop device, returns the number of pure ACKs
+ * sent by the receiver.
+ */
+static int bulk_transfer(int ack_delay, uint16_t port)
+{
+    struct pico_stack *S;
+    struct pico_device *lo;
+    struct pico_socket *l, *cli[1], *srv;
+    struct pico_ip4 addr, nm, orig;
+    uint16_t rport;
+    static uint8_t buf[2000];
+    uint32_t sent = 0, rcvd = 0;
+    const uint32_t total = 128 * sizeof(buf);
+    int r, tries = 0;
+
+    fail_if(pico_stack_init(&S) != 0);
+    lo = pico_loop_create(S);
+    fail_if(!lo);
+    addr.addr = long_be(0x7F000001);
+    nm.addr = long_be(0xFF000000);
+    fail_if(pico_ipv4_link_add(S, lo, addr, nm) != 0);
+
+    l = accept_listener(S, port, 1);
+    fail_if(pico_socket_setoption(l, PICO_TCP_ACK_DELAY, &ack_delay) != 0);
+    accept_connect(S, l, cli, 1, port);
+    srv = pico_socket_accept(l, &orig, &rport);
+    fail_if(!srv);
+    fail_if(pico_socket_getoption(srv, PICO_TCP_ACK_DELAY, &r) != 0);
+    fail_unless(r == ack_delay);
+
+    tcp_process_out = pico_proto_tcp.process_out;
+    pico_proto_tcp.process_out = ack_count_out;
+    acks_sock = srv;
+    acks_sent = 0;
+    while ((rcvd < total) && (tries++ < 1000000)) {
+        if (sent < total) {
+            r = pico_socket_write(cli[0], buf, sizeof(buf));
+            if (r > 0)
+                sent += (uint32_t)r;
+        }
+
+        pico_stack_tick(S);
+        while ((r = pico_socket_read(srv, buf, sizeof(buf))) > 0)
+            rcvd += (uint32_t)r;
+    }
+    pico_proto_tcp.process_out = tcp_process_out;
+    acks_sock = NULL;
+    fail_unless(rcvd == total);
+    return acks_sent;
+}
+
+START_TEST(tc_delayed_ack)
+{
+    int bad = 500;
+    int per_segment = bulk_transfer(0, short_be(7002));
+    int delayed = bulk_transfer(40, short_be(7003));
+    struct pico_stack *S;
+    struct pico_socket *s;
+
+    printf("ACKs sent for 250 KiB: %d with ACK_DELAY 0, %d with ACK_DELAY 40\n", per_segment, delayed);
+    fail_unless(delayed * 3 < per_segment * 2);
+
+    fail_if(pico_stack_init(&S) != 0);
+    s = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, accept_cb);
+    fail_if(!s);
+    fail_if(pico_socket_setoption(s, PICO_TCP_ACK_DELAY, &bad) == 0);
+    fail_unless(pico_err == PICO_ERR_EINVAL);
+}
+END_TEST
+
+static uint16_t zc_port;
+static uint32_t zc_srv_ack;
+static int zc_freed;
+static uint32_t zc_acked;
+static uint32_t zc_ack_base;
+
+/* Remember the client ISN and the last ACK the server side of zc_port sent */
+static int zc_ack_out(struct pico_stack *S, struct pico_protocol *self, struct pico_frame *f)
+{
+    struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *)f->transport_hdr;
+
+    if ((hdr->trans.dport == zc_port) && (hdr->flags & PICO_TCP_SYN))
+        zc_ack_base = long_be(hdr->seq) + 1;
+
+    if ((hdr->trans.sport == zc_port) && (hdr->flags & PICO_TCP_ACK))
+        zc_srv_ack = long_be(hdr->ack);
+
+    return tcp_process_out(S, self, f);
+}
+
+static void zc_notify_free(uint8_t *buf)
+{
+    zc_freed++;
+    zc_acked = zc_srv_ack - zc_ack_base;
+    PICO_FREE(buf);
+}
+
+START_TEST(tc_send_zc)
+{
+    struct pico_stack *S;
+    struct pico_device *lo;
+    struct pico_socket *l, *cli[1], *srv;
+    struct pico_ip4 addr, nm, orig;
+    struct pico_iovec iov[3];
+    static uint8_t out[400], in[400];
+    uint8_t *zc;
+    uint16_t rport;
+    int headroom, nagle = 0, r, i, rcvd = 0, tries = 0;
+
+    for (i = 0; i < (int)sizeof(out); i++)
+        out[i] = (uint8_t)(i * 7);
+
+    fail_if(pico_stack_init(&S) != 0);
+    lo = pico_loop_create(S);
+    fail_if(!lo);
+    addr.addr = long_be(0x7F000001);
+    nm.addr = long_be(0xFF000000);
+    fail_if(pico_ipv4_link_add(S, lo, addr, nm) != 0);
+
+    tcp_process_out = pico_proto_tcp.process_out;
+    pico_proto_tcp.process_out = zc_ack_out;
+    zc_port = short_be(7013);
+    zc_freed = 0;
+    l = accept_listener(S, zc_port, 1);
+    accept_connect(S, l, cli, 1, zc_port);
+    srv = pico_socket_accept(l, &orig, &rport);
+    fail_if(!srv);
+    fail_if(pico_socket_setoption(cli[0], PICO_TCP_NODELAY, &nagle) != 0);
+
+    /* writev: goes out at once, the connection is idle */
+    iov[0].base = out;
+    iov[0].len = 10;
+    iov[1].base = NULL;
+    iov[1].len = 0;
+    iov[2].base = out + 10;
+    iov[2].len = 190;
+    fail_unless(pico_socket_writev(cli[0], iov, 3) == 200);
+
+    /* Unacknowledged data in flight: Nagle holds this one back */
+    fail_unless(pico_socket_write(cli[0], out + 200, 50) == 50);
+
+    /* ... but not the zero-copy segment, nor what is held in front of it */
+    headroom = pico_socket_zc_headroom(cli[0]);
+    fail_if(headroom <= 0);
+    zc = PICO_ZALLOC((size_t)(headroom + 150));
+    fail_if(!zc);
+    memcpy(zc + headroom, out + 250, 150);
+    fail_unless(pico_socket_send_zc(cli[0], zc, 150, zc_notify_free) == 150);
+    fail_unless(zc_freed == 0);
+
+    while ((rcvd < (int)sizeof(in)) && (tries++ < 100000)) {
+        pico_stack_tick(S);
+        while ((r = pico_socket_read(srv, in + rcvd, (int)sizeof(in) - rcvd)) > 0)
+            rcvd += r;
+    }
+    fail_unless(rcvd == (int)sizeof(in));
+    fail_unless(memcmp(in, out, sizeof(in)) == 0);
+
+    /* Released once, after the peer acknowledged all of it */
+    for (i = 0; (i < 1000) && !zc_freed; i++)
+        pico_stack_tick(S);
+    fail_unless(zc_freed == 1);
+    fail_unless(zc_acked == sizeof(out));
+    pico_proto_tcp.process_out = tcp_process_out;
+}
+END_TEST
+
+/* Reflects IPv4 frames, addresses swapped, through the zero-copy receive
+ * path. While hold is set, frames stay in the ring.
+ */
+#define RXZC_RING 16
+
+struct rxzc_dev {
+    struct pico_device dev;
+    uint8_t *buf[RXZC_RING];
+    int len[RXZC_RING];
+    int n;
+    int hold;
+};
+
+/* Buffers carrying TCP payload that the stack has not released yet */
+static uint8_t *rxzc_data[RXZC_RING];
+static int rxzc_data_live;
+
+static void rxzc_free(uint8_t *buf)
+{
+    int i;
+    for (i = 0; i < RXZC_RING; i++) {
+        if (rxzc_data[i] == buf) {
+            rxzc_data[i] = NULL;
+            rxzc_data_live--;
+        }
+    }
+    PICO_FREE(buf);
+}
+
+static int rxzc_send(struct pico_device *dev, void *buf, int len)
+{
+    struct rxzc_dev *d = (struct rxzc_dev *)dev;
+    uint8_t *b;
+    int ihl, i;
+
+    if ((d->n == RXZC_RING) || ((((uint8_t *)buf)[0] >> 4) != 4))
+        return len;
+
+    b = PICO_ZALLOC((size_t)len);
+    if (!b)
+        return len;
+
+    memcpy(b, buf, (size_t)len);
+    memcpy(b + 12, (uint8_t *)buf + 16, 4);
+    memcpy(b + 16, (uint8_t *)buf + 12, 4);
+    ihl = (b[0] & 0x0F) << 2;
+    if (len > ihl + ((b[ihl + 12] >> 4) << 2)) {
+        for (i = 0; rxzc_data[i]; i++) ;
+        rxzc_data[i] = b;
+        rxzc_data_live++;
+    }
+
+    d->buf[d->n] = b;
+    d->len[d->n++] = len;
+    return len;
+}
+
+static int rxzc_poll(struct pico_device *dev, int loop_score)
+{
+    struct rxzc_dev *d = (struct rxzc_dev *)dev;
+    int i;
+
+    if (d->hold)
+        return loop_score;
+
+    for (i = 0; i < d->n; i++) {
+        if (d->buf[i])
+            pico_stack_recv_zerocopy_ext_buffer_notify(dev, d->buf[i], (uint32_t)d->len[i], rxzc_free);
+    }
+    d->n = 0;
+    return loop_score;
+}
+
+START_TEST(tc_read_zc)
+{
+    static struct rxzc_dev d;
+    struct pico_stack *S;
+    struct pico_socket *l, *cli, *srv = NULL;
+    struct pico_ip4 addr, peer, nm, orig;
+    static uint8_t out[1200];
+    uint8_t in[100], *late;
+    uint16_t rport, port = short_be(7014);
+    void *data;
+    int i, late_len, zc = 1;
+
+    for (i = 0; i < (int)sizeof(out); i++)
+        out[i] = (uint8_t)(i * 13);
+
+    memset(&d, 0, sizeof(d));
+    fail_if(pico_stack_init(&S) != 0);
+    fail_if(pico_device_init(S, &d.dev, "rxzc", NULL) != 0);
+    d.dev.send = rxzc_send;
+    d.dev.poll = rxzc_poll;
+    addr.addr = long_be(0x0A2A0001);
+    peer.addr = long_be(0x0A2A0002);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &d.dev, addr, nm) != 0);
+
+    l = accept_listener(S, port, 1);
+    cli = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, accept_cb);
+    fail_if(!cli);
+    fail_if(pico_socket_connect(cli, &peer, port) != 0);
+    for (i = 0; !srv && (i < 1000); i++) {
+        pico_stack_tick(S);
+        srv = pico_socket_accept(l, &orig, &rport);
+    }
+    fail_if(!srv);
+    fail_if(pico_socket_setoption(srv, PICO_TCP_RX_ZEROCOPY, &zc) != 0);
+    for (i = 0; i < 100; i++)
+        pico_stack_tick(S);
+    fail_unless(rxzc_data_live == 0);
+
+    /* Three segments, the last two arriving out of order */
+    d.hold = 1;
+    fail_unless(pico_socket_write(cli, out, 300) == 300);
+    fail_unless(pico_socket_write(cli, out + 300, 400) == 400);
+    fail_unless(pico_socket_write(cli, out + 700, 500) == 500);
+    for (i = 0; (i < 100) && (rxzc_data_live < 3); i++)
+        pico_stack_tick(S);
+    fail_unless(d.n == 3);
+
+    /* The middle one is held back here, it stays in rxzc_data_live */
+    late = d.buf[1];
+    late_len = d.len[1];
+    d.buf[1] = NULL;
+    d.hold = 0;
+    for (i = 0; i < 100; i++)
+        pico_stack_tick(S);
+    fail_unless(rxzc_data_live == 3);
+
+    /* Partial consumption: the buffer stays with the socket */
+    fail_unless(pico_socket_read_zc(srv, &data) == 300);
+    fail_unless(memcmp(data, out, 300) == 0);
+    fail_unless(pico_socket_read_zc_done(srv, 100) == 100);
+    fail_unless(pico_socket_read_zc(srv, &data) == 200);
+    fail_unless(memcmp(data, out + 100, 200) == 0);
+    fail_unless(rxzc_data_live == 3);
+    fail_unless(pico_socket_read_zc_done(srv, 200) == 200);
+    fail_unless(rxzc_data_live == 2);
+
+    /* Nothing past the hole */
+    fail_unless(pico_socket_read_zc(srv, &data) == 0);
+    fail_unless(data == NULL);
+    pico_stack_recv_zerocopy_ext_buffer_notify(&d.dev, late, (uint32_t)late_len, rxzc_free);
+    for (i = 0; i < 100; i++)
+        pico_stack_tick(S);
+    fail_unless(rxzc_data_live == 2);
+
+    /* Copying reads and zero-copy reads share the same position */
+    fail_unless(pico_socket_read_zc(srv, &data) == 400);
+    fail_unless(memcmp(data, out + 300, 400) == 0);
+    fail_unless(pico_socket_read(srv, in, sizeof(in)) == sizeof(in));
+    fail_unless(memcmp(in, out + 300, sizeof(in)) == 0);
+    fail_unless(pico_socket_read_zc(srv, &data) == 300);
+    fail_unless(memcmp(data, out + 400, 300) == 0);
+    fail_unless(pico_socket_read_zc_done(srv, 300) == 300);
+    fail_unless(rxzc_data_live == 1);
+    fail_unless(pico_socket_read_zc(srv, &data) == 500);
+    fail_unless(memcmp(data, out + 700, 500) == 0);
+    fail_unless(pico_socket_read_zc_done(srv, 500) == 500);
+    fail_unless(rxzc_data_live == 0);
+    fail_unless(pico_socket_read_zc(srv, &data) == 0);
+
+    pico_socket_close(cli);
+    pico_socket_close(srv);
+    pico_socket_close(l);
+    for (i = 0; i < 1000; i++)
+        pico_stack_tick(S);
+}
+END_TEST
+
+/* Long fat pipe: every IPv4 frame comes back, addresses swapped, after
+ * DELAY_MS. Frames that do not fit in the ring are dropped.
+ */
+#define DELAY_RING  1024
+#define DELAY_MTU   1500
+#define DELAY_MS    20
+#define DELAY_BYTES (1024 * 1024)
+
+struct delay_dev {
+    struct pico_device dev;
+    uint8_t ring[DELAY_RING][DELAY_MTU];
+    int len[DELAY_RING];
+    pico_time due[DELAY_RING];
+    int head, tail;
+};
+
+static int delay_send(struct pico_device *dev, void *buf, int len)
+{
+    struct delay_dev *d = (struct delay_dev *)dev;
+    int next = (d->head + 1) % DELAY_RING;
+
+    if ((len > DELAY_MTU) || (next == d->tail) || ((((uint8_t *)buf)[0] >> 4) != 4))
+        return len;
+
+    memcpy(d->ring[d->head], buf, (size_t)len);
+    memcpy(d->ring[d->head] + 12, (uint8_t *)buf + 16, 4);
+    memcpy(d->ring[d->head] + 16, (uint8_t *)buf + 12, 4);
+    d->len[d->head] = len;
+    d->due[d->head] = PICO_TIME_MS() + DELAY_MS;
+    d->head = next;
+    return len;
+}
+
+static int delay_poll(struct pico_device *dev, int loop_score)
+{
+    struct delay_dev *d = (struct delay_dev *)dev;
+    while ((loop_score > 0) && (d->tail != d->head) && (d->due[d->tail] <= PICO_TIME_MS())) {
+        pico_stack_recv(dev, d->ring[d->tail], (uint32_t)d->len[d->tail]);
+        d->tail = (d->tail + 1) % DELAY_RING;
+        loop_score--;
+    }
+    return loop_score;
+}
+
+/* Sends DELAY_BYTES over a 2 * DELAY_MS RTT path. rcvbuf > 0 fixes the
+ * receive buffer on the listener, limit is the stack autotuning budget.
+ * Returns the transfer time in ms and the final receive buffer size.
+ */
+static double delay_transfer(struct delay_dev *d, int rcvbuf, uint32_t limit, uint16_t port, uint32_t *bufsize)
+{
+    struct pico_stack *S;
+    struct pico_socket *l, *cli, *srv = NULL;
+    struct pico_ip4 addr, peer, nm, orig;
+    static uint8_t buf[4096];
+    int sndbuf = 2 * DELAY_BYTES;
+    uint32_t sent = 0, rcvd = 0;
+    uint16_t rport;
+    pico_time t0;
+    long ticks = 0;
+    int r;
+
+    memset(d, 0, sizeof(*d));
+    fail_if(pico_stack_init(&S) != 0);
+    fail_if(pico_device_init(S, &d->dev, "delay", NULL) != 0);
+    d->dev.send = delay_send;
+    d->dev.poll = delay_poll;
+    addr.addr = long_be(0x0A290001);
+    peer.addr = long_be(0x0A290002);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &d->dev, addr, nm) != 0);
+    fail_if(pico_tcp_set_rcvbuf_limit(S, limit) != 0);
+
+    l = accept_listener(S, port, 1);
+    if (rcvbuf > 0)
+        fail_if(pico_socket_setoption(l, PICO_SOCKET_OPT_RCVBUF, &rcvbuf) != 0);
+
+    cli = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, accept_cb);
+    fail_if(!cli);
+    fail_if(pico_socket_setoption(cli, PICO_SOCKET_OPT_SNDBUF, &sndbuf) != 0);
+    fail_if(pico_socket_connect(cli, &peer, port) != 0);
+    while (!srv && (ticks++ < 1000000)) {
+        pico_stack_tick(S);
+        srv = pico_socket_accept(l, &orig, &rport);
+    }
+    fail_if(!srv);
+
+    t0 = PICO_TIME_MS();
+    while ((rcvd < DELAY_BYTES) && (ticks++ < 50000000)) {
+        while (sent < DELAY_BYTES) {
+            r = pico_socket_write(cli, buf, sizeof(buf));
+            if (r <= 0)
+                break;
+
+            sent += (uint32_t)r;
+        }
+        pico_stack_tick(S);
+        while ((r = pico_socket_read(srv, buf, sizeof(buf))) > 0)
+            rcvd += (uint32_t)r;
+        fail_if(S->TCPRcvBufUsed > limit);
+    }
+    fail_unless(rcvd == DELAY_BYTES);
+    fail_if(pico_socket_getoption(srv, PICO_SOCKET_OPT_RCVBUF, bufsize) != 0);
+
+    if (limit > 0) {
+        /* Memory pressure: the buffer drains back to its initial size */
+        fail_if(pico_tcp_set_rcvbuf_limit(S, 0) != 0);
+        sent = rcvd = 0;
+        while ((S->TCPRcvBufUsed > 0) && (ticks++ < 50000000)) {
+            if (sent < DELAY_BYTES) {
+                r = pico_socket_write(cli, buf, sizeof(buf));
+                if (r > 0)
+                    sent += (uint32_t)r;
+            }
+
+            pico_stack_tick(S);
+            while ((r = pico_socket_read(srv, buf, sizeof(buf))) > 0)
+                rcvd += (uint32_t)r;
+        }
+        fail_unless(S->TCPRcvBufUsed == 0);
+    }
+
+    pico_socket_close(cli);
+    pico_socket_close(srv);
+    pico_socket_close(l);
+    for (r = 0; r < 1000; r++)
+        pico_stack_tick(S);
+    fail_unless(S->TCPRcvBufUsed == 0);
+    return (double)(PICO_TIME_MS() - t0);
+}
+
+START_TEST(tc_rcvbuf_autotune)
+{
+    static struct delay_dev d;
+    double ms_fixed, ms_auto, ms_capped;
+    uint32_t size_fixed, size_auto, size_capped;
+
+    ms_fixed = delay_transfer(&d, PICO_DEFAULT_SOCKETQ, PICO_TCP_RCVBUF_LIMIT, short_be(7010), &size_fixed);
+    fail_unless(size_fixed == PICO_DEFAULT_SOCKETQ);
+    ms_auto = delay_transfer(&d, 0, PICO_TCP_RCVBUF_LIMIT, short_be(7011), &size_auto);
+    ms_capped = delay_transfer(&d, 0, 64 * 1024, short_be(7012), &size_capped);
+
+    printf("%u KiB over a %u ms RTT path:\n", DELAY_BYTES / 1024, 2 * DELAY_MS);
+    printf("  fixed %u KiB buffer: %6.0f ms\n", size_fixed / 1024, ms_fixed);
+    printf("  autotuned to %u KiB: %6.0f ms\n", size_auto / 1024, ms_auto);
+    printf("  capped at %u KiB:    %6.0f ms\n", size_capped / 1024, ms_capped);
+    fail_unless(size_auto > 4 * PICO_DEFAULT_SOCKETQ);
+    fail_unless(size_auto <= PICO_TCP_RCVBUF_MAX);
+    fail_unless(size_capped <= PICO_DEFAULT_SOCKETQ + 64 * 1024);
+    fail_unless(ms_auto * 2 < ms_fixed);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_accept_queue = tcase_create("Unit test for the TCP accept queue");
+
+    tcase_add_test(TCase_accept_queue, tc_accept_queue);
+    tcase_set_timeout(TCase_accept_queue, 60);
+    suite_add_tcase(s, TCase_accept_queue);
+
+    TCase *TCase_conn_hash = tcase_create("Unit test for the TCP connection table");
+    tcase_add_test(TCase_conn_hash, tc_conn_hash);
+    tcase_set_timeout(TCase_conn_hash, 60);
+    suite_add_tcase(s, TCase_conn_hash);
+
+    TCase *TCase_active_list = tcase_create("Unit test for the socket work list");
+    tcase_add_test(TCase_active_list, tc_active_list);
+    tcase_set_timeout(TCase_active_list, 60);
+    suite_add_tcase(s, TCase_active_list);
+
+    TCase *TCase_delayed_ack = tcase_create("Unit test for delayed ACKs");
+    tcase_add_test(TCase_delayed_ack, tc_delayed_ack);
+    tcase_set_timeout(TCase_delayed_ack, 60);
+    suite_add_tcase(s, TCase_delayed_ack);
+
+    TCase *TCase_send_zc = tcase_create("Unit test for writev and zero-copy send");
+    tcase_add_test(TCase_send_zc, tc_send_zc);
+    tcase_set_timeout(TCase_send_zc, 60);
+    suite_add_tcase(s, TCase_send_zc);
+
+    TCase *TCase_read_zc = tcase_create("Unit test for zero-copy receive");
+    tcase_add_test(TCase_read_zc, tc_read_zc);
+    tcase_set_timeout(TCase_read_zc, 60);
+    suite_add_tcase(s, TCase_read_zc);
+
+    TCase *TCase_rcvbuf_autotune = tcase_create("Unit test for receive buffer autotuning");
+    tcase_add_test(TCase_rcvbuf_autotune, tc_rcvbuf_autotune);
+    tcase_set_timeout(TCase_rcvbuf_autotune, 60);
+    suite_add_tcase(s, TCase_rcvbuf_autotune);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -55,26 +55,36 @@ START_TEST(tc_tcp_input_segment)
     memset(f->payload, 'c', f->payload_len);
     ((struct pico_tcp_hdr *)((f)->transport_hdr))->seq = long_be(0xdeadbeef);
 
-    seg = segment_from_frame(f);
+    seg = segment_from_frame(f, 0);
     fail_if(!seg);
     fail_if(seg->seq != 0xdeadbeef);
     fail_if(seg->payload_len != f->payload_len);
     fail_if(memcmp(seg->payload, f->payload, f->payload_len) != 0);
+    segment_free(seg);
+
+    /* Zero-copy: the segment references the frame buffer */
+    seg = segment_from_frame(f, 1);
+    fail_if(!seg);
+    fail_if(!seg->frame);
+    fail_if(seg->payload != f->payload);
+    fail_if(*f->usage_count != 2);
+    segment_free(seg);
+    fail_if(*f->usage_count != 1);
 
 #ifdef PICO_FAULTY
     printf("Testing with faulty memory in segment_from_frame (1)\n");
     pico_set_mm_failure(1);
-    seg = segment_from_frame(f);
+    seg = segment_from_frame(f, 0);
     fail_if(seg);
 
     printf("Testing with faulty memory in segment_from_frame (2)\n");
     pico_set_mm_failure(2);
-    seg = segment_from_frame(f);
+    seg = segment_from_frame(f, 0);
     fail_if(seg);
 #endif
     printf("Testing segment_from_frame with empty payload\n");
     f->payload_len = 0;
-    seg = segment_from_frame(f);
+    seg = segment_from_frame(f, 0);
     fail_if(seg);
 
 }
@@ -112,7 +122,7 @@ START_TEST(tc_tcp_discard_all_segments)
     f->payload = f->start + 40;
     f->payload_len = 40;
     memset(f->payload, 'c', f->payload_len);
-    is = segment_from_frame(f);
+    is = segment_from_frame(f, 0);
     fail_if(!is);
     is->payload_len = 0;
     fail_if(pico_enqueue_segment(&t->tcpq_in, is) >= 0);
@@ -139,11 +149,11 @@ START_TEST(tc_tcp_discard_all_segments)
 
     printf("Testing input segment conversion with faulty mm(1)\n");
     pico_set_mm_failure(1);
-    is = segment_from_frame(f);
+    is = segment_from_frame(f, 0);
     fail_if(is);
     printf("Testing input segment conversion with faulty mm(2)\n");
     pico_set_mm_failure(2);
-    is = segment_from_frame(f);
+    is = segment_from_frame(f, 0);
     fail_if(is);
 #endif
 
@@ -207,7 +217,7 @@ START_TEST(tc_release_until)
         f->payload_len = f->transport_len;
         f->payload = f->start;
         ((struct pico_tcp_hdr *)((f)->transport_hdr))->seq = long_be(0xaa00 + f->buffer_len * i);
-        is = segment_from_frame(f);
+        is = segment_from_frame(f, 0);
         fail_if(!is);
         printf("inserting Input frame seq = %08x len = %d\n", long_be(is->seq), is->payload_len);
         fail_if(!is);
@@ -261,7 +271,7 @@ START_TEST(tc_release_all_until)
         f->payload_len = f->transport_len;
         f->payload = f->start;
         ((struct pico_tcp_hdr *)((f)->transport_hdr))->seq = long_be(0xaa00 + f->buffer_len * i);
-        is = segment_from_frame(f);
+        is = segment_from_frame(f, 0);
         fail_if(!is);
         printf("inserting Input frame seq = %08x len = %d\n", long_be(is->seq), is->payload_len);
         fail_if(!is);
@@ -307,7 +317,6 @@ START_TEST(tc_tcp_add_options)
     uint16_t optsiz = 50;
     uint8_t *frame_opt_buff;
     int i;
-    struct tcp_sack_block *a, *b, *c;
     uint32_t al = 0xa0,
              ar = 0xaf,
              bl = 0xb0,
@@ -354,21 +363,15 @@ START_TEST(tc_tcp_add_options)
 
     /* Testing SACKs */
     printf("Testing full SACK options\n");
-    a = PICO_ZALLOC(sizeof (struct tcp_sack_block));
-    b = PICO_ZALLOC(sizeof (struct tcp_sack_block));
-    c = PICO_ZALLOC(sizeof (struct tcp_sack_block));
-    a->left = al;
-    a->right = ar;
-    a->next = b;
-    b->left = bl;
-    b->right = br;
-    b->next = c;
-    c->left = cl;
-    c->right = cr;
-    c->next = NULL;
+    ts.sacks[0].left = al;
+    ts.sacks[0].right = ar;
+    ts.sacks[1].left = bl;
+    ts.sacks[1].right = br;
+    ts.sacks[2].left = cl;
+    ts.sacks[2].right = cr;
+    ts.sacks_n = 3;
 
     ts.sack_ok = 1;
-    ts.sacks = a;
     flags = PICO_TCP_ACK;
     tcp_add_options(&ts, f, flags, optsiz);
     fail_if(frame_opt_buff[0] != PICO_TCP_OPTION_WS);
@@ -382,7 +385,7 @@ START_TEST(tc_tcp_add_options)
     fail_if(memcmp(frame_opt_buff + 17, &br, 4) != 0);
     fail_if(memcmp(frame_opt_buff + 21, &cl, 4) != 0);
     fail_if(memcmp(frame_opt_buff + 25, &cr, 4) != 0);
-    fail_if(ts.sacks != NULL);
+    fail_if(ts.sacks_n != 0);
     for (i = 29; i < optsiz - 1; i++)
         fail_if(frame_opt_buff[i] != PICO_TCP_OPTION_NOOP);
     fail_if(frame_opt_buff[optsiz - 1] != PICO_TCP_OPTION_END);
@@ -0,0 +1,258 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_socket.h"
+#include "pico_tcp_cc.h"
+#include "modules/pico_tcp_cc.c"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+#define MSS 1000u
+
+static void cc_start(struct pico_tcp_cc *cc, uint8_t id)
+{
+    memset(cc, 0, sizeof(*cc));
+    cc->ops = pico_tcp_cc_get(id);
+    pico_tcp_cc_reset(cc, MSS, 1000);
+}
+
+START_TEST(tc_reno)
+{
+    struct pico_tcp_cc cc;
+    int i;
+
+    cc_start(&cc, PICO_TCP_CC_RENO);
+    fail_unless(cc.cwnd == 10 * MSS);
+
+    /* Slow start counts bytes, at most two segments per ACK */
+    cc.flight = cc.cwnd;
+    cc.ops->on_ack(&cc, MSS, 0, 1000);
+    fail_unless(cc.cwnd == 11 * MSS);
+    cc.ops->on_ack(&cc, 5 * MSS, 0, 1000);
+    fail_unless(cc.cwnd == 13 * MSS);
+
+    /* Application limited: no growth */
+    cc.flight = 0;
+    cc.ops->on_ack(&cc, MSS, 0, 1000);
+    fail_unless(cc.cwnd == 13 * MSS);
+
+    cc.flight = 20 * MSS;
+    cc.ops->on_loss(&cc, 1000);
+    fail_unless(cc.ssthresh == 10 * MSS);
+    fail_unless(cc.cwnd == 20 * MSS);
+
+    /* Congestion avoidance: one segment per window */
+    cc.cwnd = cc.ssthresh;
+    for (i = 0; i < 10; i++) {
+        cc.flight = cc.cwnd;
+        cc.ops->on_ack(&cc, MSS, 0, 1000);
+    }
+    fail_unless(cc.cwnd == 11 * MSS);
+
+    cc.flight = 11 * MSS;
+    cc.ops->on_rto(&cc, 1000);
+    fail_unless(cc.cwnd == PICO_TCP_CC_LW * MSS);
+    fail_unless(cc.ssthresh == 11 * MSS / 2);
+}
+END_TEST
+
+/* ACK clock on a long path: cwnd/rtt bytes acknowledged every 10 ms */
+static void cc_run(struct pico_tcp_cc *cc, uint32_t rtt, pico_time from, pico_time to)
+{
+    pico_time now;
+    for (now = from; now < to; now += 10) {
+        cc->flight = cc->cwnd;
+        cc->ops->on_ack(cc, (cc->cwnd * 10u) / rtt, rtt, now);
+    }
+}
+
+START_TEST(tc_cubic)
+{
+    struct pico_tcp_cc cubic, reno;
+    const uint32_t rtt = 500, w_max = 100 * MSS;
+
+    fail_unless(cc_cbrt(0) == 0);
+    fail_unless(cc_cbrt(26) == 2);
+    fail_unless(cc_cbrt(27) == 3);
+    fail_unless(cc_cbrt(1000000000000ull) == 10000);
+
+    cc_start(&cubic, PICO_TCP_CC_CUBIC);
+    cc_start(&reno, PICO_TCP_CC_RENO);
+    cubic.cwnd = reno.cwnd = w_max;
+    cubic.flight = reno.flight = w_max;
+    cubic.ops->on_loss(&cubic, 1000);
+    reno.ops->on_loss(&reno, 1000);
+    fail_unless(cubic.ssthresh == (uint32_t)(((uint64_t)w_max * CUBIC_BETA) >> 10));
+    fail_unless(cubic.priv.cubic.w_max == w_max);
+
+    /* Recovery done, the TCP layer deflated the window */
+    cubic.cwnd = cubic.ssthresh;
+    reno.cwnd = reno.ssthresh;
+
+    /* K = cbrt(30 / 0.4) s ~= 4.2 s: back at W_max regardless of RTT */
+    cc_run(&cubic, rtt, 1000, 3000);
+    fail_unless(cubic.cwnd > cubic.ssthresh + 10 * MSS);
+    fail_unless(cubic.cwnd < w_max);
+    cc_run(&cubic, rtt, 3000, 5300);
+    fail_unless(cubic.cwnd >= (w_max * 95u) / 100u);
+    fail_unless(cubic.cwnd <= (w_max * 105u) / 100u);
+
+    cc_run(&reno, rtt, 1000, 5300);
+    fail_unless(reno.cwnd < (w_max * 70u) / 100u);
+    printf("Window %u ms after a loss at %u segments, RTT %u ms: reno %u, cubic %u\n",
+           4300u, w_max / MSS, rtt, reno.cwnd / MSS, cubic.cwnd / MSS);
+
+    /* Past the plateau the window probes beyond W_max */
+    cc_run(&cubic, rtt, 5300, 9000);
+    fail_unless(cubic.cwnd > w_max);
+
+    /* A second loss below W_max releases bandwidth (fast convergence) */
+    cubic.cwnd = 90 * MSS;
+    cubic.priv.cubic.w_max = w_max;
+    cubic.ops->on_rto(&cubic, 9000);
+    fail_unless(cubic.priv.cubic.w_max < 90 * MSS);
+    fail_unless(cubic.cwnd == PICO_TCP_CC_LW * MSS);
+}
+END_TEST
+
+/* 1 MB/s bottleneck, 20 ms base RTT, unbounded buffer */
+#define LINK_RATE 1000u   /* bytes per ms */
+#define LINK_RTT  20u
+#define LINK_BDP  (LINK_RATE * LINK_RTT)
+
+static uint32_t link_run(struct pico_tcp_cc *cc, pico_time from, pico_time to)
+{
+    uint32_t inflight = 0, deliver, send, rtt = LINK_RTT;
+    pico_time now;
+
+    for (now = from; now < to; now++) {
+        deliver = (inflight < LINK_BDP) ? inflight / LINK_RTT : LINK_RATE;
+        inflight -= deliver;
+        rtt = LINK_RTT + ((inflight > LINK_BDP) ? (inflight - LINK_BDP) / LINK_RATE : 0u);
+        cc->flight = inflight;
+        if (deliver)
+            cc->ops->on_ack(cc, deliver, rtt, now);
+
+        send = (cc->cwnd > inflight) ? cc->cwnd - inflight : 0u;
+        if (cc->ops->pacing_rate && cc->ops->pacing_rate(cc) && (send > cc->ops->pacing_rate(cc) / 1000u))
+            send = cc->ops->pacing_rate(cc) / 1000u;
+
+        if (!deliver && !inflight && !send)
+            send = cc->cwnd;
+
+        inflight += send;
+    }
+    return rtt;
+}
+
+START_TEST(tc_bbr)
+{
+    struct pico_tcp_cc bbr, reno;
+    uint32_t rtt_bbr, rtt_reno;
+
+    cc_start(&bbr, PICO_TCP_CC_BBR);
+    fail_unless(bbr.ops->pacing_rate(&bbr) == 0);
+    rtt_bbr = link_run(&bbr, 1000, 4000);
+    fail_unless(bbr.priv.bbr.mode == BBR_PROBE_BW);
+    fail_unless(bbr.priv.bbr.min_rtt == LINK_RTT);
+    fail_unless(bbr.priv.bbr.btl_bw >= 900000u);
+    fail_unless(bbr.priv.bbr.btl_bw <= 1100000u);
+    fail_unless(bbr.cwnd >= LINK_BDP);
+    fail_unless(bbr.cwnd <= 3u * LINK_BDP);
+    fail_unless(bbr.ops->pacing_rate(&bbr) > 0);
+
+    /* A loss-based sender keeps filling the buffer */
+    cc_start(&reno, PICO_TCP_CC_RENO);
+    rtt_reno = link_run(&reno, 1000, 4000);
+    fail_unless(rtt_bbr < 2u * LINK_RTT);
+    fail_unless(rtt_reno > rtt_bbr);
+    printf("RTT after 3 s on a 20 ms path: reno %u ms, bbr %u ms\n", rtt_reno, rtt_bbr);
+
+    /* The model survives losses; only an RTO collapses the window */
+    bbr.flight = LINK_BDP;
+    bbr.ops->on_loss(&bbr, 4000);
+    fail_unless(bbr.cwnd >= LINK_BDP);
+    bbr.ops->on_rto(&bbr, 4000);
+    fail_unless(bbr.cwnd == PICO_TCP_CC_LW * MSS);
+    fail_unless(bbr.priv.bbr.btl_bw >= 900000u);
+
+    /* Min RTT expires after 10 s: drain the queue for 200 ms */
+    bbr.ops->on_ack(&bbr, MSS, 0, 1000 + 4000 + BBR_MIN_RTT_WIN);
+    fail_unless(bbr.priv.bbr.mode == BBR_PROBE_RTT);
+    fail_unless(bbr.cwnd == 4u * MSS);
+}
+END_TEST
+
+START_TEST(tc_cc_sockopt)
+{
+    struct pico_stack *S;
+    struct pico_socket *s;
+    uint32_t idle;
+    int val = -1;
+
+    fail_unless(pico_tcp_cc_get(PICO_TCP_CC_RENO) == &cc_reno);
+    fail_unless(pico_tcp_cc_get(PICO_TCP_CC_CUBIC) == &cc_cubic);
+    fail_unless(pico_tcp_cc_get(PICO_TCP_CC_BBR) == &cc_bbr);
+    fail_unless(pico_tcp_cc_get(42) == NULL);
+
+    pico_stack_init(&S);
+    s = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, NULL);
+    fail_if(!s);
+    fail_unless(pico_socket_getoption(s, PICO_TCP_CONGESTION, &val) == 0);
+    fail_unless(val == PICO_TCP_CC_DEFAULT);
+    val = PICO_TCP_CC_CUBIC;
+    fail_unless(pico_socket_setoption(s, PICO_TCP_CONGESTION, &val) == 0);
+    val = -1;
+    fail_unless(pico_socket_getoption(s, PICO_TCP_CONGESTION, &val) == 0);
+    fail_unless(val == PICO_TCP_CC_CUBIC);
+    val = 42;
+    fail_unless(pico_socket_setoption(s, PICO_TCP_CONGESTION, &val) == -1);
+    fail_unless(pico_err == PICO_ERR_EINVAL);
+    val = -1;
+    fail_unless(pico_socket_setoption(s, PICO_TCP_CONGESTION, &val) == -1);
+
+    /* Keepalive options are left alone, and leave the algorithm alone */
+    idle = 7200000u;
+    fail_unless(pico_socket_setoption(s, PICO_SOCKET_OPT_KEEPIDLE, &idle) == 0);
+    idle = 0;
+    fail_unless(pico_socket_getoption(s, PICO_SOCKET_OPT_KEEPIDLE, &idle) == 0);
+    fail_unless(idle == 7200000u);
+    idle = PICO_TCP_CC_RENO;
+    fail_unless(pico_socket_setoption(s, PICO_SOCKET_OPT_KEEPIDLE, &idle) == 0);
+    val = -1;
+    fail_unless(pico_socket_getoption(s, PICO_TCP_CONGESTION, &val) == 0);
+    fail_unless(val == PICO_TCP_CC_CUBIC);
+    pico_socket_close(s);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_reno = tcase_create("Unit test for Reno congestion control");
+    TCase *TCase_cubic = tcase_create("Unit test for CUBIC congestion control");
+    TCase *TCase_bbr = tcase_create("Unit test for BBR-style congestion control");
+    TCase *TCase_cc_sockopt = tcase_create("Unit test for PICO_TCP_CONGESTION");
+
+    tcase_add_test(TCase_reno, tc_reno);
+    suite_add_tcase(s, TCase_reno);
+    tcase_add_test(TCase_cubic, tc_cubic);
+    suite_add_tcase(s, TCase_cubic);
+    tcase_add_test(TCase_bbr, tc_bbr);
+    suite_add_tcase(s, TCase_bbr);
+    tcase_add_test(TCase_cc_sockopt, tc_cc_sockopt);
+    suite_add_tcase(s, TCase_cc_sockopt);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,347 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_socket.h"
+#include "pico_device.h"
+#include "pico_tcp.h"
+#include "pico_tcp_sack.h"
+#include "modules/pico_tcp_sack.c"
+#include "check.h"
+#include <time.h>
+
+Suite *pico_suite(void);
+
+#define MSS 1000u
+#define UNA 0xFFFFF000u /* exercise sequence wrap-around */
+
+START_TEST(tc_scoreboard)
+{
+    struct pico_tcp_scoreboard sb;
+    const uint32_t high = UNA + 20 * MSS;
+    uint32_t i;
+
+    memset(&sb, 0, sizeof(sb));
+    pico_tcp_sack_reset(&sb, UNA);
+
+    /* Bogus and stale blocks are ignored */
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 2 * MSS, UNA + MSS) == 0);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA - MSS, UNA) == 0);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 19 * MSS, UNA + 21 * MSS) == 0);
+    fail_unless(sb.n == 0);
+
+    /* Segments 2, 4, 6 arrive: three holes */
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 6 * MSS, UNA + 7 * MSS) == 1);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 2 * MSS, UNA + 3 * MSS) == 1);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 4 * MSS, UNA + 5 * MSS) == 1);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 4 * MSS, UNA + 5 * MSS) == 0);
+    fail_unless(sb.n == 3);
+    fail_unless(sb.sacked == 3 * MSS);
+    fail_unless(sb.blk[0].left == UNA + 2 * MSS);
+    fail_unless(sb.blk[2].right == UNA + 7 * MSS);
+    fail_unless(pico_tcp_sack_high(&sb, UNA) == UNA + 7 * MSS);
+
+    fail_unless(pico_tcp_sack_covered(&sb, UNA + 4 * MSS, MSS));
+    fail_if(pico_tcp_sack_covered(&sb, UNA + 3 * MSS, MSS));
+    fail_if(pico_tcp_sack_covered(&sb, UNA + 4 * MSS, 2 * MSS));
+    fail_unless(pico_tcp_sack_skip(&sb, UNA + 2 * MSS) == UNA + 3 * MSS);
+    fail_unless(pico_tcp_sack_skip(&sb, UNA + 3 * MSS) == UNA + 3 * MSS);
+
+    /* Three ranges above the first hole, two above the second one,
+     * and only MSS bytes above the third one.
+     */
+    fail_unless(pico_tcp_sack_is_lost(&sb, UNA, MSS));
+    fail_unless(pico_tcp_sack_is_lost(&sb, UNA + 3 * MSS, MSS) == 0);
+    fail_unless(pico_tcp_sack_is_lost(&sb, UNA + 5 * MSS, MSS) == 0);
+    fail_unless(pico_tcp_sack_is_lost(&sb, UNA + 7 * MSS, MSS) == 0);
+
+    /* 10 segments out: 2 lost, 3 SACKed */
+    fail_unless(pico_tcp_sack_pipe(&sb, UNA, UNA + 10 * MSS, MSS) == 5 * MSS);
+    /* Retransmitting the first hole puts it back in the pipe */
+    sb.high_rxt = UNA + MSS;
+    fail_unless(pico_tcp_sack_pipe(&sb, UNA, UNA + 10 * MSS, MSS) == 6 * MSS);
+    /* Only what was sent below snd_nxt counts after a go-back-N reset */
+    fail_unless(pico_tcp_sack_pipe(&sb, UNA, UNA + 5 * MSS, MSS) == 2 * MSS);
+
+    /* Filling a gap merges ranges */
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 3 * MSS, UNA + 4 * MSS) == 1);
+    fail_unless(sb.n == 2);
+    fail_unless(sb.blk[0].left == UNA + 2 * MSS && sb.blk[0].right == UNA + 5 * MSS);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 2 * MSS, UNA + 8 * MSS) == 1);
+    fail_unless(sb.n == 1);
+    fail_unless(sb.sacked == 6 * MSS);
+
+    /* The cumulative ACK trims the scoreboard */
+    pico_tcp_sack_advance(&sb, UNA + 4 * MSS);
+    fail_unless(sb.n == 1);
+    fail_unless(sb.blk[0].left == UNA + 4 * MSS);
+    fail_unless(sb.sacked == 4 * MSS);
+    fail_unless(sb.high_rxt == UNA + 4 * MSS);
+    pico_tcp_sack_advance(&sb, UNA + 8 * MSS);
+    fail_unless(sb.n == 0 && sb.sacked == 0);
+
+    /* When full, the highest range is dropped */
+    pico_tcp_sack_reset(&sb, UNA);
+    for (i = 0; i < PICO_TCP_SACK_BLOCKS; i++)
+        fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + (2 * i + 2) * MSS, UNA + (2 * i + 3) * MSS) == 1);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA + 19 * MSS, UNA + 20 * MSS) == 0);
+    fail_unless(pico_tcp_sack_add(&sb, UNA, high, UNA, UNA + MSS) == 1);
+    fail_unless(sb.n == PICO_TCP_SACK_BLOCKS);
+    fail_unless(sb.blk[0].left == UNA && sb.blk[0].right == UNA + MSS);
+    fail_unless(sb.blk[PICO_TCP_SACK_BLOCKS - 1].right == UNA + (2 * PICO_TCP_SACK_BLOCKS - 1) * MSS);
+    fail_unless(sb.sacked == PICO_TCP_SACK_BLOCKS * MSS);
+}
+END_TEST
+
+/* Lossy link: a device that reflects every IPv4 packet with source and
+ * destination swapped, so that a connection to a neighbour ends up on
+ * a local listener and both directions cross the device. Data segments
+ * are dropped following a fixed pattern, several per window, and
+ * SACK-permitted can be hidden from SYNs to emulate a peer without SACK.
+ */
+#define LOSSY_RING   512
+#define LOSSY_MTU    1500
+#define LOSSY_BYTES  (256 * 1024)
+
+struct lossy_dev {
+    struct pico_device dev;
+    uint8_t ring[LOSSY_RING][LOSSY_MTU];
+    int len[LOSSY_RING];
+    int head, tail;
+    int strip_sack_ok;
+    uint32_t data_segs;
+    uint32_t dropped;
+    uint32_t sack_acks;
+};
+
+static uint8_t *lossy_tcp(uint8_t *ip, int len, int *tcp_len)
+{
+    int ihl = (ip[0] & 0x0F) << 2;
+    if ((len < ihl + 20) || (ip[9] != PICO_PROTO_TCP))
+        return NULL;
+
+    *tcp_len = len - ihl;
+    return ip + ihl;
+}
+
+/* Offset of option kind in the TCP header, or -1 */
+static int lossy_option(uint8_t *tcp, uint8_t kind)
+{
+    int hl = (tcp[12] >> 4) << 2;
+    int i = 20;
+
+    while (i < hl) {
+        if (tcp[i] == PICO_TCP_OPTION_END)
+            break;
+
+        if (tcp[i] == PICO_TCP_OPTION_NOOP) {
+            i++;
+            continue;
+        }
+
+        if (tcp[i] == kind)
+            return i;
+
+        if (((i + 1) >= hl) || (tcp[i + 1] < 2))
+            break;
+
+        i += tcp[i + 1];
+    }
+    return -1;
+}
+
+static void lossy_strip_sack_ok(uint8_t *tcp)
+{
+    int i = lossy_option(tcp, PICO_TCP_OPTION_SACK_OK);
+    uint32_t sum;
+
+    if (i < 0)
+        return;
+
+    /* Same word turned into two NOPs: adjust the checksum (RFC 1624) */
+    fail_if(i & 1);
+    sum = (uint16_t)~((tcp[16] << 8) | tcp[17]);
+    sum += (uint16_t)~((tcp[i] << 8) | tcp[i + 1]);
+    sum += (PICO_TCP_OPTION_NOOP << 8) | PICO_TCP_OPTION_NOOP;
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (uint16_t)~sum;
+    tcp[16] = (uint8_t)(sum >> 8);
+    tcp[17] = (uint8_t)(sum & 0xFF);
+    tcp[i] = PICO_TCP_OPTION_NOOP;
+    tcp[i + 1] = PICO_TCP_OPTION_NOOP;
+}
+
+static int lossy_send(struct pico_device *dev, void *buf, int len)
+{
+    struct lossy_dev *l = (struct lossy_dev *)dev;
+    int next = (l->head + 1) % LOSSY_RING;
+    uint8_t *tcp;
+    int tcp_len, payload;
+
+    if ((len > LOSSY_MTU) || (next == l->tail))
+        return 0;
+
+    /* IPv4 only: looping IPv6 DAD probes back would look like a conflict */
+    if ((((uint8_t *)buf)[0] >> 4) != 4)
+        return len;
+
+    tcp = lossy_tcp(buf, len, &tcp_len);
+    if (tcp) {
+        payload = tcp_len - ((tcp[12] >> 4) << 2);
+        if (payload > 0) {
+            /* Three segments out of every 40 get lost */
+            uint32_t k = l->data_segs++ % 40u;
+            if ((k == 10) || (k == 12) || (k == 15)) {
+                l->dropped++;
+                return len;
+            }
+        }
+
+        if ((payload == 0) && (lossy_option(tcp, PICO_TCP_OPTION_SACK) >= 0))
+            l->sack_acks++;
+    }
+
+    memcpy(l->ring[l->head], buf, (size_t)len);
+    memcpy(l->ring[l->head] + 12, (uint8_t *)buf + 16, 4);
+    memcpy(l->ring[l->head] + 16, (uint8_t *)buf + 12, 4);
+    if (tcp && l->strip_sack_ok && (tcp[13] & PICO_TCP_SYN))
+        lossy_strip_sack_ok(l->ring[l->head] + (tcp - (uint8_t *)buf));
+
+    l->len[l->head] = len;
+    l->head = next;
+    return len;
+}
+
+static int lossy_poll(struct pico_device *dev, int loop_score)
+{
+    struct lossy_dev *l = (struct lossy_dev *)dev;
+    while ((loop_score > 0) && (l->tail != l->head)) {
+        pico_stack_recv(dev, l->ring[l->tail], (uint32_t)l->len[l->tail]);
+        l->tail = (l->tail + 1) % LOSSY_RING;
+        loop_score--;
+    }
+    return loop_score;
+}
+
+static void lossy_cb(uint16_t ev, struct pico_socket *s)
+{
+    IGNORE_PARAMETER(ev);
+    IGNORE_PARAMETER(s);
+}
+
+/* Returns the transfer time in ms */
+static double lossy_transfer(struct lossy_dev *l, int strip_sack_ok, uint16_t port)
+{
+    struct pico_stack *S;
+    struct pico_socket *srv, *cli, *acc = NULL;
+    struct pico_ip4 addr, peer, nm, any = { 0 }, orig;
+    struct timespec t0, t1;
+    static uint8_t buf[4096];
+    uint16_t rport;
+    int sent = 0, rcvd = 0, r, i;
+    long ticks = 0;
+
+    memset(l, 0, sizeof(*l));
+    l->strip_sack_ok = strip_sack_ok;
+    fail_if(pico_stack_init(&S) != 0);
+    fail_if(pico_device_init(S, &l->dev, "lossy", NULL) != 0);
+    l->dev.send = lossy_send;
+    l->dev.poll = lossy_poll;
+    addr.addr = long_be(0x0A280001);
+    peer.addr = long_be(0x0A280002);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &l->dev, addr, nm) != 0);
+
+    srv = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, lossy_cb);
+    fail_if(!srv);
+    fail_if(pico_socket_bind(srv, &any, &port) != 0);
+    fail_if(pico_socket_listen(srv, 1) != 0);
+    cli = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, lossy_cb);
+    fail_if(!cli);
+    fail_if(pico_socket_connect(cli, &peer, port) != 0);
+    while (!acc && (ticks++ < 100000)) {
+        pico_stack_tick(S);
+        acc = pico_socket_accept(srv, &orig, &rport);
+    }
+    fail_if(!acc);
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    while ((rcvd < LOSSY_BYTES) && (ticks++ < 50000000)) {
+        while (sent < LOSSY_BYTES) {
+            int len = LOSSY_BYTES - sent;
+            if (len > (int)sizeof(buf))
+                len = (int)sizeof(buf);
+
+            for (i = 0; i < len; i++)
+                buf[i] = (uint8_t)(sent + i);
+            r = pico_socket_write(cli, buf, len);
+            if (r <= 0)
+                break;
+
+            sent += r;
+        }
+        pico_stack_tick(S);
+        while ((r = pico_socket_read(acc, buf, sizeof(buf))) > 0) {
+            for (i = 0; i < r; i++)
+                fail_if(buf[i] != (uint8_t)(rcvd + i));
+            rcvd += r;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    fail_unless(rcvd == LOSSY_BYTES);
+    fail_unless(l->dropped > 0);
+    pico_socket_close(cli);
+    pico_socket_close(acc);
+    pico_socket_close(srv);
+    return ((double)(t1.tv_sec - t0.tv_sec) * 1e3) + ((double)(t1.tv_nsec - t0.tv_nsec) / 1e6);
+}
+
+START_TEST(tc_sack_lossy_link)
+{
+    static struct lossy_dev l;
+    double ms_sack, ms_plain;
+    uint32_t segs_sack, drop_sack;
+
+    ms_sack = lossy_transfer(&l, 0, short_be(7100));
+    segs_sack = l.data_segs;
+    drop_sack = l.dropped;
+    fail_unless(l.sack_acks > 0);
+
+    ms_plain = lossy_transfer(&l, 1, short_be(7101));
+    fail_unless(l.sack_acks == 0);
+
+    printf("%u KB over a link losing 3/40 data segments:\n", LOSSY_BYTES / 1024);
+    printf("  SACK:    %8.1f ms, %6.1f KB/s, %u segments (%u lost)\n", ms_sack,
+           (LOSSY_BYTES / 1024.0) / (ms_sack / 1e3), segs_sack, drop_sack);
+    printf("  no SACK: %8.1f ms, %6.1f KB/s, %u segments (%u lost)\n", ms_plain,
+           (LOSSY_BYTES / 1024.0) / (ms_plain / 1e3), l.data_segs, l.dropped);
+    fail_unless(ms_sack < ms_plain);
+    fail_unless(segs_sack <= l.data_segs);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_scoreboard = tcase_create("Unit test for the SACK scoreboard");
+    TCase *TCase_sack_lossy_link = tcase_create("SACK recovery on a lossy link");
+
+    tcase_add_test(TCase_scoreboard, tc_scoreboard);
+    suite_add_tcase(s, TCase_scoreboard);
+    tcase_add_test(TCase_sack_lossy_link, tc_sack_lossy_link);
+    tcase_set_timeout(TCase_sack_lossy_link, 60);
+    suite_add_tcase(s, TCase_sack_lossy_link);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,410 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_socket.h"
+#include "pico_device.h"
+#include "pico_tcp.h"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+#define LOCAL4   0x0A290001u
+#define PEER4    0x0A290002u
+#define OPTLEN   20u
+
+static struct pico_stack *S;
+static struct pico_device dev;
+
+/* Last segment sent by the stack */
+static uint8_t out[PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR + 40];
+static uint32_t synacks, rsts;
+static uint16_t lport; /* of the current listener */
+static int peer_ws = 1; /* whether the peer's SYN offers a window scale */
+
+static int dev_send(struct pico_device *d, void *buf, int len)
+{
+    struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *)((uint8_t *)buf + PICO_SIZE_IP4HDR);
+    IGNORE_PARAMETER(d);
+    if ((len < (int)(PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR)) || (len > (int)sizeof(out)))
+        return len;
+
+    memcpy(out, buf, (size_t)len);
+    if (hdr->flags == PICO_TCP_SYNACK)
+        synacks++;
+
+    if (hdr->flags & PICO_TCP_RST)
+        rsts++;
+
+    return len;
+}
+
+static struct pico_tcp_hdr *out_tcp(void)
+{
+    return (struct pico_tcp_hdr *)(out + PICO_SIZE_IP4HDR);
+}
+
+static void synq_setup(void)
+{
+    struct pico_ip4 addr, nm;
+
+    if (S)
+        return;
+
+    fail_if(pico_stack_init(&S) != 0);
+    dev.send = dev_send;
+    dev.mtu = 1500;
+    fail_if(pico_device_init(S, &dev, "synq", NULL) != 0);
+    addr.addr = long_be(LOCAL4);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &dev, addr, nm) != 0);
+}
+
+static void cb(uint16_t ev, struct pico_socket *s)
+{
+    IGNORE_PARAMETER(ev);
+    IGNORE_PARAMETER(s);
+}
+
+static struct pico_socket *listener(uint16_t port, int backlog)
+{
+    struct pico_ip4 any = {
+        0
+    };
+    struct pico_socket *l = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, cb);
+    fail_if(!l);
+    fail_if(pico_socket_bind(l, &any, &port) != 0);
+    fail_if(pico_socket_listen(l, backlog) != 0);
+    lport = port;
+    return l;
+}
+
+/* A segment from the peer. A SYN offers MSS 1400, SACK, timestamps and,
+ * if peer_ws is set, a window scale of 5.
+ */
+static void peer_send(uint16_t sport, uint32_t seq, uint32_t ack, uint8_t flags)
+{
+    uint8_t buf[PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR + OPTLEN];
+    struct pico_ipv4_hdr *ip = (struct pico_ipv4_hdr *)buf;
+    struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)(buf + PICO_SIZE_IP4HDR);
+    uint8_t *opt = buf + PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR;
+    struct pico_frame f;
+    uint32_t tsval = long_be(0x1000u + seq);
+
+    memset(buf, 0, sizeof(buf));
+    ip->vhl = 0x45;
+    ip->len = short_be((uint16_t)sizeof(buf));
+    ip->ttl = 64;
+    ip->proto = PICO_PROTO_TCP;
+    ip->src.addr = long_be(PEER4);
+    ip->dst.addr = long_be(LOCAL4);
+    ip->crc = short_be(pico_checksum(ip, PICO_SIZE_IP4HDR));
+
+    tcp->trans.sport = short_be(sport);
+    tcp->trans.dport = lport;
+    tcp->seq = long_be(seq);
+    tcp->ack = long_be(ack);
+    tcp->len = (uint8_t)(((PICO_SIZE_TCPHDR + OPTLEN) >> 2) << 4);
+    tcp->flags = flags;
+    tcp->rwnd = short_be(8192);
+    memset(opt, PICO_TCP_OPTION_NOOP, OPTLEN);
+    if (flags & PICO_TCP_SYN) {
+        opt[0] = PICO_TCP_OPTION_MSS;
+        opt[1] = PICO_TCPOPTLEN_MSS;
+        opt[2] = 1400 >> 8;
+        opt[3] = 1400 & 0xFF;
+        opt[4] = PICO_TCP_OPTION_SACK_OK;
+        opt[5] = PICO_TCPOPTLEN_SACK_OK;
+        if (peer_ws) {
+            opt[17] = PICO_TCP_OPTION_WS;
+            opt[18] = PICO_TCPOPTLEN_WS;
+            opt[19] = 5;
+        }
+    }
+
+    opt[6] = PICO_TCP_OPTION_TIMESTAMP;
+    opt[7] = PICO_TCPOPTLEN_TIMESTAMP;
+    memcpy(opt + 8, &tsval, 4);
+
+    memset(&f, 0, sizeof(f));
+    f.net_hdr = buf;
+    f.transport_hdr = (uint8_t *)tcp;
+    f.transport_len = (uint16_t)(PICO_SIZE_TCPHDR + OPTLEN);
+    tcp->crc = short_be(pico_tcp_checksum(&f));
+
+    fail_if(pico_stack_recv(&dev, buf, sizeof(buf)) <= 0);
+    pico_stack_tick(S);
+}
+
+/* The window scale option of the last segment sent, -1 if none */
+static int out_wscale(void)
+{
+    struct pico_tcp_hdr *hdr = out_tcp();
+    uint8_t *opt = (uint8_t *)hdr + PICO_SIZE_TCPHDR;
+    uint32_t i = 0, optlen = (uint32_t)(((hdr->len & 0xf0u) >> 2u) - PICO_SIZE_TCPHDR);
+
+    while (i < optlen) {
+        if (opt[i] == PICO_TCP_OPTION_END)
+            break;
+
+        if (opt[i] == PICO_TCP_OPTION_NOOP) {
+            i++;
+            continue;
+        }
+
+        if (opt[i] == PICO_TCP_OPTION_WS)
+            return opt[i + 2];
+
+        i += opt[i + 1];
+    }
+    return -1;
+}
+
+static int sockets(void)
+{
+    struct pico_sockport *sp = pico_get_sockport(S, PICO_PROTO_TCP, lport);
+    struct pico_tree_node *index;
+    int n = 0;
+
+    fail_if(!sp);
+    pico_tree_foreach(index, &sp->socks) {
+        n++;
+    }
+    return n;
+}
+
+START_TEST(tc_synq_flood)
+{
+    struct pico_socket *l, *s;
+    struct pico_ip4 orig;
+    uint16_t rport;
+    uint32_t i, iss, n = PICO_TCP_SYNQ_MAX + 100u;
+
+    synq_setup();
+    fail_if(pico_tcp_set_syncookies(S, 3) == 0);
+    fail_if(pico_tcp_set_syncookies(S, PICO_TCP_SYNCOOKIES_OFF) != 0);
+    l = listener(short_be(80), 4000);
+
+    /* A flood fills the table, not the socket tree */
+    synacks = 0;
+    for (i = 0; i < n; i++)
+        peer_send((uint16_t)(10000u + i), i * 1000u, 0, PICO_TCP_SYN);
+    fail_unless(synacks == PICO_TCP_SYNQ_MAX);
+    fail_unless(l->number_of_pending_conn == PICO_TCP_SYNQ_MAX);
+    fail_unless(sockets() == 1);
+
+    /* A retransmitted SYN gets the same SYN-ACK */
+    peer_send(10000, 0, 0, PICO_TCP_SYN);
+    fail_unless(synacks == PICO_TCP_SYNQ_MAX + 1u);
+    fail_unless(out_tcp()->trans.dport == short_be(10000));
+    fail_unless(long_be(out_tcp()->ack) == 1u);
+    iss = long_be(out_tcp()->seq);
+    peer_send(10000, 0, 0, PICO_TCP_SYN);
+    fail_unless(long_be(out_tcp()->seq) == iss);
+
+    /* The final ACK creates the socket */
+    peer_send(10000, 1, iss + 1u, PICO_TCP_ACK);
+    fail_unless(sockets() == 2);
+    fail_unless(l->number_of_pending_conn == PICO_TCP_SYNQ_MAX);
+    s = pico_socket_accept(l, &orig, &rport);
+    fail_if(!s);
+    fail_unless(rport == short_be(10000));
+    fail_unless(orig.addr == long_be(PEER4));
+    fail_unless(pico_tcp_get_socket_mss(s) == 1400u + PICO_SIZE_TCPHDR);
+    fail_unless(l->number_of_pending_conn == PICO_TCP_SYNQ_MAX - 1u);
+
+    /* A wrong ACK is reset, a RST forgets the connection */
+    rsts = 0;
+    peer_send(10001, 1001, 0x12345678u, PICO_TCP_ACK);
+    fail_unless(rsts == 1);
+    fail_unless(sockets() == 2);
+    peer_send(10002, 2001, 0, PICO_TCP_RST);
+    fail_unless(l->number_of_pending_conn == PICO_TCP_SYNQ_MAX - 2u);
+
+    /* Half-open connections go away with their listener */
+    pico_socket_close(s);
+    pico_socket_close(l);
+    pico_stack_tick(S);
+    l = listener(short_be(81), 4000);
+    peer_send(30000, 0, 0, PICO_TCP_SYN);
+    fail_unless(l->number_of_pending_conn == 1);
+    pico_socket_close(l);
+    pico_stack_tick(S);
+}
+END_TEST
+
+START_TEST(tc_syncookie)
+{
+    struct pico_socket *l, *s;
+    struct pico_ip4 orig;
+    uint16_t rport;
+    uint32_t iss, cookie;
+    int n;
+
+    synq_setup();
+    fail_if(pico_tcp_set_syncookies(S, PICO_TCP_SYNCOOKIES_OVERFLOW) != 0);
+    l = listener(short_be(82), 1);
+
+    peer_send(20000, 5000, 0, PICO_TCP_SYN);
+    iss = long_be(out_tcp()->seq);
+    fail_unless(l->number_of_pending_conn == 1);
+
+    /* Backlog full: a cookie, and nothing is kept */
+    synacks = 0;
+    peer_send(20001, 7000, 0, PICO_TCP_SYN);
+    fail_unless(synacks == 1);
+    fail_unless(out_tcp()->trans.dport == short_be(20001));
+    cookie = long_be(out_tcp()->seq);
+    fail_unless(l->number_of_pending_conn == 1);
+    fail_unless(sockets() == 1);
+
+    /* Still full when the cookie comes back: dropped, not reset */
+    rsts = 0;
+    peer_send(20001, 7001, cookie + 1u, PICO_TCP_ACK);
+    fail_unless(rsts == 0);
+    fail_unless(sockets() == 1);
+
+    peer_send(20000, 5001, iss + 1u, PICO_TCP_ACK);
+    s = pico_socket_accept(l, &orig, &rport);
+    fail_if(!s);
+    fail_unless(rport == short_be(20000));
+    pico_socket_close(s);
+    n = sockets();
+
+    /* Forged cookies are reset */
+    rsts = 0;
+    peer_send(20001, 7001, (cookie ^ 0x80000000u) + 1u, PICO_TCP_ACK);
+    peer_send(20002, 7001, cookie + 1u, PICO_TCP_ACK);
+    peer_send(20001, 7002, cookie + 1u, PICO_TCP_ACK);
+    fail_unless(rsts == 3);
+    fail_unless(sockets() == n);
+
+    /* The right one is a connection, with the options of its SYN */
+    peer_send(20001, 7001, cookie + 1u, PICO_TCP_ACK);
+    fail_unless(sockets() == n + 1);
+    s = pico_socket_accept(l, &orig, &rport);
+    fail_if(!s);
+    fail_unless(rport == short_be(20001));
+    fail_unless(pico_tcp_get_socket_mss(s) == 1220u + PICO_SIZE_TCPHDR);
+    fail_unless(l->number_of_pending_conn == 0);
+
+    /* Turned off, cookies are just ACKs to a listener */
+    fail_if(pico_tcp_set_syncookies(S, PICO_TCP_SYNCOOKIES_ALWAYS) != 0);
+    peer_send(20003, 9000, 0, PICO_TCP_SYN);
+    cookie = long_be(out_tcp()->seq);
+    fail_unless(l->number_of_pending_conn == 0);
+    fail_if(pico_tcp_set_syncookies(S, PICO_TCP_SYNCOOKIES_OFF) != 0);
+    rsts = 0;
+    peer_send(20003, 9001, cookie + 1u, PICO_TCP_ACK);
+    fail_unless(rsts == 1);
+    fail_unless(sockets() == n + 1);
+
+    pico_socket_close(s);
+    pico_socket_close(l);
+    pico_stack_tick(S);
+}
+END_TEST
+
+START_TEST(tc_synq_no_wscale)
+{
+    struct pico_socket *l, *s;
+    struct pico_ip4 orig, peer;
+    uint16_t rport, port = short_be(90);
+    uint32_t iss, cookie;
+    uint8_t c = 'x';
+
+    synq_setup();
+    fail_if(pico_tcp_set_syncookies(S, PICO_TCP_SYNCOOKIES_OVERFLOW) != 0);
+    l = listener(short_be(84), 1);
+
+    /* Offered, the scale is answered and used */
+    peer_send(40000, 100, 0, PICO_TCP_SYN);
+    fail_unless(out_wscale() > 0);
+    peer_send(40000, 101, long_be(out_tcp()->seq) + 1u, PICO_TCP_ACK);
+    s = pico_socket_accept(l, &orig, &rport);
+    fail_if(!s);
+    fail_unless(pico_socket_write(s, &c, 1) == 1);
+    pico_stack_tick(S);
+    fail_unless(out_wscale() > 0);
+    fail_unless(short_be(out_tcp()->rwnd) < PICO_DEFAULT_SOCKETQ);
+    pico_socket_close(s);
+
+    /* Not offered: no scale in the SYN-ACK, full 16-bit windows after */
+    peer_ws = 0;
+    peer_send(40001, 200, 0, PICO_TCP_SYN);
+    fail_unless(out_wscale() == -1);
+    iss = long_be(out_tcp()->seq);
+    fail_unless(short_be(out_tcp()->rwnd) == PICO_DEFAULT_SOCKETQ);
+
+    /* Same through a SYN cookie */
+    peer_send(40002, 300, 0, PICO_TCP_SYN);
+    fail_unless(out_wscale() == -1);
+    cookie = long_be(out_tcp()->seq);
+
+    peer_send(40001, 201, iss + 1u, PICO_TCP_ACK);
+    s = pico_socket_accept(l, &orig, &rport);
+    fail_if(!s);
+    fail_unless(pico_socket_write(s, &c, 1) == 1);
+    pico_stack_tick(S);
+    fail_unless(out_tcp()->trans.dport == short_be(40001));
+    fail_unless(out_wscale() == -1);
+    fail_unless(short_be(out_tcp()->rwnd) == PICO_DEFAULT_SOCKETQ);
+    pico_socket_close(s);
+
+    peer_send(40002, 301, cookie + 1u, PICO_TCP_ACK);
+    s = pico_socket_accept(l, &orig, &rport);
+    fail_if(!s);
+    fail_unless(rport == short_be(40002));
+    fail_unless(pico_socket_write(s, &c, 1) == 1);
+    pico_stack_tick(S);
+    fail_unless(out_wscale() == -1);
+    fail_unless(short_be(out_tcp()->rwnd) == PICO_DEFAULT_SOCKETQ);
+    pico_socket_close(s);
+    pico_socket_close(l);
+
+    /* Active open: our SYN offers a scale, a SYN-ACK without one turns it off */
+    s = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, cb);
+    fail_if(!s);
+    peer.addr = long_be(PEER4);
+    fail_if(pico_socket_connect(s, &peer, port) != 0);
+    pico_stack_tick(S);
+    fail_unless(out_tcp()->flags == PICO_TCP_SYN);
+    fail_unless(out_wscale() > 0);
+    iss = long_be(out_tcp()->seq);
+    lport = out_tcp()->trans.sport;
+    peer_send(90, 500, iss + 1u, PICO_TCP_SYNACK);
+    fail_unless(out_tcp()->flags == PICO_TCP_ACK);
+    fail_unless(out_wscale() == -1);
+    fail_unless(short_be(out_tcp()->rwnd) == PICO_DEFAULT_SOCKETQ);
+    pico_socket_close(s);
+    pico_stack_tick(S);
+    peer_ws = 1;
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_synq_flood = tcase_create("Unit test for the half-open connection table");
+    TCase *TCase_syncookie = tcase_create("Unit test for SYN cookies");
+    TCase *TCase_synq_no_wscale = tcase_create("Unit test for peers without window scaling");
+
+    tcase_add_test(TCase_synq_flood, tc_synq_flood);
+    suite_add_tcase(s, TCase_synq_flood);
+    tcase_add_test(TCase_syncookie, tc_syncookie);
+    suite_add_tcase(s, TCase_syncookie);
+    tcase_add_test(TCase_synq_no_wscale, tc_synq_no_wscale);
+    suite_add_tcase(s, TCase_synq_no_wscale);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -0,0 +1,299 @@
+#include "pico_config.h"
+#include "pico_stack.h"
+#include "pico_ipv4.h"
+#include "pico_socket.h"
+#include "pico_device.h"
+#include "pico_tcp.h"
+#include "check.h"
+
+Suite *pico_suite(void);
+
+#define LOCAL4   0x0A2A0001u
+#define PEER4    0x0A2A0002u
+#define OPTLEN   20u
+
+static struct pico_stack *S;
+static struct pico_device dev;
+
+/* Last segment sent by the stack */
+static uint8_t out[PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR + 40];
+static uint32_t synacks, rsts, acks, fins;
+static uint16_t lport; /* of the current listener */
+
+static int dev_send(struct pico_device *d, void *buf, int len)
+{
+    struct pico_tcp_hdr *hdr = (struct pico_tcp_hdr *)((uint8_t *)buf + PICO_SIZE_IP4HDR);
+    IGNORE_PARAMETER(d);
+    if ((len < (int)(PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR)) || (len > (int)sizeof(out)))
+        return len;
+
+    if (((struct pico_ipv4_hdr *)buf)->proto != PICO_PROTO_TCP)
+        return len;
+
+    memcpy(out, buf, (size_t)len);
+    if (hdr->flags == PICO_TCP_ACK)
+        acks++;
+
+    if (hdr->flags == PICO_TCP_SYNACK)
+        synacks++;
+
+    if (hdr->flags & PICO_TCP_RST)
+        rsts++;
+
+    return len;
+}
+
+static struct pico_tcp_hdr *out_tcp(void)
+{
+    return (struct pico_tcp_hdr *)(out + PICO_SIZE_IP4HDR);
+}
+
+static void tw_setup(void)
+{
+    struct pico_ip4 addr, nm;
+
+    if (S)
+        return;
+
+    fail_if(pico_stack_init(&S) != 0);
+    dev.send = dev_send;
+    dev.mtu = 1500;
+    fail_if(pico_device_init(S, &dev, "tw", NULL) != 0);
+    addr.addr = long_be(LOCAL4);
+    nm.addr = long_be(0xFFFFFF00);
+    fail_if(pico_ipv4_link_add(S, &dev, addr, nm) != 0);
+}
+
+static void cb(uint16_t ev, struct pico_socket *s)
+{
+    IGNORE_PARAMETER(s);
+    if (ev & PICO_SOCK_EV_FIN)
+        fins++;
+}
+
+static struct pico_socket *listener(uint16_t port, int backlog)
+{
+    struct pico_ip4 any = {
+        0
+    };
+    struct pico_socket *l = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, cb);
+    fail_if(!l);
+    fail_if(pico_socket_bind(l, &any, &port) != 0);
+    fail_if(pico_socket_listen(l, backlog) != 0);
+    lport = port;
+    return l;
+}
+
+/* A segment from the peer. A SYN offers MSS 1400, SACK, timestamps and
+ * a window scale of 5.
+ */
+static void peer_send(uint16_t sport, uint32_t seq, uint32_t ack, uint8_t flags)
+{
+    uint8_t buf[PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR + OPTLEN];
+    struct pico_ipv4_hdr *ip = (struct pico_ipv4_hdr *)buf;
+    struct pico_tcp_hdr *tcp = (struct pico_tcp_hdr *)(buf + PICO_SIZE_IP4HDR);
+    uint8_t *opt = buf + PICO_SIZE_IP4HDR + PICO_SIZE_TCPHDR;
+    struct pico_frame f;
+    uint32_t tsval = long_be(0x1000u + seq);
+
+    memset(buf, 0, sizeof(buf));
+    ip->vhl = 0x45;
+    ip->len = short_be((uint16_t)sizeof(buf));
+    ip->ttl = 64;
+    ip->proto = PICO_PROTO_TCP;
+    ip->src.addr = long_be(PEER4);
+    ip->dst.addr = long_be(LOCAL4);
+    ip->crc = short_be(pico_checksum(ip, PICO_SIZE_IP4HDR));
+
+    tcp->trans.sport = short_be(sport);
+    tcp->trans.dport = lport;
+    tcp->seq = long_be(seq);
+    tcp->ack = long_be(ack);
+    tcp->len = (uint8_t)(((PICO_SIZE_TCPHDR + OPTLEN) >> 2) << 4);
+    tcp->flags = flags;
+    tcp->rwnd = short_be(8192);
+    memset(opt, PICO_TCP_OPTION_NOOP, OPTLEN);
+    if (flags & PICO_TCP_SYN) {
+        opt[0] = PICO_TCP_OPTION_MSS;
+        opt[1] = PICO_TCPOPTLEN_MSS;
+        opt[2] = 1400 >> 8;
+        opt[3] = 1400 & 0xFF;
+        opt[4] = PICO_TCP_OPTION_SACK_OK;
+        opt[5] = PICO_TCPOPTLEN_SACK_OK;
+        opt[17] = PICO_TCP_OPTION_WS;
+        opt[18] = PICO_TCPOPTLEN_WS;
+        opt[19] = 5;
+    }
+
+    opt[6] = PICO_TCP_OPTION_TIMESTAMP;
+    opt[7] = PICO_TCPOPTLEN_TIMESTAMP;
+    memcpy(opt + 8, &tsval, 4);
+
+    memset(&f, 0, sizeof(f));
+    f.net_hdr = buf;
+    f.transport_hdr = (uint8_t *)tcp;
+    f.transport_len = (uint16_t)(PICO_SIZE_TCPHDR + OPTLEN);
+    tcp->crc = short_be(pico_tcp_checksum(&f));
+
+    fail_if(pico_stack_recv(&dev, buf, sizeof(buf)) <= 0);
+    pico_stack_tick(S);
+}
+
+static int sockets(void)
+{
+    struct pico_sockport *sp = pico_get_sockport(S, PICO_PROTO_TCP, lport);
+    struct pico_tree_node *index;
+    int n = 0;
+
+    fail_if(!sp);
+    pico_tree_foreach(index, &sp->socks) {
+        n++;
+    }
+    return n;
+}
+
+/* Handshake from sport, accepted: returns our ISS */
+static struct pico_socket *connection(struct pico_socket *l, uint16_t sport, uint32_t *iss)
+{
+    struct pico_socket *s;
+    struct pico_ip4 orig;
+    uint16_t rport;
+
+    peer_send(sport, 0, 0, PICO_TCP_SYN);
+    *iss = long_be(out_tcp()->seq);
+    peer_send(sport, 1, *iss + 1u, PICO_TCP_ACK);
+    s = pico_socket_accept(l, &orig, &rport);
+    fail_if(!s);
+    return s;
+}
+
+/* We close first, the peer acknowledges and closes */
+static void active_close(struct pico_socket *s, uint16_t sport, uint32_t iss)
+{
+    int i;
+
+    pico_socket_close(s);
+    for (i = 0; i < 3; i++)
+        pico_stack_tick(S);
+    fail_unless(out_tcp()->flags & PICO_TCP_FIN);
+    fail_unless(long_be(out_tcp()->seq) == iss + 1u);
+    peer_send(sport, 1, iss + 2u, PICO_TCP_ACK);
+    fins = 0;
+    acks = 0;
+    peer_send(sport, 1, iss + 2u, PICO_TCP_FINACK);
+}
+
+START_TEST(tc_timewait)
+{
+    struct pico_socket *l, *s;
+    uint32_t iss;
+
+    tw_setup();
+    l = listener(short_be(90), 8);
+    s = connection(l, 40000, &iss);
+    fail_unless(sockets() == 2);
+
+    /* TIME_WAIT leaves no socket behind */
+    active_close(s, 40000, iss);
+    fail_unless(fins > 0);
+    fail_unless(acks == 1);
+    fail_unless(long_be(out_tcp()->seq) == iss + 2u);
+    fail_unless(long_be(out_tcp()->ack) == 2u);
+    pico_stack_tick(S);
+    fail_unless(sockets() == 1);
+
+    /* A retransmitted FIN is acknowledged again, not reset */
+    rsts = 0;
+    peer_send(40000, 1, iss + 2u, PICO_TCP_FINACK);
+    fail_unless(acks == 2);
+    fail_unless(long_be(out_tcp()->ack) == 2u);
+    fail_unless(out_tcp()->trans.dport == short_be(40000));
+
+    /* RFC 1337: a RST does not end it */
+    peer_send(40000, 2, 0, PICO_TCP_RST);
+    fail_unless((acks == 2) && (rsts == 0));
+    peer_send(40000, 1, iss + 2u, PICO_TCP_ACK);
+    fail_unless(acks == 3);
+    fail_unless(l->number_of_pending_conn == 0);
+
+    /* A new SYN beyond the old sequence space reopens the tuple */
+    synacks = 0;
+    peer_send(40000, 100000, 0, PICO_TCP_SYN);
+    fail_unless(synacks == 1);
+    fail_unless(l->number_of_pending_conn == 1);
+    fail_unless(long_be(out_tcp()->ack) == 100001u);
+
+    pico_socket_close(l);
+    pico_stack_tick(S);
+}
+END_TEST
+
+START_TEST(tc_timewait_expire)
+{
+    struct pico_socket *l, *s;
+    struct pico_ip4 any = {
+        0
+    }, local;
+    uint32_t iss, linger = 200;
+    uint16_t port = short_be(91);
+
+    tw_setup();
+    l = listener(short_be(91), 8);
+    s = connection(l, 41000, &iss);
+    fail_if(pico_socket_setoption(s, PICO_SOCKET_OPT_LINGER, &linger) != 0);
+
+    /* The last socket on the port goes: the record still answers */
+    pico_socket_close(l);
+    active_close(s, 41000, iss);
+    fail_unless(acks == 1);
+    pico_stack_tick(S);
+    fail_unless(pico_get_sockport(S, PICO_PROTO_TCP, short_be(91)) == NULL);
+    peer_send(41000, 1, iss + 2u, PICO_TCP_FINACK);
+    fail_unless(acks == 2);
+
+    /* The port is still taken */
+    local.addr = long_be(LOCAL4);
+    fail_unless(pico_is_port_free(S, PICO_PROTO_TCP, port, &any, &pico_proto_ipv4) == 0);
+    fail_unless(pico_is_port_free(S, PICO_PROTO_TCP, port, &local, &pico_proto_ipv4) == 0);
+    fail_unless(pico_is_port_free(S, PICO_PROTO_TCP, short_be(92), &any, &pico_proto_ipv4) == 1);
+    l = pico_socket_open(S, PICO_PROTO_IPV4, PICO_PROTO_TCP, cb);
+    fail_if(!l);
+    fail_unless(pico_socket_bind(l, &any, &port) < 0);
+    fail_unless(pico_err == PICO_ERR_EADDRINUSE);
+
+    /* Until it expires */
+    usleep(300000);
+    pico_stack_tick(S);
+    peer_send(41000, 1, iss + 2u, PICO_TCP_FINACK);
+    fail_unless(acks == 2);
+    fail_unless(pico_is_port_free(S, PICO_PROTO_TCP, port, &any, &pico_proto_ipv4) == 1);
+    fail_unless(pico_socket_bind(l, &any, &port) == 0);
+    pico_socket_close(l);
+    pico_stack_tick(S);
+}
+END_TEST
+
+Suite *pico_suite(void)
+{
+    Suite *s = suite_create("PicoTCP");
+
+    TCase *TCase_timewait = tcase_create("Unit test for TIME_WAIT records");
+    TCase *TCase_timewait_expire = tcase_create("Unit test for TIME_WAIT expiry");
+
+    tcase_add_test(TCase_timewait, tc_timewait);
+    suite_add_tcase(s, TCase_timewait);
+    tcase_add_test(TCase_timewait_expire, tc_timewait_expire);
+    suite_add_tcase(s, TCase_timewait_expire);
+    return s;
+}
+
+int main(void)
+{
+    int fails;
+    Suite *s = pico_suite();
+    SRunner *sr = srunner_create(s);
+    srunner_run_all(sr, CK_NORMAL);
+    fails = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return fails;
+}
@@ -61,14 +61,60 @@ START_TEST(tc_q)
 }
 END_TEST
 
+START_TEST(tc_q_list)
+{
+    struct pico_queue q = {
+        0
+    };
+    struct pico_frame *f[5], *list = NULL, *p;
+    int i;
+
+    for (i = 4; i >= 0; i--) {
+        f[i] = pico_frame_alloc(100);
+        f[i]->next = list;
+        list = f[i];
+    }
+
+    /* Only what fits is enqueued, the rest stays on the list */
+    q.max_frames = 3;
+    fail_if(pico_enqueue_list(&q, &list) != 3);
+    fail_if(list != f[3]);
+    fail_if(f[3]->next != f[4]);
+    fail_if(q.frames != 3);
+    fail_if(q.size != 300);
+    fail_if(pico_enqueue_list(&q, &list) != 0);
+
+    q.max_frames = 0;
+    fail_if(pico_enqueue_list(&q, &list) != 2);
+    fail_if(list != NULL);
+    fail_if(q.tail != f[4]);
+
+    p = pico_dequeue_list(&q, 2);
+    fail_if(p != f[0] || p->next != f[1] || f[1]->next != NULL);
+    fail_if(q.frames != 3);
+    fail_if(q.size != 300);
+    fail_if(pico_dequeue(&q) != f[2]);
+    p = pico_dequeue_list(&q, 10);
+    fail_if(p != f[3] || f[4]->next != NULL);
+    fail_if(q.frames != 0 || q.size != 0);
+    fail_if(q.head != NULL || q.tail != NULL);
+    fail_if(pico_dequeue_list(&q, 10) != NULL);
+
+    for (i = 0; i < 5; i++)
+        pico_frame_discard(f[i]);
+}
+END_TEST
 
 Suite *pico_suite(void)
 {
     Suite *s = suite_create("Packet Queues");
 
     TCase *TCase_q = tcase_create("Unit test for pico_queue.c");
+    TCase *TCase_q_list = tcase_create("Unit test for pico_enqueue_list/pico_dequeue_list");
     tcase_add_test(TCase_q, tc_q);
     suite_add_tcase(s, TCase_q);
+    tcase_add_test(TCase_q_list, tc_q_list);
+    suite_add_tcase(s, TCase_q_list);
     return s;
 }
 
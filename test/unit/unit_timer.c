@@ -1,40 +1,152 @@
-#define EXISTING_TIMERS 9
-
-
 START_TEST (test_timers)
 {
     uint32_t T[128];
     int i;
+    uint32_t n;
     struct pico_timer_ref *tref;
-    pico_stack_init();
+    struct pico_stack *S;
+    pico_stack_init(&S);
+    n = S->Timers->n;
     for (i = 0; i < 128; i++) {
         pico_time expire = (pico_time)(999999 + i);
         void (*timer)(pico_time, void *) =(void (*)(pico_time, void *))0xff00 + i;
         void *arg = ((void*)0xaa00 + i);
 
-        T[i] = pico_timer_add(expire, timer, arg);
+        T[i] = pico_timer_add(S, expire, timer, arg);
         printf("New timer %u\n", T[i]);
     }
     for (i = 0; i < 128; i++) {
         void (*timer)(pico_time, void *) =(void (*)(pico_time, void *))0xff00 + i;
         void *arg = ((void*)0xaa00 + i);
 
-        fail_if((uint32_t)(i + 1) > Timers->n);
-        tref = heap_get_element(Timers, (uint32_t)i + EXISTING_TIMERS);
+        fail_if((uint32_t)(i + 1) > S->Timers->n);
+        tref = heap_get_element(S->Timers, n + 1u + (uint32_t)i);
         fail_unless(tref->id == T[i]);
         fail_unless(tref->tmr->timer == timer);
         fail_unless(tref->tmr->arg == arg);
     }
     for (i = 127; i >= 0; i--) {
         printf("Deleting timer %d \n", i );
-        pico_timer_cancel(T[i]);
+        pico_timer_cancel(S, T[i]);
         printf("Deleted timer %d \n", i );
-        tref = heap_get_element(Timers, (uint32_t)i + EXISTING_TIMERS);
-        fail_unless(tref->tmr == NULL);
+        fail_unless(heap_index_find(S->Timers, T[i]) == NULL);
+        fail_unless(S->Timers->n == n + (uint32_t)i);
     }
-    pico_stack_tick();
-    pico_stack_tick();
-    pico_stack_tick();
-    pico_stack_tick();
+    pico_stack_tick(S);
+    pico_stack_tick(S);
+    pico_stack_tick(S);
+    pico_stack_tick(S);
+}
+END_TEST
+
+static void timer_bench_cb(pico_time now, void *arg)
+{
+    IGNORE_PARAMETER(now);
+    IGNORE_PARAMETER(arg);
+}
+
+/* Re-arm pattern used by TCP: cancel a pending timer and add a new one,
+ * with a large population of other timers in the heap.
+ */
+START_TEST (test_timers_cancel_bench)
+{
+    struct pico_stack *S;
+    uint32_t *T;
+    const int timers = 20000;
+    const int rounds = 200000;
+    pico_time start, elapsed;
+    int i, j;
+    uint32_t n;
+
+    pico_stack_init(&S);
+    n = S->Timers->n;
+    T = PICO_ZALLOC(sizeof(uint32_t) * (size_t)timers);
+    fail_if(!T);
+    for (i = 0; i < timers; i++) {
+        T[i] = pico_timer_add(S, (pico_time)(100000 + (i * 7919) % 50000), timer_bench_cb, NULL);
+        fail_if(T[i] == 0);
+    }
+    fail_unless(S->Timers->n == n + (uint32_t)timers);
+
+    start = PICO_TIME_MS();
+    for (j = 0; j < rounds; j++) {
+        i = (j * 31) % timers;
+        pico_timer_cancel(S, T[i]);
+        T[i] = pico_timer_add(S, (pico_time)(100000 + (j * 7919) % 50000), timer_bench_cb, NULL);
+        fail_if(T[i] == 0);
+    }
+    elapsed = PICO_TIME_MS() - start;
+    printf("Timer re-arm: %d cancel+add with %d timers in %lu ms\n", rounds, timers, (unsigned long)elapsed);
+
+    /* Cancelled timers are really gone */
+    fail_unless(S->Timers->n == n + (uint32_t)timers);
+    for (i = 1; i <= (int)S->Timers->n; i++) {
+        struct pico_timer_ref *tref = heap_get_element(S->Timers, (uint32_t)i);
+        fail_unless(heap_index_find(S->Timers, tref->id)->pos == (uint32_t)i);
+        if (i > 1)
+            fail_if(heap_get_element(S->Timers, (uint32_t)i / 2)->expire > tref->expire);
+    }
+
+    for (i = 0; i < timers; i++)
+        pico_timer_cancel(S, T[i]);
+    fail_unless(S->Timers->n == n);
+    PICO_FREE(T);
+}
+END_TEST
+
+static void timer_hashed_cb(pico_time now, void *arg)
+{
+    IGNORE_PARAMETER(now);
+    (*(int *)arg)++;
+}
+
+START_TEST (test_timers_hashed_compact)
+{
+    struct pico_stack *S;
+    int fired = 0;
+    int i;
+    uint32_t n, keep;
+
+    pico_stack_init(&S);
+    n = S->Timers->n;
+    for (i = 0; i < 100; i++)
+        fail_if(pico_timer_add_hashed(S, 0, timer_hashed_cb, &fired, 0xCAFE) == 0);
+    keep = pico_timer_add(S, 0, timer_hashed_cb, &fired);
+    fail_if(keep == 0);
+
+    /* More than half of the heap is dead: it gets compacted right away */
+    pico_timer_cancel_hashed(S, 0xCAFE);
+    fail_unless(S->Timers->dead == 0);
+    fail_unless(S->Timers->n == n + 1);
+    fail_unless(heap_index_find(S->Timers, keep) != NULL);
+
+    pico_check_timers(S);
+    fail_unless(fired == 1);
+}
+END_TEST
+
+START_TEST (test_timers_growth)
+{
+    struct pico_stack *S;
+    const uint32_t timers = 100000;
+    uint32_t i, n, id;
+
+    pico_stack_init(&S);
+    n = S->Timers->n;
+    for (i = 0; i < timers; i++)
+        fail_if(pico_timer_add(S, (pico_time)(100000 + i), timer_bench_cb, NULL) == 0);
+    fail_unless(S->Timers->n == n + timers);
+    fail_unless(S->Timers->size > S->Timers->n);
+    fail_unless(S->Timers->blocks < MAX_BLOCK_COUNT);
+
+    /* Runtime limit */
+    heap_set_max(S->Timers, S->Timers->n);
+    fail_unless(pico_timer_add(S, 1000, timer_bench_cb, NULL) == 0);
+    heap_set_max(S->Timers, 0);
+    id = pico_timer_add(S, 0, timer_bench_cb, NULL);
+    fail_if(id == 0);
+    fail_unless(heap_index_find(S->Timers, id) != NULL);
+    for (i = 2; i <= S->Timers->n; i++)
+        fail_if(heap_get_element(S->Timers, i / 2)->expire > heap_get_element(S->Timers, i)->expire);
 }
 END_TEST
@@ -195,6 +195,9 @@ Suite *pico_suite(void)
     suite_add_tcase(s, frame);
 
     tcase_add_test(timers, test_timers);
+    tcase_add_test(timers, test_timers_cancel_bench);
+    tcase_add_test(timers, test_timers_hashed_compact);
+    tcase_add_test(timers, test_timers_growth);
     suite_add_tcase(s, timers);
 
     tcase_add_test(slaacv4, test_slaacv4);
@@ -9,8 +9,21 @@ ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_6lowpan.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_ethernet.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_pico_protocol.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_pico_frame.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_lpm.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_frame_pool.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_seq.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_tcp.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_socket_tcp.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_tcp_cc.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_tcp_sack.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_tcp_synq.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_tcp_tw.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_nat.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_arp.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_dst_cache.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_ipv4_flow.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_gso.elf || exit 1
+ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_gro.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_dev_loop.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_dns_client.elf || exit 1
 ASAN_OPTIONS="detect_leaks=0" ./build/test/modunit_dns_common.elf || exit 1